@@ -136,6 +136,9 @@ void init(void)
 
 void notified(microkit_channel ch)
 {
+    /* Hand any configuration space writes the guest has made to the virtual PCI bus. */
+    coalesced_io_flush();
+
     switch (ch) {
     case SERIAL_IRQ_CH: {
         bool success = virq_handle_passthrough(ch);
@@ -166,10 +166,11 @@ void init(void)
 
 void notified(microkit_channel ch)
 {
-    if (ch == serial_config.rx.id) {
+    if (ch == serial_config.rx.id || ch == serial_config.tx.id) {
+        /* The TX virtualiser notifies us once it has made room for a large guest write */
         virtio_console_queue_notify(&virtio_console);
-    } else if (ch == serial_config.tx.id || ch == net_config.tx.id) {
-        /* Nothing to do */
+    } else if (ch == net_config.tx.id) {
+        virtio_net_handle_tx_complete(&virtio_net);
     } else if (ch == blk_config.virt.id) {
         virtio_blk_handle_resp(&virtio_blk);
     } else if (ch == net_config.rx.id) {
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <microkit.h>
+#include <libvmm/coalesced_io.h>
 
 /* Fault-handling functions */
 bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo);
@@ -20,8 +21,17 @@ bool fault_handle_user_exception(size_t vcpu_id);
 bool fault_handle_unknown_syscall(size_t vcpu_id);
 bool fault_handle_vm_exception(size_t vcpu_id);
 
+/* Maximum number of VM exception handlers, can be overridden at build time */
+#ifndef MAX_VM_EXCEPTION_HANDLERS
+#define MAX_VM_EXCEPTION_HANDLERS 64
+#endif
+
 typedef bool (*vm_exception_handler_t)(size_t vcpu_id, size_t offset, size_t fsr, seL4_UserContext *regs, void *data);
 bool fault_register_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback, void *data);
+/* Like fault_register_vm_exception_handler, but writes to the region are given to `coalesced_write` in
+ * batches rather than to `callback` as they fault. See coalesced_io.h. */
+bool fault_register_coalesced_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback,
+                                                   coalesced_io_write_fn_t coalesced_write, void *data);
 
 /* Helpers for emulating the fault and getting fault details */
 int fault_get_width_bytes(uint64_t fsr);
@@ -11,6 +11,7 @@
 #include <microkit.h>
 
 #include <libvmm/arch/x86_64/instruction.h>
+#include <libvmm/coalesced_io.h>
 
 /* Documents referenced:
  * 1. Intel® 64 and IA-32 Architectures Software Developer’s Manual
@@ -24,13 +25,33 @@ bool ept_fault_is_write(seL4_Word qualification);
 char *fault_to_string(int exit_reason);
 bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo);
 
+/* Maximum number of EPT and PIO exception handlers, can be overridden at build time */
+#ifndef MAX_EPT_EXCEPTION_HANDLERS
+#define MAX_EPT_EXCEPTION_HANDLERS 64
+#endif
+#ifndef MAX_PIO_EXCEPTION_HANDLERS
+#define MAX_PIO_EXCEPTION_HANDLERS 64
+#endif
+/* Number of 256 port blocks that can have PIO exception handlers in them, can be overridden at build time */
+#ifndef MAX_PIO_PORT_BLOCKS
+#define MAX_PIO_PORT_BLOCKS 16
+#endif
+
 typedef bool (*ept_exception_callback_t)(size_t vcpu_id, size_t offset, size_t qualification,
                                          decoded_instruction_ret_t decoded_ins, seL4_VCPUContext *vctx, void *cookie);
 
 bool fault_update_ept_exception_handler(uintptr_t base, uintptr_t new_base);
 bool fault_register_ept_exception_handler(uintptr_t base, size_t size, ept_exception_callback_t callback, void *cookie);
+/* Like fault_register_ept_exception_handler, but writes to the region are given to `coalesced_write` in
+ * batches rather than to `callback` as they fault. See coalesced_io.h. */
+bool fault_register_coalesced_ept_exception_handler(uintptr_t base, size_t size, ept_exception_callback_t callback,
+                                                    coalesced_io_write_fn_t coalesced_write, void *cookie);
 
 typedef bool (*pio_exception_callback_t)(size_t vcpu_id, uint16_t port_offset, size_t qualification,
                                          seL4_VCPUContext *vctx, void *cookie);
 bool fault_register_pio_exception_handler(uint16_t base, uint16_t size, pio_exception_callback_t callback,
-                                          void *cookie);
\ No newline at end of file
+                                          void *cookie);
+/* Like fault_register_pio_exception_handler, but for coalescing writes to the ports. String operations are never
+ * coalesced. */
+bool fault_register_coalesced_pio_exception_handler(uint16_t base, uint16_t size, pio_exception_callback_t callback,
+                                                    coalesced_io_write_fn_t coalesced_write, void *cookie);
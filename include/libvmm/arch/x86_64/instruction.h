@@ -73,8 +73,17 @@ typedef struct decoded_instruction_ret {
     instruction_data_t decoded;
 } decoded_instruction_ret_t;
 
+/* Number of entries in the decoded instruction cache, must be a power of two or 0 to disable
+ * the cache. Can be overridden at build time. */
+#ifndef X86_DECODE_CACHE_SIZE
+#define X86_DECODE_CACHE_SIZE 64
+#endif
+
 decoded_instruction_ret_t decode_instruction(size_t vcpu_id, seL4_Word rip);
 
+/* Drop all cached decoded instructions, for when the guest changes paging mode or remaps its code. */
+void decode_instruction_cache_invalidate(void);
+
 void debug_print_instruction(decoded_instruction_ret_t decode_result);
 
 int mem_access_width_to_bytes(decoded_instruction_ret_t decoded_ins);
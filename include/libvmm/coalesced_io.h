@@ -0,0 +1,42 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Coalesced writes, in the style of KVM's coalesced MMIO. Writes to registers that have no
+ * side effect the guest can observe straight away are not emulated when they fault. They
+ * are appended to a ring and the vCPU is resumed at once, and the device model is given the
+ * writes in a batch later on. Regions are registered for this with the fault handling
+ * functions of each architecture.
+ *
+ * The ring is drained, in order, before any access that is not coalesced is handled, so a
+ * guest reading back a register, or accessing a region whose handler a coalesced write
+ * would have registered, sees the writes. It is also drained when full. VMMs should call
+ * coalesced_io_flush() when notified so that writes are not held for long when the guest
+ * goes idle.
+ */
+
+/* Number of entries in the ring, can be overridden at build time */
+#ifndef COALESCED_IO_RING_SIZE
+#define COALESCED_IO_RING_SIZE 64
+#endif
+
+/* Called for each write when the ring is drained, `offset` is relative to the registered region. */
+typedef bool (*coalesced_io_write_fn_t)(uint64_t offset, int access_width_bytes, uint64_t data, void *cookie);
+
+/* Append a write to the ring, draining it first if it is full. */
+void coalesced_io_push(coalesced_io_write_fn_t write, void *cookie, uint64_t offset, int access_width_bytes,
+                       uint64_t data);
+
+/* Give all the writes in the ring to their device models. */
+void coalesced_io_flush(void);
+
+bool coalesced_io_pending(void);
@@ -37,6 +37,9 @@ typedef struct guest {
 
     size_t guest_ram_regions_len;
     struct guest_ram_region guest_ram_regions[GUEST_MAX_RAM_REGIONS];
+
+    size_t guest_ram_hotplug_regions_len;
+    struct guest_ram_hotplug_region guest_ram_hotplug_regions[GUEST_MAX_HOTPLUG_REGIONS];
 } guest_t;
 
 typedef struct arch_guest_init {
@@ -61,6 +64,9 @@ typedef struct guest {
 
     size_t guest_ram_regions_len;
     struct guest_ram_region guest_ram_regions[GUEST_MAX_RAM_REGIONS];
+
+    size_t guest_ram_hotplug_regions_len;
+    struct guest_ram_hotplug_region guest_ram_hotplug_regions[GUEST_MAX_HOTPLUG_REGIONS];
 } guest_t;
 
 typedef struct arch_guest_init {
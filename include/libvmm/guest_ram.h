@@ -20,9 +20,30 @@ struct guest_ram_region {
     void *vmm_vaddr;
 };
 
+/* Most regions of guest RAM that can be plugged and unplugged while the guest runs */
+#define GUEST_MAX_HOTPLUG_REGIONS 2
+
+/*
+ * Guest RAM that is plugged in and unplugged in blocks of `block_size` while the guest
+ * runs, by a virtio-mem device. The whole region is reserved up front, but only the
+ * blocks set in the `plugged` bitmap are guest RAM.
+ */
+struct guest_ram_hotplug_region {
+    struct guest_ram_region region;
+    uint64_t block_size;
+    uint64_t *plugged;
+};
+
 /* Tell libvmm valid guest physical RAM region */
 bool guest_ram_add_region(struct guest_ram_region guest_ram_region);
 
+/*
+ * Tell libvmm of a region of hotpluggable guest RAM, with a bitmap of the blocks that
+ * are plugged in. The bitmap is read on every translation, so it must be kept up to date.
+ */
+bool guest_ram_add_hotplug_region(struct guest_ram_region guest_ram_region, uint64_t block_size,
+                                  uint64_t *plugged);
+
 /*
  * GVA: Guest Virtual Address
  * GPA: Guest Physical Address
@@ -31,7 +52,8 @@ bool guest_ram_add_region(struct guest_ram_region guest_ram_region);
 */
 
 /* Converts a Guest Physical Address to a Host Virtual Address.
- * Ensures the entire requested length is contiguous in guest RAM.
+ * Ensures the entire requested length is contiguous in guest RAM,
+ * and plugged in if it is hotpluggable RAM.
  * Returns NULL on failure.
  */
 void *gpa_to_hva(uint64_t gpa, size_t size);
@@ -44,4 +66,21 @@ struct guest_ram_region *guest_ram_get_regions(int *num_regions_ret);
 /* Convert guest virtual address to guest physical address. `bytes_remaining` will
  * contain number of bytes to page boundary. */
 bool gva_to_gpa(size_t vcpu_id, uint64_t gva, uint64_t *gpa, size_t *bytes_remaining);
+
+/* Number of entries in each vCPU's cache of gva_to_gpa translations, must be a power of
+ * two or 0 to disable it. Can be overridden at build time. */
+#ifndef GUEST_TLB_SIZE
+#define GUEST_TLB_SIZE 64
+#endif
+
+/* Whether cached translations are dropped on every VM exit. Only set this to 0 if the guest
+ * is made to exit on CR3 loads and INVLPG. Can be overridden at build time. */
+#ifndef GUEST_TLB_FLUSH_ON_EXIT
+#define GUEST_TLB_FLUSH_ON_EXIT 1
+#endif
+
+/* Drop cached translations, for when the guest changes address space or paging mode. */
+void gva_to_gpa_tlb_flush(size_t vcpu_id);
+/* Drop cached translations of the page containing `gva`, for when the guest executes INVLPG. */
+void gva_to_gpa_tlb_flush_page(size_t vcpu_id, uint64_t gva);
 #endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <microkit.h>
+#include <libvmm/virq.h>
+#include <libvmm/pci.h>
+
+/*
+ * An inter-VM shared memory device in the style of QEMU's ivshmem. A region of memory that
+ * the system description maps into several guests is exposed to each of them along with a
+ * small block of doorbell registers. Ringing a peer's doorbell notifies the VMM of that
+ * peer over a Microkit channel, which then raises the device's virtual IRQ in its guest.
+ *
+ * The register layout matches ivshmem so that existing guest drivers (ivshmem-uio, or
+ * uio_pci_generic) can be used as is:
+ *
+ *     0x00 IntrMask    read/write, interrupt is asserted while IntrStatus & IntrMask
+ *     0x04 IntrStatus  read clears, set by incoming doorbells
+ *     0x08 IVPosition  read only, the ID of this peer
+ *     0x0c Doorbell    write only, (peer ID << 16) | vector
+ *
+ * Only INTx style interrupts are supported, so the vector is ignored.
+ */
+
+#define IVSHMEM_PCI_VENDOR_ID 0x1af4
+#define IVSHMEM_PCI_DEVICE_ID 0x1110
+
+#define IVSHMEM_REG_INTR_MASK   0x0
+#define IVSHMEM_REG_INTR_STATUS 0x4
+#define IVSHMEM_REG_IV_POSITION 0x8
+#define IVSHMEM_REG_DOORBELL    0xc
+
+/* Size of the register block, as a BAR or as an MMIO region */
+#define IVSHMEM_REGS_SIZE 0x100
+
+#define IVSHMEM_MAX_PEERS 16
+
+struct ivshmem_peer {
+    uint16_t id;
+    /* Channel to the VMM of the peer */
+    microkit_channel ch;
+};
+
+typedef struct ivshmem_device {
+    uint16_t id;
+    uint64_t shm_gpa;
+    uint64_t shm_size;
+    struct ivshmem_peer peers[IVSHMEM_MAX_PEERS];
+    uint32_t num_peers;
+    uint32_t intr_mask;
+    uint32_t intr_status;
+    irq_routing_info_t irq_routing_info;
+    bool pci;
+    pci_dev_handle_t pci_handle;
+} ivshmem_device_t;
+
+#if !defined(CONFIG_ARCH_X86)
+/* The shared memory and the registers are separate regions of the guest physical address
+ * space, both of which must be described to the guest (e.g. with a device tree node for
+ * uio_pdrv_genirq). */
+bool ivshmem_mmio_init(ivshmem_device_t *shm, uintptr_t regs_gpa, irq_routing_info_t irq_routing_info, uint16_t id,
+                       uint64_t shm_gpa, uint64_t shm_size, struct ivshmem_peer *peers, uint32_t num_peers);
+#endif
+
+/* BAR0 holds the registers and BAR2 the shared memory, which must satisfy the constraints
+ * of pci_register_device_memory_bar. */
+bool ivshmem_pci_init(ivshmem_device_t *shm, uint16_t pci_bus, uint16_t pci_dev, irq_routing_info_t irq_routing_info,
+                      uint16_t id, uint64_t shm_gpa, uint64_t shm_size, struct ivshmem_peer *peers,
+                      uint32_t num_peers);
+
+/* To be called when a peer has rung our doorbell, i.e. when a notification arrives on the
+ * channel of one of the peers. */
+bool ivshmem_handle_doorbell(ivshmem_device_t *shm);
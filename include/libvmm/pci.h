@@ -21,8 +21,11 @@
 
 // PCI Class
 #define PCI_CLASS_STORAGE_SCSI           0x0100
+#define PCI_CLASS_STORAGE_OTHER          0x0180
 #define PCI_CLASS_NETWORK_ETHERNET       0x0200
+#define PCI_CLASS_MEMORY_RAM             0x0500
 #define PCI_CLASS_COMMUNICATION_OTHER    0x0780
+#define PCI_CLASS_OTHERS                 0xff00
 
 #define PCI_CLASS_CODE(x) ((x >> 8) & 0xFF)
 #define PCI_SUB_CLASS(x) (x & 0xFF)
@@ -94,3 +97,8 @@ typedef bool (*pci_bar_mmio_fault_handler_t)(pci_dev_handle_t pci_dev_handle, ui
 /* Allocate a memory BAR in the virtual PCI bus' MMIO aperature for the given PCI device. */
 bool pci_register_device_mmio_bar(pci_dev_handle_t pci_dev_handle, uint8_t bar_index, uint64_t size,
                                   pci_bar_mmio_fault_handler_t callback, void *cookie);
+
+/* Register a memory BAR that is backed by memory mapped into the guest at `gpa` rather than emulated. Since the
+ * mapping cannot move, the BAR is reported at `gpa` from the start and the guest must keep that assignment. `gpa` must
+ * be below 4GiB, within the MMIO aperature and aligned to `size`, which must be a power of two. */
+bool pci_register_device_memory_bar(pci_dev_handle_t pci_dev_handle, uint8_t bar_index, uint64_t gpa, uint64_t size);
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libvmm/guest_ram.h>
+#include <libvmm/virtio/virtio.h>
+
+/* Feature bits */
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST     0 /* Tell before reclaiming pages */
+#define VIRTIO_BALLOON_F_STATS_VQ           1 /* Memory Stats virtqueue */
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM     2 /* Deflate balloon on OOM */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT     3 /* VQ to report free pages */
+#define VIRTIO_BALLOON_F_PAGE_POISON        4 /* Guest is using page poisoning */
+#define VIRTIO_BALLOON_F_REPORTING          5 /* Page reporting virtqueue */
+
+/* Balloon PFNs are always in 4K pages, whatever the guest's page size */
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+#define VIRTIO_BALLOON_PAGE_SIZE (1ul << VIRTIO_BALLOON_PFN_SHIFT)
+
+/* Free page hint command IDs with a special meaning */
+#define VIRTIO_BALLOON_CMD_ID_STOP 0
+#define VIRTIO_BALLOON_CMD_ID_DONE 1
+
+/* Device chosen free page hint command IDs start from here */
+#define VIRTIO_BALLOON_CMD_ID_MIN 0x80000000
+
+/*
+ * Virtqueues in the order they are numbered. Queues of features the driver did not
+ * accept are skipped in the numbering, so the reporting queue is queue 2 if only
+ * VIRTIO_BALLOON_F_REPORTING is negotiated.
+ */
+#define VIRTIO_BALLOON_INFLATE_VQ 0
+#define VIRTIO_BALLOON_DEFLATE_VQ 1
+#define VIRTIO_BALLOON_STATS_VQ 2
+#define VIRTIO_BALLOON_FREE_PAGE_VQ 3
+#define VIRTIO_BALLOON_REPORTING_VQ 4
+#define VIRTIO_BALLOON_NUM_VIRTQ 5
+
+struct virtio_balloon_config {
+    /* Number of pages host wants Guest to give up. */
+    uint32_t num_pages;
+    /* Number of pages we've actually got in balloon. */
+    uint32_t actual;
+    /* Free page hint command ID, readonly by guest */
+    uint32_t free_page_hint_cmd_id;
+    /* Stores PAGE_POISON if page poisoning is in use */
+    uint32_t poison_val;
+} __attribute__((packed));
+
+/* Memory statistics */
+#define VIRTIO_BALLOON_S_SWAP_IN  0   /* Amount of memory swapped in */
+#define VIRTIO_BALLOON_S_SWAP_OUT 1   /* Amount of memory swapped out */
+#define VIRTIO_BALLOON_S_MAJFLT   2   /* Number of major faults */
+#define VIRTIO_BALLOON_S_MINFLT   3   /* Number of minor faults */
+#define VIRTIO_BALLOON_S_MEMFREE  4   /* Total amount of free memory */
+#define VIRTIO_BALLOON_S_MEMTOT   5   /* Total amount of memory */
+#define VIRTIO_BALLOON_S_AVAIL    6   /* Available memory as in /proc */
+#define VIRTIO_BALLOON_S_CACHES   7   /* Disk caches */
+#define VIRTIO_BALLOON_S_HTLB_PGALLOC  8  /* Hugetlb page allocations */
+#define VIRTIO_BALLOON_S_HTLB_PGFAIL   9  /* Hugetlb page allocation failures */
+#define VIRTIO_BALLOON_S_NR       10
+
+struct virtio_balloon_stat {
+    uint16_t tag;
+    uint64_t val;
+} __attribute__((packed));
+
+/*
+ * What the guest has said about a page. A page may be in more than one state.
+ *
+ * INFLATED: in the balloon. The guest will not touch it until it has been deflated,
+ *           which the device only acknowledges once the memory manager has given it back.
+ * REPORTED: free in the guest when it was reported through VIRTIO_BALLOON_F_REPORTING.
+ *           The guest may reuse it at any time without telling the device, so it can
+ *           only be reclaimed if the page can be restored when the guest faults on it.
+ * HINTED:   held by the guest driver for a free page hinting run, until the VMM ends
+ *           the run with `virtio_balloon_free_page_hint_done`.
+ */
+enum virtio_balloon_page_state {
+    VIRTIO_BALLOON_PAGE_INFLATED,
+    VIRTIO_BALLOON_PAGE_REPORTED,
+    VIRTIO_BALLOON_PAGE_HINTED,
+    VIRTIO_BALLOON_NUM_PAGE_STATES,
+};
+
+struct virtio_balloon_free_map_region {
+    uint64_t gpa_start;
+    uint64_t num_pages;
+    /* Bit of the region's first page in each bitmap */
+    uint64_t first_page;
+};
+
+/*
+ * Pages the guest has given back, one bitmap per `enum virtio_balloon_page_state` with a
+ * bit for every 4K page of guest RAM. Bits are laid out region by region, in the order of
+ * `guest_ram_get_regions()`. The map is meant to be placed in memory shared with a memory
+ * manager, which is notified whenever it changes.
+ */
+struct virtio_balloon_free_map {
+    /* Incremented every time a bitmap changes */
+    uint64_t generation;
+    /* Pages of guest RAM covered, and 64-bit words in each bitmap */
+    uint64_t num_pages;
+    uint64_t words;
+    /* Number of pages set in each bitmap */
+    uint64_t count[VIRTIO_BALLOON_NUM_PAGE_STATES];
+    uint32_t num_regions;
+    struct virtio_balloon_free_map_region regions[GUEST_MAX_RAM_REGIONS];
+    /* VIRTIO_BALLOON_NUM_PAGE_STATES bitmaps of `words` words each */
+    uint64_t bits[];
+};
+
+/* Bytes needed for the free map of `ram_size` bytes of guest RAM */
+#define VIRTIO_BALLOON_FREE_MAP_SIZE(ram_size)                                                                      \
+    (sizeof(struct virtio_balloon_free_map)                                                                         \
+     + VIRTIO_BALLOON_NUM_PAGE_STATES * (((ram_size) / VIRTIO_BALLOON_PAGE_SIZE + 63) / 64) * sizeof(uint64_t))
+
+static inline uint64_t *virtio_balloon_free_map_bits(struct virtio_balloon_free_map *map,
+                                                      enum virtio_balloon_page_state state)
+{
+    return &map->bits[state * map->words];
+}
+
+/* Whether the page containing `gpa` is in `state`, false for addresses outside guest RAM */
+static inline bool virtio_balloon_page_in_state(struct virtio_balloon_free_map *map, uint64_t gpa,
+                                                enum virtio_balloon_page_state state)
+{
+    for (uint32_t i = 0; i < map->num_regions; i++) {
+        struct virtio_balloon_free_map_region *region = &map->regions[i];
+        uint64_t page = (gpa - region->gpa_start) >> VIRTIO_BALLOON_PFN_SHIFT;
+        if (gpa >= region->gpa_start && page < region->num_pages) {
+            uint64_t bit = region->first_page + page;
+            return (virtio_balloon_free_map_bits(map, state)[bit / 64] >> (bit % 64)) & 1;
+        }
+    }
+    return false;
+}
+
+struct virtio_balloon_device {
+    struct virtio_device virtio_device;
+    struct virtio_queue_handler vqs[VIRTIO_BALLOON_NUM_VIRTQ];
+    struct virtio_balloon_config config;
+    /* Virtqueue, as VIRTIO_BALLOON_*_VQ, behind each queue index for the negotiated features */
+    uint8_t vq_type[VIRTIO_BALLOON_NUM_VIRTQ];
+    struct virtio_balloon_free_map *free_map;
+    /* Channel of the memory manager, or -1 if there is none */
+    int mm_ch;
+    /* A deflate request waiting for the memory manager to give its pages back */
+    bool deflate_pending;
+    uint16_t deflate_head;
+    /* The guest's stats buffer, held until the VMM asks for new stats */
+    bool stats_pending;
+    uint16_t stats_head;
+    /* Latest stats from the guest, with a bit set in `stats_valid` for each one reported */
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    uint32_t stats_valid;
+    /* Free page hinting run the guest is reporting hints for */
+    bool hinting;
+    uint32_t next_hint_cmd_id;
+};
+
+/*
+ * Initialise a balloon device. Guest RAM regions must already have been added, as the
+ * free map covers them. `free_map_size` must be at least VIRTIO_BALLOON_FREE_MAP_SIZE of
+ * the guest RAM size. If `mm_ch` is not -1, the memory manager on that channel is notified
+ * when the free map changes and must acknowledge deflates with `virtio_balloon_mm_ack`.
+ */
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_balloon_init(struct virtio_balloon_device *balloon, uintptr_t region_base, uintptr_t region_size,
+                              irq_routing_info_t irq_routing_info, struct virtio_balloon_free_map *free_map,
+                              size_t free_map_size, int mm_ch);
+#endif
+
+bool virtio_pci_balloon_init(struct virtio_balloon_device *balloon, uint16_t pci_bus, uint16_t pci_dev,
+                             irq_routing_info_t irq_routing_info, struct virtio_balloon_free_map *free_map,
+                             size_t free_map_size, int mm_ch);
+
+/* Ask the guest to inflate or deflate the balloon to `num_pages` 4K pages */
+bool virtio_balloon_set_target(struct virtio_balloon_device *balloon, uint32_t num_pages);
+
+/* Ask the guest for new memory stats, which are in `stats` once it has reported them */
+bool virtio_balloon_request_stats(struct virtio_balloon_device *balloon);
+
+/* Ask the guest to hint its free pages, which are then HINTED in the free map */
+bool virtio_balloon_free_page_hint_start(struct virtio_balloon_device *balloon);
+
+/* End a hinting run once the memory manager is done with the HINTED pages, the guest takes them back */
+bool virtio_balloon_free_page_hint_done(struct virtio_balloon_device *balloon);
+
+/* The memory manager has given back the pages of a deflate request */
+bool virtio_balloon_mm_ack(struct virtio_balloon_device *balloon);
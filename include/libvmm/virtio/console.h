@@ -54,9 +54,19 @@
 
 #define VIRTIO_CONSOLE_BAD_ID (~(uint32_t)0)
 
-#define VIRTIO_CONSOLE_MAX_PORTS 4 /* Support max 4 ports right now... */
+/* Maximum number of ports of a multiport device, can be overridden at build time */
+#ifndef VIRTIO_CONSOLE_MAX_PORTS
+#define VIRTIO_CONSOLE_MAX_PORTS 4
+#endif
+
+/* Port 0's queues, the control queues, then an RX and TX queue for every other port */
+#define VIRTIO_CONSOLE_MAX_VIRTQ (2 * VIRTIO_CONSOLE_MAX_PORTS + 2)
+
+/* Control messages waiting for a guest buffer, enough for every port to be set up at once */
+#define VIRTIO_CONSOLE_CTRL_PENDING (4 * VIRTIO_CONSOLE_MAX_PORTS)
 
-#define VIRTIO_CONSOLE_CFG_MAX_PORTS (VIRTIO_PCI_CONFIG_OFF(false) + offsetof(struct virtio_con_cfg, max_nr_ports))
+/* Longest port name reported to the guest */
+#define VIRTIO_CONSOLE_PORT_NAME_MAX 64
 
 struct virtio_console_config {
     /* colums of the screens */
@@ -89,23 +99,69 @@ struct virtio_console_control {
 #define VIRTIO_CONSOLE_PORT_OPEN    6
 #define VIRTIO_CONSOLE_PORT_NAME    7
 
-struct virtio_console_device {
-    struct virtio_device virtio_device;
-    struct virtio_queue_handler vqs[VIRTIO_CONSOLE_NUM_VIRTQ];
+/* A port of the device and the sDDF serial queues it is bound to */
+struct virtio_console_port {
     serial_queue_handle_t *rxq;
     serial_queue_handle_t *txq;
     int tx_ch;
     int rx_ch;
+    /*
+     * Name reported to the guest for ports other than port 0, which is always the console.
+     * Linux exposes named ports as /dev/virtio-ports/<name>. May be NULL.
+     */
+    const char *name;
+};
+
+struct virtio_console_port_state {
+    /* Bytes of the chain at the head of the TX avail ring already sent to the serial TX queue */
+    uint32_t tx_progress;
+    /* The guest has set the port up */
+    bool ready;
+    /* A program in the guest has the port open */
+    bool guest_open;
+};
+
+struct virtio_console_device {
+    struct virtio_device virtio_device;
+    struct virtio_queue_handler vqs[VIRTIO_CONSOLE_MAX_VIRTQ];
+    struct virtio_console_port ports[VIRTIO_CONSOLE_MAX_PORTS];
+    struct virtio_console_port_state port_state[VIRTIO_CONSOLE_MAX_PORTS];
+    uint32_t num_ports;
+    struct virtio_console_config config;
+    /* Whether MULTIPORT is offered, and whether the driver accepted it */
+    bool multiport;
+    bool multiport_enabled;
+    /* Ring of control messages for the guest waiting on a control RX buffer */
+    struct virtio_console_control ctrl_pending[VIRTIO_CONSOLE_CTRL_PENDING];
+    uint32_t ctrl_pending_head;
+    uint32_t ctrl_pending_tail;
 };
 
 #if !defined(CONFIG_ARCH_X86)
 bool virtio_mmio_console_init(struct virtio_console_device *console, uintptr_t region_base, uintptr_t region_size,
                               irq_routing_info_t irq_routing_info, serial_queue_handle_t *rxq,
                               serial_queue_handle_t *txq, int tx_ch, int rx_ch);
+
+/*
+ * Initialise a console device with `num_ports` ports using the MULTIPORT feature. Port 0
+ * is the guest's console, the rest are generic byte streams.
+ */
+bool virtio_mmio_console_init_multiport(struct virtio_console_device *console, uintptr_t region_base,
+                                        uintptr_t region_size, irq_routing_info_t irq_routing_info,
+                                        struct virtio_console_port *ports, uint32_t num_ports);
 #endif
 
 bool virtio_pci_console_init(struct virtio_console_device *console, uint16_t pci_bus, uint16_t pci_dev,
                              irq_routing_info_t irq_routing_info, serial_queue_handle_t *rxq,
                              serial_queue_handle_t *txq, int tx_ch, int rx_ch);
 
+bool virtio_pci_console_init_multiport(struct virtio_console_device *console, uint16_t pci_bus, uint16_t pci_dev,
+                                       irq_routing_info_t irq_routing_info, struct virtio_console_port *ports,
+                                       uint32_t num_ports);
+
+/*
+ * Move data between the guest and the serial queues of every port. Must be called when notified on
+ * the RX channel of a port, and on its TX channel, which the TX virtualiser notifies once it has made
+ * room for a guest write that did not fit in the serial TX queue.
+ */
 bool virtio_console_queue_notify(struct virtio_console_device *console);
\ No newline at end of file
@@ -0,0 +1,507 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libvmm/virtio/virtio.h>
+#include <sddf/fs/protocol.h>
+#include <sddf/util/fsmalloc.h>
+#include <sddf/util/ialloc.h>
+
+/* Feature bits */
+#define VIRTIO_FS_F_NOTIFICATION 0 /* Device has support for FUSE notify messages */
+
+/* Shared memory region IDs */
+#define VIRTIO_FS_SHMCAP_ID_CACHE 0 /* DAX window */
+
+#define VIRTIO_FS_TAG_LEN 36
+
+struct virtio_fs_config {
+    /* Filesystem name (UTF-8, not NUL-terminated, padded with NUL bytes) */
+    char tag[VIRTIO_FS_TAG_LEN];
+    /* Number of request queues */
+    uint32_t num_request_queues;
+    /* Minimum number of bytes required for each buffer in the notification queue */
+    uint32_t notify_buf_size;
+} __attribute__((packed));
+
+/* FUSE protocol version the device speaks */
+#define FUSE_KERNEL_VERSION 7
+#define FUSE_KERNEL_MINOR_VERSION 31
+
+#define FUSE_ROOT_ID 1
+
+enum fuse_opcode {
+    FUSE_LOOKUP = 1,
+    FUSE_FORGET = 2,
+    FUSE_GETATTR = 3,
+    FUSE_SETATTR = 4,
+    FUSE_READLINK = 5,
+    FUSE_SYMLINK = 6,
+    FUSE_MKNOD = 8,
+    FUSE_MKDIR = 9,
+    FUSE_UNLINK = 10,
+    FUSE_RMDIR = 11,
+    FUSE_RENAME = 12,
+    FUSE_LINK = 13,
+    FUSE_OPEN = 14,
+    FUSE_READ = 15,
+    FUSE_WRITE = 16,
+    FUSE_STATFS = 17,
+    FUSE_RELEASE = 18,
+    FUSE_FSYNC = 20,
+    FUSE_SETXATTR = 21,
+    FUSE_GETXATTR = 22,
+    FUSE_LISTXATTR = 23,
+    FUSE_REMOVEXATTR = 24,
+    FUSE_FLUSH = 25,
+    FUSE_INIT = 26,
+    FUSE_OPENDIR = 27,
+    FUSE_READDIR = 28,
+    FUSE_RELEASEDIR = 29,
+    FUSE_FSYNCDIR = 30,
+    FUSE_GETLK = 31,
+    FUSE_SETLK = 32,
+    FUSE_SETLKW = 33,
+    FUSE_ACCESS = 34,
+    FUSE_CREATE = 35,
+    FUSE_INTERRUPT = 36,
+    FUSE_BMAP = 37,
+    FUSE_DESTROY = 38,
+    FUSE_IOCTL = 39,
+    FUSE_POLL = 40,
+    FUSE_NOTIFY_REPLY = 41,
+    FUSE_BATCH_FORGET = 42,
+    FUSE_FALLOCATE = 43,
+    FUSE_READDIRPLUS = 44,
+    FUSE_RENAME2 = 45,
+    FUSE_LSEEK = 46,
+    FUSE_COPY_FILE_RANGE = 47,
+    FUSE_SETUPMAPPING = 48,
+    FUSE_REMOVEMAPPING = 49,
+    FUSE_SYNCFS = 50,
+};
+
+/* INIT flags */
+#define FUSE_ASYNC_READ (1 << 0)
+#define FUSE_BIG_WRITES (1 << 5)
+#define FUSE_PARALLEL_DIROPS (1 << 18)
+#define FUSE_MAX_PAGES (1 << 22)
+#define FUSE_MAP_ALIGNMENT (1 << 26)
+
+/* SETATTR valid bits */
+#define FATTR_MODE (1 << 0)
+#define FATTR_UID (1 << 1)
+#define FATTR_GID (1 << 2)
+#define FATTR_SIZE (1 << 3)
+#define FATTR_ATIME (1 << 4)
+#define FATTR_MTIME (1 << 5)
+#define FATTR_FH (1 << 6)
+
+/* SETUPMAPPING flags */
+#define FUSE_SETUPMAPPING_FLAG_WRITE (1 << 0)
+#define FUSE_SETUPMAPPING_FLAG_READ (1 << 1)
+
+struct fuse_in_header {
+    uint32_t len;
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+    uint16_t total_extlen;
+    uint16_t padding;
+};
+
+struct fuse_out_header {
+    uint32_t len;
+    int32_t error;
+    uint64_t unique;
+};
+
+struct fuse_attr {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t atimensec;
+    uint32_t mtimensec;
+    uint32_t ctimensec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t rdev;
+    uint32_t blksize;
+    uint32_t flags;
+};
+
+struct fuse_init_in {
+    uint32_t major;
+    uint32_t minor;
+    uint32_t max_readahead;
+    uint32_t flags;
+    uint32_t flags2;
+    uint32_t unused[11];
+};
+
+struct fuse_init_out {
+    uint32_t major;
+    uint32_t minor;
+    uint32_t max_readahead;
+    uint32_t flags;
+    uint16_t max_background;
+    uint16_t congestion_threshold;
+    uint32_t max_write;
+    uint32_t time_gran;
+    uint16_t max_pages;
+    uint16_t map_alignment;
+    uint32_t flags2;
+    uint32_t unused[7];
+};
+
+struct fuse_entry_out {
+    uint64_t nodeid;
+    uint64_t generation;
+    uint64_t entry_valid;
+    uint64_t attr_valid;
+    uint32_t entry_valid_nsec;
+    uint32_t attr_valid_nsec;
+    struct fuse_attr attr;
+};
+
+struct fuse_forget_in {
+    uint64_t nlookup;
+};
+
+struct fuse_forget_one {
+    uint64_t nodeid;
+    uint64_t nlookup;
+};
+
+struct fuse_batch_forget_in {
+    uint32_t count;
+    uint32_t dummy;
+};
+
+struct fuse_getattr_in {
+    uint32_t getattr_flags;
+    uint32_t dummy;
+    uint64_t fh;
+};
+
+struct fuse_attr_out {
+    uint64_t attr_valid;
+    uint32_t attr_valid_nsec;
+    uint32_t dummy;
+    struct fuse_attr attr;
+};
+
+struct fuse_setattr_in {
+    uint32_t valid;
+    uint32_t padding;
+    uint64_t fh;
+    uint64_t size;
+    uint64_t lock_owner;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t atimensec;
+    uint32_t mtimensec;
+    uint32_t ctimensec;
+    uint32_t mode;
+    uint32_t unused4;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t unused5;
+};
+
+struct fuse_mkdir_in {
+    uint32_t mode;
+    uint32_t umask;
+};
+
+struct fuse_rename_in {
+    uint64_t newdir;
+};
+
+struct fuse_rename2_in {
+    uint64_t newdir;
+    uint32_t flags;
+    uint32_t padding;
+};
+
+struct fuse_open_in {
+    uint32_t flags;
+    uint32_t open_flags;
+};
+
+struct fuse_create_in {
+    uint32_t flags;
+    uint32_t mode;
+    uint32_t umask;
+    uint32_t open_flags;
+};
+
+struct fuse_open_out {
+    uint64_t fh;
+    uint32_t open_flags;
+    uint32_t padding;
+};
+
+struct fuse_release_in {
+    uint64_t fh;
+    uint32_t flags;
+    uint32_t release_flags;
+    uint64_t lock_owner;
+};
+
+struct fuse_read_in {
+    uint64_t fh;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t read_flags;
+    uint64_t lock_owner;
+    uint32_t flags;
+    uint32_t padding;
+};
+
+struct fuse_write_in {
+    uint64_t fh;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t write_flags;
+    uint64_t lock_owner;
+    uint32_t flags;
+    uint32_t padding;
+};
+
+struct fuse_write_out {
+    uint32_t size;
+    uint32_t padding;
+};
+
+struct fuse_fsync_in {
+    uint64_t fh;
+    uint32_t fsync_flags;
+    uint32_t padding;
+};
+
+struct fuse_kstatfs {
+    uint64_t blocks;
+    uint64_t bfree;
+    uint64_t bavail;
+    uint64_t files;
+    uint64_t ffree;
+    uint32_t bsize;
+    uint32_t namelen;
+    uint32_t frsize;
+    uint32_t padding;
+    uint32_t spare[6];
+};
+
+struct fuse_statfs_out {
+    struct fuse_kstatfs st;
+};
+
+struct fuse_dirent {
+    uint64_t ino;
+    uint64_t off;
+    uint32_t namelen;
+    uint32_t type;
+    char name[];
+};
+
+#define FUSE_DIRENT_ALIGN(x) (((x) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+struct fuse_setupmapping_in {
+    uint64_t fh;
+    uint64_t foffset;
+    uint64_t len;
+    uint64_t flags;
+    uint64_t moffset;
+};
+
+struct fuse_removemapping_in {
+    uint32_t count;
+};
+
+struct fuse_removemapping_one {
+    uint64_t moffset;
+    uint64_t len;
+};
+
+/* Queue 0 is the high priority queue, request queues follow it */
+#define VIRTIO_FS_HIPRIO_QUEUE 0
+
+/* Most request queues a device can have, can be overridden at build time */
+#ifndef VIRTIO_FS_MAX_REQUEST_QUEUES
+#define VIRTIO_FS_MAX_REQUEST_QUEUES 4
+#endif
+
+#define VIRTIO_FS_MAX_VIRTQ (1 + VIRTIO_FS_MAX_REQUEST_QUEUES)
+
+/* FUSE requests the device works on at once. Each has at most one sDDF command in flight. */
+#ifndef VIRTIO_FS_MAX_REQUESTS
+#define VIRTIO_FS_MAX_REQUESTS 64
+#endif
+
+/* Files and directories the guest has looked up */
+#ifndef VIRTIO_FS_MAX_NODES
+#define VIRTIO_FS_MAX_NODES 512
+#endif
+
+/* Longest path, including the NUL terminator, of a file the guest can reach */
+#ifndef VIRTIO_FS_MAX_PATH
+#define VIRTIO_FS_MAX_PATH 512
+#endif
+
+/* Directories the guest has open */
+#ifndef VIRTIO_FS_MAX_DIRS
+#define VIRTIO_FS_MAX_DIRS 32
+#endif
+
+/* Data region cells, each holding the paths of a request or part of its data */
+#define VIRTIO_FS_CELL_SIZE 0x1000
+#ifndef VIRTIO_FS_MAX_DATA_CELLS
+#define VIRTIO_FS_MAX_DATA_CELLS 256
+#endif
+
+/* Largest read or write, the guest is told to split larger ones */
+#define VIRTIO_FS_MAX_IO (32 * VIRTIO_FS_CELL_SIZE)
+
+/* The DAX window is mapped in chunks of this size, as Linux does */
+#define VIRTIO_FS_DAX_CHUNK_SIZE 0x200000
+#ifndef VIRTIO_FS_DAX_MAX_CHUNKS
+#define VIRTIO_FS_DAX_MAX_CHUNKS 256
+#endif
+
+/* Seconds the guest may cache entries and attributes for */
+#ifndef VIRTIO_FS_ATTR_TIMEOUT
+#define VIRTIO_FS_ATTR_TIMEOUT 1
+#endif
+
+struct virtio_fs_node {
+    bool in_use;
+    /* The file was removed or replaced, so the path no longer leads to it */
+    bool stale;
+    /* Lookups the guest holds on the node, it is freed once they are all forgotten */
+    uint64_t nlookup;
+    uint32_t hash;
+    char path[VIRTIO_FS_MAX_PATH];
+};
+
+struct virtio_fs_dir {
+    bool in_use;
+    uint64_t fd;
+    /* Entries the guest has been given, the first two are "." and ".." */
+    uint64_t pos;
+    /* An entry read from the file server that did not fit in the guest's buffer */
+    bool pending;
+    char pending_name[FS_MAX_NAME_LENGTH + 1];
+};
+
+/*
+ * Part of a file mapped into the DAX window. The file contents are read into the window
+ * when it is mapped, and written back when it is unmapped or the file is synced.
+ */
+struct virtio_fs_dax_chunk {
+    bool in_use;
+    bool writable;
+    uint64_t nodeid;
+    uint64_t foffset;
+    uint64_t moffset;
+    uint64_t len;
+    /* Bytes of the mapping that are within the file */
+    uint64_t valid;
+};
+
+struct virtio_fs_request {
+    bool in_use;
+    /* The device was reset while the request was with the file server, it is dropped once it comes back */
+    bool cancelled;
+    uint16_t vq;
+    uint16_t desc_head;
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+    /* Length of the request, and where the reply goes in the descriptor chain and its room */
+    uint32_t req_len;
+    uint32_t reply_off;
+    uint32_t reply_len;
+    /* How far a request that takes several sDDF commands has got */
+    uint32_t step;
+    uint32_t writeback_step;
+    /* Data region cells of the request, the first holds paths and small buffers */
+    uintptr_t cells;
+    uint64_t num_cells;
+    /* Arguments and results carried between steps */
+    uint64_t fd;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t written;
+    uint32_t index;
+    uint32_t chunk;
+    int error;
+    uint64_t target;
+};
+
+struct virtio_fs_device {
+    struct virtio_device virtio_device;
+    struct virtio_queue_handler vqs[VIRTIO_FS_MAX_VIRTQ];
+    struct virtio_fs_config config;
+    struct virtio_shm_region dax_window;
+    struct virtio_fs_request reqs[VIRTIO_FS_MAX_REQUESTS];
+    struct virtio_fs_node nodes[VIRTIO_FS_MAX_NODES];
+    struct virtio_fs_dir dirs[VIRTIO_FS_MAX_DIRS];
+    struct virtio_fs_dax_chunk dax_chunks[VIRTIO_FS_DAX_MAX_CHUNKS];
+    uint32_t num_dax_chunks;
+    /* Offset of the DAX window in the data region */
+    uint64_t dax_offset;
+    /* sDDF file system client state */
+    fs_queue_t *cmd_queue;
+    fs_queue_t *cmpl_queue;
+    uintptr_t data_region;
+    fsmalloc_t fsmalloc;
+    bitarray_t fsmalloc_avail_bitarr;
+    uint64_t fsmalloc_avail_bitarr_words[BITS_2_WORDS64(VIRTIO_FS_MAX_DATA_CELLS)];
+    ialloc_t ialloc;
+    uint32_t ialloc_idxlist[VIRTIO_FS_MAX_REQUESTS];
+    int server_ch;
+    /* Commands were queued for the file server since it was last notified */
+    bool server_notify;
+    /* Replies were added to a used ring since the guest was last interrupted */
+    bool guest_notify;
+};
+
+/*
+ * Initialise a virtio-fs device exporting the file system of the sDDF file server on
+ * `server_ch`, visible to the guest as `tag`. Requests from the guest are spread over
+ * `num_request_queues` queues.
+ *
+ * The data region is shared with the file server. On MMIO, the last `dax_window_size`
+ * bytes of it can be used as a DAX window, which must also be mapped into the guest at
+ * `dax_window_gpa`. A size of zero disables DAX.
+ */
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_fs_init(struct virtio_fs_device *fs, uintptr_t region_base, uintptr_t region_size,
+                         irq_routing_info_t irq_routing_info, const char *tag, uint32_t num_request_queues,
+                         fs_queue_t *cmd_queue, fs_queue_t *cmpl_queue, uintptr_t data_region, size_t data_region_size,
+                         uint64_t dax_window_gpa, size_t dax_window_size, int server_ch);
+#endif
+
+bool virtio_pci_fs_init(struct virtio_fs_device *fs, uint16_t pci_bus, uint16_t pci_dev,
+                        irq_routing_info_t irq_routing_info, const char *tag, uint32_t num_request_queues,
+                        fs_queue_t *cmd_queue, fs_queue_t *cmpl_queue, uintptr_t data_region, size_t data_region_size,
+                        int server_ch);
+
+/* Call when notified by the file server, handles its completions */
+bool virtio_fs_handle_cmpl(struct virtio_fs_device *fs);
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libvmm/virtio/virtio.h>
+
+/* Feature bits */
+#define VIRTIO_MEM_F_ACPI_PXM                 0 /* node_id is an ACPI PXM and is valid */
+#define VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE   1 /* Unplugged memory cannot be accessed */
+#define VIRTIO_MEM_F_PERSISTENT_SUSPEND       2 /* Plugged memory is kept across suspend */
+
+#define VIRTIO_MEM_REQ_QUEUE 0
+#define VIRTIO_MEM_NUM_VIRTQ 1
+
+struct virtio_mem_config {
+    /* Block size and alignment. Cannot change. */
+    uint64_t block_size;
+    /* Valid with VIRTIO_MEM_F_ACPI_PXM. Cannot change. */
+    uint16_t node_id;
+    uint8_t padding[6];
+    /* Start address of the memory region. Cannot change. */
+    uint64_t addr;
+    /* Region size (maximum). Cannot change. */
+    uint64_t region_size;
+    /* Currently usable region size. Can grow up to region_size. */
+    uint64_t usable_region_size;
+    /* Currently used size. Changes due to plug/unplug requests, but no other changes. */
+    uint64_t plugged_size;
+    /* Requested size. New plug requests cannot exceed it. Can change. */
+    uint64_t requested_size;
+} __attribute__((packed));
+
+/* Request types */
+#define VIRTIO_MEM_REQ_PLUG        0
+#define VIRTIO_MEM_REQ_UNPLUG      1
+#define VIRTIO_MEM_REQ_UNPLUG_ALL  2
+#define VIRTIO_MEM_REQ_STATE       3
+
+struct virtio_mem_req_range {
+    uint64_t addr;
+    uint16_t nb_blocks;
+    uint16_t padding[3];
+} __attribute__((packed));
+
+struct virtio_mem_req {
+    uint16_t type;
+    uint16_t padding[3];
+    /* Unused for VIRTIO_MEM_REQ_UNPLUG_ALL */
+    struct virtio_mem_req_range range;
+} __attribute__((packed));
+
+/* Response types */
+#define VIRTIO_MEM_RESP_ACK    0
+#define VIRTIO_MEM_RESP_NACK   1
+#define VIRTIO_MEM_RESP_BUSY   2
+#define VIRTIO_MEM_RESP_ERROR  3
+
+/* States of a range, in response to VIRTIO_MEM_REQ_STATE */
+#define VIRTIO_MEM_STATE_PLUGGED   0
+#define VIRTIO_MEM_STATE_UNPLUGGED 1
+#define VIRTIO_MEM_STATE_MIXED     2
+
+struct virtio_mem_resp {
+    uint16_t type;
+    uint16_t padding[3];
+    uint16_t state;
+} __attribute__((packed));
+
+/* 64-bit words of the plugged bitmap for a region of `region_size` bytes */
+#define VIRTIO_MEM_BITMAP_WORDS(region_size, block_size) ((((region_size) / (block_size)) + 63) / 64)
+
+struct virtio_mem_device {
+    struct virtio_device virtio_device;
+    struct virtio_queue_handler vqs[VIRTIO_MEM_NUM_VIRTQ];
+    struct virtio_mem_config config;
+    /* Bit per block of the region, set while the block is plugged in */
+    uint64_t *plugged;
+    /* Channel of the memory manager, or -1 if there is none */
+    int mm_ch;
+    /* A plug request waiting for the memory manager to back its blocks */
+    bool plug_pending;
+    uint16_t plug_head;
+};
+
+/*
+ * Initialise a virtio-mem device for the hotpluggable region of `size` bytes at `gpa`,
+ * mapped into the VMM at `vmm_vaddr`. The guest plugs and unplugs it in blocks of
+ * `block_size` bytes, a power of two that `gpa` and `size` are multiples of. The region
+ * is registered as hotpluggable guest RAM, so it must not overlap other guest RAM.
+ *
+ * `plugged` is the bitmap of plugged blocks, of at least VIRTIO_MEM_BITMAP_WORDS words.
+ * It may be in memory shared with a memory manager. If `mm_ch` is not -1, the memory
+ * manager on that channel is notified whenever the bitmap changes, and must acknowledge
+ * plugs with `virtio_mem_mm_ack` once the new blocks are backed.
+ */
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_mem_init(struct virtio_mem_device *mem, uintptr_t region_base, uintptr_t region_size,
+                          irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, void *vmm_vaddr,
+                          uint64_t block_size, uint64_t *plugged, size_t plugged_words, int mm_ch);
+#endif
+
+bool virtio_pci_mem_init(struct virtio_mem_device *mem, uint16_t pci_bus, uint16_t pci_dev,
+                         irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, void *vmm_vaddr,
+                         uint64_t block_size, uint64_t *plugged, size_t plugged_words, int mm_ch);
+
+/* Ask the guest to grow or shrink the memory it has plugged in to `size` bytes */
+bool virtio_mem_set_requested_size(struct virtio_mem_device *mem, uint64_t size);
+
+/* The memory manager has backed the blocks of a plug request */
+bool virtio_mem_mm_ack(struct virtio_mem_device *mem);
@@ -39,6 +39,12 @@
 #define REG_VIRTIO_MMIO_QUEUE_AVAIL_HIGH    0x094
 #define REG_VIRTIO_MMIO_QUEUE_USED_LOW      0x0a0
 #define REG_VIRTIO_MMIO_QUEUE_USED_HIGH     0x0a4
+#define REG_VIRTIO_MMIO_SHM_SEL             0x0ac
+#define REG_VIRTIO_MMIO_SHM_LEN_LOW         0x0b0
+#define REG_VIRTIO_MMIO_SHM_LEN_HIGH        0x0b4
+#define REG_VIRTIO_MMIO_SHM_BASE_LOW        0x0b8
+#define REG_VIRTIO_MMIO_SHM_BASE_HIGH       0x0bc
+#define REG_VIRTIO_MMIO_QUEUE_RESET         0x0c0
 #define REG_VIRTIO_MMIO_CONFIG_GENERATION   0x0fc
 #define REG_VIRTIO_MMIO_CONFIG              0x100
 
@@ -46,7 +52,12 @@
 #define VIRTIO_DEVICE_ID_NET          1
 #define VIRTIO_DEVICE_ID_BLOCK        2
 #define VIRTIO_DEVICE_ID_CONSOLE      3
+#define VIRTIO_DEVICE_ID_BALLOON      5
+#define VIRTIO_DEVICE_ID_VSOCK        19
+#define VIRTIO_DEVICE_ID_MEM          24
 #define VIRTIO_DEVICE_ID_SOUND        25
+#define VIRTIO_DEVICE_ID_FS           26
+#define VIRTIO_DEVICE_ID_PMEM         27
 
 typedef struct virtio_mmio_data {
     uint32_t revision;
@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <sddf/network/queue.h>
 #include <libvmm/virtio/virtio.h>
+#include <libvmm/virtio/net_filter.h>
 
 /* The feature bitmap for virtio net */
 #define VIRTIO_NET_F_CSUM               0   /* Host handles pkts w/ partial csum */
@@ -55,22 +56,43 @@
 #define VIRTIO_NET_F_GUEST_ANNOUNCE     21  /* Guest can announce device on the network */
 #define VIRTIO_NET_F_MQ                 22  /* Device supports Receive Flow Steering */
 #define VIRTIO_NET_F_CTRL_MAC_ADDR      23  /* Set MAC address */
+#define VIRTIO_NET_F_RSS                60  /* Device supports RSS (receive-side scaling) */
 
 #define VIRTIO_NET_S_LINK_UP            1   /* Link is up */
 #define VIRTIO_NET_S_ANNOUNCE           2   /* Announcement is needed */
 
 #define VIRTIO_NET_CONFIG_MAC_SZ        6
 
+/* Hash types for VIRTIO_NET_F_RSS */
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4   (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4  (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4  (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6   (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6  (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6  (1 << 5)
+#define VIRTIO_NET_RSS_HASH_TYPE_IP_EX  (1 << 6)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCP_EX (1 << 7)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDP_EX (1 << 8)
+
 struct virtio_net_config {
     /* The config defining mac address (if VIRTIO_NET_F_MAC) */
     uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ];
     /* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
-    // uint16_t status;
+    uint16_t status;
     /* Maximum number of each of transmit and receive queues;
      * see VIRTIO_NET_F_MQ and VIRTIO_NET_CTRL_MQ.
      * Legal values are between 1 and 0x8000
      */
-    // uint16_t max_virtqueue_pairs;
+    uint16_t max_virtqueue_pairs;
+    /* Default maximum transmit unit advice (if VIRTIO_NET_F_MTU) */
+    uint16_t mtu;
+    /* Speed and duplex (if VIRTIO_NET_F_SPEED_DUPLEX) */
+    uint32_t speed;
+    uint8_t duplex;
+    /* Limits of the RSS configuration (if VIRTIO_NET_F_RSS) */
+    uint8_t rss_max_key_size;
+    uint16_t rss_max_indirection_table_length;
+    uint32_t supported_hash_types;
 } __attribute__((packed));
 
 /* This header comes first in the scatter-gather list.
@@ -207,30 +229,214 @@ struct virtio_net_ctrl_mq {
 #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
 #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
 
-#define VIRTIO_NET_RX_VIRTQ     0
-#define VIRTIO_NET_TX_VIRTQ     1
-#define VIRTIO_NET_NUM_VIRTQ    2
+/*
+ * Configure receive-side scaling with VIRTIO_NET_F_RSS. The command data is
+ * a struct virtio_net_rss_config with a variable length indirection table
+ * followed by max_tx_vq, the hash key length and the hash key itself.
+ */
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
 
-struct virtio_net_device {
-    struct virtio_device virtio_device;
+struct virtio_net_rss_config {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[];
+    /* uint16_t max_tx_vq; */
+    /* uint8_t hash_key_length; */
+    /* uint8_t hash_key_data[hash_key_length]; */
+} __attribute__((packed));
 
-    struct virtio_net_config config;
-    struct virtio_queue_handler vqs[VIRTIO_NET_NUM_VIRTQ];
+/* Device (backend) implementation */
 
+/* Maximum number of RX/TX virtqueue pairs of a device, can be overridden at build time */
+#ifndef VIRTIO_NET_MAX_QUEUE_PAIRS
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 4
+#endif
+
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE 40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN 128
+
+/* Each queue pair is an RX then a TX virtqueue. The control virtqueue comes after all of them
+ * if VIRTIO_NET_F_MQ is negotiated, otherwise after the first pair. */
+#define VIRTIO_NET_RX_VIRTQ_IDX(qp)     (2 * (qp))
+#define VIRTIO_NET_TX_VIRTQ_IDX(qp)     (2 * (qp) + 1)
+#define VIRTIO_NET_RX_VIRTQ     VIRTIO_NET_RX_VIRTQ_IDX(0)
+#define VIRTIO_NET_TX_VIRTQ     VIRTIO_NET_TX_VIRTQ_IDX(0)
+#define VIRTIO_NET_NUM_VIRTQ    (2 * VIRTIO_NET_MAX_QUEUE_PAIRS + 1)
+
+/* The sDDF queues, data regions and channels backing one RX/TX virtqueue pair */
+struct virtio_net_queue_pair {
     net_queue_handle_t rx;
     net_queue_handle_t tx;
     void *rx_data;
     void *tx_data;
-    microkit_channel tx_ch;
     microkit_channel rx_ch;
+    microkit_channel tx_ch;
+};
+
+/*
+ * Maximum number of sDDF TX buffers held back by the device per queue pair, can be overridden at build
+ * time. This bounds the number of segments of a single TSO/UFO frame.
+ */
+#ifndef VIRTIO_NET_TX_POOL_SIZE
+#define VIRTIO_NET_TX_POOL_SIZE 512
+#endif
+
+/* TX state of a queue pair */
+struct virtio_net_tx_state {
+    /* Free sDDF buffers taken off the free queue but not used yet */
+    net_buff_desc_t pool[VIRTIO_NET_TX_POOL_SIZE];
+    uint32_t num_pool;
+};
+
+/* Maximum number of received frames held per guest RX queue while it has no buffers, can be
+ * overridden at build time */
+#ifndef VIRTIO_NET_RX_STAGING_SIZE
+#define VIRTIO_NET_RX_STAGING_SIZE 128
+#endif
+
+struct virtio_net_rx_staged {
+    net_buff_desc_t buffer;
+    /* Queue pair whose sDDF RX queue the buffer came from */
+    uint16_t qp_idx;
+};
+
+/* sDDF RX buffers waiting for a guest RX queue to make buffers available, oldest first */
+struct virtio_net_rx_staging {
+    struct virtio_net_rx_staged frames[VIRTIO_NET_RX_STAGING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+};
+
+/* Maximum number of guest RX buffers a single frame is spread across with VIRTIO_NET_F_MRG_RXBUF */
+#define VIRTIO_NET_RX_MAX_BUFS 48
+
+/* Largest run of L2-L4 headers we handle when segmenting or coalescing frames */
+#define VIRTIO_NET_MAX_HDR_LEN 192
+
+/* Where the headers of an ethernet frame start and end */
+struct virtio_net_hdr_info {
+    uint16_t eth_type;
+    uint8_t l4_proto;
+    /* Not the first fragment of an IP packet, the L4 header is not present */
+    bool fragment;
+    uint16_t l3_off;
+    /* Length of the IP packet according to its header */
+    uint32_t l3_len;
+    uint16_t l4_off;
+    uint16_t payload_off;
+};
+
+/* A frame being written into one or more guest RX buffers */
+struct virtio_net_rx_frame {
+    /* The guest RX virtqueue the buffers come from */
+    virtio_queue_handler_t *vq;
+    uint16_t num_bufs;
+    uint16_t desc_heads[VIRTIO_NET_RX_MAX_BUFS];
+    uint32_t buf_lens[VIRTIO_NET_RX_MAX_BUFS];
+    /* Bytes available across all buffers, including the virtIO header */
+    uint64_t capacity;
+    /* Bytes written so far, including the virtIO header */
+    uint64_t len;
+};
+
+/*
+ * A large TCP frame being built up out of in-order segments of the same flow for a guest
+ * that negotiated VIRTIO_NET_F_GUEST_TSO4/6. This only lives for the duration of one
+ * virtio_net_handle_rx() call.
+ */
+struct virtio_net_rx_coalesce {
+    bool active;
+    /* No further segments may be appended */
+    bool closed;
+    bool push;
+    uint16_t num_segs;
+    uint16_t mss;
+    uint32_t next_seq;
+    struct virtio_net_hdr_info info;
+    struct virtio_net_rx_frame frame;
+    /* Headers of the first segment */
+    uint8_t hdr[VIRTIO_NET_MAX_HDR_LEN];
+    /* The same headers with the fields that differ between segments of a flow cleared */
+    uint8_t key[VIRTIO_NET_MAX_HDR_LEN];
+};
+
+/* Maximum number of unicast and of multicast addresses the driver can program into the RX
+ * filter, beyond which all addresses of that kind are accepted. Can be overridden at build time */
+#ifndef VIRTIO_NET_MAC_TABLE_SIZE
+#define VIRTIO_NET_MAC_TABLE_SIZE 32
+#endif
+
+#define VIRTIO_NET_VLAN_MAX 4096
+
+/* RX filtering programmed by the driver through the control virtqueue */
+struct virtio_net_rx_mode {
+    bool promisc;
+    bool allmulti;
+    bool alluni;
+    bool nomulti;
+    bool nouni;
+    bool nobcast;
+    /* The driver's table did not fit */
+    bool uni_overflow;
+    bool multi_overflow;
+    uint32_t num_uni;
+    uint32_t num_multi;
+    uint8_t uni[VIRTIO_NET_MAC_TABLE_SIZE][VIRTIO_NET_CONFIG_MAC_SZ];
+    uint8_t multi[VIRTIO_NET_MAC_TABLE_SIZE][VIRTIO_NET_CONFIG_MAC_SZ];
+    /* VLAN IDs let through with VIRTIO_NET_F_CTRL_VLAN */
+    uint32_t vlans[VIRTIO_NET_VLAN_MAX / 32];
+};
+
+/* Receive-side scaling state programmed by the driver */
+struct virtio_net_rss {
+    bool enabled;
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key_size;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+};
+
+struct virtio_net_device {
+    struct virtio_device virtio_device;
+
+    struct virtio_net_config config;
+    struct virtio_queue_handler vqs[VIRTIO_NET_NUM_VIRTQ];
+
+    struct virtio_net_queue_pair queue_pairs[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    /* Number of queue pairs backed by sDDF */
+    uint16_t num_queue_pairs;
+    /* Number of queue pairs the driver has enabled */
+    uint16_t active_queue_pairs;
+    struct virtio_net_rss rss;
+    struct virtio_net_rx_mode rx_mode;
+    /* MAC address given by the VMM, restored when the device is reset */
+    uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ];
+    struct virtio_net_tx_state tx_state[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    /* Indexed by guest RX queue */
+    struct virtio_net_rx_staging rx_staging[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    /* Indexed by guest RX queue */
+    struct virtio_net_rx_coalesce rx_coalesce[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    /* Frames the VMM does not let through, see virtio_net_set_filter */
+    struct net_filter filter;
 
     bool dev_csum_offload;
+    /* Feature bits accepted from the driver */
+    uint64_t driver_features;
 };
 
 /* Initialise the virtIO Network device and connect it to the sDDF Net queues. If the backing network device
  * supports checksum offloading, then set `csum_offload` to true. In this case the virtIO device
- * will ensure that all packets have their checksums cleared before being enqueued. Otherwise, you will
- * get double-checksumming of packets. */
+ * will ensure that all packets have their checksums cleared before being enqueued, otherwise you will
+ * get double-checksumming of packets. It also assumes the backing device has already validated the
+ * checksums of the frames it receives and tells the guest so. Without checksum offloading, checksums
+ * are computed and checked by the VMM in software.
+ *
+ * The guest may hand the device TCP and UDP frames of up to 64KiB which are split into MTU-sized frames
+ * before being enqueued, and in-order TCP segments received from sDDF are coalesced into large frames
+ * before being delivered to the guest. */
 #if !defined(CONFIG_ARCH_X86)
 bool virtio_mmio_net_init(struct virtio_net_device *net_dev, uintptr_t region_base, uintptr_t region_size,
                           irq_routing_info_t irq_routing_info, net_queue_handle_t *rx, net_queue_handle_t *tx,
@@ -243,11 +449,45 @@ bool virtio_pci_net_init(struct virtio_net_device *net_dev, uint16_t pci_bus, ui
                          uintptr_t rx_data, uintptr_t tx_data, microkit_channel rx_ch, microkit_channel tx_ch,
                          uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload);
 
+/*
+ * Same as above but backs the device with `num_queue_pairs` RX/TX queue pairs, each with their own
+ * sDDF queues and channels. With more than one pair the device offers VIRTIO_NET_F_MQ and
+ * VIRTIO_NET_F_RSS so that the guest can spread its traffic over several virtqueues. Frames received
+ * on any sDDF RX queue are steered to the guest's RX virtqueues by the driver's RSS configuration.
+ */
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_net_init_mq(struct virtio_net_device *net_dev, uintptr_t region_base, uintptr_t region_size,
+                             irq_routing_info_t irq_routing_info, struct virtio_net_queue_pair *queue_pairs,
+                             uint16_t num_queue_pairs, uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload);
+#endif
+
+bool virtio_pci_net_init_mq(struct virtio_net_device *net_dev, uint16_t pci_bus, uint16_t pci_dev,
+                            irq_routing_info_t irq_routing_info, struct virtio_net_queue_pair *queue_pairs,
+                            uint16_t num_queue_pairs, uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload);
+
+/*
+ * Install a packet filter on the device, which must already be initialised. Received frames it
+ * rejects are dropped before being copied into guest RAM, and frames the guest sends are
+ * dropped before being copied to sDDF. The filter persists across resets of the device by the
+ * guest. Returns false, keeping the current filter, if the rules are invalid.
+ */
+bool virtio_net_set_filter(struct virtio_net_device *dev, const struct net_filter_rule *rules, uint32_t num_rules,
+                           enum net_filter_action default_action);
+
 /**
- * Handles the incoming sDDF net traffic and queues the data into the virtio queues.
- * Will drop the packets if the virtio device is not yet initialized by the guest.
+ * Handles the incoming sDDF net traffic of all queue pairs and queues the data into the virtio queues.
+ * Will drop the packets if the virtio device is not yet initialized by the guest. Packets for which
+ * the guest has no buffers are held back, up to VIRTIO_NET_RX_STAGING_SIZE per queue, and delivered
+ * once the guest kicks its RX queue.
  * If there are packets to be processed, injects the virtual IRQ into the guest.
  *
  * @param virtio device to use
  */
-void virtio_net_handle_rx(struct virtio_net_device *dev);
\ No newline at end of file
+void virtio_net_handle_rx(struct virtio_net_device *dev);
+/**
+ * Resumes sending frames that were waiting for free sDDF TX buffers. Must be called when
+ * notified on the TX channel of any queue pair.
+ *
+ * @param virtio device to use
+ */
+void virtio_net_handle_tx_complete(struct virtio_net_device *dev);
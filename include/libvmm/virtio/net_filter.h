@@ -0,0 +1,140 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Match-action packet filter for the virtIO net device. Rules are compiled into a flat
+ * table of masked keys per direction, which frames are checked against before they are
+ * copied to or from guest RAM.
+ */
+
+/* Maximum number of rules per direction, can be overridden at build time */
+#ifndef NET_FILTER_MAX_RULES
+#define NET_FILTER_MAX_RULES 32
+#endif
+
+enum net_filter_action {
+    NET_FILTER_ACCEPT = 0,
+    NET_FILTER_DROP = 1,
+};
+
+/* Direction of a frame, as seen from the guest */
+enum net_filter_direction {
+    NET_FILTER_RX = 0,
+    NET_FILTER_TX = 1,
+    NET_FILTER_NUM_DIRECTIONS,
+};
+
+#define NET_FILTER_DIR_RX       (1 << NET_FILTER_RX)
+#define NET_FILTER_DIR_TX       (1 << NET_FILTER_TX)
+
+/* Fields a rule matches on, fields that are not selected match any frame */
+#define NET_FILTER_MATCH_DST_MAC    (1 << 0)
+#define NET_FILTER_MATCH_SRC_MAC    (1 << 1)
+/* The VLAN ID of the outermost tag, NET_FILTER_VLAN_NONE matches untagged frames */
+#define NET_FILTER_MATCH_VLAN       (1 << 2)
+/* The EtherType after any VLAN tags */
+#define NET_FILTER_MATCH_ETH_TYPE   (1 << 3)
+/* IPv4 addresses, under a prefix */
+#define NET_FILTER_MATCH_SRC_IP     (1 << 4)
+#define NET_FILTER_MATCH_DST_IP     (1 << 5)
+/* IPv4 protocol or IPv6 next header */
+#define NET_FILTER_MATCH_IP_PROTO   (1 << 6)
+/* Inclusive TCP or UDP port ranges, never matching fragments without the L4 header */
+#define NET_FILTER_MATCH_SRC_PORT   (1 << 7)
+#define NET_FILTER_MATCH_DST_PORT   (1 << 8)
+
+#define NET_FILTER_VLAN_NONE 0xFFFF
+
+struct net_filter_rule {
+    /* NET_FILTER_MATCH_* */
+    uint32_t match;
+    /* NET_FILTER_DIR_* */
+    uint8_t directions;
+    enum net_filter_action action;
+    uint8_t dst_mac[6];
+    uint8_t src_mac[6];
+    uint16_t vlan_id;
+    uint16_t eth_type;
+    /* IPv4 addresses in host byte order */
+    uint32_t src_ip;
+    uint8_t src_ip_prefix_len;
+    uint32_t dst_ip;
+    uint8_t dst_ip_prefix_len;
+    uint8_t ip_proto;
+    uint16_t src_port_min;
+    uint16_t src_port_max;
+    uint16_t dst_port_min;
+    uint16_t dst_port_max;
+};
+
+/* Header fields of a frame, laid out so that a rule can be checked a word at a time */
+union net_filter_key {
+    struct {
+        uint8_t dst_mac[6];
+        uint8_t src_mac[6];
+        uint16_t vlan_id;
+        uint16_t eth_type;
+        uint32_t src_ip;
+        uint32_t dst_ip;
+        uint16_t src_port;
+        uint16_t dst_port;
+        uint8_t ip_proto;
+        /* NET_FILTER_KEY_* */
+        uint8_t flags;
+        uint8_t pad[2];
+    };
+    uint64_t words[4];
+};
+
+/* Which of the key's fields the frame actually has */
+#define NET_FILTER_KEY_IP       (1 << 0)
+#define NET_FILTER_KEY_IPV4     (1 << 1)
+#define NET_FILTER_KEY_PORTS    (1 << 2)
+
+struct net_filter_entry {
+    union net_filter_key mask;
+    union net_filter_key value;
+    uint16_t src_port_min;
+    uint16_t src_port_max;
+    uint16_t dst_port_min;
+    uint16_t dst_port_max;
+    enum net_filter_action action;
+};
+
+struct net_filter_table {
+    struct net_filter_entry entries[NET_FILTER_MAX_RULES];
+    uint32_t num_entries;
+    enum net_filter_action default_action;
+    /* Frames dropped so far */
+    uint64_t dropped;
+};
+
+struct net_filter {
+    struct net_filter_table tables[NET_FILTER_NUM_DIRECTIONS];
+};
+
+/*
+ * Compile `rules` into `filter`, replacing what it held. Rules are checked in order and the
+ * first one matching a frame decides its fate, frames matching no rule get `default_action`.
+ * Returns false, leaving `filter` unchanged, if a rule is invalid or there are too many.
+ */
+bool net_filter_compile(struct net_filter *filter, const struct net_filter_rule *rules, uint32_t num_rules,
+                        enum net_filter_action default_action);
+
+/* Returns whether the frame of `len` bytes travelling in `dir` passes `filter` */
+bool net_filter_accept(struct net_filter *filter, enum net_filter_direction dir, const uint8_t *frame, uint32_t len);
+
+/* Returns whether any frame in `dir` could be dropped, so that checking can be skipped otherwise */
+static inline bool net_filter_enabled(const struct net_filter *filter, enum net_filter_direction dir)
+{
+    const struct net_filter_table *table = &filter->tables[dir];
+    return table->num_entries != 0 || table->default_action != NET_FILTER_ACCEPT;
+}
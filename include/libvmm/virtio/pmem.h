@@ -0,0 +1,71 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libvmm/virtio/virtio.h>
+
+/* Feature bits */
+#define VIRTIO_PMEM_F_SHMEM_REGION 0 /* The range is given by a shared memory region rather than the config */
+
+#define VIRTIO_PMEM_SHMEM_REGION_ID 0
+
+#define VIRTIO_PMEM_REQ_QUEUE 0
+#define VIRTIO_PMEM_NUM_VIRTQ 1
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+
+struct virtio_pmem_config {
+    uint64_t start;
+    uint64_t size;
+} __attribute__((packed));
+
+struct virtio_pmem_req {
+    uint32_t type;
+} __attribute__((packed));
+
+struct virtio_pmem_resp {
+    /* Zero on success */
+    uint32_t ret;
+} __attribute__((packed));
+
+/* Most flush requests passed on to the storage component at once, can be overridden at build time */
+#ifndef VIRTIO_PMEM_FLUSH_BATCH
+#define VIRTIO_PMEM_FLUSH_BATCH 32
+#endif
+
+struct virtio_pmem_device {
+    struct virtio_device virtio_device;
+    struct virtio_queue_handler vqs[VIRTIO_PMEM_NUM_VIRTQ];
+    struct virtio_pmem_config config;
+    struct virtio_shm_region region;
+    /* Channel of the component that owns the image, or -1 if flushes need no work */
+    int storage_ch;
+    /* Flush requests waiting for the storage component to acknowledge */
+    bool flushing;
+    uint16_t flush_heads[VIRTIO_PMEM_FLUSH_BATCH];
+    uint32_t num_flush_heads;
+};
+
+/*
+ * Initialise a pmem device for the `size` bytes at `gpa`, which the system description must
+ * map into the guest, usually from memory holding a storage image. The guest accesses it
+ * directly, so the device is only involved when the guest flushes. If `storage_ch` is not
+ * -1, flushes are passed on to the component on that channel, which acknowledges them once
+ * the image is persistent and the VMM calls `virtio_pmem_flush_done`.
+ */
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_pmem_init(struct virtio_pmem_device *pmem, uintptr_t region_base, uintptr_t region_size,
+                           irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, int storage_ch);
+#endif
+
+bool virtio_pci_pmem_init(struct virtio_pmem_device *pmem, uint16_t pci_bus, uint16_t pci_dev,
+                          irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, int storage_ch);
+
+/* The storage component has made the image persistent, completes the flushes passed to it */
+bool virtio_pmem_flush_done(struct virtio_pmem_device *pmem);
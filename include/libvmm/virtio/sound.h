@@ -296,6 +296,19 @@ typedef struct virtio_snd_request {
 
 #define VIRTIO_SND_MAX_REQUESTS 64
 
+/*
+ * Guest RAM shared with the sound driver for zero-copy PCM transfer. The guest physical range
+ * [gpa, gpa + size) appears at `offset` within the sound data region, as seen by the driver, and
+ * must lie beyond the device's own copy buffers at the start of the region. PCM buffers inside
+ * it are handed to the driver without being copied, others are still copied.
+ * A size of zero disables zero-copy.
+ */
+struct virtio_snd_zero_copy {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t offset;
+};
+
 struct virtio_snd_device {
     struct virtio_device virtio_device;
 
@@ -318,6 +331,7 @@ struct virtio_snd_device {
     sound_pcm_queue_handle_t pcm_res;
     void *data_region;
     int server_ch;
+    struct virtio_snd_zero_copy zero_copy;
 };
 
 /**
@@ -344,4 +358,15 @@ bool virtio_mmio_snd_init(struct virtio_snd_device *sound_dev,
                           uintptr_t data_region,
                           int server_ch);
 
+/**
+ * Hand PCM buffers in a window of guest RAM to the sound driver directly rather than copying
+ * them. Must be called after initialisation and before the guest starts using the device.
+ *
+ * @param sound_dev The initialised sound device.
+ * @param zero_copy Guest RAM window shared with the driver.
+ *
+ * @return `true` on success, `false` if the window overlaps the device's copy buffers.
+ */
+bool virtio_snd_enable_zero_copy(struct virtio_snd_device *sound_dev, struct virtio_snd_zero_copy *zero_copy);
+
 void virtio_snd_notified(struct virtio_snd_device *sound_dev);
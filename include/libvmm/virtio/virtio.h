@@ -45,6 +45,15 @@ typedef struct virtio_queue_handler {
     uint16_t last_idx;
 } virtio_queue_handler_t;
 
+/*
+ * Shared memory region of a device, guest memory the device and driver both access
+ * directly. Regions are identified by their index in the device's list.
+ */
+struct virtio_shm_region {
+    uint64_t gpa;
+    uint64_t size;
+};
+
 typedef struct virtio_device virtio_device_t;
 
 /* functions provided by the virtio device emulation for the transport layer (MMIO/PCI) */
@@ -78,6 +87,8 @@ typedef struct virtio_device_regs {
     uint32_t Status;
 
     uint32_t ConfigGeneration;
+
+    uint32_t SHMSel;
 } virtio_device_regs_t;
 
 /* Everything needed at runtime for a virtIO device to function. */
@@ -90,6 +101,9 @@ typedef struct virtio_device {
     virtio_queue_handler_t *vqs;
     /* Length of the vqs list */
     size_t num_vqs;
+    /* Shared memory regions, only supported on the MMIO transport */
+    struct virtio_shm_region *shm_regions;
+    size_t num_shm_regions;
     /* Virtual IRQ associated with this virtIO device */
     irq_routing_info_t irq_routing_info;
     /* Device specific data such as sDDF queues */
@@ -114,6 +128,14 @@ struct virtq_used *virtio_get_used_ring(struct virtq *virtq);
  */
 uint64_t virtio_desc_chain_payload_len(virtio_queue_handler_t *vq_handler, uint16_t desc_head);
 
+/*
+ * Given a descriptor head, walk the descriptor chain and compute the length of the buffers
+ * the device reads, which come first, and of the buffers after them that it writes.
+ * Return false if the chain is invalid or has readable buffers after writable ones.
+ */
+bool virtio_desc_chain_split_len(virtio_queue_handler_t *vq_handler, uint16_t desc_head, uint64_t *read_len,
+                                 uint64_t *write_len);
+
 /*
  * Given a scatter gather list of a virtio request in the form of a descriptor
  * head, copy a chunk of data from the list, starting from `read_off` into `data`.
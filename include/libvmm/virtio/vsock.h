@@ -0,0 +1,234 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libvmm/virtio/virtio.h>
+
+/* Feature bits */
+#define VIRTIO_VSOCK_F_STREAM              0 /* Stream sockets are supported */
+#define VIRTIO_VSOCK_F_SEQPACKET           1 /* SOCK_SEQPACKET sockets are supported */
+#define VIRTIO_VSOCK_F_NO_IMPLIED_STREAM   2 /* Stream sockets are only supported if negotiated */
+
+#define VIRTIO_VSOCK_RX_QUEUE 0
+#define VIRTIO_VSOCK_TX_QUEUE 1
+#define VIRTIO_VSOCK_EVENT_QUEUE 2
+#define VIRTIO_VSOCK_NUM_VIRTQ 3
+
+/* The VMM is always reached at the host CID */
+#define VIRTIO_VSOCK_CID_HOST 2
+
+struct virtio_vsock_config {
+    uint64_t guest_cid;
+} __attribute__((packed));
+
+struct virtio_vsock_hdr {
+    uint64_t src_cid;
+    uint64_t dst_cid;
+    uint32_t src_port;
+    uint32_t dst_port;
+    uint32_t len;
+    uint16_t type;
+    uint16_t op;
+    uint32_t flags;
+    uint32_t buf_alloc;
+    uint32_t fwd_cnt;
+} __attribute__((packed));
+
+enum virtio_vsock_type {
+    VIRTIO_VSOCK_TYPE_STREAM = 1,
+    VIRTIO_VSOCK_TYPE_SEQPACKET = 2,
+};
+
+enum virtio_vsock_op {
+    VIRTIO_VSOCK_OP_INVALID = 0,
+    /* Connect operations */
+    VIRTIO_VSOCK_OP_REQUEST = 1,
+    VIRTIO_VSOCK_OP_RESPONSE = 2,
+    VIRTIO_VSOCK_OP_RST = 3,
+    VIRTIO_VSOCK_OP_SHUTDOWN = 4,
+    /* To send payload */
+    VIRTIO_VSOCK_OP_RW = 5,
+    /* Tell the peer our credit info */
+    VIRTIO_VSOCK_OP_CREDIT_UPDATE = 6,
+    /* Request the peer to send the credit info to us */
+    VIRTIO_VSOCK_OP_CREDIT_REQUEST = 7,
+};
+
+/* VIRTIO_VSOCK_OP_SHUTDOWN flags values */
+#define VIRTIO_VSOCK_SHUTDOWN_RCV  1
+#define VIRTIO_VSOCK_SHUTDOWN_SEND 2
+
+/* VIRTIO_VSOCK_OP_RW flags values for SEQPACKET sockets */
+#define VIRTIO_VSOCK_SEQ_EOM 1
+#define VIRTIO_VSOCK_SEQ_EOR 2
+
+/*
+ * Queue of packets between two VMMs, in memory shared between them. Each direction has
+ * its own queue, with one producer and one consumer, like the sDDF queues. Packets larger
+ * than a slot are split, which both socket types allow.
+ */
+
+/* A slot holds a header and payload in 4K */
+#define VIRTIO_VSOCK_SLOT_DATA (0x1000 - sizeof(struct virtio_vsock_hdr))
+
+struct virtio_vsock_queue_slot {
+    struct virtio_vsock_hdr hdr;
+    uint8_t data[VIRTIO_VSOCK_SLOT_DATA];
+};
+
+struct virtio_vsock_queue {
+    /* Written by the producer */
+    uint32_t tail;
+    /* Written by the consumer */
+    uint32_t head;
+    /* Set by a producer waiting for free slots, the consumer notifies it once it frees some */
+    uint32_t producer_waiting;
+    struct virtio_vsock_queue_slot slots[];
+};
+
+/* Bytes of shared memory a queue of `capacity` slots takes */
+#define VIRTIO_VSOCK_QUEUE_SIZE(capacity)                                                                          \
+    (sizeof(struct virtio_vsock_queue) + (capacity) * sizeof(struct virtio_vsock_queue_slot))
+
+/* Another VMM whose guest is reachable at `cid` */
+struct virtio_vsock_peer {
+    uint64_t cid;
+    /* Packets from our guest to the peer's */
+    struct virtio_vsock_queue *txq;
+    /* Packets from the peer's guest to ours */
+    struct virtio_vsock_queue *rxq;
+    /* Slots in each queue, a power of two */
+    uint32_t capacity;
+    /* Channel to the peer VMM */
+    int ch;
+};
+
+/* Most peer VMMs a device connects to, can be overridden at build time */
+#ifndef VIRTIO_VSOCK_MAX_PEERS
+#define VIRTIO_VSOCK_MAX_PEERS 4
+#endif
+
+/* Most connections between the guest and the VMM itself */
+#ifndef VIRTIO_VSOCK_MAX_CONNS
+#define VIRTIO_VSOCK_MAX_CONNS 16
+#endif
+
+/* Most ports the VMM listens on */
+#ifndef VIRTIO_VSOCK_MAX_LISTENERS
+#define VIRTIO_VSOCK_MAX_LISTENERS 8
+#endif
+
+/* Control packets for the guest waiting on an RX buffer */
+#define VIRTIO_VSOCK_CTRL_PENDING (2 * VIRTIO_VSOCK_MAX_CONNS)
+
+/* Receive buffer space the VMM advertises for each connection */
+#define VIRTIO_VSOCK_BUF_ALLOC 0x40000
+
+struct virtio_vsock_device;
+
+/*
+ * Callbacks for connections between the guest and the VMM. `conn` identifies the
+ * connection in calls to `virtio_vsock_send` and `virtio_vsock_close`.
+ */
+struct virtio_vsock_ops {
+    /* A guest connected to a listening port, or accepted a connection from `virtio_vsock_connect` */
+    void (*connected)(struct virtio_vsock_device *vsock, int conn, void *cookie);
+    /* Data from the guest. For SEQPACKET, `eom` is set on the last part of a message. */
+    void (*recv)(struct virtio_vsock_device *vsock, int conn, const void *data, uint32_t len, bool eom,
+                 void *cookie);
+    /* The guest now has credit for more data, after a send that was cut short */
+    void (*writable)(struct virtio_vsock_device *vsock, int conn, void *cookie);
+    /* The connection was closed or refused, `conn` is no longer valid */
+    void (*closed)(struct virtio_vsock_device *vsock, int conn, void *cookie);
+};
+
+struct virtio_vsock_listener {
+    bool in_use;
+    uint32_t port;
+    uint16_t type;
+    const struct virtio_vsock_ops *ops;
+    void *cookie;
+};
+
+enum virtio_vsock_conn_state {
+    VIRTIO_VSOCK_CONN_FREE = 0,
+    VIRTIO_VSOCK_CONN_CONNECTING,
+    VIRTIO_VSOCK_CONN_CONNECTED,
+    VIRTIO_VSOCK_CONN_CLOSING,
+};
+
+struct virtio_vsock_conn {
+    enum virtio_vsock_conn_state state;
+    uint16_t type;
+    uint32_t local_port;
+    uint32_t guest_port;
+    const struct virtio_vsock_ops *ops;
+    void *cookie;
+    /* The guest's receive buffer, and how much of what we sent it has consumed */
+    uint32_t guest_buf_alloc;
+    uint32_t guest_fwd_cnt;
+    /* Bytes we have sent, bytes we have consumed, and the consumed count the guest last saw */
+    uint32_t tx_cnt;
+    uint32_t fwd_cnt;
+    uint32_t last_fwd_cnt;
+    /* A send ran out of credit */
+    bool blocked;
+};
+
+struct virtio_vsock_device {
+    struct virtio_device virtio_device;
+    struct virtio_queue_handler vqs[VIRTIO_VSOCK_NUM_VIRTQ];
+    struct virtio_vsock_config config;
+    struct virtio_vsock_peer peers[VIRTIO_VSOCK_MAX_PEERS];
+    uint32_t num_peers;
+    struct virtio_vsock_listener listeners[VIRTIO_VSOCK_MAX_LISTENERS];
+    struct virtio_vsock_conn conns[VIRTIO_VSOCK_MAX_CONNS];
+    /* Next local port for connections the VMM makes */
+    uint32_t next_port;
+    /* Ring of control packets for the guest waiting on an RX buffer */
+    struct virtio_vsock_hdr ctrl_pending[VIRTIO_VSOCK_CTRL_PENDING];
+    uint32_t ctrl_pending_head;
+    uint32_t ctrl_pending_tail;
+};
+
+/*
+ * Initialise a vsock device for a guest at `guest_cid`, which can reach the guests of the
+ * `num_peers` peer VMMs as well as the VMM itself at VIRTIO_VSOCK_CID_HOST.
+ */
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_vsock_init(struct virtio_vsock_device *vsock, uintptr_t region_base, uintptr_t region_size,
+                            irq_routing_info_t irq_routing_info, uint64_t guest_cid,
+                            struct virtio_vsock_peer *peers, uint32_t num_peers);
+#endif
+
+bool virtio_pci_vsock_init(struct virtio_vsock_device *vsock, uint16_t pci_bus, uint16_t pci_dev,
+                           irq_routing_info_t irq_routing_info, uint64_t guest_cid,
+                           struct virtio_vsock_peer *peers, uint32_t num_peers);
+
+/* Call when notified by a peer VMM, moves packets between the guest and the peer queues */
+bool virtio_vsock_handle_peer_notify(struct virtio_vsock_device *vsock);
+
+/* Accept connections from the guest to `port` of the VMM */
+bool virtio_vsock_listen(struct virtio_vsock_device *vsock, uint32_t port, enum virtio_vsock_type type,
+                         const struct virtio_vsock_ops *ops, void *cookie);
+
+/* Connect to `port` in the guest, returns the connection or -1. `ops->connected` is called once accepted. */
+int virtio_vsock_connect(struct virtio_vsock_device *vsock, uint32_t port, enum virtio_vsock_type type,
+                         const struct virtio_vsock_ops *ops, void *cookie);
+
+/*
+ * Send data to the guest on a connected connection. Returns how many bytes were sent,
+ * which is less than `len` if the guest is out of receive buffers or credit; `ops->writable`
+ * is called when there is credit again. For SEQPACKET, `eom` ends the message with the
+ * last byte of `data`, and is dropped if not all of `data` could be sent.
+ */
+uint32_t virtio_vsock_send(struct virtio_vsock_device *vsock, int conn, const void *data, uint32_t len, bool eom);
+
+/* Close a connection, `ops->closed` is called once the guest has closed its end */
+bool virtio_vsock_close(struct virtio_vsock_device *vsock, int conn);
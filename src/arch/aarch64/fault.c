@@ -5,8 +5,10 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <string.h>
 #include <libvmm/util/util.h>
 #include <libvmm/tcb.h>
+#include <libvmm/coalesced_io.h>
 #include <libvmm/vcpu.h>
 #include <libvmm/arch/aarch64/cpuif.h>
 #include <libvmm/arch/aarch64/hsr.h>
@@ -363,23 +365,46 @@ bool fault_handle_unknown_syscall(size_t vcpu_id)
     return fault_advance_vcpu(vcpu_id, &regs, SEL4_USER_CONTEXT_SIZE);
 }
 
-#define MAX_VM_EXCEPTION_HANDLERS 16
-
 struct vm_exception_handler {
     uintptr_t base;
     uintptr_t end;
     vm_exception_handler_t callback;
+    /* Set if writes to the region are coalesced */
+    coalesced_io_write_fn_t coalesced_write;
     void *data;
 };
 
+/*
+ * Every trapping access to an emulated device (the vGIC distributor, virtIO MMIO devices,
+ * PCI BARs etc) goes through this table, so it is kept sorted by base address for a binary
+ * search. Guests tend to access the same device many times in a row, so the last handler
+ * found is checked before searching.
+ */
 static struct vm_exception_handler registered_vm_exception_handlers[MAX_VM_EXCEPTION_HANDLERS];
 static size_t vm_exception_handler_index = 0;
+static size_t vm_exception_handler_last_hit = 0;
 
-bool fault_register_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback, void *data)
+/* Index of the first handler with a base above `addr`. */
+static size_t vm_exception_handler_upper_bound(uintptr_t addr)
 {
+    size_t lo = 0;
+    size_t hi = vm_exception_handler_index;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (registered_vm_exception_handlers[mid].base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    if (vm_exception_handler_index == MAX_VM_EXCEPTION_HANDLERS - 1) {
-        LOG_VMM_ERR("maximum number of VM exception handlers registered");
+bool fault_register_coalesced_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback,
+                                                   coalesced_io_write_fn_t coalesced_write, void *data)
+{
+    if (vm_exception_handler_index == MAX_VM_EXCEPTION_HANDLERS) {
+        LOG_VMM_ERR("maximum number of VM exception handlers registered\n");
         return false;
     }
 
@@ -388,47 +413,100 @@ bool fault_register_vm_exception_handler(uintptr_t base, size_t size, vm_excepti
         return false;
     }
 
-    for (int i = 0; i < vm_exception_handler_index; i++) {
-        struct vm_exception_handler *curr = &registered_vm_exception_handlers[i];
-        if (!(base >= curr->end || base + size <= curr->base)) {
-            LOG_VMM_ERR("VM exception handler [0x%lx..0x%lx), overlaps with another handler [0x%lx..0x%lx)\n", base,
-                        base + size, curr->base, curr->end);
-            return false;
-        }
+    /* Since the table has no overlaps, only the neighbours of the new handler can overlap it. */
+    size_t idx = vm_exception_handler_upper_bound(base);
+    struct vm_exception_handler *prev = idx > 0 ? &registered_vm_exception_handlers[idx - 1] : NULL;
+    struct vm_exception_handler *next = idx < vm_exception_handler_index ? &registered_vm_exception_handlers[idx]
+                                                                           : NULL;
+    if (prev && base < prev->end) {
+        LOG_VMM_ERR("VM exception handler [0x%lx..0x%lx), overlaps with another handler [0x%lx..0x%lx)\n", base,
+                    base + size, prev->base, prev->end);
+        return false;
+    }
+    if (next && base + size > next->base) {
+        LOG_VMM_ERR("VM exception handler [0x%lx..0x%lx), overlaps with another handler [0x%lx..0x%lx)\n", base,
+                    base + size, next->base, next->end);
+        return false;
     }
 
-    registered_vm_exception_handlers[vm_exception_handler_index] = (struct vm_exception_handler) {
+    memmove(&registered_vm_exception_handlers[idx + 1], &registered_vm_exception_handlers[idx],
+            (vm_exception_handler_index - idx) * sizeof(struct vm_exception_handler));
+    registered_vm_exception_handlers[idx] = (struct vm_exception_handler) {
         .base = base,
         .end = base + size,
         .callback = callback,
+        .coalesced_write = coalesced_write,
         .data = data,
     };
     vm_exception_handler_index += 1;
 
+    if (vm_exception_handler_last_hit >= idx && vm_exception_handler_index > 1) {
+        vm_exception_handler_last_hit += 1;
+    }
+
     return true;
 }
 
+bool fault_register_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback, void *data)
+{
+    return fault_register_coalesced_vm_exception_handler(base, size, callback, NULL, data);
+}
+
+static struct vm_exception_handler *fault_find_vm_exception_handler(uintptr_t addr)
+{
+    if (vm_exception_handler_index == 0) {
+        return NULL;
+    }
+
+    struct vm_exception_handler *handler = &registered_vm_exception_handlers[vm_exception_handler_last_hit];
+    if (addr >= handler->base && addr < handler->end) {
+        return handler;
+    }
+
+    size_t idx = vm_exception_handler_upper_bound(addr);
+    if (idx == 0) {
+        return NULL;
+    }
+
+    handler = &registered_vm_exception_handlers[idx - 1];
+    if (addr >= handler->end) {
+        return NULL;
+    }
+
+    vm_exception_handler_last_hit = idx - 1;
+    return handler;
+}
+
 static bool fault_handle_registered_vm_exceptions(size_t vcpu_id, uintptr_t addr, size_t fsr, seL4_UserContext *regs)
 {
-    for (int i = 0; i < MAX_VM_EXCEPTION_HANDLERS; i++) {
-        uintptr_t base = registered_vm_exception_handlers[i].base;
-        uintptr_t end = registered_vm_exception_handlers[i].end;
-        vm_exception_handler_t callback = registered_vm_exception_handlers[i].callback;
-        void *data = registered_vm_exception_handlers[i].data;
-        if (addr >= base && addr < end) {
-            bool success = callback(vcpu_id, addr - base, fsr, regs, data);
-            if (!success) {
-                LOG_VMM_ERR(
-                    "registered virtual memory exception handler for region [0x%lx..0x%lx) at address 0x%lx failed\n",
-                    base, end, addr);
-            }
-
-            return success;
-        }
+    struct vm_exception_handler *handler = fault_find_vm_exception_handler(addr);
+    if (handler && handler->coalesced_write && fault_is_write(fsr)) {
+        /* The register holds the data in its low bits, whereas the mask is shifted to the offset of
+         * the access within the word. */
+        uint64_t data = fault_get_data(regs, fsr) & (fault_get_data_mask(addr, fsr) >> ((addr & 0x3) * 8));
+        coalesced_io_push(handler->coalesced_write, handler->data, addr - handler->base, fault_get_width_bytes(fsr),
+                          data);
+        return true;
     }
 
-    /* We could not find a handler for the faulting address. */
-    return false;
+    if (coalesced_io_pending()) {
+        /* Draining can register handlers, which moves them around in the table. */
+        coalesced_io_flush();
+        handler = fault_find_vm_exception_handler(addr);
+    }
+
+    if (!handler) {
+        /* We could not find a handler for the faulting address. */
+        return false;
+    }
+
+    bool success = handler->callback(vcpu_id, addr - handler->base, fsr, regs, handler->data);
+    if (!success) {
+        LOG_VMM_ERR("registered virtual memory exception handler for region [0x%lx..0x%lx) at address 0x%lx failed\n",
+                    handler->base, handler->end, addr);
+    }
+
+    return success;
 }
 
 bool fault_handle_vm_exception(size_t vcpu_id)
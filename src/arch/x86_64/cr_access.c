@@ -7,9 +7,11 @@
 #include <microkit.h>
 #include <sddf/util/util.h>
 #include <libvmm/util/util.h>
+#include <libvmm/guest_ram.h>
 #include <libvmm/arch/x86_64/apic.h>
 #include <libvmm/arch/x86_64/vmcs.h>
 #include <libvmm/arch/x86_64/vcpu.h>
+#include <libvmm/arch/x86_64/instruction.h>
 
 /* Documents referenced:
  * 1. Intel® 64 and IA-32 Architectures Software Developer’s Manual
@@ -140,6 +142,23 @@ static void write_to_read_operand(seL4_VCPUContext *vctx, seL4_Word qualificatio
 bool handle_cr_access(seL4_VCPUContext *vctx, seL4_Word qualification)
 {
     switch (get_cr_number(qualification)) {
+    case 3: {
+        /* Only seen if CR3 accesses are configured to exit. */
+        if (get_access_type(qualification) == MOV_TO_CR) {
+            /* With PCID, bit 63 asks for the TLB not to be flushed. It is not part of CR3 and is
+             * reserved in the VMCS field, so leaving it set would fail the next VM entry. */
+            uint64_t cr3 = get_write_operand(vctx, qualification) & ~BIT(63);
+            microkit_vcpu_x86_write_vmcs(0, VMX_GUEST_CR3, cr3);
+            decode_instruction_cache_invalidate();
+            gva_to_gpa_tlb_flush(0);
+            return true;
+        } else if (get_access_type(qualification) == MOV_FROM_CR) {
+            write_to_read_operand(vctx, qualification, microkit_vcpu_x86_read_vmcs(0, VMX_GUEST_CR3));
+            return true;
+        }
+        LOG_VMM_ERR("unhandled CR3 access, access type %d\n", get_access_type(qualification));
+        return false;
+    }
 #if APIC_VIRT_LEVEL < APIC_VIRT_LEVEL_APICV
     case 8: {
         /* CR8 is the high bits of the TPR https://wiki.osdev.org/CPU_Registers_x86-64#CR8 */
@@ -163,6 +182,10 @@ bool handle_cr_access(seL4_VCPUContext *vctx, seL4_Word qualification)
             microkit_vcpu_x86_write_vmcs(0, VMX_GUEST_CR0, guest_requested_cr0 | CR0_NE);
             microkit_vcpu_x86_write_vmcs(0, VMX_CONTROL_CR0_READ_SHADOW, guest_requested_cr0);
 
+            /* Paging may have been turned on or off, which changes what cached addresses refer to. */
+            decode_instruction_cache_invalidate();
+            gva_to_gpa_tlb_flush(0);
+
             /* On real hardware, setting THEN clearing CR0.PG have side effects. We must emulate
              * this on software or we will get invalid state on VM resume.
              * See section "Switching Out of IA-32e Mode Operation" of [1]:
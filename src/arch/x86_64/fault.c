@@ -7,6 +7,7 @@
 #include <string.h>
 #include <sddf/util/util.h>
 #include <libvmm/util/util.h>
+#include <libvmm/coalesced_io.h>
 #include <libvmm/arch/x86_64/fault.h>
 #include <libvmm/arch/x86_64/ioports.h>
 #include <libvmm/arch/x86_64/vmcs.h>
@@ -23,6 +24,7 @@
 #include <libvmm/arch/x86_64/guest_time.h>
 #include <libvmm/arch/x86_64/cr_access.h>
 #include <libvmm/guest.h>
+#include <libvmm/guest_ram.h>
 #include <sel4/arch/vmenter.h>
 
 /* Uncomment to print out summary of VM Exit reasons every 100000 exit */
@@ -211,18 +213,124 @@ struct ept_exception_handler {
     uintptr_t base;
     uintptr_t end;
     ept_exception_callback_t callback;
+    /* Set if writes to the region are coalesced */
+    coalesced_io_write_fn_t coalesced_write;
     void *cookie;
 };
-#define MAX_EPT_EXCEPTION_HANDLERS 16
-static struct ept_exception_handler registered_ept_exception_handlers[MAX_EPT_EXCEPTION_HANDLERS];
-static size_t ept_exception_handler_index = 0;
+
+static bool ioapic_ept_fault_handle(size_t vcpu_id, size_t offset, size_t qualification,
+                                    decoded_instruction_ret_t decoded_ins, seL4_VCPUContext *vctx, void *cookie)
+{
+    return ioapic_fault_handle(vctx, offset, qualification, decoded_ins);
+}
+
+static bool hpet_ept_fault_handle(size_t vcpu_id, size_t offset, size_t qualification,
+                                  decoded_instruction_ret_t decoded_ins, seL4_VCPUContext *vctx, void *cookie)
+{
+    return hpet_fault_handle(vctx, offset, qualification, decoded_ins);
+}
+
+#if APIC_VIRT_LEVEL < APIC_VIRT_LEVEL_APICV
+static bool lapic_ept_fault_handle(size_t vcpu_id, size_t offset, size_t qualification,
+                                   decoded_instruction_ret_t decoded_ins, seL4_VCPUContext *vctx, void *cookie)
+{
+    return lapic_fault_handle(vctx, offset, qualification, decoded_ins);
+}
+#endif
+
+/*
+ * Kept sorted by base address so that the handler for a fault is found with a binary
+ * search, the last handler found is checked first as guests tend to access the same device
+ * many times in a row. The emulated interrupt controllers and HPET are always present and
+ * start out in the table.
+ */
+static struct ept_exception_handler registered_ept_exception_handlers[MAX_EPT_EXCEPTION_HANDLERS] = {
+    { .base = IOAPIC_GPA, .end = IOAPIC_GPA + IOAPIC_SIZE, .callback = ioapic_ept_fault_handle },
+    { .base = HPET_GPA, .end = HPET_GPA + HPET_SIZE, .callback = hpet_ept_fault_handle },
+#if APIC_VIRT_LEVEL < APIC_VIRT_LEVEL_APICV
+    { .base = LAPIC_GPA, .end = LAPIC_GPA + LAPIC_SIZE, .callback = lapic_ept_fault_handle },
+#endif
+};
+#if APIC_VIRT_LEVEL < APIC_VIRT_LEVEL_APICV
+static size_t ept_exception_handler_index = 3;
+#else
+static size_t ept_exception_handler_index = 2;
+#endif
+static size_t ept_exception_handler_last_hit = 0;
+
+_Static_assert(IOAPIC_GPA + IOAPIC_SIZE <= HPET_GPA && HPET_GPA + HPET_SIZE <= LAPIC_GPA,
+               "initial EPT exception handlers must be sorted");
+
+/* Index of the first handler with a base above `addr`. */
+static size_t ept_exception_handler_upper_bound(uintptr_t addr)
+{
+    size_t lo = 0;
+    size_t hi = ept_exception_handler_index;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (registered_ept_exception_handlers[mid].base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool ept_exception_handler_insert(struct ept_exception_handler *handler)
+{
+    if (ept_exception_handler_index == MAX_EPT_EXCEPTION_HANDLERS) {
+        LOG_VMM_ERR("maximum number of EPT exception handlers registered\n");
+        return false;
+    }
+
+    /* Since the table has no overlaps, only the neighbours of the new handler can overlap it. */
+    size_t idx = ept_exception_handler_upper_bound(handler->base);
+    struct ept_exception_handler *prev = idx > 0 ? &registered_ept_exception_handlers[idx - 1] : NULL;
+    struct ept_exception_handler *next = idx < ept_exception_handler_index ? &registered_ept_exception_handlers[idx]
+                                                                             : NULL;
+    if (prev && handler->base < prev->end) {
+        LOG_VMM_ERR("EPT exception handler [0x%lx..0x%lx), overlaps with another handler [0x%lx..0x%lx)\n",
+                    handler->base, handler->end, prev->base, prev->end);
+        return false;
+    }
+    if (next && handler->end > next->base) {
+        LOG_VMM_ERR("EPT exception handler [0x%lx..0x%lx), overlaps with another handler [0x%lx..0x%lx)\n",
+                    handler->base, handler->end, next->base, next->end);
+        return false;
+    }
+
+    memmove(&registered_ept_exception_handlers[idx + 1], &registered_ept_exception_handlers[idx],
+            (ept_exception_handler_index - idx) * sizeof(struct ept_exception_handler));
+    registered_ept_exception_handlers[idx] = *handler;
+    ept_exception_handler_index += 1;
+    ept_exception_handler_last_hit = idx;
+
+    return true;
+}
+
+static void ept_exception_handler_remove(size_t idx)
+{
+    memmove(&registered_ept_exception_handlers[idx], &registered_ept_exception_handlers[idx + 1],
+            (ept_exception_handler_index - idx - 1) * sizeof(struct ept_exception_handler));
+    ept_exception_handler_index -= 1;
+    ept_exception_handler_last_hit = 0;
+}
 
 bool fault_update_ept_exception_handler(uintptr_t base, uintptr_t new_base)
 {
-    for (int i = 0; i < ept_exception_handler_index; i++) {
-        struct ept_exception_handler *curr = &registered_ept_exception_handlers[i];
-        if (curr->base == base) {
-            curr->base = new_base;
+    for (size_t i = 0; i < ept_exception_handler_index; i++) {
+        struct ept_exception_handler curr = registered_ept_exception_handlers[i];
+        if (curr.base == base) {
+            /* Moving the handler can change its place in the table. */
+            ept_exception_handler_remove(i);
+            struct ept_exception_handler moved = curr;
+            moved.base = new_base;
+            moved.end = new_base + (curr.end - curr.base);
+            if (!ept_exception_handler_insert(&moved)) {
+                assert(ept_exception_handler_insert(&curr));
+                return false;
+            }
             return true;
         }
     }
@@ -232,88 +340,138 @@ bool fault_update_ept_exception_handler(uintptr_t base, uintptr_t new_base)
     return false;
 }
 
-bool fault_register_ept_exception_handler(uintptr_t base, size_t size, ept_exception_callback_t callback, void *cookie)
+bool fault_register_coalesced_ept_exception_handler(uintptr_t base, size_t size, ept_exception_callback_t callback,
+                                                    coalesced_io_write_fn_t coalesced_write, void *cookie)
 {
-    if (ept_exception_handler_index == MAX_EPT_EXCEPTION_HANDLERS - 1) {
-        LOG_VMM_ERR("maximum number of EPT exception handlers registered");
-        return false;
-    }
-
     if (size == 0) {
         LOG_VMM_ERR("registered EPT exception handler with size 0\n");
         return false;
     }
 
-    for (int i = 0; i < ept_exception_handler_index; i++) {
-        struct ept_exception_handler *curr = &registered_ept_exception_handlers[i];
-        if (!(base >= curr->end || base + size <= curr->base)) {
-            LOG_VMM_ERR("EPT exception handler [0x%lx..0x%lx), overlaps with another handler [0x%lx..0x%lx)\n", base,
-                        base + size, curr->base, curr->end);
-            return false;
-        }
-    }
-
-    registered_ept_exception_handlers[ept_exception_handler_index] = (struct ept_exception_handler) {
+    struct ept_exception_handler handler = {
         .base = base,
         .end = base + size,
         .callback = callback,
+        .coalesced_write = coalesced_write,
         .cookie = cookie,
     };
-    ept_exception_handler_index += 1;
 
-    return true;
+    return ept_exception_handler_insert(&handler);
+}
+
+bool fault_register_ept_exception_handler(uintptr_t base, size_t size, ept_exception_callback_t callback, void *cookie)
+{
+    return fault_register_coalesced_ept_exception_handler(base, size, callback, NULL, cookie);
+}
+
+static struct ept_exception_handler *find_ept_exception_handler(uintptr_t addr)
+{
+    if (ept_exception_handler_index == 0) {
+        return NULL;
+    }
+
+    struct ept_exception_handler *handler = &registered_ept_exception_handlers[ept_exception_handler_last_hit];
+    if (addr >= handler->base && addr < handler->end) {
+        return handler;
+    }
+
+    size_t idx = ept_exception_handler_upper_bound(addr);
+    if (idx == 0) {
+        return NULL;
+    }
+
+    handler = &registered_ept_exception_handlers[idx - 1];
+    if (addr >= handler->end) {
+        return NULL;
+    }
+
+    ept_exception_handler_last_hit = idx - 1;
+    return handler;
 }
 
 static bool handle_ept_fault(seL4_VCPUContext *vctx, seL4_Word qualification, decoded_instruction_ret_t decoded_ins)
 {
     uint64_t addr = microkit_mr_get(SEL4_VMENTER_FAULT_GUEST_PHYSICAL_MR);
 
-    if (addr >= IOAPIC_GPA && addr < IOAPIC_GPA + IOAPIC_SIZE) {
-        return ioapic_fault_handle(vctx, addr - IOAPIC_GPA, qualification, decoded_ins);
-    } else if (addr >= HPET_GPA && addr < HPET_GPA + HPET_SIZE) {
-        return hpet_fault_handle(vctx, addr - HPET_GPA, qualification, decoded_ins);
-#if APIC_VIRT_LEVEL < APIC_VIRT_LEVEL_APICV
-    } else if (addr >= LAPIC_GPA && addr < LAPIC_GPA + LAPIC_SIZE) {
-        return lapic_fault_handle(vctx, addr - LAPIC_GPA, qualification, decoded_ins);
-#endif
-    } else {
-        for (int i = 0; i < MAX_EPT_EXCEPTION_HANDLERS; i++) {
-            uintptr_t base = registered_ept_exception_handlers[i].base;
-            uintptr_t end = registered_ept_exception_handlers[i].end;
-            ept_exception_callback_t callback = registered_ept_exception_handlers[i].callback;
-            void *cookie = registered_ept_exception_handlers[i].cookie;
-            if (addr >= base && addr < end) {
-                bool success = callback(0, addr - base, qualification, decoded_ins, vctx, cookie);
-                if (!success) {
-                    LOG_VMM_ERR("registered EPT exception handler for region [0x%lx..0x%lx) at address "
-                                "0x%lx failed\n",
-                                base, end, addr);
-                }
-
-                return success;
-            }
+    struct ept_exception_handler *handler = find_ept_exception_handler(addr);
+    if (handler && handler->coalesced_write && ept_fault_is_write(qualification)) {
+        uint64_t data;
+        if (!mem_write_get_data(decoded_ins, qualification, vctx, &data)) {
+            return false;
         }
+        coalesced_io_push(handler->coalesced_write, handler->cookie, addr - handler->base,
+                          mem_access_width_to_bytes(decoded_ins), data);
+        return true;
+    }
 
+    if (coalesced_io_pending()) {
+        /* Draining can register handlers, which moves them around in the table. */
+        coalesced_io_flush();
+        handler = find_ept_exception_handler(addr);
+    }
+
+    if (!handler) {
         LOG_VMM_ERR("failed to find EPT handler for address 0x%lx\n", addr);
+        return false;
     }
 
-    return false;
+    bool success = handler->callback(0, addr - handler->base, qualification, decoded_ins, vctx, handler->cookie);
+    if (!success) {
+        LOG_VMM_ERR("registered EPT exception handler for region [0x%lx..0x%lx) at address "
+                    "0x%lx failed\n",
+                    handler->base, handler->end, addr);
+    }
+
+    return success;
 }
 
 struct pio_exception_handler {
     uint16_t base;
     uint16_t end;
     pio_exception_callback_t callback;
+    /* Set if writes to the ports are coalesced */
+    coalesced_io_write_fn_t coalesced_write;
     void *cookie;
 };
-#define MAX_PIO_EXCEPTION_HANDLERS 16
 static struct pio_exception_handler registered_pio_exception_handlers[MAX_PIO_EXCEPTION_HANDLERS];
 static size_t pio_exception_handler_index = 0;
 
-bool fault_register_pio_exception_handler(uint16_t base, uint16_t size, pio_exception_callback_t callback, void *cookie)
+/*
+ * Port I/O exits are dispatched through a two level table indexed by the port number, so
+ * that noisy legacy ports (CMOS, the PM timer, fw_cfg etc) find their handler in constant
+ * time. The top byte of the port selects a block of 256 ports, which is only allocated once
+ * a handler is registered in it. Both levels store indices plus one, so zero means nothing
+ * is there.
+ */
+#define PIO_PORT_BLOCK_SIZE 0x100
+#define PIO_NUM_PORT_BLOCKS 0x100
+_Static_assert(MAX_PIO_EXCEPTION_HANDLERS < 0x100, "PIO exception handler indices must fit in a uint8_t");
+_Static_assert(MAX_PIO_PORT_BLOCKS < 0x100, "PIO port block indices must fit in a uint8_t");
+
+static uint8_t pio_port_directory[PIO_NUM_PORT_BLOCKS];
+static uint8_t pio_port_blocks[MAX_PIO_PORT_BLOCKS][PIO_PORT_BLOCK_SIZE];
+static size_t pio_port_blocks_used = 0;
+
+static struct pio_exception_handler *find_pio_exception_handler(uint16_t port_addr)
 {
-    if (pio_exception_handler_index == MAX_PIO_EXCEPTION_HANDLERS - 1) {
-        LOG_VMM_ERR("maximum number of PIO exception handlers registered");
+    uint8_t block = pio_port_directory[port_addr / PIO_PORT_BLOCK_SIZE];
+    if (!block) {
+        return NULL;
+    }
+
+    uint8_t handler = pio_port_blocks[block - 1][port_addr % PIO_PORT_BLOCK_SIZE];
+    if (!handler) {
+        return NULL;
+    }
+
+    return &registered_pio_exception_handlers[handler - 1];
+}
+
+bool fault_register_coalesced_pio_exception_handler(uint16_t base, uint16_t size, pio_exception_callback_t callback,
+                                                    coalesced_io_write_fn_t coalesced_write, void *cookie)
+{
+    if (pio_exception_handler_index == MAX_PIO_EXCEPTION_HANDLERS) {
+        LOG_VMM_ERR("maximum number of PIO exception handlers registered\n");
         return false;
     }
 
@@ -328,49 +486,82 @@ bool fault_register_pio_exception_handler(uint16_t base, uint16_t size, pio_exce
         return false;
     }
 
-    for (int i = 0; i < pio_exception_handler_index; i++) {
-        struct pio_exception_handler *curr = &registered_pio_exception_handlers[i];
-        if (!(base >= curr->end || base + size <= curr->base)) {
+    size_t new_blocks = 0;
+    for (uint32_t port = base; port < size_64; port++) {
+        struct pio_exception_handler *curr = find_pio_exception_handler(port);
+        if (curr) {
             LOG_VMM_ERR("PIO exception handler [0x%hx..0x%hx), overlaps with another handler [0x%hx..0x%hx)\n", base,
                         base + size, curr->base, curr->end);
             return false;
         }
+        if (!pio_port_directory[port / PIO_PORT_BLOCK_SIZE]
+            && (port == base || port % PIO_PORT_BLOCK_SIZE == 0)) {
+            new_blocks++;
+        }
+    }
+
+    if (pio_port_blocks_used + new_blocks > MAX_PIO_PORT_BLOCKS) {
+        LOG_VMM_ERR("out of PIO port blocks for handler [0x%hx..0x%hx)\n", base, base + size);
+        return false;
     }
 
     registered_pio_exception_handlers[pio_exception_handler_index] = (struct pio_exception_handler) {
         .base = base,
         .end = base + size,
         .callback = callback,
+        .coalesced_write = coalesced_write,
         .cookie = cookie,
     };
     pio_exception_handler_index += 1;
 
+    for (uint32_t port = base; port < size_64; port++) {
+        uint8_t *block = &pio_port_directory[port / PIO_PORT_BLOCK_SIZE];
+        if (!*block) {
+            pio_port_blocks_used += 1;
+            *block = pio_port_blocks_used;
+        }
+        pio_port_blocks[*block - 1][port % PIO_PORT_BLOCK_SIZE] = pio_exception_handler_index;
+    }
+
     return true;
 }
 
+bool fault_register_pio_exception_handler(uint16_t base, uint16_t size, pio_exception_callback_t callback, void *cookie)
+{
+    return fault_register_coalesced_pio_exception_handler(base, size, callback, NULL, cookie);
+}
+
 static bool handle_pio_fault(seL4_VCPUContext *vctx, seL4_Word qualification)
 {
     uint16_t port_addr = pio_fault_addr(qualification);
 
-    for (int i = 0; i < MAX_PIO_EXCEPTION_HANDLERS; i++) {
-        uint16_t base = registered_pio_exception_handlers[i].base;
-        uint16_t end = registered_pio_exception_handlers[i].end;
-        pio_exception_callback_t callback = registered_pio_exception_handlers[i].callback;
-        void *cookie = registered_pio_exception_handlers[i].cookie;
-        if (port_addr >= base && port_addr < end) {
-            bool success = callback(0, port_addr - base, qualification, vctx, cookie);
-            if (!success) {
-                LOG_VMM_ERR("registered PIO exception handler for region [0x%hx..0x%hx) at address "
-                            "0x%hx failed\n",
-                            base, end, port_addr);
-            }
+    struct pio_exception_handler *handler = find_pio_exception_handler(port_addr);
+    if (handler && handler->coalesced_write && pio_fault_is_write(qualification)
+        && !pio_fault_is_string_op(qualification)) {
+        coalesced_io_push(handler->coalesced_write, handler->cookie, port_addr - handler->base,
+                          pio_fault_to_access_width_bytes(qualification), pio_get_write_data(qualification, vctx));
+        return true;
+    }
 
-            return success;
-        }
+    if (coalesced_io_pending()) {
+        /* Draining can register a handler for the port. */
+        coalesced_io_flush();
+        handler = find_pio_exception_handler(port_addr);
     }
 
-    emulate_ioport_noop_access(qualification, vctx);
-    return true;
+    if (!handler) {
+        emulate_ioport_noop_access(qualification, vctx);
+        return true;
+    }
+
+    bool success = handler->callback(0, port_addr - handler->base, qualification, vctx, handler->cookie);
+    if (!success) {
+        LOG_VMM_ERR("registered PIO exception handler for region [0x%hx..0x%hx) at address "
+                    "0x%hx failed\n",
+                    handler->base, handler->end, port_addr);
+    }
+
+    return success;
 }
 
 bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo)
@@ -385,6 +576,10 @@ bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo)
     seL4_Word rip = vcpu_exit_get_rip();
     seL4_VCPUContext *vctx = vcpu_exit_get_context();
 
+#if GUEST_TLB_FLUSH_ON_EXIT
+    gva_to_gpa_tlb_flush(vcpu_id);
+#endif
+
     switch (f_reason) {
     case CPUID:
         success = emulate_cpuid(vctx);
@@ -416,6 +611,12 @@ bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo)
     case CONTROL_REGISTER:
         success = handle_cr_access(vctx, qualification);
         break;
+    case INVLPG:
+        /* Only seen if INVLPG is configured to exit, the qualification is the linear address. */
+        gva_to_gpa_tlb_flush_page(vcpu_id, qualification);
+        decode_instruction_cache_invalidate();
+        success = true;
+        break;
 #if APIC_VIRT_LEVEL == APIC_VIRT_LEVEL_APICV
     case VIRTUALIZED_EOI: {
         uint8_t eoi_vector = qualification;
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <microkit.h>
 #include <libvmm/guest.h>
 #include <libvmm/guest_ram.h>
@@ -15,6 +16,10 @@
 
 #define X86_PAGING_OBJECT_SIZE 0x1000
 
+#define X86_PAGE_BITS_4K 12
+#define X86_PAGE_BITS_2M 21
+#define X86_PAGE_BITS_1G 30
+
 static uint64_t pte_to_gpa(uint64_t pte)
 {
     assert(pte & 1);
@@ -31,13 +36,119 @@ static bool pt_page_size(uint64_t pte)
     return pte & BIT(7);
 }
 
-bool gva_to_gpa(size_t vcpu_id, uint64_t gva, uint64_t *gpa, size_t *bytes_remaining)
+/*
+ * Software TLB of guest virtual to guest physical translations, so that emulating string I/O
+ * does not walk the guest page tables once per byte. Entries are keyed by CR3 and the virtual
+ * page number, and probed once per page size since 4KiB, 2MiB and 1GiB pages share the array.
+ *
+ * With the default VMCS controls the guest can change its page tables and execute INVLPG
+ * without us knowing, so the TLB is flushed on every VM exit. Systems that make CR3 loads and
+ * INVLPG exit can set GUEST_TLB_FLUSH_ON_EXIT to 0 to keep entries across exits.
+ */
+#if GUEST_TLB_SIZE
+_Static_assert((GUEST_TLB_SIZE & (GUEST_TLB_SIZE - 1)) == 0, "GUEST_TLB_SIZE must be a power of two");
+
+struct guest_tlb_entry {
+    /* Entries are only valid if this matches the epoch of their TLB, 0 is never valid */
+    uint32_t epoch;
+    uint8_t page_bits;
+    uint64_t cr3;
+    uint64_t vpn;
+    uint64_t page_gpa;
+};
+
+struct guest_tlb {
+    uint32_t epoch;
+    struct guest_tlb_entry entries[GUEST_TLB_SIZE];
+};
+
+static struct guest_tlb guest_tlbs[GUEST_MAX_NUM_VCPUS];
+
+static struct guest_tlb_entry *guest_tlb_slot(struct guest_tlb *tlb, uint64_t cr3, uint64_t vpn, uint8_t page_bits)
 {
-    if (!guest_paging_on()) {
-        *gpa = gva;
+    return &tlb->entries[(vpn ^ (cr3 >> 12) ^ page_bits) & (GUEST_TLB_SIZE - 1)];
+}
+
+static bool guest_tlb_lookup(size_t vcpu_id, uint64_t cr3, uint64_t gva, uint64_t *gpa, size_t *bytes_remaining)
+{
+    static const uint8_t page_bits[] = { X86_PAGE_BITS_4K, X86_PAGE_BITS_2M, X86_PAGE_BITS_1G };
+    struct guest_tlb *tlb = &guest_tlbs[vcpu_id];
+
+    for (int i = 0; i < ARRAY_SIZE(page_bits); i++) {
+        uint64_t vpn = gva >> page_bits[i];
+        struct guest_tlb_entry *entry = guest_tlb_slot(tlb, cr3, vpn, page_bits[i]);
+        if (entry->epoch == tlb->epoch && entry->page_bits == page_bits[i] && entry->vpn == vpn
+            && entry->cr3 == cr3) {
+            uint64_t page_offset = gva & (BIT(page_bits[i]) - 1);
+            *gpa = entry->page_gpa + page_offset;
+            *bytes_remaining = BIT(page_bits[i]) - page_offset;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void guest_tlb_insert(size_t vcpu_id, uint64_t cr3, uint64_t gva, uint64_t page_gpa, uint8_t page_bits)
+{
+    struct guest_tlb *tlb = &guest_tlbs[vcpu_id];
+    uint64_t vpn = gva >> page_bits;
+
+    if (tlb->epoch == 0) {
+        /* Nothing has been flushed yet */
+        tlb->epoch = 1;
+    }
+
+    *guest_tlb_slot(tlb, cr3, vpn, page_bits) = (struct guest_tlb_entry) {
+        .epoch = tlb->epoch,
+        .page_bits = page_bits,
+        .cr3 = cr3,
+        .vpn = vpn,
+        .page_gpa = page_gpa,
+    };
+}
+#endif
+
+void gva_to_gpa_tlb_flush(size_t vcpu_id)
+{
+#if GUEST_TLB_SIZE
+    assert(vcpu_id < GUEST_MAX_NUM_VCPUS);
+    struct guest_tlb *tlb = &guest_tlbs[vcpu_id];
+
+    tlb->epoch++;
+    if (tlb->epoch == 0) {
+        /* Wrapped around, entries from the first use of this epoch could still look valid. */
+        memset(tlb->entries, 0, sizeof(tlb->entries));
+        tlb->epoch = 1;
+    }
+#endif
+}
+
+void gva_to_gpa_tlb_flush_page(size_t vcpu_id, uint64_t gva)
+{
+#if GUEST_TLB_SIZE
+    assert(vcpu_id < GUEST_MAX_NUM_VCPUS);
+    struct guest_tlb *tlb = &guest_tlbs[vcpu_id];
+
+    /* INVLPG drops the translation in every address space that has one, as would global pages. */
+    for (int i = 0; i < GUEST_TLB_SIZE; i++) {
+        struct guest_tlb_entry *entry = &tlb->entries[i];
+        if (entry->epoch == tlb->epoch && entry->vpn == gva >> entry->page_bits) {
+            entry->epoch = 0;
+        }
     }
+#endif
+}
 
-    uint64_t pml4_gpa = vcpu_exit_get_cr3() & ~0xfff;
+/* Maps a 2MiB or 1GiB page, in which case bit 12 is PAT rather than part of the address. */
+static uint64_t large_pte_to_gpa(uint64_t pte, uint8_t page_bits)
+{
+    return pte_to_gpa(pte) & ~(BIT(page_bits) - 1);
+}
+
+static bool gva_to_gpa_walk(uint64_t cr3, uint64_t gva, uint64_t *page_gpa, uint8_t *page_bits)
+{
+    uint64_t pml4_gpa = cr3 & ~0xfff;
     uint64_t *pml4 = gpa_to_hva(pml4_gpa, X86_PAGING_OBJECT_SIZE);
     uint64_t pml4_idx = (gva >> (12 + (9 * 3))) & 0x1ff;
     uint64_t pml4_pte = pml4[pml4_idx];
@@ -55,6 +166,13 @@ bool gva_to_gpa(size_t vcpu_id, uint64_t gva, uint64_t *gpa, size_t *bytes_remai
         return false;
     }
 
+    if (pt_page_size(pdpt_pte)) {
+        // 1GiB page
+        *page_bits = X86_PAGE_BITS_1G;
+        *page_gpa = large_pte_to_gpa(pdpt_pte, *page_bits);
+        return true;
+    }
+
     uint64_t pd_gpa = pte_to_gpa(pdpt_pte);
     uint64_t *pd = gpa_to_hva(pd_gpa, X86_PAGING_OBJECT_SIZE);
     uint64_t pd_idx = (gva >> (12 + (9 * 1))) & 0x1ff;
@@ -64,28 +182,59 @@ bool gva_to_gpa(size_t vcpu_id, uint64_t gva, uint64_t *gpa, size_t *bytes_remai
         return false;
     }
 
-    if (pt_page_size(pd_pte) && pte_present(pd_pte)) {
+    if (pt_page_size(pd_pte)) {
         // 2MiB page
-        uint64_t page_gpa = pte_to_gpa(pd_pte);
-        uint64_t page_offset = (gva & 0x1fffff);
-        *gpa = page_gpa + page_offset;
-        *bytes_remaining = 0x200000 - page_offset;
-    } else {
-        // 4k page
-        uint64_t pt_gpa = pte_to_gpa(pd_pte);
-        uint64_t *pt = gpa_to_hva(pt_gpa, X86_PAGING_OBJECT_SIZE);
-        uint64_t pt_idx = (gva >> (12)) & 0x1ff;
-        uint64_t pt_pte = pt[pt_idx];
-        if (!pte_present(pt_pte)) {
-            LOG_VMM_ERR("PT PTE not present when converting GVA 0x%lx to GPA\n", gva);
-            return 0;
-        }
+        *page_bits = X86_PAGE_BITS_2M;
+        *page_gpa = large_pte_to_gpa(pd_pte, *page_bits);
+        return true;
+    }
 
-        uint64_t page_gpa = pte_to_gpa(pt_pte);
-        uint64_t page_offset = (gva & 0xfff);
-        *gpa = page_gpa + page_offset;
-        *bytes_remaining = 0x1000 - page_offset;
+    // 4k page
+    uint64_t pt_gpa = pte_to_gpa(pd_pte);
+    uint64_t *pt = gpa_to_hva(pt_gpa, X86_PAGING_OBJECT_SIZE);
+    uint64_t pt_idx = (gva >> (12)) & 0x1ff;
+    uint64_t pt_pte = pt[pt_idx];
+    if (!pte_present(pt_pte)) {
+        LOG_VMM_ERR("PT PTE not present when converting GVA 0x%lx to GPA\n", gva);
+        return false;
     }
 
+    *page_bits = X86_PAGE_BITS_4K;
+    *page_gpa = pte_to_gpa(pt_pte);
     return true;
-}
\ No newline at end of file
+}
+
+bool gva_to_gpa(size_t vcpu_id, uint64_t gva, uint64_t *gpa, size_t *bytes_remaining)
+{
+    uint64_t cr3 = vcpu_exit_get_cr3();
+
+#if GUEST_TLB_SIZE
+    /* Entries are only ever inserted with paging on, and turning it off flushes the TLB. */
+    assert(vcpu_id < GUEST_MAX_NUM_VCPUS);
+    if (guest_tlb_lookup(vcpu_id, cr3, gva, gpa, bytes_remaining)) {
+        return true;
+    }
+#endif
+
+    if (!guest_paging_on()) {
+        *gpa = gva;
+        *bytes_remaining = X86_PAGING_OBJECT_SIZE - (gva & (X86_PAGING_OBJECT_SIZE - 1));
+        return true;
+    }
+
+    uint64_t page_gpa;
+    uint8_t page_bits;
+    if (!gva_to_gpa_walk(cr3, gva, &page_gpa, &page_bits)) {
+        return false;
+    }
+
+#if GUEST_TLB_SIZE
+    guest_tlb_insert(vcpu_id, cr3, gva, page_gpa, page_bits);
+#endif
+
+    uint64_t page_offset = gva & (BIT(page_bits) - 1);
+    *gpa = page_gpa + page_offset;
+    *bytes_remaining = BIT(page_bits) - page_offset;
+
+    return true;
+}
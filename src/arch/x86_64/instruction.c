@@ -283,19 +283,12 @@ void debug_print_instruction(decoded_instruction_ret_t decode_result)
     }
 }
 
-decoded_instruction_ret_t decode_instruction(size_t vcpu_id, seL4_Word rip)
+static decoded_instruction_ret_t decode_instruction_uncached(uint8_t *instruction_vaddr)
 {
     uint8_t instruction_buf[X86_MAX_INSTRUCTION_LENGTH];
-    uint64_t rip_gpa;
-    size_t bytes_remaining;
-    assert(gva_to_gpa(vcpu_id, rip, &rip_gpa, &bytes_remaining));
-
-    // @billn fix lazyness, crashes if the instruction crosses a page boundary
-    assert(bytes_remaining >= X86_MAX_INSTRUCTION_LENGTH);
 
     /* Copy 15 bytes of instruction from guest RAM, the actual number of bytes parsed will be less.
      * We have to derive the instruction length ourselves, as the silicon won't tell us... */
-    void *instruction_vaddr = gpa_to_hva(rip_gpa, X86_MAX_INSTRUCTION_LENGTH);
     memcpy(instruction_buf, instruction_vaddr, X86_MAX_INSTRUCTION_LENGTH);
 
     decoded_instruction_ret_t ret = { .type = INSTRUCTION_DECODE_FAIL, .decoded = {} };
@@ -491,5 +484,73 @@ decoded_instruction_ret_t decode_instruction(size_t vcpu_id, seL4_Word rip)
 
     memcpy(&ret.raw, instruction_vaddr, X86_MAX_INSTRUCTION_LENGTH);
     ret.len = parsed_byte;
+    return ret;
+}
+
+#if X86_DECODE_CACHE_SIZE
+_Static_assert((X86_DECODE_CACHE_SIZE & (X86_DECODE_CACHE_SIZE - 1)) == 0,
+               "X86_DECODE_CACHE_SIZE must be a power of two");
+
+/*
+ * Drivers doing MMIO fault on the same few instructions over and over, so decoded instructions
+ * are cached by the guest physical address of their RIP to skip decoding them again. RIP is
+ * translated on every fault, as the guest can remap its code without us knowing, which is cheap
+ * with the guest TLB. Guest writes to its own code cannot be trapped either, so on a hit the cached
+ * bytes are compared against what is in guest RAM now.
+ */
+struct decode_cache_entry {
+    bool valid;
+    uint64_t gpa;
+    decoded_instruction_ret_t decoded;
+};
+
+static struct decode_cache_entry decode_cache[X86_DECODE_CACHE_SIZE];
+
+static struct decode_cache_entry *decode_cache_slot(uint64_t gpa)
+{
+    return &decode_cache[(gpa ^ (gpa >> 12)) & (X86_DECODE_CACHE_SIZE - 1)];
+}
+#endif
+
+void decode_instruction_cache_invalidate(void)
+{
+#if X86_DECODE_CACHE_SIZE
+    for (int i = 0; i < X86_DECODE_CACHE_SIZE; i++) {
+        decode_cache[i].valid = false;
+    }
+#endif
+}
+
+decoded_instruction_ret_t decode_instruction(size_t vcpu_id, seL4_Word rip)
+{
+    uint64_t rip_gpa;
+    size_t bytes_remaining;
+    assert(gva_to_gpa(vcpu_id, rip, &rip_gpa, &bytes_remaining));
+
+    // @billn fix lazyness, crashes if the instruction crosses a page boundary
+    assert(bytes_remaining >= X86_MAX_INSTRUCTION_LENGTH);
+
+    uint8_t *instruction_vaddr = gpa_to_hva(rip_gpa, X86_MAX_INSTRUCTION_LENGTH);
+
+#if X86_DECODE_CACHE_SIZE
+    struct decode_cache_entry *entry = decode_cache_slot(rip_gpa);
+    if (entry->valid && entry->gpa == rip_gpa
+        && !memcmp(instruction_vaddr, entry->decoded.raw, entry->decoded.len)) {
+        return entry->decoded;
+    }
+#endif
+
+    decoded_instruction_ret_t ret = decode_instruction_uncached(instruction_vaddr);
+
+#if X86_DECODE_CACHE_SIZE
+    if (ret.type != INSTRUCTION_DECODE_FAIL) {
+        *entry = (struct decode_cache_entry) {
+            .valid = true,
+            .gpa = rip_gpa,
+            .decoded = ret,
+        };
+    }
+#endif
+
     return ret;
 }
\ No newline at end of file
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/util.h>
+#include <libvmm/coalesced_io.h>
+
+struct coalesced_io_entry {
+    coalesced_io_write_fn_t write;
+    void *cookie;
+    uint64_t offset;
+    uint64_t data;
+    int access_width_bytes;
+};
+
+/* All vCPUs are handled by the same thread, so one ring is shared by all of them. */
+static struct coalesced_io_entry coalesced_io_ring[COALESCED_IO_RING_SIZE];
+static size_t coalesced_io_head = 0;
+static size_t coalesced_io_tail = 0;
+
+bool coalesced_io_pending(void)
+{
+    return coalesced_io_head != coalesced_io_tail;
+}
+
+void coalesced_io_flush(void)
+{
+    while (coalesced_io_head != coalesced_io_tail) {
+        struct coalesced_io_entry *entry = &coalesced_io_ring[coalesced_io_head % COALESCED_IO_RING_SIZE];
+        /* The write was completed as far as the guest is concerned, so there is no one to
+         * report a failure to other than the log. */
+        if (!entry->write(entry->offset, entry->access_width_bytes, entry->data, entry->cookie)) {
+            LOG_VMM_ERR("coalesced write of 0x%lx to offset 0x%lx failed\n", entry->data, entry->offset);
+        }
+        coalesced_io_head++;
+    }
+}
+
+void coalesced_io_push(coalesced_io_write_fn_t write, void *cookie, uint64_t offset, int access_width_bytes,
+                       uint64_t data)
+{
+    if (coalesced_io_tail - coalesced_io_head == COALESCED_IO_RING_SIZE) {
+        coalesced_io_flush();
+    }
+
+    coalesced_io_ring[coalesced_io_tail % COALESCED_IO_RING_SIZE] = (struct coalesced_io_entry) {
+        .write = write,
+        .cookie = cookie,
+        .offset = offset,
+        .data = data,
+        .access_width_bytes = access_width_bytes,
+    };
+    coalesced_io_tail++;
+}
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <microkit.h>
 #include <libvmm/guest.h>
 #include <libvmm/guest_ram.h>
@@ -13,42 +14,92 @@
 
 extern guest_t guest;
 
-bool guest_ram_add_region(struct guest_ram_region guest_ram_region)
+static bool region_overlaps(struct guest_ram_region *region, struct guest_ram_region *other)
 {
-    if (guest.guest_ram_regions_len == GUEST_MAX_RAM_REGIONS) {
-        LOG_VMM_ERR("bookkeeping array is full\n");
-        return false;
+    uint64_t this_gpa_start = region->gpa_start;
+    uint64_t this_gpa_end = this_gpa_start + region->size;
+    uint64_t other_start = other->gpa_start;
+    uint64_t other_end = other_start + other->size;
+    if (ranges_overlap(this_gpa_start, this_gpa_end, other_start, other_end)) {
+        LOG_VMM_ERR("region [0x%lx..0x%lx) overlaps with existing region [0x%lx..0x%lx)\n", this_gpa_start,
+                    this_gpa_end, other_start, other_end);
+        return true;
     }
+    return false;
+}
 
-    if (guest_ram_region.size == 0) {
+static bool region_valid(struct guest_ram_region *region)
+{
+    if (region->size == 0) {
         LOG_VMM_ERR("size is 0\n");
         return false;
     }
 
-    if (guest_ram_region.vmm_vaddr == NULL) {
+    if (region->vmm_vaddr == NULL) {
         LOG_VMM_ERR("vmm_vaddr is NULL\n");
         return false;
     }
 
-    uint64_t this_gpa_start = guest_ram_region.gpa_start;
-    uint64_t this_gpa_end = this_gpa_start + guest_ram_region.size;
-
     for (int i = 0; i < guest.guest_ram_regions_len; i++) {
-        uint64_t other_start = guest.guest_ram_regions[i].gpa_start;
-        uint64_t other_end = other_start + guest.guest_ram_regions[i].size;
-        if (ranges_overlap(this_gpa_start, this_gpa_end, other_start, other_end)) {
-            LOG_VMM_ERR("guest_ram_add_region(): region [0x%lx..0x%lx) overlaps with existing region [0x%lx..0x%lx)\n",
-                        this_gpa_start, this_gpa_end, other_start, other_end);
+        if (region_overlaps(region, &guest.guest_ram_regions[i])) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < guest.guest_ram_hotplug_regions_len; i++) {
+        if (region_overlaps(region, &guest.guest_ram_hotplug_regions[i].region)) {
             return false;
         }
     }
 
+    return true;
+}
+
+bool guest_ram_add_region(struct guest_ram_region guest_ram_region)
+{
+    if (guest.guest_ram_regions_len == GUEST_MAX_RAM_REGIONS) {
+        LOG_VMM_ERR("bookkeeping array is full\n");
+        return false;
+    }
+
+    if (!region_valid(&guest_ram_region)) {
+        return false;
+    }
+
     memcpy(&guest.guest_ram_regions[guest.guest_ram_regions_len], &guest_ram_region, sizeof(struct guest_ram_region));
     guest.guest_ram_regions_len++;
 
     return true;
 }
 
+bool guest_ram_add_hotplug_region(struct guest_ram_region guest_ram_region, uint64_t block_size,
+                                  uint64_t *plugged)
+{
+    if (guest.guest_ram_hotplug_regions_len == GUEST_MAX_HOTPLUG_REGIONS) {
+        LOG_VMM_ERR("hotplug bookkeeping array is full\n");
+        return false;
+    }
+
+    if (block_size == 0 || (block_size & (block_size - 1)) || guest_ram_region.gpa_start % block_size
+        || guest_ram_region.size % block_size) {
+        LOG_VMM_ERR("region [0x%lx..0x%lx) is not made of blocks of 0x%lx bytes\n", guest_ram_region.gpa_start,
+                    guest_ram_region.gpa_start + guest_ram_region.size, block_size);
+        return false;
+    }
+
+    if (plugged == NULL || !region_valid(&guest_ram_region)) {
+        return false;
+    }
+
+    struct guest_ram_hotplug_region *hotplug = &guest.guest_ram_hotplug_regions[guest.guest_ram_hotplug_regions_len];
+    hotplug->region = guest_ram_region;
+    hotplug->block_size = block_size;
+    hotplug->plugged = plugged;
+    guest.guest_ram_hotplug_regions_len++;
+
+    return true;
+}
+
 struct guest_ram_region *guest_ram_get_regions(int *num_regions)
 {
     *num_regions = guest.guest_ram_regions_len;
@@ -70,5 +121,26 @@ void *gpa_to_hva(uint64_t gpa, size_t size)
             }
         }
     }
+
+    for (int i = 0; i < guest.guest_ram_hotplug_regions_len; i++) {
+        struct guest_ram_hotplug_region *hotplug = &guest.guest_ram_hotplug_regions[i];
+        uint64_t this_region_gpa_start = hotplug->region.gpa_start;
+        uint64_t this_region_gpa_end = this_region_gpa_start + hotplug->region.size;
+        if (gpa < this_region_gpa_start || gpa >= this_region_gpa_end || size > this_region_gpa_end - gpa) {
+            continue;
+        }
+
+        /* Every block of the range must be plugged in */
+        uint64_t offset = gpa - this_region_gpa_start;
+        uint64_t first = offset / hotplug->block_size;
+        uint64_t last = (offset + MAX(size, 1) - 1) / hotplug->block_size;
+        for (uint64_t block = first; block <= last; block++) {
+            if (!((hotplug->plugged[block / 64] >> (block % 64)) & 1)) {
+                return NULL;
+            }
+        }
+        return (void *)((uintptr_t)hotplug->region.vmm_vaddr + offset);
+    }
+
     return NULL;
 }
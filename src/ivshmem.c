@@ -0,0 +1,266 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/virq.h>
+#include <libvmm/pci.h>
+#include <libvmm/util/util.h>
+#include <libvmm/ivshmem.h>
+#if defined(CONFIG_ARCH_ARM)
+#include <libvmm/arch/aarch64/fault.h>
+#endif
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_IVSHMEM
+
+#if defined(DEBUG_IVSHMEM)
+#define LOG_IVSHMEM(...) do{ printf("%s|IVSHMEM: ", microkit_name); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_IVSHMEM(...) do{}while(0)
+#endif
+
+#define LOG_IVSHMEM_ERR(...) do{ printf("%s|IVSHMEM|ERROR: ", microkit_name); printf(__VA_ARGS__); }while(0)
+
+#define IVSHMEM_DOORBELL_PEER(x) ((x) >> 16)
+
+/* ivshmem only defines bit 0 of IntrStatus and IntrMask */
+#define IVSHMEM_INTR_DOORBELL BIT_LOW(0)
+
+static bool ivshmem_irq_pending(ivshmem_device_t *shm)
+{
+    return (shm->intr_status & shm->intr_mask) != 0;
+}
+
+/*
+ * Called whenever IntrStatus or IntrMask change. Over PCI the line is level triggered and
+ * follows IntrStatus & IntrMask, so it is dropped once the guest has read IntrStatus. Over
+ * MMIO the IRQ is edge triggered and is injected on the rising edge only.
+ */
+static bool ivshmem_update_irq(ivshmem_device_t *shm, bool was_pending)
+{
+    bool pending = ivshmem_irq_pending(shm);
+
+    if (shm->pci) {
+        if (!pci_device_set_irq_status(shm->pci_handle, pending)) {
+            return false;
+        }
+        if (pending != was_pending) {
+            return virq_set_level(shm->irq_routing_info, pending);
+        }
+        return true;
+    }
+
+    if (pending && !was_pending) {
+        return virq_inject(shm->irq_routing_info);
+    }
+
+    return true;
+}
+
+static bool ivshmem_ring_doorbell(ivshmem_device_t *shm, uint32_t value)
+{
+    uint16_t peer_id = IVSHMEM_DOORBELL_PEER(value);
+
+    for (uint32_t i = 0; i < shm->num_peers; i++) {
+        if (shm->peers[i].id == peer_id) {
+            LOG_IVSHMEM("ringing doorbell of peer %u on channel %u\n", peer_id, shm->peers[i].ch);
+            microkit_notify(shm->peers[i].ch);
+            return true;
+        }
+    }
+
+    /* The ID is chosen by the guest, so this is the guest's mistake rather than ours. */
+    LOG_IVSHMEM_ERR("doorbell rung for unknown peer %u\n", peer_id);
+    return true;
+}
+
+static bool ivshmem_reg_read(ivshmem_device_t *shm, uint64_t offset, uint32_t *data)
+{
+    bool was_pending = ivshmem_irq_pending(shm);
+
+    switch (offset) {
+    case IVSHMEM_REG_INTR_MASK:
+        *data = shm->intr_mask;
+        return true;
+    case IVSHMEM_REG_INTR_STATUS:
+        *data = shm->intr_status;
+        shm->intr_status = 0;
+        return ivshmem_update_irq(shm, was_pending);
+    case IVSHMEM_REG_IV_POSITION:
+        *data = shm->id;
+        return true;
+    case IVSHMEM_REG_DOORBELL:
+        *data = 0;
+        return true;
+    default:
+        LOG_IVSHMEM_ERR("unknown register read at offset 0x%lx\n", offset);
+        return false;
+    }
+}
+
+static bool ivshmem_reg_write(ivshmem_device_t *shm, uint64_t offset, uint32_t data)
+{
+    bool was_pending = ivshmem_irq_pending(shm);
+
+    switch (offset) {
+    case IVSHMEM_REG_INTR_MASK:
+        shm->intr_mask = data & IVSHMEM_INTR_DOORBELL;
+        return ivshmem_update_irq(shm, was_pending);
+    case IVSHMEM_REG_INTR_STATUS:
+        shm->intr_status = data & IVSHMEM_INTR_DOORBELL;
+        return ivshmem_update_irq(shm, was_pending);
+    case IVSHMEM_REG_IV_POSITION:
+        /* Read only */
+        return true;
+    case IVSHMEM_REG_DOORBELL:
+        return ivshmem_ring_doorbell(shm, data);
+    default:
+        LOG_IVSHMEM_ERR("unknown register write at offset 0x%lx\n", offset);
+        return false;
+    }
+}
+
+bool ivshmem_handle_doorbell(ivshmem_device_t *shm)
+{
+    bool was_pending = ivshmem_irq_pending(shm);
+    shm->intr_status |= IVSHMEM_INTR_DOORBELL;
+    return ivshmem_update_irq(shm, was_pending);
+}
+
+static bool ivshmem_init_common(ivshmem_device_t *shm, irq_routing_info_t irq_routing_info, uint16_t id,
+                                uint64_t shm_gpa, uint64_t shm_size, struct ivshmem_peer *peers, uint32_t num_peers)
+{
+    if (num_peers > IVSHMEM_MAX_PEERS) {
+        LOG_IVSHMEM_ERR("%u peers given, at most %u are supported\n", num_peers, IVSHMEM_MAX_PEERS);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < num_peers; i++) {
+        if (peers[i].id == id) {
+            LOG_IVSHMEM_ERR("peer %u has the same ID as this device\n", i);
+            return false;
+        }
+    }
+
+    memset(shm, 0, sizeof(ivshmem_device_t));
+    shm->id = id;
+    shm->shm_gpa = shm_gpa;
+    shm->shm_size = shm_size;
+    memcpy(shm->peers, peers, num_peers * sizeof(struct ivshmem_peer));
+    shm->num_peers = num_peers;
+    shm->irq_routing_info = irq_routing_info;
+
+    return true;
+}
+
+static void ivshmem_virq_ack(irq_routing_info_t irq_routing_info, void *cookie)
+{
+}
+
+#if !defined(CONFIG_ARCH_X86)
+static bool ivshmem_mmio_fault_handle(size_t vcpu_id, size_t offset, size_t fsr, seL4_UserContext *regs, void *data)
+{
+    ivshmem_device_t *shm = (ivshmem_device_t *)data;
+    assert(shm);
+
+    uint32_t mask = fault_get_data_mask(offset, fsr);
+    if (fault_is_read(fsr)) {
+        uint32_t reg = 0;
+        bool success = ivshmem_reg_read(shm, offset, &reg);
+        fault_emulate_write(regs, offset, fsr, reg & mask);
+        return success;
+    } else {
+        return ivshmem_reg_write(shm, offset, fault_get_data(regs, fsr) & mask);
+    }
+}
+
+bool ivshmem_mmio_init(ivshmem_device_t *shm, uintptr_t regs_gpa, irq_routing_info_t irq_routing_info, uint16_t id,
+                       uint64_t shm_gpa, uint64_t shm_size, struct ivshmem_peer *peers, uint32_t num_peers)
+{
+    if (!ivshmem_init_common(shm, irq_routing_info, id, shm_gpa, shm_size, peers, num_peers)) {
+        return false;
+    }
+
+    shm->pci = false;
+
+    if (!fault_register_vm_exception_handler(regs_gpa, IVSHMEM_REGS_SIZE, &ivshmem_mmio_fault_handle, shm)) {
+        LOG_IVSHMEM_ERR("could not register fault handler for registers at [0x%lx..0x%lx)\n", regs_gpa,
+                        regs_gpa + IVSHMEM_REGS_SIZE);
+        return false;
+    }
+
+    if (!virq_register(irq_routing_info, &ivshmem_virq_ack, NULL)) {
+        LOG_IVSHMEM_ERR("could not register IRQ\n");
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+static bool ivshmem_pci_bar_fault_handle(pci_dev_handle_t pci_dev_handle, uint64_t bar_offset, bool is_read,
+                                         int access_width_bytes, uint64_t *data, void *cookie)
+{
+    ivshmem_device_t *shm = (ivshmem_device_t *)cookie;
+    assert(shm);
+
+    if (is_read) {
+        uint32_t reg = 0;
+        bool success = ivshmem_reg_read(shm, bar_offset, &reg);
+        *data = reg;
+        return success;
+    } else {
+        return ivshmem_reg_write(shm, bar_offset, (uint32_t)*data);
+    }
+}
+
+bool ivshmem_pci_init(ivshmem_device_t *shm, uint16_t pci_bus, uint16_t pci_dev, irq_routing_info_t irq_routing_info,
+                      uint16_t id, uint64_t shm_gpa, uint64_t shm_size, struct ivshmem_peer *peers,
+                      uint32_t num_peers)
+{
+    if (!ivshmem_init_common(shm, irq_routing_info, id, shm_gpa, shm_size, peers, num_peers)) {
+        return false;
+    }
+
+    shm->pci = true;
+
+    pci_device_register_data_t device_data = (pci_device_register_data_t) {
+        .vendor_id = IVSHMEM_PCI_VENDOR_ID,
+        .device_id = IVSHMEM_PCI_DEVICE_ID,
+        .command = PCI_COMMAND_MEMORY,
+        .status = 0,
+        .revision_id = 1,
+        .subclass = PCI_SUB_CLASS(PCI_CLASS_MEMORY_RAM),
+        .class_code = PCI_CLASS_CODE(PCI_CLASS_MEMORY_RAM),
+        .subsystem_vendor_id = IVSHMEM_PCI_VENDOR_ID,
+        .subsystem_device_id = IVSHMEM_PCI_DEVICE_ID,
+    };
+
+    shm->pci_handle = pci_register_device(pci_bus, pci_dev, 0, &device_data);
+    if (shm->pci_handle == INVALID_PCI_DEVICE_HANDLE) {
+        LOG_IVSHMEM_ERR("could not register PCI device\n");
+        return false;
+    }
+
+    if (!pci_register_device_irq(shm->pci_handle, irq_routing_info, &ivshmem_virq_ack, NULL)) {
+        LOG_IVSHMEM_ERR("could not register IRQ\n");
+        return false;
+    }
+
+    if (!pci_register_device_mmio_bar(shm->pci_handle, 0, IVSHMEM_REGS_SIZE, &ivshmem_pci_bar_fault_handle, shm)) {
+        LOG_IVSHMEM_ERR("could not register register BAR\n");
+        return false;
+    }
+
+    if (!pci_register_device_memory_bar(shm->pci_handle, 2, shm_gpa, shm_size)) {
+        LOG_IVSHMEM_ERR("could not register shared memory BAR\n");
+        return false;
+    }
+
+    return true;
+}
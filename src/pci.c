@@ -109,6 +109,8 @@ struct pci_device_bar {
     uint64_t size;
     pci_bar_mmio_fault_handler_t callback;
     void *cookie;
+    /* Backed by memory mapped into the guest at a fixed GPA rather than emulated. */
+    bool fixed;
 };
 
 struct pci_device {
@@ -271,6 +273,16 @@ static bool pci_ecam_emulate_access(pci_dev_handle_t handle, bool is_read, int a
                 struct pci_bar_memory_bits *bar = &config_space->bars[dev_bar_id];
                 if (*data == 0xFFFFFFFF) {
                     bar->base_address = (~(pci_device->bars[dev_bar_id].size - 1)) >> 4;
+                } else if (pci_device->bars[dev_bar_id].fixed) {
+                    /* The memory behind the BAR is mapped by the system description, so it cannot
+                     * move. Anything other than the fixed GPA is refused and the BAR keeps reading back
+                     * the fixed GPA, the guest is expected to leave the assignment alone. */
+                    uint32_t guest_allocated_addr = *data & 0xFFFFFFF0;
+                    if (guest_allocated_addr != (uint32_t)pci_device->bars[dev_bar_id].gpa) {
+                        LOG_VMM_ERR("guest attempted to move fixed BAR %d of PCI device handle %d to GPA 0x%x\n",
+                                    dev_bar_id, handle, guest_allocated_addr);
+                    }
+                    bar->base_address = pci_device->bars[dev_bar_id].gpa >> 4;
                 } else {
                     uint32_t guest_allocated_addr = *data & 0xFFFFFFF0;   // Ignore control bits
 
@@ -346,13 +358,7 @@ static bool pci_ecam_emulate_access(pci_dev_handle_t handle, bool is_read, int a
     return true;
 }
 
-#if defined(CONFIG_ARCH_ARM)
-static bool pci_ecam_memory_fault_handle(size_t vcpu_id, size_t ecam_offset, size_t fsr, seL4_UserContext *regs,
-                                         void *cookie)
-#elif defined(CONFIG_ARCH_X86)
-static bool pci_ecam_memory_fault_handle(size_t qualification, size_t ecam_offset,
-                                         decoded_instruction_ret_t decoded_ins, seL4_VCPUContext *vctx, void *cookie)
-#endif
+static bool pci_ecam_offset_access(uint64_t ecam_offset, bool is_read, int access_width_bytes, uint64_t *data)
 {
     uint16_t bus = ecam_offset >> 20;
     uint16_t dev = (ecam_offset >> 15) & 0x1F;
@@ -373,6 +379,24 @@ static bool pci_ecam_memory_fault_handle(size_t qualification, size_t ecam_offse
     /* We don't need to check if the device is registered, because in that case we already initialised
      * vendor ID to PCI_INVALID_VENDOR_ID. */
 
+    return pci_ecam_emulate_access(handle, is_read, access_width_bytes, offset, data);
+}
+
+/* Config space writes have no side effects that the guest can see without a later access,
+ * so they are coalesced. */
+static bool pci_ecam_coalesced_write(uint64_t ecam_offset, int access_width_bytes, uint64_t data, void *cookie)
+{
+    return pci_ecam_offset_access(ecam_offset, false, access_width_bytes, &data);
+}
+
+#if defined(CONFIG_ARCH_ARM)
+static bool pci_ecam_memory_fault_handle(size_t vcpu_id, size_t ecam_offset, size_t fsr, seL4_UserContext *regs,
+                                         void *cookie)
+#elif defined(CONFIG_ARCH_X86)
+static bool pci_ecam_memory_fault_handle(size_t qualification, size_t ecam_offset,
+                                         decoded_instruction_ret_t decoded_ins, seL4_VCPUContext *vctx, void *cookie)
+#endif
+{
     bool is_read;
     int access_width_bytes;
     uint64_t data = 0;
@@ -393,11 +417,11 @@ static bool pci_ecam_memory_fault_handle(size_t qualification, size_t ecam_offse
 #endif
     }
 
-    bool success = pci_ecam_emulate_access(handle, is_read, access_width_bytes, offset, &data);
+    bool success = pci_ecam_offset_access(ecam_offset, is_read, access_width_bytes, &data);
 
     if (success && is_read) {
 #if defined(CONFIG_ARCH_ARM)
-        fault_emulate_write(regs, offset, fsr, data);
+        fault_emulate_write(regs, ecam_offset, fsr, data);
 #elif defined(CONFIG_ARCH_X86)
         assert(mem_read_set_data(decoded_ins, qualification, vctx, ecam_offset, data));
 #endif
@@ -413,68 +437,92 @@ static bool pci_pio_select_fault_handle(size_t vcpu_id, uint16_t port_offset, si
     if (pio_fault_is_read(qualification)) {
         pio_emulate_read(qualification, vctx, pci_bus.pio_addr_value);
     } else {
+        /* Only string operations get here, other writes are coalesced */
         pci_bus.pio_addr_value = pio_get_write_data(qualification, vctx);
     }
 
     return true;
 }
 
-static bool pci_pio_data_fault_handle(size_t vcpu_id, uint16_t port_offset, size_t qualification,
-                                      seL4_VCPUContext *vctx, void *cookie)
+static bool pci_pio_select_coalesced_write(uint64_t port_offset, int access_width_bytes, uint64_t data, void *cookie)
 {
-    assert(!pio_fault_is_string_op(qualification));
+    pci_bus.pio_addr_value = data;
 
+    return true;
+}
+
+/* Find the device and config space offset selected by the address register, returns false
+ * if the access should be ignored. */
+static bool pci_pio_data_decode(uint16_t port_offset, int access_width_bytes, pci_dev_handle_t *handle,
+                                uint8_t *config_space_off)
+{
     if (!pci_pio_addr_reg_enable(pci_bus.pio_addr_value)) {
-        emulate_ioport_noop_access(qualification, vctx);
-        return true;
+        return false;
     }
 
     uint8_t bus = pci_pio_addr_reg_bus(pci_bus.pio_addr_value);
     uint8_t dev = pci_pio_addr_reg_dev(pci_bus.pio_addr_value);
     uint8_t func = pci_pio_addr_reg_func(pci_bus.pio_addr_value);
     if (bus >= PCI_NUM_BUS) {
-        emulate_ioport_noop_access(qualification, vctx);
-        return true;
+        return false;
     }
     if (dev >= PCI_DEV_PER_BUS) {
-        emulate_ioport_noop_access(qualification, vctx);
-        return true;
+        return false;
     }
     if (func >= PCI_FUNC_PER_DEV) {
-        emulate_ioport_noop_access(qualification, vctx);
-        return true;
+        return false;
     }
 
-    uint8_t config_space_off = pci_pio_addr_reg_offset(pci_bus.pio_addr_value) + port_offset;
-    int access_width_bytes = pio_fault_to_access_width_bytes(qualification);
+    *config_space_off = pci_pio_addr_reg_offset(pci_bus.pio_addr_value) + port_offset;
 
     /* Let's make sure that the access does not cross a 32 bits boundary. */
-    if (config_space_off % 4) {
-        if (config_space_off + access_width_bytes > ROUND_UP(config_space_off, 4)) {
+    if (*config_space_off % 4) {
+        if (*config_space_off + access_width_bytes > ROUND_UP(*config_space_off, 4)) {
             LOG_PCI_ERR("access crosses 32 bit boundary!\n");
         }
     }
 
-    bool success;
-    pci_dev_handle_t handle = pci_geo_addr_to_internal_index(bus, dev, func);
-    if (pio_fault_is_read(qualification)) {
-        uint64_t result = 0;
-        success = pci_ecam_emulate_access(handle, pio_fault_is_read(qualification), access_width_bytes,
-                                          config_space_off, &result);
+    *handle = pci_geo_addr_to_internal_index(bus, dev, func);
+    return true;
+}
 
-        /* pci_ecam_emulate_access() reads in multiple of 32-bit, so we must shift the answer to get
-         * the correct data. */
-        result >>= (config_space_off - ROUND_DOWN(config_space_off, 4)) * 8;
+static bool pci_pio_data_fault_handle(size_t vcpu_id, uint16_t port_offset, size_t qualification,
+                                      seL4_VCPUContext *vctx, void *cookie)
+{
+    assert(!pio_fault_is_string_op(qualification));
+    /* Writes are coalesced */
+    assert(pio_fault_is_read(qualification));
 
-        pio_emulate_read(qualification, vctx, result);
-    } else {
-        uint64_t data = pio_get_write_data(qualification, vctx);
-        success = pci_ecam_emulate_access(handle, pio_fault_is_read(qualification), access_width_bytes,
-                                          config_space_off, &data);
+    pci_dev_handle_t handle;
+    uint8_t config_space_off;
+    int access_width_bytes = pio_fault_to_access_width_bytes(qualification);
+    if (!pci_pio_data_decode(port_offset, access_width_bytes, &handle, &config_space_off)) {
+        emulate_ioport_noop_access(qualification, vctx);
+        return true;
     }
 
+    uint64_t result = 0;
+    bool success = pci_ecam_emulate_access(handle, true, access_width_bytes, config_space_off, &result);
+
+    /* pci_ecam_emulate_access() reads in multiple of 32-bit, so we must shift the answer to get
+     * the correct data. */
+    result >>= (config_space_off - ROUND_DOWN(config_space_off, 4)) * 8;
+
+    pio_emulate_read(qualification, vctx, result);
+
     return success;
 }
+
+static bool pci_pio_data_coalesced_write(uint64_t port_offset, int access_width_bytes, uint64_t data, void *cookie)
+{
+    pci_dev_handle_t handle;
+    uint8_t config_space_off;
+    if (!pci_pio_data_decode(port_offset, access_width_bytes, &handle, &config_space_off)) {
+        return true;
+    }
+
+    return pci_ecam_emulate_access(handle, false, access_width_bytes, config_space_off, &data);
+}
 #endif
 
 pci_dev_handle_t pci_register_device(uint8_t bus, uint8_t dev, uint8_t func, pci_device_register_data_t *device_data)
@@ -698,6 +746,60 @@ bool pci_register_device_mmio_bar(pci_dev_handle_t pci_dev_handle, uint8_t bar_i
     return true;
 }
 
+bool pci_register_device_memory_bar(pci_dev_handle_t pci_dev_handle, uint8_t bar_index, uint64_t gpa, uint64_t size)
+{
+    if (!pci_bus_initialised_check()) {
+        return false;
+    }
+
+    if (!pci_device_exist_check(pci_dev_handle)) {
+        return false;
+    }
+
+    if (!size || (size & (size - 1))) {
+        LOG_PCI_ERR("bar size 0x%lx is not a power of two\n", size);
+        return false;
+    }
+
+    if (gpa & (size - 1)) {
+        LOG_PCI_ERR("bar GPA 0x%lx is not aligned to its size 0x%lx\n", gpa, size);
+        return false;
+    }
+
+    // @billn handle 64-bit BARs
+    if (gpa + size > BIT(32)) {
+        LOG_PCI_ERR("bar [0x%lx..0x%lx) is not below 4GiB\n", gpa, gpa + size);
+        return false;
+    }
+
+    if (gpa < pci_bus.mmio_aperature.gpa || gpa + size > pci_bus.mmio_aperature.gpa + pci_bus.mmio_aperature.size) {
+        LOG_PCI_ERR("bar [0x%lx..0x%lx) is outside of the MMIO aperature\n", gpa, gpa + size);
+        return false;
+    }
+
+    if (bar_index >= PCI_NUM_BARS_PER_CONFIG_SPACE) {
+        LOG_PCI_ERR("bar index %u is out of bound\n", bar_index);
+        return false;
+    }
+
+    struct pci_device *pci_device = pci_get_device(pci_dev_handle);
+    if (pci_device->bars[bar_index].valid) {
+        LOG_PCI_ERR("bar index %u is is already registered for PCI device handle %d\n", bar_index, pci_dev_handle);
+        return false;
+    }
+
+    pci_device->bars[bar_index].valid = true;
+    pci_device->bars[bar_index].fixed = true;
+    pci_device->bars[bar_index].gpa = gpa;
+    pci_device->bars[bar_index].size = size;
+
+    /* Reads of the memory never have side effects. */
+    pci_device->config_space.bars[bar_index].prefetchable = 1;
+    pci_device->config_space.bars[bar_index].base_address = gpa >> 4;
+
+    return true;
+}
+
 bool pci_bus_get_mmio_aperature(uint64_t *mmio_aperature_gpa, uint64_t *mmio_aperature_size)
 {
     if (!pci_bus.initialised) {
@@ -737,19 +839,22 @@ bool pci_bus_init(uint64_t ecam_gpa, uint32_t ecam_size, uint64_t mmio_aperature
     }
 
 #if defined(CONFIG_ARCH_ARM)
-    if (!fault_register_vm_exception_handler(ecam_gpa, ecam_size, &pci_ecam_memory_fault_handle, NULL)) {
+    if (!fault_register_coalesced_vm_exception_handler(ecam_gpa, ecam_size, &pci_ecam_memory_fault_handle,
+                                                       &pci_ecam_coalesced_write, NULL)) {
         LOG_PCI_ERR("Could not register virtual memory fault handler for PCI ECAM area!\n");
         return false;
     }
 #elif defined(CONFIG_ARCH_X86)
     /* Don't care about ECAM on x86 for now, just do the PIO access mechanism #1 */
-    if (!fault_register_pio_exception_handler(PCI_CONFIG_ADDRESS_START_PORT, PCI_CONFIG_ADDRESS_PORT_SIZE,
-                                              pci_pio_select_fault_handle, NULL)) {
+    if (!fault_register_coalesced_pio_exception_handler(PCI_CONFIG_ADDRESS_START_PORT, PCI_CONFIG_ADDRESS_PORT_SIZE,
+                                                        pci_pio_select_fault_handle, pci_pio_select_coalesced_write,
+                                                        NULL)) {
         LOG_PCI_ERR("Could not register PIO fault handler for PCI mech #1 select register!\n");
         return false;
     }
-    if (!fault_register_pio_exception_handler(PCI_CONFIG_DATA_START_PORT, PCI_CONFIG_DATA_PORT_SIZE,
-                                              pci_pio_data_fault_handle, NULL)) {
+    if (!fault_register_coalesced_pio_exception_handler(PCI_CONFIG_DATA_START_PORT, PCI_CONFIG_DATA_PORT_SIZE,
+                                                        pci_pio_data_fault_handle, pci_pio_data_coalesced_write,
+                                                        NULL)) {
         LOG_PCI_ERR("Could not register PIO fault handler for PCI mech #1 data register!\n");
         return false;
     }
@@ -0,0 +1,687 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stddef.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/guest.h>
+#include <libvmm/guest_ram.h>
+#include <libvmm/virq.h>
+#include <libvmm/util/util.h>
+#include <libvmm/virtio/config.h>
+#include <libvmm/virtio/mmio.h>
+#include <libvmm/virtio/balloon.h>
+#include <libvmm/virtio/virtio.h>
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_BALLOON
+
+#if defined(DEBUG_BALLOON)
+#define LOG_BALLOON(...) do{ printf("VIRTIO(BALLOON): "); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_BALLOON(...) do{}while(0)
+#endif
+
+#define LOG_BALLOON_ERR(...) do{ printf("VIRTIO(BALLOON)|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+/* Features we offer in the first 32 feature bits */
+#define BALLOON_FEATURES (BIT_LOW(VIRTIO_BALLOON_F_MUST_TELL_HOST) | BIT_LOW(VIRTIO_BALLOON_F_STATS_VQ) \
+                          | BIT_LOW(VIRTIO_BALLOON_F_FREE_PAGE_HINT) | BIT_LOW(VIRTIO_BALLOON_F_REPORTING))
+
+/* PFNs read from an inflate or deflate buffer at a time */
+#define PFN_BATCH 64
+
+static inline struct virtio_balloon_device *device_state(struct virtio_device *dev)
+{
+    return (struct virtio_balloon_device *)dev->device_data;
+}
+
+static void virtio_balloon_features_print(uint32_t features)
+{
+    /* Dump the features given in a human-readable format */
+    LOG_BALLOON("Dumping features (0x%lx):\n", features);
+    LOG_BALLOON("feature VIRTIO_BALLOON_F_MUST_TELL_HOST set to %s\n",
+                BIT_LOW(VIRTIO_BALLOON_F_MUST_TELL_HOST) & features ? "true" : "false");
+    LOG_BALLOON("feature VIRTIO_BALLOON_F_STATS_VQ set to %s\n",
+                BIT_LOW(VIRTIO_BALLOON_F_STATS_VQ) & features ? "true" : "false");
+    LOG_BALLOON("feature VIRTIO_BALLOON_F_FREE_PAGE_HINT set to %s\n",
+                BIT_LOW(VIRTIO_BALLOON_F_FREE_PAGE_HINT) & features ? "true" : "false");
+    LOG_BALLOON("feature VIRTIO_BALLOON_F_REPORTING set to %s\n",
+                BIT_LOW(VIRTIO_BALLOON_F_REPORTING) & features ? "true" : "false");
+}
+
+/*
+ * Free map
+ */
+
+static void free_map_init(struct virtio_balloon_free_map *map)
+{
+    int num_regions;
+    struct guest_ram_region *regions = guest_ram_get_regions(&num_regions);
+
+    uint64_t num_pages = 0;
+    for (int i = 0; i < num_regions; i++) {
+        map->regions[i].gpa_start = regions[i].gpa_start;
+        map->regions[i].num_pages = regions[i].size / VIRTIO_BALLOON_PAGE_SIZE;
+        map->regions[i].first_page = num_pages;
+        num_pages += map->regions[i].num_pages;
+    }
+
+    map->num_regions = num_regions;
+    map->num_pages = num_pages;
+    map->words = (num_pages + 63) / 64;
+    map->generation = 0;
+    memset(map->count, 0, sizeof(map->count));
+    memset(map->bits, 0, VIRTIO_BALLOON_NUM_PAGE_STATES * map->words * sizeof(uint64_t));
+}
+
+static size_t free_map_bytes_needed(void)
+{
+    int num_regions;
+    struct guest_ram_region *regions = guest_ram_get_regions(&num_regions);
+
+    uint64_t ram_size = 0;
+    for (int i = 0; i < num_regions; i++) {
+        ram_size += regions[i].size;
+    }
+
+    return VIRTIO_BALLOON_FREE_MAP_SIZE(ram_size);
+}
+
+/* Set or clear bits [first, first + count) of a bitmap, returns how many bits changed */
+static uint64_t bitmap_update(uint64_t *bits, uint64_t first, uint64_t count, bool set)
+{
+    uint64_t changed = 0;
+    while (count > 0) {
+        uint64_t word = first / 64;
+        uint64_t shift = first % 64;
+        uint64_t n = MIN(count, 64 - shift);
+        uint64_t mask = (n == 64) ? ~0ull : ((1ull << n) - 1) << shift;
+
+        uint64_t old = bits[word];
+        bits[word] = set ? old | mask : old & ~mask;
+        changed += __builtin_popcountll(old ^ bits[word]);
+
+        first += n;
+        count -= n;
+    }
+    return changed;
+}
+
+/*
+ * Mark the whole pages within [gpa, gpa + size) as in `state` or not. Returns false if
+ * the range is not within one guest RAM region.
+ */
+static bool free_map_update(struct virtio_balloon_free_map *map, enum virtio_balloon_page_state state, uint64_t gpa,
+                            uint64_t size, bool set)
+{
+    for (uint32_t i = 0; i < map->num_regions; i++) {
+        struct virtio_balloon_free_map_region *region = &map->regions[i];
+        uint64_t region_end = region->gpa_start + region->num_pages * VIRTIO_BALLOON_PAGE_SIZE;
+        if (gpa < region->gpa_start || gpa >= region_end) {
+            continue;
+        }
+        if (size > region_end - gpa) {
+            return false;
+        }
+
+        /* Only pages the range covers completely */
+        uint64_t first = (gpa - region->gpa_start + VIRTIO_BALLOON_PAGE_SIZE - 1) / VIRTIO_BALLOON_PAGE_SIZE;
+        uint64_t end = (gpa + size - region->gpa_start) / VIRTIO_BALLOON_PAGE_SIZE;
+        if (end <= first) {
+            return true;
+        }
+
+        uint64_t *bits = virtio_balloon_free_map_bits(map, state);
+        uint64_t changed = bitmap_update(bits, region->first_page + first, end - first, set);
+        if (changed) {
+            map->count[state] = set ? map->count[state] + changed : map->count[state] - changed;
+            map->generation++;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static void free_map_clear(struct virtio_balloon_free_map *map, enum virtio_balloon_page_state state)
+{
+    if (map->count[state] == 0) {
+        return;
+    }
+    memset(virtio_balloon_free_map_bits(map, state), 0, map->words * sizeof(uint64_t));
+    map->count[state] = 0;
+    map->generation++;
+}
+
+static void notify_mm(struct virtio_balloon_device *balloon)
+{
+    if (balloon->mm_ch >= 0) {
+        microkit_notify((microkit_channel)balloon->mm_ch);
+    }
+}
+
+/*
+ * Device operations
+ */
+
+static void virtio_balloon_regs_init(struct virtio_device *dev)
+{
+    dev->regs.DeviceID = VIRTIO_DEVICE_ID_BALLOON;
+    dev->regs.VendorID = VIRTIO_DEV_VENDOR_ID;
+}
+
+/*
+ * Map queue indices to queue types for the given feature set. Optional queues are numbered only when
+ * their feature is present, so this is redone once the driver accepts features. Until then every
+ * offered queue is numbered so that all of them can be probed.
+ */
+static void virtio_balloon_vq_types_init(struct virtio_balloon_device *balloon, uint32_t features)
+{
+    int idx = 0;
+    balloon->vq_type[idx++] = VIRTIO_BALLOON_INFLATE_VQ;
+    balloon->vq_type[idx++] = VIRTIO_BALLOON_DEFLATE_VQ;
+    if (features & BIT_LOW(VIRTIO_BALLOON_F_STATS_VQ)) {
+        balloon->vq_type[idx++] = VIRTIO_BALLOON_STATS_VQ;
+    }
+    if (features & BIT_LOW(VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        balloon->vq_type[idx++] = VIRTIO_BALLOON_FREE_PAGE_VQ;
+    }
+    if (features & BIT_LOW(VIRTIO_BALLOON_F_REPORTING)) {
+        balloon->vq_type[idx++] = VIRTIO_BALLOON_REPORTING_VQ;
+    }
+    balloon->virtio_device.num_vqs = idx;
+}
+
+static void virtio_balloon_reset(struct virtio_device *dev)
+{
+    LOG_BALLOON("operation: reset device\n");
+
+    for (int i = 0; i < VIRTIO_BALLOON_NUM_VIRTQ; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        dev->vqs[i].virtq.avail_gpa = 0;
+        dev->vqs[i].virtq.used_gpa = 0;
+        dev->vqs[i].virtq.desc_gpa = 0;
+        dev->vqs[i].virtq.num = 0;
+    }
+
+    /* The guest owns all of its memory again */
+    struct virtio_balloon_device *balloon = device_state(dev);
+    uint64_t generation = balloon->free_map->generation;
+    for (int i = 0; i < VIRTIO_BALLOON_NUM_PAGE_STATES; i++) {
+        free_map_clear(balloon->free_map, i);
+    }
+    if (balloon->free_map->generation != generation) {
+        notify_mm(balloon);
+    }
+
+    balloon->config.actual = 0;
+    balloon->config.free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_STOP;
+    balloon->deflate_pending = false;
+    balloon->stats_pending = false;
+    balloon->hinting = false;
+    virtio_balloon_vq_types_init(balloon, BALLOON_FEATURES);
+
+    virtio_set_interrupt_status(dev, false, false);
+    memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
+    virtio_balloon_regs_init(dev);
+}
+
+static bool virtio_balloon_get_device_features(struct virtio_device *dev, uint32_t *features)
+{
+    LOG_BALLOON("operation: get device features\n");
+
+    switch (dev->regs.DeviceFeaturesSel) {
+    case 0:
+        *features = BALLOON_FEATURES;
+        break;
+    case 1:
+        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        break;
+    default:
+        *features = 0;
+    }
+
+    return true;
+}
+
+static bool virtio_balloon_set_driver_features(struct virtio_device *dev, uint32_t features)
+{
+    LOG_BALLOON("operation: set driver features\n");
+    virtio_balloon_features_print(features);
+
+    bool success = false;
+
+    switch (dev->regs.DriverFeaturesSel) {
+    // feature bits 0 to 31
+    case 0:
+        success = (features & ~BALLOON_FEATURES) == 0;
+        if (success) {
+            virtio_balloon_vq_types_init(device_state(dev), features);
+        }
+        break;
+    // features bits 32 to 63
+    case 1:
+        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        break;
+    default:
+        success = true;
+    }
+
+    if (success) {
+        dev->regs.DriverFeatures = features;
+        dev->features_happy = 1;
+        LOG_BALLOON("device is feature happy\n");
+    }
+
+    return success;
+}
+
+static bool virtio_balloon_get_device_config(struct virtio_device *dev, uint32_t offset, uint32_t *config)
+{
+    LOG_BALLOON("operation: get device config\n");
+
+    struct virtio_balloon_config *device_config = &device_state(dev)->config;
+    if (offset >= sizeof(struct virtio_balloon_config)) {
+        LOG_BALLOON_ERR("Unknown device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    *config = 0;
+    memcpy(config, (uint8_t *)device_config + offset,
+           MIN(sizeof(uint32_t), sizeof(struct virtio_balloon_config) - offset));
+
+    return true;
+}
+
+static bool virtio_balloon_set_device_config(struct virtio_device *dev, uint32_t offset, uint32_t config)
+{
+    LOG_BALLOON("operation: set device config\n");
+
+    /* The driver only updates how many pages it has put in the balloon */
+    if (offset != offsetof(struct virtio_balloon_config, actual)) {
+        LOG_BALLOON_ERR("Read-only device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    device_state(dev)->config.actual = config;
+    return true;
+}
+
+/*
+ * Virtqueue handling
+ */
+
+/* Mark the PFNs of an inflate or deflate buffer, returns false if it is malformed */
+static bool virtio_balloon_handle_pfns(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq,
+                                       uint16_t desc_head, bool inflate)
+{
+    uint64_t len = virtio_desc_chain_payload_len(vq, desc_head);
+    if (len % sizeof(uint32_t) != 0) {
+        LOG_BALLOON_ERR("PFN buffer of %lu bytes is not an array of PFNs\n", len);
+        return false;
+    }
+
+    uint32_t pfns[PFN_BATCH];
+    uint64_t num_pfns = len / sizeof(uint32_t);
+    for (uint64_t done = 0; done < num_pfns;) {
+        uint64_t n = MIN(num_pfns - done, PFN_BATCH);
+        if (!virtio_read_data_from_desc_chain(vq, desc_head, n * sizeof(uint32_t), done * sizeof(uint32_t),
+                                              (char *)pfns)) {
+            return false;
+        }
+
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t gpa = (uint64_t)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT;
+            if (!free_map_update(balloon->free_map, VIRTIO_BALLOON_PAGE_INFLATED, gpa, VIRTIO_BALLOON_PAGE_SIZE,
+                                 inflate)) {
+                LOG_BALLOON_ERR("PFN 0x%x is not in guest RAM\n", pfns[i]);
+            }
+        }
+        done += n;
+    }
+
+    return true;
+}
+
+static bool virtio_balloon_handle_inflate(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq)
+{
+    bool handled = false;
+    uint16_t desc_head;
+    while (virtio_virtq_pop_avail(vq, &desc_head)) {
+        virtio_balloon_handle_pfns(balloon, vq, desc_head, true);
+        virtio_virtq_add_used(vq, desc_head, 0);
+        handled = true;
+    }
+    return handled;
+}
+
+static bool virtio_balloon_handle_deflate(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq)
+{
+    bool handled = false;
+    uint16_t desc_head;
+    /* One request at a time, the memory manager has to return its pages before the guest uses them */
+    while (!balloon->deflate_pending && virtio_virtq_pop_avail(vq, &desc_head)) {
+        uint64_t generation = balloon->free_map->generation;
+        virtio_balloon_handle_pfns(balloon, vq, desc_head, false);
+
+        if (balloon->mm_ch >= 0 && balloon->free_map->generation != generation) {
+            balloon->deflate_pending = true;
+            balloon->deflate_head = desc_head;
+        } else {
+            virtio_virtq_add_used(vq, desc_head, 0);
+            handled = true;
+        }
+    }
+    return handled;
+}
+
+static bool virtio_balloon_handle_stats(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq)
+{
+    uint16_t desc_head;
+    if (balloon->stats_pending || !virtio_virtq_pop_avail(vq, &desc_head)) {
+        return false;
+    }
+
+    uint64_t len = virtio_desc_chain_payload_len(vq, desc_head);
+    struct virtio_balloon_stat stat;
+    for (uint64_t off = 0; off + sizeof(stat) <= len; off += sizeof(stat)) {
+        if (!virtio_read_data_from_desc_chain(vq, desc_head, sizeof(stat), off, (char *)&stat)) {
+            break;
+        }
+        /* Tags we do not know about are from newer drivers */
+        if (stat.tag < VIRTIO_BALLOON_S_NR) {
+            balloon->stats[stat.tag] = stat.val;
+            balloon->stats_valid |= BIT_LOW(stat.tag);
+        }
+    }
+
+    /* Keep the buffer, returning it is how we ask for the next stats */
+    balloon->stats_pending = true;
+    balloon->stats_head = desc_head;
+    return false;
+}
+
+/* Walk the descriptors of a chain, marking the pages each one covers */
+static bool virtio_balloon_mark_chain(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq,
+                                      uint16_t desc_head, enum virtio_balloon_page_state state)
+{
+    struct virtq *virtq = &vq->virtq;
+    struct virtq_desc *desc_ring = virtio_get_desc_ring(virtq);
+
+    uint16_t curr_desc = desc_head;
+    for (uint32_t i = 0; i <= virtq->num; i++) {
+        if (curr_desc >= virtq->num) {
+            break;
+        }
+
+        struct virtq_desc *desc = &desc_ring[curr_desc];
+        if (!free_map_update(balloon->free_map, state, desc->addr, desc->len, true)) {
+            LOG_BALLOON_ERR("range 0x%lx..0x%lx is not in guest RAM\n", desc->addr, desc->addr + desc->len);
+        }
+
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            return true;
+        }
+        curr_desc = desc->next;
+    }
+
+    LOG_BALLOON_ERR("bad descriptor chain starting at %u\n", desc_head);
+    return false;
+}
+
+static bool virtio_balloon_handle_free_page(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq)
+{
+    struct virtq_desc *desc_ring = virtio_get_desc_ring(&vq->virtq);
+
+    bool handled = false;
+    uint16_t desc_head;
+    while (virtio_virtq_pop_avail(vq, &desc_head)) {
+        if (desc_head < vq->virtq.num && !(desc_ring[desc_head].flags & VIRTQ_DESC_F_WRITE)) {
+            /* Command ID the driver is starting or stopping a run for */
+            uint32_t cmd_id;
+            if (virtio_read_data_from_desc_chain(vq, desc_head, sizeof(cmd_id), 0, (char *)&cmd_id)) {
+                balloon->hinting = cmd_id != VIRTIO_BALLOON_CMD_ID_STOP
+                                   && cmd_id == balloon->config.free_page_hint_cmd_id;
+            }
+        } else if (balloon->hinting) {
+            virtio_balloon_mark_chain(balloon, vq, desc_head, VIRTIO_BALLOON_PAGE_HINTED);
+        }
+
+        virtio_virtq_add_used(vq, desc_head, 0);
+        handled = true;
+    }
+    return handled;
+}
+
+static bool virtio_balloon_handle_reporting(struct virtio_balloon_device *balloon, virtio_queue_handler_t *vq)
+{
+    bool handled = false;
+    uint16_t desc_head;
+    while (virtio_virtq_pop_avail(vq, &desc_head)) {
+        virtio_balloon_mark_chain(balloon, vq, desc_head, VIRTIO_BALLOON_PAGE_REPORTED);
+        virtio_virtq_add_used(vq, desc_head, 0);
+        handled = true;
+    }
+    return handled;
+}
+
+static bool virtio_balloon_queue_notify(struct virtio_device *dev)
+{
+    struct virtio_balloon_device *balloon = device_state(dev);
+    uint64_t generation = balloon->free_map->generation;
+
+    bool handled = false;
+    for (int i = 0; i < dev->num_vqs; i++) {
+        virtio_queue_handler_t *vq = &dev->vqs[i];
+        if (!vq->ready) {
+            continue;
+        }
+
+        switch (balloon->vq_type[i]) {
+        case VIRTIO_BALLOON_INFLATE_VQ:
+            handled |= virtio_balloon_handle_inflate(balloon, vq);
+            break;
+        case VIRTIO_BALLOON_DEFLATE_VQ:
+            handled |= virtio_balloon_handle_deflate(balloon, vq);
+            break;
+        case VIRTIO_BALLOON_STATS_VQ:
+            handled |= virtio_balloon_handle_stats(balloon, vq);
+            break;
+        case VIRTIO_BALLOON_FREE_PAGE_VQ:
+            handled |= virtio_balloon_handle_free_page(balloon, vq);
+            break;
+        case VIRTIO_BALLOON_REPORTING_VQ:
+            handled |= virtio_balloon_handle_reporting(balloon, vq);
+            break;
+        }
+    }
+
+    if (balloon->free_map->generation != generation) {
+        notify_mm(balloon);
+    }
+
+    if (handled) {
+        virtio_set_interrupt_status(dev, true, false);
+        return virtio_inject_interrupt(dev);
+    }
+
+    return true;
+}
+
+/* Queue index of a virtqueue, -1 if the driver did not negotiate it */
+static int virtio_balloon_vq_index(struct virtio_balloon_device *balloon, uint8_t type)
+{
+    for (int i = 0; i < balloon->virtio_device.num_vqs; i++) {
+        if (balloon->vq_type[i] == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool virtio_balloon_config_changed(struct virtio_balloon_device *balloon)
+{
+    struct virtio_device *dev = &balloon->virtio_device;
+    dev->regs.ConfigGeneration++;
+    virtio_set_interrupt_status(dev, false, true);
+    return virtio_inject_interrupt(dev);
+}
+
+bool virtio_balloon_set_target(struct virtio_balloon_device *balloon, uint32_t num_pages)
+{
+    uint64_t max_pages = balloon->free_map->num_pages;
+    if (num_pages > max_pages) {
+        LOG_BALLOON_ERR("target of %u pages is more than the %lu pages of guest RAM\n", num_pages, max_pages);
+        return false;
+    }
+
+    balloon->config.num_pages = num_pages;
+    return virtio_balloon_config_changed(balloon);
+}
+
+bool virtio_balloon_request_stats(struct virtio_balloon_device *balloon)
+{
+    int idx = virtio_balloon_vq_index(balloon, VIRTIO_BALLOON_STATS_VQ);
+    if (idx < 0 || !balloon->stats_pending) {
+        /* The driver does not report stats, or has not given us its buffer yet */
+        return false;
+    }
+
+    balloon->stats_pending = false;
+    virtio_virtq_add_used(&balloon->vqs[idx], balloon->stats_head, 0);
+    virtio_set_interrupt_status(&balloon->virtio_device, true, false);
+    return virtio_inject_interrupt(&balloon->virtio_device);
+}
+
+bool virtio_balloon_free_page_hint_start(struct virtio_balloon_device *balloon)
+{
+    if (virtio_balloon_vq_index(balloon, VIRTIO_BALLOON_FREE_PAGE_VQ) < 0) {
+        return false;
+    }
+
+    /* A fresh ID, so hints of an earlier run are not mistaken for this one's */
+    balloon->config.free_page_hint_cmd_id = balloon->next_hint_cmd_id++;
+    if (balloon->next_hint_cmd_id < VIRTIO_BALLOON_CMD_ID_MIN) {
+        balloon->next_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_MIN;
+    }
+    balloon->hinting = false;
+
+    return virtio_balloon_config_changed(balloon);
+}
+
+bool virtio_balloon_free_page_hint_done(struct virtio_balloon_device *balloon)
+{
+    if (virtio_balloon_vq_index(balloon, VIRTIO_BALLOON_FREE_PAGE_VQ) < 0) {
+        return false;
+    }
+
+    balloon->config.free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+    balloon->hinting = false;
+
+    uint64_t generation = balloon->free_map->generation;
+    free_map_clear(balloon->free_map, VIRTIO_BALLOON_PAGE_HINTED);
+    if (balloon->free_map->generation != generation) {
+        notify_mm(balloon);
+    }
+
+    return virtio_balloon_config_changed(balloon);
+}
+
+bool virtio_balloon_mm_ack(struct virtio_balloon_device *balloon)
+{
+    if (!balloon->deflate_pending) {
+        return true;
+    }
+
+    int idx = virtio_balloon_vq_index(balloon, VIRTIO_BALLOON_DEFLATE_VQ);
+    balloon->deflate_pending = false;
+    virtio_virtq_add_used(&balloon->vqs[idx], balloon->deflate_head, 0);
+    virtio_set_interrupt_status(&balloon->virtio_device, true, false);
+    if (!virtio_inject_interrupt(&balloon->virtio_device)) {
+        return false;
+    }
+
+    /* Deflate requests that queued up behind this one */
+    return virtio_balloon_queue_notify(&balloon->virtio_device);
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_balloon_reset,
+    .get_device_features = virtio_balloon_get_device_features,
+    .set_driver_features = virtio_balloon_set_driver_features,
+    .get_device_config = virtio_balloon_get_device_config,
+    .set_device_config = virtio_balloon_set_device_config,
+    .queue_notify = virtio_balloon_queue_notify,
+};
+
+static struct virtio_device *virtio_balloon_init(struct virtio_balloon_device *balloon, virtio_transport_type_t type,
+                                                 irq_routing_info_t irq_routing_info,
+                                                 struct virtio_balloon_free_map *free_map, size_t free_map_size,
+                                                 int mm_ch)
+{
+    if (free_map_size < free_map_bytes_needed()) {
+        LOG_BALLOON_ERR("free map of 0x%lx bytes is too small, guest RAM needs 0x%lx bytes\n", free_map_size,
+                        free_map_bytes_needed());
+        return NULL;
+    }
+
+    struct virtio_device *dev = &balloon->virtio_device;
+
+    dev->transport_type = type;
+    dev->funs = &functions;
+    dev->vqs = balloon->vqs;
+    dev->irq_routing_info = irq_routing_info;
+    dev->device_data = balloon;
+    virtio_balloon_regs_init(dev);
+
+    memset(&balloon->config, 0, sizeof(balloon->config));
+    balloon->config.free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_STOP;
+    balloon->free_map = free_map;
+    balloon->mm_ch = mm_ch;
+    balloon->deflate_pending = false;
+    balloon->stats_pending = false;
+    balloon->stats_valid = 0;
+    balloon->hinting = false;
+    balloon->next_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_MIN;
+    virtio_balloon_vq_types_init(balloon, BALLOON_FEATURES);
+
+    free_map_init(free_map);
+
+    return dev;
+}
+
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_balloon_init(struct virtio_balloon_device *balloon, uintptr_t region_base, uintptr_t region_size,
+                              irq_routing_info_t irq_routing_info, struct virtio_balloon_free_map *free_map,
+                              size_t free_map_size, int mm_ch)
+{
+    struct virtio_device *dev = virtio_balloon_init(balloon, VIRTIO_TRANSPORT_MMIO, irq_routing_info, free_map,
+                                                    free_map_size, mm_ch);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+#endif
+
+bool virtio_pci_balloon_init(struct virtio_balloon_device *balloon, uint16_t pci_bus, uint16_t pci_dev,
+                             irq_routing_info_t irq_routing_info, struct virtio_balloon_free_map *free_map,
+                             size_t free_map_size, int mm_ch)
+{
+    struct virtio_device *dev = virtio_balloon_init(balloon, VIRTIO_TRANSPORT_PCI, irq_routing_info, free_map,
+                                                    free_map_size, mm_ch);
+    if (!dev) {
+        return false;
+    }
+
+    dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_BALLOON;
+    dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
+    dev->transport.pci.device_class = PCI_CLASS_OTHERS;
+
+    return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
+}
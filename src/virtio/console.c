@@ -12,6 +12,7 @@
 #include <libvmm/virtio/console.h>
 #include <libvmm/virtio/virtio.h>
 #include <sddf/serial/queue.h>
+#include <sddf/util/fence.h>
 
 /* Uncomment this to enable debug logging */
 // #define DEBUG_CONSOLE
@@ -29,6 +30,23 @@ static inline struct virtio_console_device *device_state(struct virtio_device *d
     return (struct virtio_console_device *)dev->device_data;
 }
 
+/* Port 0 uses the first two virtqueues, the others come after the control virtqueues */
+static inline uint32_t port_rx_vq(uint32_t port)
+{
+    return port == 0 ? RX_QUEUE : 2 * (port + 1);
+}
+
+static inline uint32_t port_tx_vq(uint32_t port)
+{
+    return port_rx_vq(port) + 1;
+}
+
+/* Number of ports the guest can currently use */
+static inline uint32_t active_ports(struct virtio_console_device *console)
+{
+    return console->multiport_enabled ? console->num_ports : 1;
+}
+
 static void virtio_console_features_print(uint32_t features)
 {
     /* Dump the features given in a human-readable format */
@@ -60,6 +78,12 @@ static void virtio_console_reset(struct virtio_device *dev)
         dev->vqs[i].virtq.num = 0;
     }
 
+    struct virtio_console_device *console = device_state(dev);
+    memset(console->port_state, 0, sizeof(console->port_state));
+    console->multiport_enabled = false;
+    console->ctrl_pending_head = 0;
+    console->ctrl_pending_tail = 0;
+
     virtio_set_interrupt_status(dev, false, false);
     memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
     virtio_console_regs_init(dev);
@@ -71,7 +95,7 @@ static bool virtio_console_get_device_features(struct virtio_device *dev, uint32
 
     switch (dev->regs.DeviceFeaturesSel) {
     case 0:
-        *features = 0;
+        *features = device_state(dev)->multiport ? BIT_LOW(VIRTIO_CONSOLE_F_MULTIPORT) : 0;
         break;
     case 1:
         *features = BIT_HIGH(VIRTIO_F_VERSION_1);
@@ -89,14 +113,20 @@ static bool virtio_console_set_driver_features(struct virtio_device *dev, uint32
     LOG_CONSOLE("operation: set driver features\n");
     virtio_console_features_print(features);
 
+    struct virtio_console_device *console = device_state(dev);
     bool success = false;
 
     switch (dev->regs.DriverFeaturesSel) {
     // feature bits 0 to 31
-    case 0:
-        /* We do not offer any features in the first 32-bit bits */
-        success = (features == 0);
+    case 0: {
+        /* MULTIPORT is the only feature we may offer in the first 32-bit bits */
+        uint32_t offered = console->multiport ? BIT_LOW(VIRTIO_CONSOLE_F_MULTIPORT) : 0;
+        success = (features & ~offered) == 0;
+        if (success) {
+            console->multiport_enabled = (features & BIT_LOW(VIRTIO_CONSOLE_F_MULTIPORT)) != 0;
+        }
         break;
+    }
     // features bits 32 to 63
     case 1:
         success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
@@ -117,7 +147,18 @@ static bool virtio_console_set_driver_features(struct virtio_device *dev, uint32
 static bool virtio_console_get_device_config(struct virtio_device *dev, uint32_t offset, uint32_t *config)
 {
     LOG_CONSOLE("operation: get device config\n");
-    return false;
+
+    struct virtio_console_config *device_config = &device_state(dev)->config;
+    if (offset >= sizeof(struct virtio_console_config)) {
+        LOG_CONSOLE_ERR("Unknown device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    *config = 0;
+    memcpy(config, (uint8_t *)device_config + offset,
+           MIN(sizeof(uint32_t), sizeof(struct virtio_console_config) - offset));
+
+    return true;
 }
 
 static bool virtio_console_set_device_config(struct virtio_device *dev, uint32_t offset, uint32_t config)
@@ -126,162 +167,321 @@ static bool virtio_console_set_device_config(struct virtio_device *dev, uint32_t
     return false;
 }
 
-static bool virtio_console_handle_tx(struct virtio_device *dev)
+static void virtio_console_ctrl_queue(struct virtio_console_device *console, uint32_t id, uint16_t event,
+                                      uint16_t value)
 {
-    LOG_CONSOLE("operation: handle transmit\n");
-
-    if (dev->regs.QueueSel != TX_QUEUE) {
-        return true;
+    if (console->ctrl_pending_tail - console->ctrl_pending_head == VIRTIO_CONSOLE_CTRL_PENDING) {
+        LOG_CONSOLE_ERR("control message queue full, dropping event %u for port %u\n", event, id);
+        return;
     }
 
-    struct virtio_queue_handler *vq = &dev->vqs[TX_QUEUE];
+    struct virtio_console_control *msg =
+        &console->ctrl_pending[console->ctrl_pending_tail % VIRTIO_CONSOLE_CTRL_PENDING];
+    msg->id = id;
+    msg->event = event;
+    msg->value = value;
+    console->ctrl_pending_tail++;
+}
+
+/* Hand pending control messages to the guest for as long as it has control RX buffers */
+static bool virtio_console_ctrl_flush(struct virtio_console_device *console)
+{
+    struct virtio_queue_handler *vq = &console->virtio_device.vqs[CTL_RX_QUEUE];
     if (!vq->ready) {
-        LOG_VMM_ERR("virtio console TX vq not ready!\n");
-        return true;
+        return false;
     }
 
-    struct virtio_console_device *console = device_state(dev);
-
-    /* Transmit all available descriptors possible */
-    LOG_CONSOLE("processing available buffers from index [0x%lx..0x%lx)\n", vq->last_idx, vq->virtq.avail->idx);
     bool transferred = false;
     uint16_t desc_head;
-    while (virtio_virtq_peek_avail(vq, &desc_head)) {
+    while (console->ctrl_pending_head != console->ctrl_pending_tail && virtio_virtq_peek_avail(vq, &desc_head)) {
+        struct virtio_console_control *msg =
+            &console->ctrl_pending[console->ctrl_pending_head % VIRTIO_CONSOLE_CTRL_PENDING];
+
+        /* The name of a port directly follows the header, without a terminator */
+        const char *name = NULL;
+        uint32_t name_len = 0;
+        if (msg->event == VIRTIO_CONSOLE_PORT_NAME) {
+            name = console->ports[msg->id].name;
+            name_len = strnlen(name, VIRTIO_CONSOLE_PORT_NAME_MAX);
+        }
+
         uint64_t payload_len = virtio_desc_chain_payload_len(vq, desc_head);
+        if (payload_len < sizeof(*msg) + name_len) {
+            LOG_CONSOLE_ERR("control RX buffer of 0x%lx bytes too small for event %u\n", payload_len, msg->event);
+            virtio_virtq_add_used(vq, desc_head, 0);
+        } else {
+            assert(virtio_write_data_to_desc_chain(vq, desc_head, sizeof(*msg), 0, (char *)msg));
+            if (name_len) {
+                assert(virtio_write_data_to_desc_chain(vq, desc_head, name_len, sizeof(*msg), (char *)name));
+            }
+            virtio_virtq_add_used(vq, desc_head, sizeof(*msg) + name_len);
+        }
 
-        if (payload_len > console->txq->capacity) {
-            // @billn, fix properly by partial TX, bookkeep, then continue once serial virt notifies?
-            LOG_CONSOLE_ERR(
-                "payload length 0x%lx bytes of desciptor %u is larger than serial TX queue capacity of 0x%x bytes\n",
-                payload_len, desc_head, console->txq->capacity);
-            assert(false);
+        virtio_virtq_pop_avail(vq, &desc_head);
+        console->ctrl_pending_head++;
+        transferred = true;
+    }
+
+    return transferred;
+}
+
+static void virtio_console_handle_ctrl_msg(struct virtio_console_device *console, struct virtio_console_control *msg)
+{
+    LOG_CONSOLE("control event %u for port %u with value %u\n", msg->event, msg->id, msg->value);
+
+    if (msg->event == VIRTIO_CONSOLE_DEVICE_READY) {
+        if (msg->value != 1) {
+            LOG_CONSOLE_ERR("guest driver failed to set up the device\n");
+            return;
+        }
+        for (uint32_t port = 0; port < console->num_ports; port++) {
+            virtio_console_ctrl_queue(console, port, VIRTIO_CONSOLE_PORT_ADD, 0);
         }
+        return;
+    }
 
-        uint32_t serial_txq_free_len = serial_queue_free(console->txq);
+    if (msg->id >= console->num_ports) {
+        LOG_CONSOLE_ERR("control event %u for invalid port %u\n", msg->event, msg->id);
+        return;
+    }
+    struct virtio_console_port_state *state = &console->port_state[msg->id];
 
-        if (payload_len > serial_txq_free_len) {
-            /* Can't consume this descriptor in full for now, just wait for serial TXQ to drain. */
-            LOG_CONSOLE("payload length 0x%lx bytes of desciptor %u is larger than serial TX queue contiguous free "
-                        "length of 0x%lx bytes, won't consume for now.\n",
-                        payload_len, desc_head, serial_txq_free_len);
-            serial_request_consumer_signal(console->txq);
-            break;
+    switch (msg->event) {
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (msg->value != 1) {
+            LOG_CONSOLE_ERR("guest driver failed to set up port %u\n", msg->id);
+            return;
         }
-        /* Ok there is enough space in TX queue for this descriptor */
+        state->ready = true;
+        if (msg->id == 0) {
+            virtio_console_ctrl_queue(console, msg->id, VIRTIO_CONSOLE_CON_PORT, 1);
+        } else if (console->ports[msg->id].name) {
+            virtio_console_ctrl_queue(console, msg->id, VIRTIO_CONSOLE_PORT_NAME, 1);
+        }
+        /* Our end of every port is always connected */
+        virtio_console_ctrl_queue(console, msg->id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        state->guest_open = (msg->value != 0);
+        break;
+    default:
+        LOG_CONSOLE_ERR("unexpected control event %u for port %u\n", msg->event, msg->id);
+        break;
+    }
+}
+
+static bool virtio_console_handle_ctrl(struct virtio_console_device *console)
+{
+    if (!console->multiport_enabled) {
+        return false;
+    }
 
-        uint32_t serial_txq_contiguous_free_len = serial_queue_contiguous_free(console->txq);
-        bool copy_twice = false;
-        if (payload_len > serial_txq_contiguous_free_len) {
-            /* Handle case where the free space wraps around */
-            copy_twice = true;
+    bool transferred = false;
+    struct virtio_queue_handler *vq = &console->virtio_device.vqs[CTL_TX_QUEUE];
+    if (vq->ready) {
+        uint16_t desc_head;
+        while (virtio_virtq_pop_avail(vq, &desc_head)) {
+            struct virtio_console_control msg;
+            if (virtio_desc_chain_payload_len(vq, desc_head) < sizeof(msg)) {
+                LOG_CONSOLE_ERR("control TX buffer too small for a control message\n");
+            } else {
+                assert(virtio_read_data_from_desc_chain(vq, desc_head, sizeof(msg), 0, (char *)&msg));
+                virtio_console_handle_ctrl_msg(console, &msg);
+            }
+            virtio_virtq_add_used(vq, desc_head, 0);
+            transferred = true;
         }
+    }
+
+    return virtio_console_ctrl_flush(console) || transferred;
+}
+
+/*
+ * Move as much of the descriptor chain, starting `offset` bytes in, as currently fits into
+ * the serial TX queue. The free space is filled in at most two runs, as it may wrap around
+ * the end of the data region.
+ */
+static uint32_t virtio_console_tx_copy(struct virtio_console_port *port, struct virtio_queue_handler *vq,
+                                       uint16_t desc_head, uint32_t offset, uint32_t len)
+{
+    serial_queue_handle_t *txq = port->txq;
+    uint32_t local_tail = txq->queue->tail;
+
+    uint32_t copy_len = MIN(len, serial_queue_free(txq));
+    uint32_t bytes_copied = 0;
+    while (bytes_copied < copy_len) {
+        uint32_t txq_offset = (local_tail + bytes_copied) % txq->capacity;
+        uint32_t run_len = MIN(copy_len - bytes_copied, txq->capacity - txq_offset);
+        assert(virtio_read_data_from_desc_chain(vq, desc_head, run_len, offset + bytes_copied,
+                                                txq->data_region + txq_offset));
+        bytes_copied += run_len;
+    }
+
+    if (bytes_copied) {
+        serial_update_shared_tail(txq, local_tail + bytes_copied);
+    }
+
+    return bytes_copied;
+}
+
+static bool virtio_console_handle_tx(struct virtio_console_device *console, uint32_t port_idx)
+{
+    LOG_CONSOLE("operation: handle transmit on port %u\n", port_idx);
+
+    struct virtio_queue_handler *vq = &console->virtio_device.vqs[port_tx_vq(port_idx)];
+    if (!vq->ready) {
+        return false;
+    }
+
+    struct virtio_console_port *port = &console->ports[port_idx];
+    struct virtio_console_port_state *state = &console->port_state[port_idx];
 
-        uint32_t bytes_copied = 0;
-        uint32_t local_tail = console->txq->queue->tail;
-
-        /* Copy data until no more to copy or until the queue wraps around */
-        char *serial_txq_dest = (char *)(console->txq->data_region + (local_tail % console->txq->capacity));
-        uint32_t copy_len = MIN(payload_len, serial_txq_contiguous_free_len);
-        assert(virtio_read_data_from_desc_chain(vq, desc_head, copy_len, bytes_copied, serial_txq_dest));
-        bytes_copied += copy_len;
-
-        if (copy_twice) {
-            /* Need to copy more data after the queue wraps around */
-            serial_txq_dest = (char *)(console->txq->data_region
-                                       + ((local_tail + bytes_copied) % console->txq->capacity));
-            copy_len = payload_len - bytes_copied;
-            assert(virtio_read_data_from_desc_chain(vq, desc_head, copy_len, bytes_copied, serial_txq_dest));
-            bytes_copied += copy_len;
+    /*
+     * Transmit all available descriptors possible. A chain that does not fit into the
+     * serial TX queue is streamed into it as space frees up, with tx_progress recording
+     * how much of the chain at the head of the avail ring has been sent so far.
+     */
+    LOG_CONSOLE("processing available buffers from index [0x%lx..0x%lx)\n", vq->last_idx, vq->virtq.avail->idx);
+    bool transferred = false;
+    bool enqueued = false;
+    uint16_t desc_head;
+    while (virtio_virtq_peek_avail(vq, &desc_head)) {
+        uint64_t payload_len = virtio_desc_chain_payload_len(vq, desc_head);
+        if (state->tx_progress > payload_len) {
+            /* The guest shortened the chain while we were part way through sending it. What has
+             * been sent cannot be taken back, so consider the chain done. */
+            LOG_CONSOLE_ERR("descriptor %u shrunk to 0x%lx bytes after 0x%x bytes were sent, completing it\n",
+                            desc_head, payload_len, state->tx_progress);
+            state->tx_progress = 0;
+            virtio_virtq_add_used(vq, desc_head, 0);
+            virtio_virtq_pop_avail(vq, &desc_head);
+            transferred = true;
+            continue;
         }
 
-        assert(bytes_copied == payload_len);
-        serial_update_shared_tail(console->txq, local_tail + bytes_copied);
+        uint32_t bytes_copied = virtio_console_tx_copy(port, vq, desc_head, state->tx_progress,
+                                                       payload_len - state->tx_progress);
+        state->tx_progress += bytes_copied;
+        enqueued |= (bytes_copied != 0);
+
+        if (state->tx_progress < payload_len) {
+            /* Serial TX queue is full, continue once the serial virtualiser has drained some of it */
+            LOG_CONSOLE("descriptor %u sent 0x%x of 0x%lx bytes, waiting for serial TX queue to drain\n", desc_head,
+                        state->tx_progress, payload_len);
+            serial_request_consumer_signal(port->txq);
+            if (serial_queue_free(port->txq) == 0) {
+                break;
+            }
+            /* Space was freed before the signal request was seen */
+            serial_cancel_consumer_signal(port->txq);
+            continue;
+        }
 
-        LOG_CONSOLE("processed descriptor %u with content: %s\n", desc_head, serial_txq_dest);
+        LOG_CONSOLE("processed descriptor %u of 0x%lx bytes\n", desc_head, payload_len);
 
+        state->tx_progress = 0;
         virtio_virtq_add_used(vq, desc_head, 0);
         virtio_virtq_pop_avail(vq, &desc_head);
         transferred = true;
     }
 
-    /* While unlikely, it is possible that we could not consume any of the
-     * available data. In this case we do not set the IRQ status. */
-    if (transferred) {
-        virtio_set_interrupt_status(dev, true, false);
-        bool success = virtio_inject_interrupt(dev);
+    if (enqueued) {
+        microkit_notify(port->tx_ch);
+    }
+
+    return transferred;
+}
 
-        microkit_notify(console->tx_ch);
-        return success;
+/*
+ * Move as much of the serial RX queue as fits into the descriptor chain. The queue's data
+ * is copied in at most two runs, as it may wrap around the end of the data region.
+ */
+static uint32_t virtio_console_rx_copy(struct virtio_console_port *port, struct virtio_queue_handler *vq,
+                                       uint16_t desc_head, uint64_t payload_len)
+{
+    serial_queue_handle_t *rxq = port->rxq;
+    uint32_t local_head = rxq->queue->head;
+    uint32_t rxq_len = rxq->queue->tail - local_head;
+    /* Make sure the data is read only after the tail that covers it */
+    THREAD_MEMORY_ACQUIRE();
+
+    uint32_t copy_len = MIN(rxq_len, payload_len);
+    uint32_t bytes_copied = 0;
+    while (bytes_copied < copy_len) {
+        uint32_t offset = (local_head + bytes_copied) % rxq->capacity;
+        uint32_t run_len = MIN(copy_len - bytes_copied, rxq->capacity - offset);
+        assert(virtio_write_data_to_desc_chain(vq, desc_head, run_len, bytes_copied, rxq->data_region + offset));
+        bytes_copied += run_len;
     }
 
-    return true;
+    serial_update_shared_head(rxq, local_head + bytes_copied);
+
+    return bytes_copied;
 }
 
-static bool virtio_console_handle_rx(struct virtio_console_device *console)
+static bool virtio_console_handle_rx(struct virtio_console_device *console, uint32_t port_idx)
 {
-    LOG_CONSOLE("operation: handle rx\n");
-    assert(console->virtio_device.num_vqs > RX_QUEUE);
+    LOG_CONSOLE("operation: handle rx on port %u\n", port_idx);
+
+    struct virtio_console_port *port = &console->ports[port_idx];
 
     /* Used to know whether to set the IRQ status. */
     bool transferred = false;
 
-    struct virtio_queue_handler *vq = &console->virtio_device.vqs[RX_QUEUE];
-    if (!vq->ready) {
+    struct virtio_queue_handler *vq = &console->virtio_device.vqs[port_rx_vq(port_idx)];
+    if (!vq->ready || port_idx >= active_ports(console)) {
         /*
          * It is valid for RX from the real device before the guest has
          * started, so just dequeue all data and early return.
          */
-        char c;
-        while (serial_dequeue(console->rxq, &c) == 0);
+        serial_update_shared_head(port->rxq, port->rxq->queue->tail);
 
-        if (serial_require_consumer_signal(console->rxq)) {
-            serial_cancel_consumer_signal(console->rxq);
-            microkit_notify(console->rx_ch);
+        if (serial_require_consumer_signal(port->rxq)) {
+            serial_cancel_consumer_signal(port->rxq);
+            microkit_notify(port->rx_ch);
         }
 
-        return true;
+        return false;
     }
 
     LOG_CONSOLE("processing available buffers from index [0x%lx..0x%lx)\n", vq->last_idx, vq->virtq.avail->idx);
     uint16_t desc_head;
-    while (!serial_queue_empty(console->rxq, console->rxq->queue->head) && virtio_virtq_pop_avail(vq, &desc_head)) {
+    while (!serial_queue_empty(port->rxq, port->rxq->queue->head) && virtio_virtq_pop_avail(vq, &desc_head)) {
         transferred = true;
         uint64_t payload_len = virtio_desc_chain_payload_len(vq, desc_head);
-
-        uint32_t bytes_written = 0;
-        char c;
-        while (bytes_written < payload_len && serial_dequeue(console->rxq, &c) == 0) {
-            assert(virtio_write_data_to_desc_chain(vq, desc_head, 1, bytes_written, &c));
-            bytes_written++;
-        }
-
+        uint32_t bytes_written = virtio_console_rx_copy(port, vq, desc_head, payload_len);
         virtio_virtq_add_used(vq, desc_head, bytes_written);
     }
 
-    if (serial_require_consumer_signal(console->rxq)) {
-        serial_cancel_consumer_signal(console->rxq);
-        microkit_notify(console->rx_ch);
+    if (serial_require_consumer_signal(port->rxq)) {
+        serial_cancel_consumer_signal(port->rxq);
+        microkit_notify(port->rx_ch);
+    }
+
+    return transferred;
+}
+
+bool virtio_console_queue_notify(struct virtio_console_device *console)
+{
+    /* The guest kicked a queue or a serial virtualiser notified us, check if we can TX/RX any data. */
+    bool transferred = virtio_console_handle_ctrl(console);
+    for (uint32_t port = 0; port < console->num_ports; port++) {
+        transferred |= virtio_console_handle_rx(console, port);
+        if (port < active_ports(console)) {
+            transferred |= virtio_console_handle_tx(console, port);
+        }
     }
 
     /* While unlikely, it is possible that we could not consume any of the
      * available data. In this case we do not set the IRQ status. */
     if (transferred) {
         virtio_set_interrupt_status(&console->virtio_device, true, false);
-        bool success = virtio_inject_interrupt(&console->virtio_device);
-        return success;
+        return virtio_inject_interrupt(&console->virtio_device);
     }
 
     return true;
 }
 
-bool virtio_console_queue_notify(struct virtio_console_device *console)
-{
-    /* The guest kicked the queue or the serial virtualiser notified us, check if we can TX/RX any data. */
-    bool rx_success = virtio_console_handle_rx(console);
-    bool tx_success = virtio_console_handle_tx(&console->virtio_device);
-    return rx_success && tx_success;
-}
-
 /* @billn revisit type juggling */
 static bool virtio_console_queue_notify_guest(struct virtio_device *dev)
 {
@@ -298,49 +498,104 @@ virtio_device_funs_t functions = {
 };
 
 static struct virtio_device *virtio_console_init(struct virtio_console_device *console, virtio_transport_type_t type,
-                                                 irq_routing_info_t irq_routing_info, serial_queue_handle_t *rxq,
-                                                 serial_queue_handle_t *txq, int tx_ch, int rx_ch)
+                                                 irq_routing_info_t irq_routing_info,
+                                                 struct virtio_console_port *ports, uint32_t num_ports,
+                                                 bool multiport)
 {
+    if (num_ports == 0 || num_ports > VIRTIO_CONSOLE_MAX_PORTS) {
+        LOG_CONSOLE_ERR("invalid number of ports %u, must be between 1 and %u\n", num_ports,
+                        VIRTIO_CONSOLE_MAX_PORTS);
+        return NULL;
+    }
+
     struct virtio_device *dev = &console->virtio_device;
 
     dev->transport_type = type;
     dev->funs = &functions;
     dev->vqs = console->vqs;
-    dev->num_vqs = VIRTIO_CONSOLE_NUM_VIRTQ;
+    dev->num_vqs = multiport ? port_tx_vq(num_ports - 1) + 1 : VIRTIO_CONSOLE_NUM_VIRTQ;
     dev->irq_routing_info = irq_routing_info;
     dev->device_data = console;
     virtio_console_regs_init(dev);
 
-    console->rxq = rxq;
-    console->txq = txq;
-    console->tx_ch = tx_ch;
-    console->rx_ch = rx_ch;
+    memcpy(console->ports, ports, num_ports * sizeof(struct virtio_console_port));
+    memset(console->port_state, 0, sizeof(console->port_state));
+    memset(&console->config, 0, sizeof(console->config));
+    console->config.max_nr_ports = num_ports;
+    console->num_ports = num_ports;
+    console->multiport = multiport;
+    console->multiport_enabled = false;
+    console->ctrl_pending_head = 0;
+    console->ctrl_pending_tail = 0;
 
     return dev;
 }
 
 #if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_console_init_multiport(struct virtio_console_device *console, uintptr_t region_base,
+                                        uintptr_t region_size, irq_routing_info_t irq_routing_info,
+                                        struct virtio_console_port *ports, uint32_t num_ports)
+{
+    struct virtio_device *dev = virtio_console_init(console, VIRTIO_TRANSPORT_MMIO, irq_routing_info, ports,
+                                                    num_ports, true);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+
 bool virtio_mmio_console_init(struct virtio_console_device *console, uintptr_t region_base, uintptr_t region_size,
                               irq_routing_info_t irq_routing_info, serial_queue_handle_t *rxq,
                               serial_queue_handle_t *txq, int tx_ch, int rx_ch)
 {
-    struct virtio_device *dev = virtio_console_init(console, VIRTIO_TRANSPORT_MMIO, irq_routing_info, rxq, txq, tx_ch,
-                                                    rx_ch);
+    struct virtio_console_port port = {
+        .rxq = rxq,
+        .txq = txq,
+        .tx_ch = tx_ch,
+        .rx_ch = rx_ch,
+    };
+    struct virtio_device *dev = virtio_console_init(console, VIRTIO_TRANSPORT_MMIO, irq_routing_info, &port, 1,
+                                                    false);
 
     return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
 }
 #endif
 
-bool virtio_pci_console_init(struct virtio_console_device *console, uint16_t pci_bus, uint16_t pci_dev,
-                             irq_routing_info_t irq_routing_info, serial_queue_handle_t *rxq,
-                             serial_queue_handle_t *txq, int tx_ch, int rx_ch)
+static bool virtio_pci_console_register(struct virtio_device *dev, uint16_t pci_bus, uint16_t pci_dev,
+                                        irq_routing_info_t irq_routing_info)
 {
-    struct virtio_device *dev = virtio_console_init(console, VIRTIO_TRANSPORT_PCI, irq_routing_info, rxq, txq, tx_ch,
-                                                    rx_ch);
-
     dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_CONSOLE;
     dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
     dev->transport.pci.device_class = PCI_CLASS_COMMUNICATION_OTHER;
 
     return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
 }
+
+bool virtio_pci_console_init_multiport(struct virtio_console_device *console, uint16_t pci_bus, uint16_t pci_dev,
+                                       irq_routing_info_t irq_routing_info, struct virtio_console_port *ports,
+                                       uint32_t num_ports)
+{
+    struct virtio_device *dev = virtio_console_init(console, VIRTIO_TRANSPORT_PCI, irq_routing_info, ports, num_ports,
+                                                    true);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_pci_console_register(dev, pci_bus, pci_dev, irq_routing_info);
+}
+
+bool virtio_pci_console_init(struct virtio_console_device *console, uint16_t pci_bus, uint16_t pci_dev,
+                             irq_routing_info_t irq_routing_info, serial_queue_handle_t *rxq,
+                             serial_queue_handle_t *txq, int tx_ch, int rx_ch)
+{
+    struct virtio_console_port port = {
+        .rxq = rxq,
+        .txq = txq,
+        .tx_ch = tx_ch,
+        .rx_ch = rx_ch,
+    };
+    struct virtio_device *dev = virtio_console_init(console, VIRTIO_TRANSPORT_PCI, irq_routing_info, &port, 1, false);
+
+    return virtio_pci_console_register(dev, pci_bus, pci_dev, irq_routing_info);
+}
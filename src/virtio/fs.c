@@ -0,0 +1,2115 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stddef.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/guest.h>
+#include <libvmm/virq.h>
+#include <libvmm/util/util.h>
+#include <libvmm/virtio/config.h>
+#include <libvmm/virtio/mmio.h>
+#include <libvmm/virtio/fs.h>
+#include <libvmm/virtio/virtio.h>
+#include <sddf/fs/protocol.h>
+#include <sddf/util/fsmalloc.h>
+#include <sddf/util/ialloc.h>
+
+/*
+ * This file implements a virtio-fs device, which gives the guest a file system through
+ * FUSE requests carried over virtqueues. The requests are served by an sDDF file server.
+ *
+ * FUSE names files by node IDs the device hands out, while the sDDF file system protocol
+ * names them by path. The device therefore keeps a table of the nodes the guest has looked
+ * up and their paths, which it keeps up to date as files are renamed and removed. File
+ * handles are the file server's file descriptors, directory handles index a table that
+ * also tracks how far the guest has read each directory.
+ *
+ * A FUSE request may take several sDDF commands, creating a file for example is an open
+ * followed by a stat. Each request in flight has at most one command with the file server
+ * at a time, and moves on to its next step when the command's completion comes back. Paths
+ * and data are passed to the file server in cells of the shared data region. When the
+ * device runs out of requests or cells, it leaves the guest's requests in the virtqueues
+ * until completions free some up.
+ *
+ * DAX lets the guest map file contents straight into its address space rather than going
+ * through its page cache. seL4 has no way for the file server to map a file into the guest,
+ * so the DAX window is part of the data region instead, mapped into the guest as well.
+ * Setting up a mapping reads the file into the window, and the contents are written back
+ * when the guest removes the mapping, or syncs the file or file system.
+ */
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_FS
+
+#if defined(DEBUG_FS)
+#define LOG_FS(...) do{ printf("VIRTIO(FS): "); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_FS(...) do{}while(0)
+#endif
+
+#define LOG_FS_ERR(...) do{ printf("VIRTIO(FS)|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+#if VIRTIO_FS_MAX_PATH > VIRTIO_FS_CELL_SIZE / 2
+#error "VIRTIO_FS_MAX_PATH must fit twice in a data region cell"
+#endif
+
+/* Errors are returned to the guest as Linux errno values, whatever the file server runs on */
+#define LINUX_ENOENT 2
+#define LINUX_EIO 5
+#define LINUX_EBADF 9
+#define LINUX_ENOMEM 12
+#define LINUX_EINVAL 22
+#define LINUX_EMFILE 24
+#define LINUX_ENAMETOOLONG 36
+#define LINUX_ENOSYS 38
+#define LINUX_EPROTO 71
+#define LINUX_ESTALE 116
+
+#define LINUX_S_IFDIR 0040000
+#define LINUX_DT_UNKNOWN 0
+#define LINUX_DT_DIR 4
+
+#define LINUX_O_ACCMODE 3
+#define LINUX_O_WRONLY 1
+#define LINUX_O_RDWR 2
+
+/* Inode number of directory entries, the guest gets the real one when it looks them up */
+#define FUSE_UNKNOWN_INO 0xffffffff
+
+/* The second half of a request's first cell, after the first path */
+#define CELL_SECOND_HALF VIRTIO_FS_MAX_PATH
+
+static inline struct virtio_fs_device *device_state(struct virtio_device *dev)
+{
+    return (struct virtio_fs_device *)dev->device_data;
+}
+
+static int status_to_errno(uint64_t status)
+{
+    switch (status) {
+    case FS_STATUS_SUCCESS:
+        return 0;
+    case FS_STATUS_INVALID_PATH:
+        return LINUX_ENOENT;
+    case FS_STATUS_ALLOCATION_ERROR:
+        return LINUX_ENOMEM;
+    case FS_STATUS_INVALID_FD:
+        return LINUX_EBADF;
+    case FS_STATUS_TOO_MANY_OPEN_FILES:
+        return LINUX_EMFILE;
+    case FS_STATUS_INVALID_NAME:
+        return LINUX_EINVAL;
+    default:
+        return LINUX_EIO;
+    }
+}
+
+static uint64_t open_flags(uint32_t flags)
+{
+    switch (flags & LINUX_O_ACCMODE) {
+    case LINUX_O_WRONLY:
+        return FS_OPEN_FLAGS_WRITE_ONLY;
+    case LINUX_O_RDWR:
+        return FS_OPEN_FLAGS_READ_WRITE;
+    default:
+        return FS_OPEN_FLAGS_READ_ONLY;
+    }
+}
+
+/*
+ * Nodes
+ */
+
+static uint32_t path_hash(const char *path)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static void node_set_path(struct virtio_fs_node *node, const char *path)
+{
+    strcpy(node->path, path);
+    node->hash = path_hash(path);
+}
+
+/* The node behind a node ID the guest gave us, NULL if there is none */
+static struct virtio_fs_node *node_get(struct virtio_fs_device *fs, uint64_t nodeid)
+{
+    if (nodeid < FUSE_ROOT_ID || nodeid - FUSE_ROOT_ID >= VIRTIO_FS_MAX_NODES) {
+        return NULL;
+    }
+    struct virtio_fs_node *node = &fs->nodes[nodeid - FUSE_ROOT_ID];
+    return node->in_use ? node : NULL;
+}
+
+static inline uint64_t node_id(struct virtio_fs_device *fs, struct virtio_fs_node *node)
+{
+    return (node - fs->nodes) + FUSE_ROOT_ID;
+}
+
+static struct virtio_fs_node *node_find(struct virtio_fs_device *fs, const char *path)
+{
+    uint32_t hash = path_hash(path);
+    for (int i = 0; i < VIRTIO_FS_MAX_NODES; i++) {
+        struct virtio_fs_node *node = &fs->nodes[i];
+        if (node->in_use && !node->stale && node->hash == hash && strcmp(node->path, path) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* Find the node of a path the guest has looked up, creating it if there is none */
+static struct virtio_fs_node *node_lookup(struct virtio_fs_device *fs, const char *path)
+{
+    struct virtio_fs_node *node = node_find(fs, path);
+    if (node) {
+        return node;
+    }
+
+    for (int i = 0; i < VIRTIO_FS_MAX_NODES; i++) {
+        node = &fs->nodes[i];
+        if (!node->in_use) {
+            node->in_use = true;
+            node->stale = false;
+            node->nlookup = 0;
+            node_set_path(node, path);
+            return node;
+        }
+    }
+
+    LOG_FS_ERR("out of nodes for '%s'\n", path);
+    return NULL;
+}
+
+static void node_forget(struct virtio_fs_device *fs, uint64_t nodeid, uint64_t nlookup)
+{
+    struct virtio_fs_node *node = node_get(fs, nodeid);
+    /* The root is never forgotten */
+    if (!node || nodeid == FUSE_ROOT_ID) {
+        return;
+    }
+
+    node->nlookup -= MIN(node->nlookup, nlookup);
+    if (node->nlookup == 0) {
+        node->in_use = false;
+    }
+}
+
+/* Whether `path` is `dir` or below it */
+static bool path_is_below(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/* The file at `path` was removed or replaced, along with anything below it */
+static void node_remove(struct virtio_fs_device *fs, const char *path)
+{
+    for (int i = 0; i < VIRTIO_FS_MAX_NODES; i++) {
+        struct virtio_fs_node *node = &fs->nodes[i];
+        if (node->in_use && !node->stale && i != 0 && path_is_below(node->path, path)) {
+            node->stale = true;
+        }
+    }
+}
+
+static void node_rename(struct virtio_fs_device *fs, const char *old_path, const char *new_path)
+{
+    node_remove(fs, new_path);
+
+    size_t old_len = strlen(old_path);
+    size_t new_len = strlen(new_path);
+    for (int i = 0; i < VIRTIO_FS_MAX_NODES; i++) {
+        struct virtio_fs_node *node = &fs->nodes[i];
+        if (!node->in_use || node->stale || i == 0 || !path_is_below(node->path, old_path)) {
+            continue;
+        }
+
+        size_t suffix_len = strlen(node->path) - old_len;
+        if (new_len + suffix_len >= VIRTIO_FS_MAX_PATH) {
+            node->stale = true;
+            continue;
+        }
+        memmove(node->path + new_len, node->path + old_len, suffix_len + 1);
+        memcpy(node->path, new_path, new_len);
+        node->hash = path_hash(node->path);
+    }
+}
+
+/* Path of `name` in the directory at `dir`, false if it does not fit */
+static bool child_path(const char *dir, const char *name, char *path)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    bool sep = dir_len == 0 || dir[dir_len - 1] != '/';
+    if (dir_len + sep + name_len >= VIRTIO_FS_MAX_PATH) {
+        return false;
+    }
+
+    memcpy(path, dir, dir_len);
+    if (sep) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + sep, name, name_len + 1);
+    return true;
+}
+
+static void fill_attr(struct fuse_attr *attr, const fs_stat_t *stat, uint64_t nodeid)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = stat->ino ? stat->ino : nodeid;
+    attr->size = stat->size;
+    attr->blocks = stat->blocks;
+    attr->atime = stat->atime;
+    attr->mtime = stat->mtime;
+    attr->ctime = stat->ctime;
+    attr->atimensec = stat->atime_nsec;
+    attr->mtimensec = stat->mtime_nsec;
+    attr->ctimensec = stat->ctime_nsec;
+    attr->mode = stat->mode;
+    attr->nlink = stat->nlink ? stat->nlink : 1;
+    attr->uid = stat->uid;
+    attr->gid = stat->gid;
+    attr->rdev = stat->rdev;
+    attr->blksize = stat->blksize ? stat->blksize : VIRTIO_FS_CELL_SIZE;
+}
+
+/* File servers cannot always stat their root, so its attributes are made up */
+static void fill_root_attr(struct fuse_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = FUSE_ROOT_ID;
+    attr->mode = LINUX_S_IFDIR | 0755;
+    attr->nlink = 2;
+    attr->blksize = VIRTIO_FS_CELL_SIZE;
+}
+
+static void fill_entry(struct fuse_entry_out *entry, const fs_stat_t *stat, uint64_t nodeid)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->nodeid = nodeid;
+    entry->entry_valid = VIRTIO_FS_ATTR_TIMEOUT;
+    entry->attr_valid = VIRTIO_FS_ATTR_TIMEOUT;
+    fill_attr(&entry->attr, stat, nodeid);
+}
+
+/*
+ * Requests
+ */
+
+static inline uint32_t request_id(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    return req - fs->reqs;
+}
+
+/* Split a descriptor chain into the part the driver wrote and the part for the reply */
+static bool chain_lengths(virtio_queue_handler_t *vq, uint16_t desc_head, uint32_t *req_len, uint32_t *reply_len)
+{
+    struct virtq *virtq = &vq->virtq;
+    struct virtq_desc *desc_ring = virtio_get_desc_ring(virtq);
+    uint64_t readable = 0;
+    uint64_t writable = 0;
+    uint16_t curr_desc = desc_head;
+
+    for (uint32_t i = 0; i <= virtq->num && curr_desc < virtq->num; i++) {
+        struct virtq_desc *desc = &desc_ring[curr_desc];
+        if (desc->flags & VIRTQ_DESC_F_WRITE) {
+            writable += desc->len;
+        } else if (writable) {
+            /* Buffers the device reads must come before those it writes */
+            break;
+        } else {
+            readable += desc->len;
+        }
+
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            if (readable > UINT32_MAX || writable > UINT32_MAX) {
+                break;
+            }
+            *req_len = readable;
+            *reply_len = writable;
+            return true;
+        }
+        curr_desc = desc->next;
+    }
+
+    LOG_FS_ERR("bad descriptor chain starting at %u\n", desc_head);
+    return false;
+}
+
+/* Read `size` bytes of arguments at `off` past the FUSE header */
+static bool request_args(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint32_t off, void *args,
+                         uint32_t size)
+{
+    uint64_t start = sizeof(struct fuse_in_header) + (uint64_t)off;
+    if (start + size > req->req_len) {
+        LOG_FS_ERR("request %lu (opcode %u) too short for its arguments\n", req->unique, req->opcode);
+        return false;
+    }
+    return virtio_read_data_from_desc_chain(&fs->vqs[req->vq], req->desc_head, size, start, args);
+}
+
+/* Read a NUL terminated name at `off` past the FUSE header into `name` */
+static bool request_name(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint32_t off, char *name)
+{
+    uint64_t start = sizeof(struct fuse_in_header) + (uint64_t)off;
+    if (start >= req->req_len) {
+        return false;
+    }
+    uint32_t len = MIN(req->req_len - start, FS_MAX_NAME_LENGTH + 1);
+    if (!virtio_read_data_from_desc_chain(&fs->vqs[req->vq], req->desc_head, len, start, name)) {
+        return false;
+    }
+    return memchr(name, '\0', len) != NULL;
+}
+
+/* Write part of the reply payload, for replies that are built up in place */
+static void request_write_reply(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint32_t off,
+                                const void *data, uint32_t len)
+{
+    assert(sizeof(struct fuse_out_header) + off + len <= req->reply_len);
+    assert(virtio_write_data_to_desc_chain(&fs->vqs[req->vq], req->desc_head, len,
+                                           req->reply_off + sizeof(struct fuse_out_header) + off, (char *)data));
+}
+
+static void request_free(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    if (req->num_cells) {
+        fsmalloc_free(&fs->fsmalloc, req->cells, req->num_cells);
+    }
+    req->in_use = false;
+    ialloc_free(&fs->ialloc, request_id(fs, req));
+}
+
+/*
+ * Reply to a request and free it. If `payload` is NULL, `len` bytes of payload have already
+ * been written with `request_write_reply`.
+ */
+static void request_reply(struct virtio_fs_device *fs, struct virtio_fs_request *req, int error,
+                          const void *payload, uint32_t len)
+{
+    virtio_queue_handler_t *vq = &fs->vqs[req->vq];
+    uint32_t bytes_written = 0;
+
+    /* FORGET has no reply, and a guest that gives no room for one does not get one */
+    if (req->reply_len >= sizeof(struct fuse_out_header)) {
+        if (error) {
+            len = 0;
+        }
+        len = MIN(len, req->reply_len - sizeof(struct fuse_out_header));
+        if (payload && len) {
+            request_write_reply(fs, req, 0, payload, len);
+        }
+
+        struct fuse_out_header hdr = {
+            .len = sizeof(struct fuse_out_header) + len,
+            .error = -error,
+            .unique = req->unique,
+        };
+        assert(virtio_write_data_to_desc_chain(vq, req->desc_head, sizeof(hdr), req->reply_off, (char *)&hdr));
+        bytes_written = hdr.len;
+    }
+
+    LOG_FS("reply to request %lu (opcode %u): error %d, %u bytes\n", req->unique, req->opcode, error, bytes_written);
+
+    virtio_virtq_add_used(vq, req->desc_head, bytes_written);
+    fs->guest_notify = true;
+    request_free(fs, req);
+}
+
+static inline void request_error(struct virtio_fs_device *fs, struct virtio_fs_request *req, int error)
+{
+    request_reply(fs, req, error, NULL, 0);
+}
+
+static inline char *request_cell(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t off)
+{
+    return (char *)(req->cells + off);
+}
+
+/* Data of a request, after its first cell */
+static inline char *request_data(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    return request_cell(fs, req, VIRTIO_FS_CELL_SIZE);
+}
+
+static inline fs_buffer_t data_buffer(struct virtio_fs_device *fs, void *addr, uint64_t size)
+{
+    return (fs_buffer_t) {
+        .offset = (uintptr_t)addr - fs->data_region,
+        .size = size,
+    };
+}
+
+/*
+ * Commands to the file server
+ */
+
+static fs_cmd_t *cmd_prepare(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t type)
+{
+    /* Each request has at most one command in flight, so there is always room */
+    assert(fs_queue_length_producer(fs->cmd_queue) < FS_QUEUE_CAPACITY);
+    fs_cmd_t *cmd = &fs_queue_idx_empty(fs->cmd_queue, 0)->cmd;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->id = request_id(fs, req);
+    cmd->type = type;
+    return cmd;
+}
+
+static void cmd_send(struct virtio_fs_device *fs)
+{
+    fs_queue_publish_production(fs->cmd_queue, 1);
+    fs->server_notify = true;
+}
+
+/* Copy a path into the request's first cell, at `off` */
+static fs_buffer_t cmd_path(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t off,
+                            const char *path)
+{
+    char *dest = request_cell(fs, req, off);
+    size_t len = strlen(path);
+    if (dest != path) {
+        memcpy(dest, path, len + 1);
+    }
+    return data_buffer(fs, dest, len);
+}
+
+static void send_path_cmd(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t type,
+                          const char *path)
+{
+    fs_cmd_t *cmd = cmd_prepare(fs, req, type);
+    fs_buffer_t buf = cmd_path(fs, req, 0, path);
+    switch (type) {
+    case FS_CMD_FILE_REMOVE:
+        cmd->params.file_remove.path = buf;
+        break;
+    case FS_CMD_DIR_CREATE:
+        cmd->params.dir_create.path = buf;
+        break;
+    case FS_CMD_DIR_REMOVE:
+        cmd->params.dir_remove.path = buf;
+        break;
+    case FS_CMD_DIR_OPEN:
+        cmd->params.dir_open.path = buf;
+        break;
+    default:
+        assert(false);
+    }
+    cmd_send(fs);
+}
+
+static void send_fd_cmd(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t type, uint64_t fd)
+{
+    fs_cmd_t *cmd = cmd_prepare(fs, req, type);
+    switch (type) {
+    case FS_CMD_FILE_CLOSE:
+        cmd->params.file_close.fd = fd;
+        break;
+    case FS_CMD_FILE_SYNC:
+        cmd->params.file_sync.fd = fd;
+        break;
+    case FS_CMD_DIR_CLOSE:
+        cmd->params.dir_close.fd = fd;
+        break;
+    case FS_CMD_DIR_REWIND:
+        cmd->params.dir_rewind.fd = fd;
+        break;
+    default:
+        assert(false);
+    }
+    cmd_send(fs);
+}
+
+static void send_open(struct virtio_fs_device *fs, struct virtio_fs_request *req, const char *path, uint64_t flags)
+{
+    fs_cmd_t *cmd = cmd_prepare(fs, req, FS_CMD_FILE_OPEN);
+    cmd->params.file_open.path = cmd_path(fs, req, 0, path);
+    cmd->params.file_open.flags = flags;
+    cmd_send(fs);
+}
+
+/* The result goes in the second half of the first cell */
+static void send_stat(struct virtio_fs_device *fs, struct virtio_fs_request *req, const char *path)
+{
+    fs_cmd_t *cmd = cmd_prepare(fs, req, FS_CMD_STAT);
+    cmd->params.stat.path = cmd_path(fs, req, 0, path);
+    cmd->params.stat.buf = data_buffer(fs, request_cell(fs, req, CELL_SECOND_HALF), sizeof(fs_stat_t));
+    cmd_send(fs);
+}
+
+static inline fs_stat_t *stat_result(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    return (fs_stat_t *)request_cell(fs, req, CELL_SECOND_HALF);
+}
+
+static void send_rw(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t type, uint64_t fd,
+                    uint64_t offset, fs_buffer_t buf)
+{
+    fs_cmd_t *cmd = cmd_prepare(fs, req, type);
+    if (type == FS_CMD_FILE_READ) {
+        cmd->params.file_read.fd = fd;
+        cmd->params.file_read.offset = offset;
+        cmd->params.file_read.buf = buf;
+    } else {
+        assert(type == FS_CMD_FILE_WRITE);
+        cmd->params.file_write.fd = fd;
+        cmd->params.file_write.offset = offset;
+        cmd->params.file_write.buf = buf;
+    }
+    cmd_send(fs);
+}
+
+/*
+ * DAX window
+ */
+
+static inline char *dax_addr(struct virtio_fs_device *fs, uint64_t moffset)
+{
+    return (char *)(fs->data_region + fs->dax_offset + moffset);
+}
+
+/* Steps of writing a DAX chunk back to its file */
+enum {
+    WRITEBACK_IDLE = 0,
+    WRITEBACK_OPEN,
+    WRITEBACK_WRITE,
+    WRITEBACK_CLOSE,
+};
+
+/*
+ * Write chunk `req->chunk` back to its file, and unmap it if `unmap` is set. Returns true
+ * once done, false while a command is in flight, in which case it is called again with
+ * the completion.
+ */
+static bool dax_writeback(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl,
+                          bool unmap)
+{
+    struct virtio_fs_dax_chunk *chunk = &fs->dax_chunks[req->chunk];
+    struct virtio_fs_node *node = node_get(fs, chunk->nodeid);
+
+    switch (req->writeback_step) {
+    case WRITEBACK_IDLE:
+        if (!chunk->writable || !chunk->valid || !node || node->stale) {
+            break;
+        }
+        send_open(fs, req, node->path, FS_OPEN_FLAGS_WRITE_ONLY);
+        req->writeback_step = WRITEBACK_OPEN;
+        return false;
+    case WRITEBACK_OPEN:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            LOG_FS_ERR("could not open '%s' to write back DAX chunk %u: %lu\n", node ? node->path : "?", req->chunk,
+                       cmpl->status);
+            break;
+        }
+        req->fd = cmpl->data.file_open.fd;
+        send_rw(fs, req, FS_CMD_FILE_WRITE, req->fd, chunk->foffset,
+                data_buffer(fs, dax_addr(fs, chunk->moffset), chunk->valid));
+        req->writeback_step = WRITEBACK_WRITE;
+        return false;
+    case WRITEBACK_WRITE:
+        if (cmpl->status != FS_STATUS_SUCCESS || cmpl->data.file_write.len_written != chunk->valid) {
+            LOG_FS_ERR("could not write back DAX chunk %u: %lu\n", req->chunk, cmpl->status);
+        }
+        send_fd_cmd(fs, req, FS_CMD_FILE_CLOSE, req->fd);
+        req->writeback_step = WRITEBACK_CLOSE;
+        return false;
+    case WRITEBACK_CLOSE:
+        break;
+    }
+
+    req->writeback_step = WRITEBACK_IDLE;
+    if (unmap) {
+        chunk->in_use = false;
+    }
+    return true;
+}
+
+/* Keep mapped parts of a file up to date with what the guest writes to it through FUSE_WRITE */
+static void dax_file_written(struct virtio_fs_device *fs, uint64_t nodeid, uint64_t offset, const char *data,
+                             uint64_t len)
+{
+    for (uint32_t i = 0; i < fs->num_dax_chunks; i++) {
+        struct virtio_fs_dax_chunk *chunk = &fs->dax_chunks[i];
+        if (!chunk->in_use || chunk->nodeid != nodeid) {
+            continue;
+        }
+        uint64_t start = MAX(offset, chunk->foffset);
+        uint64_t end = MIN(offset + len, chunk->foffset + chunk->len);
+        if (start >= end) {
+            continue;
+        }
+        memcpy(dax_addr(fs, chunk->moffset + (start - chunk->foffset)), data + (start - offset), end - start);
+        chunk->valid = MAX(chunk->valid, end - chunk->foffset);
+    }
+}
+
+static void dax_file_truncated(struct virtio_fs_device *fs, uint64_t nodeid, uint64_t size)
+{
+    for (uint32_t i = 0; i < fs->num_dax_chunks; i++) {
+        struct virtio_fs_dax_chunk *chunk = &fs->dax_chunks[i];
+        if (chunk->in_use && chunk->nodeid == nodeid) {
+            chunk->valid = size > chunk->foffset ? MIN(chunk->valid, size - chunk->foffset) : 0;
+        }
+    }
+}
+
+/*
+ * FUSE operations. Each is called with a NULL completion to start it, then with the
+ * completion of every command it sends until it replies.
+ */
+
+static void fs_init(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    struct fuse_init_in in = { 0 };
+    /* Older drivers send a shorter fuse_init_in */
+    uint32_t in_len = MIN(sizeof(in), req->req_len - sizeof(struct fuse_in_header));
+    if (in_len < offsetof(struct fuse_init_in, flags2) || !request_args(fs, req, 0, &in, in_len)) {
+        request_error(fs, req, LINUX_EINVAL);
+        return;
+    }
+
+    if (in.major < FUSE_KERNEL_VERSION) {
+        LOG_FS_ERR("unsupported FUSE version %u.%u\n", in.major, in.minor);
+        request_error(fs, req, LINUX_EPROTO);
+        return;
+    }
+
+    uint32_t flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES;
+    if (fs->dax_window.size) {
+        flags |= FUSE_MAP_ALIGNMENT;
+    }
+
+    /* A newer driver falls back to our version */
+    struct fuse_init_out out = {
+        .major = FUSE_KERNEL_VERSION,
+        .minor = in.major > FUSE_KERNEL_VERSION ? FUSE_KERNEL_MINOR_VERSION : MIN(in.minor, FUSE_KERNEL_MINOR_VERSION),
+        .max_readahead = MIN(in.max_readahead, VIRTIO_FS_MAX_IO),
+        .flags = in.flags & flags,
+        .max_background = VIRTIO_FS_MAX_REQUESTS,
+        .congestion_threshold = VIRTIO_FS_MAX_REQUESTS * 3 / 4,
+        .max_write = VIRTIO_FS_MAX_IO,
+        .time_gran = 1,
+        .max_pages = VIRTIO_FS_MAX_IO / VIRTIO_FS_CELL_SIZE,
+        /* log2 of the alignment of mappings */
+        .map_alignment = 12,
+    };
+
+    LOG_FS("FUSE %u.%u, flags 0x%x\n", out.major, out.minor, out.flags);
+    request_reply(fs, req, 0, &out, sizeof(out));
+}
+
+static void fs_forget(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    if (req->opcode == FUSE_FORGET) {
+        struct fuse_forget_in in;
+        if (request_args(fs, req, 0, &in, sizeof(in))) {
+            node_forget(fs, req->nodeid, in.nlookup);
+        }
+    } else {
+        struct fuse_batch_forget_in in;
+        if (request_args(fs, req, 0, &in, sizeof(in))) {
+            for (uint32_t i = 0; i < in.count; i++) {
+                struct fuse_forget_one one;
+                if (!request_args(fs, req, sizeof(in) + i * sizeof(one), &one, sizeof(one))) {
+                    break;
+                }
+                node_forget(fs, one.nodeid, one.nlookup);
+            }
+        }
+    }
+
+    /* No reply */
+    req->reply_len = 0;
+    request_reply(fs, req, 0, NULL, 0);
+}
+
+static void fs_statfs(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    /* The sDDF file system protocol has no way to ask for usage */
+    struct fuse_statfs_out out = {
+        .st = {
+            .bsize = VIRTIO_FS_CELL_SIZE,
+            .frsize = VIRTIO_FS_CELL_SIZE,
+            .namelen = FS_MAX_NAME_LENGTH,
+        },
+    };
+    request_reply(fs, req, 0, &out, sizeof(out));
+}
+
+/* Reply to a request that looked up, created or made a directory with the result of stat */
+static void reply_entry(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl,
+                        struct fuse_open_out *open)
+{
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+
+    /* The path stat was given is still at the start of the first cell */
+    struct virtio_fs_node *node = node_lookup(fs, request_cell(fs, req, 0));
+    if (!node) {
+        request_error(fs, req, LINUX_ENOMEM);
+        return;
+    }
+    node->nlookup++;
+
+    struct {
+        struct fuse_entry_out entry;
+        struct fuse_open_out open;
+    } out;
+    fill_entry(&out.entry, stat_result(fs, req), node_id(fs, node));
+    if (open) {
+        out.open = *open;
+    }
+    request_reply(fs, req, 0, &out, open ? sizeof(out) : sizeof(out.entry));
+}
+
+/* Parse the name of a request on a directory and put its path in the first cell */
+static int request_child_path(struct virtio_fs_device *fs, struct virtio_fs_request *req, uint64_t dirid,
+                              uint32_t name_off, uint64_t cell_off)
+{
+    struct virtio_fs_node *dir = node_get(fs, dirid);
+    if (!dir || dir->stale) {
+        return LINUX_ESTALE;
+    }
+
+    char name[FS_MAX_NAME_LENGTH + 1];
+    if (!request_name(fs, req, name_off, name)) {
+        return LINUX_EINVAL;
+    }
+
+    if (!child_path(dir->path, name, request_cell(fs, req, cell_off))) {
+        return LINUX_ENAMETOOLONG;
+    }
+    return 0;
+}
+
+enum {
+    LOOKUP_STAT = 1,
+};
+
+static void fs_lookup(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        int error = request_child_path(fs, req, req->nodeid, 0, 0);
+        if (error) {
+            request_error(fs, req, error);
+            return;
+        }
+        send_stat(fs, req, request_cell(fs, req, 0));
+        req->step = LOOKUP_STAT;
+        return;
+    }
+
+    reply_entry(fs, req, cmpl, NULL);
+}
+
+enum {
+    GETATTR_STAT = 1,
+};
+
+static void reply_attr(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_stat_t *stat)
+{
+    struct fuse_attr_out out = {
+        .attr_valid = VIRTIO_FS_ATTR_TIMEOUT,
+    };
+    if (req->nodeid == FUSE_ROOT_ID) {
+        fill_root_attr(&out.attr);
+    } else {
+        fill_attr(&out.attr, stat, req->nodeid);
+    }
+    request_reply(fs, req, 0, &out, sizeof(out));
+}
+
+static void fs_getattr(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct virtio_fs_node *node = node_get(fs, req->nodeid);
+        if (!node || node->stale) {
+            request_error(fs, req, LINUX_ESTALE);
+        } else if (req->nodeid == FUSE_ROOT_ID) {
+            reply_attr(fs, req, NULL);
+        } else {
+            send_stat(fs, req, node->path);
+            req->step = GETATTR_STAT;
+        }
+        return;
+    }
+
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+    reply_attr(fs, req, stat_result(fs, req));
+}
+
+enum {
+    SETATTR_OPEN = 1,
+    SETATTR_TRUNCATE,
+    SETATTR_CLOSE,
+    SETATTR_STAT,
+};
+
+/*
+ * Only changes of size can be passed on to the file server, others are ignored and the
+ * guest gets the attributes the file has.
+ */
+static void fs_setattr(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    struct virtio_fs_node *node = node_get(fs, req->nodeid);
+
+    switch (req->step) {
+    case 0: {
+        struct fuse_setattr_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        if (!node || node->stale) {
+            request_error(fs, req, LINUX_ESTALE);
+            return;
+        }
+        if (!(in.valid & FATTR_SIZE)) {
+            break;
+        }
+        req->offset = in.size;
+        if (in.valid & FATTR_FH) {
+            req->fd = in.fh;
+            req->target = false;
+            goto truncate;
+        }
+        req->target = true;
+        send_open(fs, req, node->path, FS_OPEN_FLAGS_WRITE_ONLY);
+        req->step = SETATTR_OPEN;
+        return;
+    }
+    case SETATTR_OPEN:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            request_error(fs, req, status_to_errno(cmpl->status));
+            return;
+        }
+        req->fd = cmpl->data.file_open.fd;
+    truncate: {
+        fs_cmd_t *cmd = cmd_prepare(fs, req, FS_CMD_FILE_TRUNCATE);
+        cmd->params.file_truncate.fd = req->fd;
+        cmd->params.file_truncate.length = req->offset;
+        cmd_send(fs);
+        req->step = SETATTR_TRUNCATE;
+        return;
+    }
+    case SETATTR_TRUNCATE:
+        req->error = status_to_errno(cmpl->status);
+        if (!req->error) {
+            dax_file_truncated(fs, req->nodeid, req->offset);
+        }
+        if (req->target) {
+            send_fd_cmd(fs, req, FS_CMD_FILE_CLOSE, req->fd);
+            req->step = SETATTR_CLOSE;
+            return;
+        }
+        break;
+    case SETATTR_CLOSE:
+        break;
+    case SETATTR_STAT:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            request_error(fs, req, status_to_errno(cmpl->status));
+            return;
+        }
+        reply_attr(fs, req, stat_result(fs, req));
+        return;
+    }
+
+    if (req->error) {
+        request_error(fs, req, req->error);
+    } else if (req->nodeid == FUSE_ROOT_ID) {
+        reply_attr(fs, req, NULL);
+    } else {
+        send_stat(fs, req, node->path);
+        req->step = SETATTR_STAT;
+    }
+}
+
+enum {
+    OPEN_OPEN = 1,
+};
+
+static void fs_open(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct fuse_open_in in;
+        struct virtio_fs_node *node = node_get(fs, req->nodeid);
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+        } else if (!node || node->stale) {
+            request_error(fs, req, LINUX_ESTALE);
+        } else {
+            send_open(fs, req, node->path, open_flags(in.flags));
+            req->step = OPEN_OPEN;
+        }
+        return;
+    }
+
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+    struct fuse_open_out out = {
+        .fh = cmpl->data.file_open.fd,
+    };
+    request_reply(fs, req, 0, &out, sizeof(out));
+}
+
+enum {
+    CREATE_OPEN = 1,
+    CREATE_STAT,
+    CREATE_CLOSE,
+};
+
+static void fs_create(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    switch (req->step) {
+    case 0: {
+        struct fuse_create_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        int error = request_child_path(fs, req, req->nodeid, sizeof(in), 0);
+        if (error) {
+            request_error(fs, req, error);
+            return;
+        }
+        send_open(fs, req, request_cell(fs, req, 0), open_flags(in.flags) | FS_OPEN_FLAGS_CREATE);
+        req->step = CREATE_OPEN;
+        return;
+    }
+    case CREATE_OPEN:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            request_error(fs, req, status_to_errno(cmpl->status));
+            return;
+        }
+        req->fd = cmpl->data.file_open.fd;
+        send_stat(fs, req, request_cell(fs, req, 0));
+        req->step = CREATE_STAT;
+        return;
+    case CREATE_STAT:
+        if (cmpl->status == FS_STATUS_SUCCESS) {
+            struct fuse_open_out open = {
+                .fh = req->fd,
+            };
+            reply_entry(fs, req, cmpl, &open);
+            return;
+        }
+        /* Do not leave the file open when the guest does not know about it */
+        req->error = status_to_errno(cmpl->status);
+        send_fd_cmd(fs, req, FS_CMD_FILE_CLOSE, req->fd);
+        req->step = CREATE_CLOSE;
+        return;
+    case CREATE_CLOSE:
+        request_error(fs, req, req->error);
+        return;
+    }
+}
+
+enum {
+    MKDIR_CREATE = 1,
+    MKDIR_STAT,
+};
+
+static void fs_mkdir(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    switch (req->step) {
+    case 0: {
+        int error = request_child_path(fs, req, req->nodeid, sizeof(struct fuse_mkdir_in), 0);
+        if (error) {
+            request_error(fs, req, error);
+            return;
+        }
+        send_path_cmd(fs, req, FS_CMD_DIR_CREATE, request_cell(fs, req, 0));
+        req->step = MKDIR_CREATE;
+        return;
+    }
+    case MKDIR_CREATE:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            request_error(fs, req, status_to_errno(cmpl->status));
+            return;
+        }
+        send_stat(fs, req, request_cell(fs, req, 0));
+        req->step = MKDIR_STAT;
+        return;
+    case MKDIR_STAT:
+        reply_entry(fs, req, cmpl, NULL);
+        return;
+    }
+}
+
+enum {
+    REMOVE_REMOVE = 1,
+};
+
+/* FUSE_UNLINK and FUSE_RMDIR */
+static void fs_remove(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        int error = request_child_path(fs, req, req->nodeid, 0, 0);
+        if (error) {
+            request_error(fs, req, error);
+            return;
+        }
+        send_path_cmd(fs, req, req->opcode == FUSE_UNLINK ? FS_CMD_FILE_REMOVE : FS_CMD_DIR_REMOVE,
+                      request_cell(fs, req, 0));
+        req->step = REMOVE_REMOVE;
+        return;
+    }
+
+    if (cmpl->status == FS_STATUS_SUCCESS) {
+        node_remove(fs, request_cell(fs, req, 0));
+    }
+    request_error(fs, req, status_to_errno(cmpl->status));
+}
+
+enum {
+    RENAME_RENAME = 1,
+};
+
+/* FUSE_RENAME and FUSE_RENAME2 */
+static void fs_rename(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    char *old_path = request_cell(fs, req, 0);
+    char *new_path = request_cell(fs, req, CELL_SECOND_HALF);
+
+    if (!cmpl) {
+        struct fuse_rename2_in in = { 0 };
+        uint32_t in_len = (req->opcode == FUSE_RENAME2) ? sizeof(struct fuse_rename2_in)
+                                                        : sizeof(struct fuse_rename_in);
+        if (!request_args(fs, req, 0, &in, in_len)) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        /* RENAME_NOREPLACE, RENAME_EXCHANGE and RENAME_WHITEOUT cannot be done atomically */
+        if (in.flags) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+
+        int error = request_child_path(fs, req, req->nodeid, in_len, 0);
+        if (!error) {
+            uint32_t new_name_off = in_len + strlen(strrchr(old_path, '/') + 1) + 1;
+            error = request_child_path(fs, req, in.newdir, new_name_off, CELL_SECOND_HALF);
+        }
+        if (error) {
+            request_error(fs, req, error);
+            return;
+        }
+
+        fs_cmd_t *cmd = cmd_prepare(fs, req, FS_CMD_RENAME);
+        cmd->params.rename.old_path = data_buffer(fs, old_path, strlen(old_path));
+        cmd->params.rename.new_path = data_buffer(fs, new_path, strlen(new_path));
+        cmd_send(fs);
+        req->step = RENAME_RENAME;
+        return;
+    }
+
+    if (cmpl->status == FS_STATUS_SUCCESS) {
+        node_rename(fs, old_path, new_path);
+    }
+    request_error(fs, req, status_to_errno(cmpl->status));
+}
+
+enum {
+    READ_READ = 1,
+};
+
+static void fs_read(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct fuse_read_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        /* The guest may ask for less than it has room for, but not more */
+        uint32_t size = MIN(in.size, VIRTIO_FS_MAX_IO);
+        size = MIN(size, req->reply_len - sizeof(struct fuse_out_header));
+        if (size == 0) {
+            request_reply(fs, req, 0, NULL, 0);
+            return;
+        }
+        send_rw(fs, req, FS_CMD_FILE_READ, in.fh, in.offset, data_buffer(fs, request_data(fs, req), size));
+        req->step = READ_READ;
+        return;
+    }
+
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+    uint32_t len = cmpl->data.file_read.len_read;
+    if (len) {
+        request_write_reply(fs, req, 0, request_data(fs, req), len);
+    }
+    request_reply(fs, req, 0, NULL, len);
+}
+
+enum {
+    WRITE_WRITE = 1,
+};
+
+static void fs_write(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct fuse_write_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in)) || in.size > VIRTIO_FS_MAX_IO
+            || !request_args(fs, req, sizeof(in), request_data(fs, req), in.size)) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        req->offset = in.offset;
+        req->size = in.size;
+        send_rw(fs, req, FS_CMD_FILE_WRITE, in.fh, in.offset, data_buffer(fs, request_data(fs, req), in.size));
+        req->step = WRITE_WRITE;
+        return;
+    }
+
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+    struct fuse_write_out out = {
+        .size = cmpl->data.file_write.len_written,
+    };
+    dax_file_written(fs, req->nodeid, req->offset, request_data(fs, req), out.size);
+    request_reply(fs, req, 0, &out, sizeof(out));
+}
+
+enum {
+    RELEASE_CLOSE = 1,
+};
+
+static void fs_release(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct fuse_release_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        send_fd_cmd(fs, req, FS_CMD_FILE_CLOSE, in.fh);
+        req->step = RELEASE_CLOSE;
+        return;
+    }
+
+    /* The guest has forgotten the handle whatever happened */
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        LOG_FS_ERR("could not close file of node %lu: %lu\n", req->nodeid, cmpl->status);
+    }
+    request_reply(fs, req, 0, NULL, 0);
+}
+
+enum {
+    SYNC_WRITEBACK = 1,
+    SYNC_SYNC,
+};
+
+/*
+ * FUSE_FSYNC and FUSE_SYNCFS. Writable DAX chunks of the file, or of every file, are
+ * written back first.
+ */
+static void fs_sync(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    bool syncfs = req->opcode == FUSE_SYNCFS;
+
+    switch (req->step) {
+    case 0:
+        if (!syncfs) {
+            struct fuse_fsync_in in;
+            if (!request_args(fs, req, 0, &in, sizeof(in))) {
+                request_error(fs, req, LINUX_EINVAL);
+                return;
+            }
+            req->target = in.fh;
+        }
+        req->chunk = 0;
+        break;
+    case SYNC_WRITEBACK:
+        if (!dax_writeback(fs, req, cmpl, false)) {
+            return;
+        }
+        req->chunk++;
+        break;
+    case SYNC_SYNC:
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+
+    for (; req->chunk < fs->num_dax_chunks; req->chunk++) {
+        struct virtio_fs_dax_chunk *chunk = &fs->dax_chunks[req->chunk];
+        if (!chunk->in_use || !chunk->writable || (!syncfs && chunk->nodeid != req->nodeid)) {
+            continue;
+        }
+        req->step = SYNC_WRITEBACK;
+        if (!dax_writeback(fs, req, NULL, false)) {
+            return;
+        }
+    }
+
+    /* The protocol has no way to sync everything, the file server's files are synced on close */
+    if (syncfs) {
+        request_reply(fs, req, 0, NULL, 0);
+        return;
+    }
+    send_fd_cmd(fs, req, FS_CMD_FILE_SYNC, req->target);
+    req->step = SYNC_SYNC;
+}
+
+/*
+ * Directories
+ */
+
+static struct virtio_fs_dir *dir_get(struct virtio_fs_device *fs, uint64_t fh)
+{
+    if (fh >= VIRTIO_FS_MAX_DIRS || !fs->dirs[fh].in_use) {
+        return NULL;
+    }
+    return &fs->dirs[fh];
+}
+
+enum {
+    OPENDIR_OPEN = 1,
+};
+
+static void fs_opendir(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct virtio_fs_node *node = node_get(fs, req->nodeid);
+        if (!node || node->stale) {
+            request_error(fs, req, LINUX_ESTALE);
+            return;
+        }
+
+        /* Claim a handle now so the directory is never open without one */
+        req->target = VIRTIO_FS_MAX_DIRS;
+        for (uint64_t i = 0; i < VIRTIO_FS_MAX_DIRS; i++) {
+            if (!fs->dirs[i].in_use) {
+                req->target = i;
+                break;
+            }
+        }
+        if (req->target == VIRTIO_FS_MAX_DIRS) {
+            request_error(fs, req, LINUX_EMFILE);
+            return;
+        }
+        memset(&fs->dirs[req->target], 0, sizeof(struct virtio_fs_dir));
+        fs->dirs[req->target].in_use = true;
+
+        send_path_cmd(fs, req, FS_CMD_DIR_OPEN, node->path);
+        req->step = OPENDIR_OPEN;
+        return;
+    }
+
+    struct virtio_fs_dir *dir = &fs->dirs[req->target];
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        dir->in_use = false;
+        request_error(fs, req, status_to_errno(cmpl->status));
+        return;
+    }
+    dir->fd = cmpl->data.dir_open.fd;
+    struct fuse_open_out out = {
+        .fh = req->target,
+    };
+    request_reply(fs, req, 0, &out, sizeof(out));
+}
+
+enum {
+    RELEASEDIR_CLOSE = 1,
+};
+
+static void fs_releasedir(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct fuse_release_in in;
+        struct virtio_fs_dir *dir;
+        if (!request_args(fs, req, 0, &in, sizeof(in)) || !(dir = dir_get(fs, in.fh))) {
+            request_error(fs, req, LINUX_EBADF);
+            return;
+        }
+        req->target = in.fh;
+        send_fd_cmd(fs, req, FS_CMD_DIR_CLOSE, dir->fd);
+        req->step = RELEASEDIR_CLOSE;
+        return;
+    }
+
+    if (cmpl->status != FS_STATUS_SUCCESS) {
+        LOG_FS_ERR("could not close directory of node %lu: %lu\n", req->nodeid, cmpl->status);
+    }
+    fs->dirs[req->target].in_use = false;
+    request_reply(fs, req, 0, NULL, 0);
+}
+
+/* Add an entry to a FUSE_READDIR reply, false if it does not fit */
+static bool readdir_emit(struct virtio_fs_device *fs, struct virtio_fs_request *req, struct virtio_fs_dir *dir,
+                         const char *name, uint32_t type)
+{
+    uint8_t buf[FUSE_DIRENT_ALIGN(sizeof(struct fuse_dirent) + FS_MAX_NAME_LENGTH)] = { 0 };
+    struct fuse_dirent *dirent = (struct fuse_dirent *)buf;
+    uint32_t namelen = strlen(name);
+    uint32_t entsize = FUSE_DIRENT_ALIGN(sizeof(struct fuse_dirent) + namelen);
+    if (req->written + entsize > req->size) {
+        return false;
+    }
+
+    dirent->ino = FUSE_UNKNOWN_INO;
+    /* The offset of an entry is where to carry on reading after it */
+    dirent->off = dir->pos + 1;
+    dirent->namelen = namelen;
+    dirent->type = type;
+    memcpy(dirent->name, name, namelen);
+    request_write_reply(fs, req, req->written, buf, entsize);
+    req->written += entsize;
+    return true;
+}
+
+enum {
+    READDIR_REWIND = 1,
+    READDIR_READ,
+};
+
+/*
+ * Read entries until the directory is at the offset the guest asked for, then give it as
+ * many as fit. An entry that does not fit is kept for the next FUSE_READDIR.
+ */
+static void readdir_fill(struct virtio_fs_device *fs, struct virtio_fs_request *req, struct virtio_fs_dir *dir)
+{
+    while (dir->pos < req->offset) {
+        if (dir->pos >= 2 && !dir->pending) {
+            goto read;
+        }
+        dir->pending = false;
+        dir->pos++;
+    }
+
+    while (true) {
+        if (dir->pos < 2) {
+            if (!readdir_emit(fs, req, dir, dir->pos == 0 ? "." : "..", LINUX_DT_DIR)) {
+                break;
+            }
+        } else if (dir->pending) {
+            if (!readdir_emit(fs, req, dir, dir->pending_name, LINUX_DT_UNKNOWN)) {
+                break;
+            }
+            dir->pending = false;
+        } else {
+            goto read;
+        }
+        dir->pos++;
+    }
+
+    request_reply(fs, req, 0, NULL, req->written);
+    return;
+
+read: {
+    fs_cmd_t *cmd = cmd_prepare(fs, req, FS_CMD_DIR_READ);
+    cmd->params.dir_read.fd = dir->fd;
+    cmd->params.dir_read.buf = data_buffer(fs, request_cell(fs, req, CELL_SECOND_HALF), FS_MAX_NAME_LENGTH);
+    cmd_send(fs);
+    req->step = READDIR_READ;
+}
+}
+
+static void fs_readdir(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    struct virtio_fs_dir *dir = dir_get(fs, req->target);
+    if (req->step && !dir) {
+        /* The guest released the directory while reading it */
+        request_error(fs, req, LINUX_EBADF);
+        return;
+    }
+
+    switch (req->step) {
+    case 0: {
+        struct fuse_read_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in)) || !(dir = dir_get(fs, in.fh))) {
+            request_error(fs, req, LINUX_EBADF);
+            return;
+        }
+        req->target = in.fh;
+        req->offset = in.offset;
+        req->size = MIN(in.size, req->reply_len - sizeof(struct fuse_out_header));
+        req->written = 0;
+
+        /* Going backwards only needs a rewind if the file server has been read from */
+        if (req->offset < dir->pos) {
+            if (dir->pos > 2 || dir->pending) {
+                send_fd_cmd(fs, req, FS_CMD_DIR_REWIND, dir->fd);
+                req->step = READDIR_REWIND;
+                return;
+            }
+            dir->pos = req->offset;
+        }
+        break;
+    }
+    case READDIR_REWIND:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            request_error(fs, req, status_to_errno(cmpl->status));
+            return;
+        }
+        dir->pos = 0;
+        dir->pending = false;
+        break;
+    case READDIR_READ:
+        if (cmpl->status == FS_STATUS_END_OF_DIRECTORY) {
+            request_reply(fs, req, 0, NULL, req->written);
+            return;
+        }
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            /* Give the guest what it has so far, it gets the error on its next read */
+            if (req->written) {
+                request_reply(fs, req, 0, NULL, req->written);
+            } else {
+                request_error(fs, req, status_to_errno(cmpl->status));
+            }
+            return;
+        }
+        uint64_t len = MIN(cmpl->data.dir_read.path_len, FS_MAX_NAME_LENGTH);
+        memcpy(dir->pending_name, request_cell(fs, req, CELL_SECOND_HALF), len);
+        dir->pending_name[len] = '\0';
+        dir->pending = true;
+        break;
+    }
+
+    readdir_fill(fs, req, dir);
+}
+
+/*
+ * DAX mappings
+ */
+
+enum {
+    SETUPMAPPING_EVICT = 1,
+    SETUPMAPPING_OPEN,
+    SETUPMAPPING_READ,
+    SETUPMAPPING_CLOSE,
+};
+
+/*
+ * The guest maps part of a file into the window. Mappings may not cross the chunks
+ * the window is split into, and a new mapping in a chunk replaces the one there.
+ */
+static void fs_setupmapping(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    struct virtio_fs_dax_chunk *chunk = &fs->dax_chunks[req->chunk];
+    struct virtio_fs_node *node = node_get(fs, req->nodeid);
+
+    switch (req->step) {
+    case 0: {
+        struct fuse_setupmapping_in in;
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        if (!node || node->stale) {
+            request_error(fs, req, LINUX_ESTALE);
+            return;
+        }
+
+        uint64_t chunk_off = in.moffset % VIRTIO_FS_DAX_CHUNK_SIZE;
+        if (!fs->num_dax_chunks || in.len == 0 || in.len > VIRTIO_FS_DAX_CHUNK_SIZE - chunk_off
+            || in.moffset / VIRTIO_FS_DAX_CHUNK_SIZE >= fs->num_dax_chunks || in.moffset % VIRTIO_FS_CELL_SIZE
+            || in.foffset % VIRTIO_FS_CELL_SIZE) {
+            LOG_FS_ERR("invalid mapping of 0x%lx bytes at 0x%lx of node %lu to 0x%lx\n", in.len, in.foffset,
+                       req->nodeid, in.moffset);
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+
+        req->chunk = in.moffset / VIRTIO_FS_DAX_CHUNK_SIZE;
+        chunk = &fs->dax_chunks[req->chunk];
+        bool writable = in.flags & FUSE_SETUPMAPPING_FLAG_WRITE;
+
+        /* Mapping the same range again, to make it writable */
+        if (chunk->in_use && chunk->nodeid == req->nodeid && chunk->foffset == in.foffset
+            && chunk->moffset == in.moffset && chunk->len == in.len) {
+            chunk->writable |= writable;
+            request_reply(fs, req, 0, NULL, 0);
+            return;
+        }
+
+        req->offset = in.foffset;
+        req->target = in.moffset;
+        req->size = in.len;
+        req->index = writable;
+        if (chunk->in_use) {
+            req->step = SETUPMAPPING_EVICT;
+            if (!dax_writeback(fs, req, NULL, true)) {
+                return;
+            }
+        }
+        break;
+    }
+    case SETUPMAPPING_EVICT:
+        if (!dax_writeback(fs, req, cmpl, true)) {
+            return;
+        }
+        break;
+    case SETUPMAPPING_OPEN:
+        if (cmpl->status != FS_STATUS_SUCCESS) {
+            request_error(fs, req, status_to_errno(cmpl->status));
+            return;
+        }
+        req->fd = cmpl->data.file_open.fd;
+        send_rw(fs, req, FS_CMD_FILE_READ, req->fd, req->offset,
+                data_buffer(fs, dax_addr(fs, req->target), req->size));
+        req->step = SETUPMAPPING_READ;
+        return;
+    case SETUPMAPPING_READ:
+        req->error = status_to_errno(cmpl->status);
+        if (!req->error) {
+            uint64_t valid = MIN(cmpl->data.file_read.len_read, req->size);
+            /* Past the end of the file reads as zeroes */
+            memset(dax_addr(fs, req->target + valid), 0, req->size - valid);
+            *chunk = (struct virtio_fs_dax_chunk) {
+                .in_use = true,
+                .writable = req->index,
+                .nodeid = req->nodeid,
+                .foffset = req->offset,
+                .moffset = req->target,
+                .len = req->size,
+                .valid = valid,
+            };
+        }
+        send_fd_cmd(fs, req, FS_CMD_FILE_CLOSE, req->fd);
+        req->step = SETUPMAPPING_CLOSE;
+        return;
+    case SETUPMAPPING_CLOSE:
+        request_error(fs, req, req->error);
+        return;
+    }
+
+    /* The file is opened for reading only, it is opened again for writing when written back */
+    send_open(fs, req, node->path, FS_OPEN_FLAGS_READ_ONLY);
+    req->step = SETUPMAPPING_OPEN;
+}
+
+/* Find the next chunk to unmap, going through the ranges of the request from `req->index` */
+static bool removemapping_next(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    for (; req->index < req->size; req->index++, req->chunk = 0) {
+        struct fuse_removemapping_one one;
+        assert(request_args(fs, req, sizeof(struct fuse_removemapping_in) + req->index * sizeof(one), &one,
+                            sizeof(one)));
+        if (one.len == 0 || one.moffset >= fs->dax_window.size) {
+            continue;
+        }
+        uint64_t end = MIN(one.moffset + one.len, fs->dax_window.size);
+        uint32_t last = (end - 1) / VIRTIO_FS_DAX_CHUNK_SIZE;
+        req->chunk = MAX(req->chunk, one.moffset / VIRTIO_FS_DAX_CHUNK_SIZE);
+        for (; req->chunk <= last; req->chunk++) {
+            struct virtio_fs_dax_chunk *chunk = &fs->dax_chunks[req->chunk];
+            if (chunk->in_use && chunk->moffset < end && chunk->moffset + chunk->len > one.moffset) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+enum {
+    REMOVEMAPPING_WRITEBACK = 1,
+};
+
+static void fs_removemapping(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    if (!cmpl) {
+        struct fuse_removemapping_in in;
+        uint64_t ranges_len;
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        ranges_len = (uint64_t)in.count * sizeof(struct fuse_removemapping_one);
+        if (sizeof(struct fuse_in_header) + sizeof(in) + ranges_len > req->req_len) {
+            request_error(fs, req, LINUX_EINVAL);
+            return;
+        }
+        req->size = in.count;
+        req->index = 0;
+        req->chunk = 0;
+    } else {
+        if (!dax_writeback(fs, req, cmpl, true)) {
+            return;
+        }
+        req->chunk++;
+    }
+
+    while (removemapping_next(fs, req)) {
+        req->step = REMOVEMAPPING_WRITEBACK;
+        if (!dax_writeback(fs, req, NULL, true)) {
+            return;
+        }
+        req->chunk++;
+    }
+    request_reply(fs, req, 0, NULL, 0);
+}
+
+static void request_step(struct virtio_fs_device *fs, struct virtio_fs_request *req, const fs_cmpl_t *cmpl)
+{
+    switch (req->opcode) {
+    case FUSE_INIT:
+        fs_init(fs, req);
+        break;
+    case FUSE_DESTROY:
+    case FUSE_FLUSH:
+    case FUSE_FSYNCDIR:
+        request_reply(fs, req, 0, NULL, 0);
+        break;
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+        fs_forget(fs, req);
+        break;
+    case FUSE_STATFS:
+        fs_statfs(fs, req);
+        break;
+    case FUSE_LOOKUP:
+        fs_lookup(fs, req, cmpl);
+        break;
+    case FUSE_GETATTR:
+        fs_getattr(fs, req, cmpl);
+        break;
+    case FUSE_SETATTR:
+        fs_setattr(fs, req, cmpl);
+        break;
+    case FUSE_OPEN:
+        fs_open(fs, req, cmpl);
+        break;
+    case FUSE_CREATE:
+        fs_create(fs, req, cmpl);
+        break;
+    case FUSE_MKDIR:
+        fs_mkdir(fs, req, cmpl);
+        break;
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+        fs_remove(fs, req, cmpl);
+        break;
+    case FUSE_RENAME:
+    case FUSE_RENAME2:
+        fs_rename(fs, req, cmpl);
+        break;
+    case FUSE_READ:
+        fs_read(fs, req, cmpl);
+        break;
+    case FUSE_WRITE:
+        fs_write(fs, req, cmpl);
+        break;
+    case FUSE_RELEASE:
+        fs_release(fs, req, cmpl);
+        break;
+    case FUSE_FSYNC:
+    case FUSE_SYNCFS:
+        fs_sync(fs, req, cmpl);
+        break;
+    case FUSE_OPENDIR:
+        fs_opendir(fs, req, cmpl);
+        break;
+    case FUSE_READDIR:
+        fs_readdir(fs, req, cmpl);
+        break;
+    case FUSE_RELEASEDIR:
+        fs_releasedir(fs, req, cmpl);
+        break;
+    case FUSE_SETUPMAPPING:
+        fs_setupmapping(fs, req, cmpl);
+        break;
+    case FUSE_REMOVEMAPPING:
+        fs_removemapping(fs, req, cmpl);
+        break;
+    default:
+        /* Drivers stop sending requests that get ENOSYS */
+        LOG_FS("unsupported opcode %u\n", req->opcode);
+        request_error(fs, req, LINUX_ENOSYS);
+        break;
+    }
+}
+
+/* Data region cells a request needs */
+static uint64_t request_num_cells(struct virtio_fs_device *fs, struct virtio_fs_request *req)
+{
+    struct fuse_read_in in;
+
+    switch (req->opcode) {
+    case FUSE_INIT:
+    case FUSE_DESTROY:
+    case FUSE_FLUSH:
+    case FUSE_FSYNCDIR:
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_STATFS:
+        return 0;
+    case FUSE_READ:
+    case FUSE_WRITE:
+        /* fuse_read_in and fuse_write_in have the size in the same place */
+        if (!request_args(fs, req, 0, &in, sizeof(in))) {
+            return 1;
+        }
+        if (req->opcode == FUSE_READ) {
+            in.size = MIN(in.size, VIRTIO_FS_MAX_IO);
+        } else if (in.size > VIRTIO_FS_MAX_IO) {
+            return 1;
+        }
+        return 1 + (in.size + VIRTIO_FS_CELL_SIZE - 1) / VIRTIO_FS_CELL_SIZE;
+    default:
+        return 1;
+    }
+}
+
+static void virtio_fs_handle_queue(struct virtio_fs_device *fs, uint16_t vq_idx)
+{
+    virtio_queue_handler_t *vq = &fs->vqs[vq_idx];
+    uint16_t desc_head;
+
+    if (!vq->ready) {
+        return;
+    }
+
+    while (virtio_virtq_peek_avail(vq, &desc_head)) {
+        uint32_t req_len, reply_len;
+        struct fuse_in_header hdr;
+        if (!chain_lengths(vq, desc_head, &req_len, &reply_len) || req_len < sizeof(hdr)
+            || reply_len > (1 << 30)) {
+            assert(virtio_virtq_pop_avail(vq, &desc_head));
+            virtio_virtq_add_used(vq, desc_head, 0);
+            fs->guest_notify = true;
+            continue;
+        }
+        assert(virtio_read_data_from_desc_chain(vq, desc_head, sizeof(hdr), 0, (char *)&hdr));
+
+        /* Requests wait in the virtqueue while the device has no room for them */
+        uint32_t id;
+        if (ialloc_alloc(&fs->ialloc, &id) == -1) {
+            return;
+        }
+        struct virtio_fs_request *req = &fs->reqs[id];
+        memset(req, 0, sizeof(*req));
+        req->vq = vq_idx;
+        req->desc_head = desc_head;
+        req->opcode = hdr.opcode;
+        req->unique = hdr.unique;
+        req->nodeid = hdr.nodeid;
+        req->req_len = MIN(hdr.len, req_len);
+        req->reply_off = req_len;
+        req->reply_len = reply_len;
+
+        uint64_t num_cells = request_num_cells(fs, req);
+        if (num_cells && fsmalloc_alloc(&fs->fsmalloc, &req->cells, num_cells) == -1) {
+            ialloc_free(&fs->ialloc, id);
+            return;
+        }
+        req->num_cells = num_cells;
+        req->in_use = true;
+
+        assert(virtio_virtq_pop_avail(vq, &desc_head));
+        LOG_FS("request %lu on queue %u: opcode %u, node %lu\n", req->unique, vq_idx, req->opcode, req->nodeid);
+        request_step(fs, req, NULL);
+    }
+}
+
+static bool virtio_fs_notify(struct virtio_fs_device *fs)
+{
+    bool success = true;
+
+    if (fs->server_notify) {
+        fs->server_notify = false;
+        microkit_notify(fs->server_ch);
+    }
+    if (fs->guest_notify) {
+        fs->guest_notify = false;
+        virtio_set_interrupt_status(&fs->virtio_device, true, false);
+        success = virtio_inject_interrupt(&fs->virtio_device);
+    }
+
+    return success;
+}
+
+static bool virtio_fs_queue_notify(struct virtio_device *dev)
+{
+    struct virtio_fs_device *fs = device_state(dev);
+    if (dev->regs.QueueNotify >= dev->num_vqs) {
+        LOG_FS_ERR("notified on invalid queue %u\n", dev->regs.QueueNotify);
+        return false;
+    }
+
+    virtio_fs_handle_queue(fs, dev->regs.QueueNotify);
+    return virtio_fs_notify(fs);
+}
+
+bool virtio_fs_handle_cmpl(struct virtio_fs_device *fs)
+{
+    uint64_t num_cmpls = fs_queue_length_consumer(fs->cmpl_queue);
+    for (uint64_t i = 0; i < num_cmpls; i++) {
+        fs_cmpl_t cmpl = fs_queue_idx_filled(fs->cmpl_queue, i)->cmpl;
+        if (cmpl.id >= VIRTIO_FS_MAX_REQUESTS || !fs->reqs[cmpl.id].in_use) {
+            LOG_FS_ERR("completion for unknown request %lu\n", cmpl.id);
+            continue;
+        }
+
+        struct virtio_fs_request *req = &fs->reqs[cmpl.id];
+        if (req->cancelled) {
+            request_free(fs, req);
+            continue;
+        }
+        request_step(fs, req, &cmpl);
+    }
+    fs_queue_publish_consumption(fs->cmpl_queue, num_cmpls);
+
+    /* Requests the guest made while the device was busy may fit now */
+    for (uint16_t i = 0; i < fs->virtio_device.num_vqs; i++) {
+        virtio_fs_handle_queue(fs, i);
+    }
+
+    return virtio_fs_notify(fs);
+}
+
+static void virtio_fs_regs_init(struct virtio_device *dev)
+{
+    dev->regs.DeviceID = VIRTIO_DEVICE_ID_FS;
+    dev->regs.VendorID = VIRTIO_DEV_VENDOR_ID;
+}
+
+static void virtio_fs_state_init(struct virtio_fs_device *fs)
+{
+    memset(fs->nodes, 0, sizeof(fs->nodes));
+    memset(fs->dirs, 0, sizeof(fs->dirs));
+    memset(fs->dax_chunks, 0, sizeof(fs->dax_chunks));
+
+    struct virtio_fs_node *root = &fs->nodes[0];
+    root->in_use = true;
+    root->nlookup = 1;
+    node_set_path(root, "/");
+}
+
+static void virtio_fs_reset(struct virtio_device *dev)
+{
+    LOG_FS("operation: reset device\n");
+
+    for (int i = 0; i < dev->num_vqs; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        dev->vqs[i].virtq.avail_gpa = 0;
+        dev->vqs[i].virtq.used_gpa = 0;
+        dev->vqs[i].virtq.desc_gpa = 0;
+        dev->vqs[i].virtq.num = 0;
+    }
+
+    /*
+     * Requests with the file server cannot be taken back, they are dropped when they
+     * complete. Directories and DAX chunks of the old driver are forgotten, the file
+     * server closes what it has open for them when its client goes away.
+     */
+    struct virtio_fs_device *fs = device_state(dev);
+    for (int i = 0; i < VIRTIO_FS_MAX_REQUESTS; i++) {
+        fs->reqs[i].cancelled = fs->reqs[i].in_use;
+    }
+    virtio_fs_state_init(fs);
+
+    virtio_set_interrupt_status(dev, false, false);
+    memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
+    virtio_fs_regs_init(dev);
+}
+
+static bool virtio_fs_get_device_features(struct virtio_device *dev, uint32_t *features)
+{
+    LOG_FS("operation: get device features\n");
+
+    switch (dev->regs.DeviceFeaturesSel) {
+    case 0:
+        *features = 0;
+        break;
+    case 1:
+        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        break;
+    default:
+        *features = 0;
+    }
+
+    return true;
+}
+
+static bool virtio_fs_set_driver_features(struct virtio_device *dev, uint32_t features)
+{
+    LOG_FS("operation: set driver features\n");
+
+    bool success = false;
+
+    switch (dev->regs.DriverFeaturesSel) {
+    // feature bits 0 to 31
+    case 0:
+        success = features == 0;
+        break;
+    // features bits 32 to 63
+    case 1:
+        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        break;
+    default:
+        success = true;
+    }
+
+    if (success) {
+        dev->regs.DriverFeatures = features;
+        dev->features_happy = 1;
+        LOG_FS("device is feature happy\n");
+    }
+
+    return success;
+}
+
+static bool virtio_fs_get_device_config(struct virtio_device *dev, uint32_t offset, uint32_t *config)
+{
+    LOG_FS("operation: get device config\n");
+
+    struct virtio_fs_config *device_config = &device_state(dev)->config;
+    if (offset >= sizeof(struct virtio_fs_config)) {
+        LOG_FS_ERR("Unknown device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    *config = 0;
+    memcpy(config, (uint8_t *)device_config + offset, MIN(sizeof(uint32_t), sizeof(struct virtio_fs_config) - offset));
+
+    return true;
+}
+
+static bool virtio_fs_set_device_config(struct virtio_device *dev, uint32_t offset, uint32_t config)
+{
+    LOG_FS("operation: set device config\n");
+    return false;
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_fs_reset,
+    .get_device_features = virtio_fs_get_device_features,
+    .set_driver_features = virtio_fs_set_driver_features,
+    .get_device_config = virtio_fs_get_device_config,
+    .set_device_config = virtio_fs_set_device_config,
+    .queue_notify = virtio_fs_queue_notify,
+};
+
+static struct virtio_device *virtio_fs_init(struct virtio_fs_device *fs, virtio_transport_type_t type,
+                                            irq_routing_info_t irq_routing_info, const char *tag,
+                                            uint32_t num_request_queues, fs_queue_t *cmd_queue,
+                                            fs_queue_t *cmpl_queue, uintptr_t data_region, size_t data_region_size,
+                                            uint64_t dax_window_gpa, size_t dax_window_size, int server_ch)
+{
+    if (num_request_queues == 0 || num_request_queues > VIRTIO_FS_MAX_REQUEST_QUEUES) {
+        LOG_FS_ERR("invalid number of request queues %u, at most %u\n", num_request_queues,
+                   VIRTIO_FS_MAX_REQUEST_QUEUES);
+        return NULL;
+    }
+
+    size_t tag_len = strlen(tag);
+    if (tag_len == 0 || tag_len > VIRTIO_FS_TAG_LEN) {
+        LOG_FS_ERR("invalid tag '%s'\n", tag);
+        return NULL;
+    }
+
+    if (VIRTIO_FS_MAX_REQUESTS > FS_QUEUE_CAPACITY) {
+        LOG_FS_ERR("more requests (%u) than the file server queues can hold\n", VIRTIO_FS_MAX_REQUESTS);
+        return NULL;
+    }
+
+    if (dax_window_size > data_region_size || dax_window_size % VIRTIO_FS_DAX_CHUNK_SIZE
+        || dax_window_size / VIRTIO_FS_DAX_CHUNK_SIZE > VIRTIO_FS_DAX_MAX_CHUNKS) {
+        LOG_FS_ERR("invalid DAX window size 0x%lx, must be a multiple of 0x%x up to 0x%lx\n", dax_window_size,
+                   VIRTIO_FS_DAX_CHUNK_SIZE, (uint64_t)VIRTIO_FS_DAX_MAX_CHUNKS * VIRTIO_FS_DAX_CHUNK_SIZE);
+        return NULL;
+    }
+
+    size_t num_cells = MIN((data_region_size - dax_window_size) / VIRTIO_FS_CELL_SIZE, VIRTIO_FS_MAX_DATA_CELLS);
+    if (num_cells < 1 + VIRTIO_FS_MAX_IO / VIRTIO_FS_CELL_SIZE) {
+        LOG_FS_ERR("data region too small, it needs 0x%x bytes outside of the DAX window\n",
+                   VIRTIO_FS_CELL_SIZE + VIRTIO_FS_MAX_IO);
+        return NULL;
+    }
+
+    struct virtio_device *dev = &fs->virtio_device;
+
+    dev->transport_type = type;
+    dev->funs = &functions;
+    dev->vqs = fs->vqs;
+    dev->num_vqs = 1 + num_request_queues;
+    dev->irq_routing_info = irq_routing_info;
+    dev->device_data = fs;
+    virtio_fs_regs_init(dev);
+
+    memset(&fs->config, 0, sizeof(fs->config));
+    memcpy(fs->config.tag, tag, tag_len);
+    fs->config.num_request_queues = num_request_queues;
+
+    fs->dax_window.gpa = dax_window_gpa;
+    fs->dax_window.size = dax_window_size;
+    fs->dax_offset = data_region_size - dax_window_size;
+    fs->num_dax_chunks = dax_window_size / VIRTIO_FS_DAX_CHUNK_SIZE;
+    if (dax_window_size) {
+        dev->shm_regions = &fs->dax_window;
+        dev->num_shm_regions = 1;
+    }
+
+    fs->cmd_queue = cmd_queue;
+    fs->cmpl_queue = cmpl_queue;
+    fs->data_region = data_region;
+    fs->server_ch = server_ch;
+    fs->server_notify = false;
+    fs->guest_notify = false;
+
+    memset(fs->reqs, 0, sizeof(fs->reqs));
+    virtio_fs_state_init(fs);
+
+    fsmalloc_init(&fs->fsmalloc, data_region, VIRTIO_FS_CELL_SIZE, num_cells, &fs->fsmalloc_avail_bitarr,
+                  fs->fsmalloc_avail_bitarr_words, BITS_2_WORDS64(num_cells));
+    ialloc_init(&fs->ialloc, fs->ialloc_idxlist, VIRTIO_FS_MAX_REQUESTS);
+
+    return dev;
+}
+
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_fs_init(struct virtio_fs_device *fs, uintptr_t region_base, uintptr_t region_size,
+                         irq_routing_info_t irq_routing_info, const char *tag, uint32_t num_request_queues,
+                         fs_queue_t *cmd_queue, fs_queue_t *cmpl_queue, uintptr_t data_region, size_t data_region_size,
+                         uint64_t dax_window_gpa, size_t dax_window_size, int server_ch)
+{
+    struct virtio_device *dev = virtio_fs_init(fs, VIRTIO_TRANSPORT_MMIO, irq_routing_info, tag, num_request_queues,
+                                               cmd_queue, cmpl_queue, data_region, data_region_size, dax_window_gpa,
+                                               dax_window_size, server_ch);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+#endif
+
+bool virtio_pci_fs_init(struct virtio_fs_device *fs, uint16_t pci_bus, uint16_t pci_dev,
+                        irq_routing_info_t irq_routing_info, const char *tag, uint32_t num_request_queues,
+                        fs_queue_t *cmd_queue, fs_queue_t *cmpl_queue, uintptr_t data_region, size_t data_region_size,
+                        int server_ch)
+{
+    /* A DAX window would need a BAR backed by memory, which the virtual PCI bus cannot do */
+    struct virtio_device *dev = virtio_fs_init(fs, VIRTIO_TRANSPORT_PCI, irq_routing_info, tag, num_request_queues,
+                                               cmd_queue, cmpl_queue, data_region, data_region_size, 0, 0, server_ch);
+    if (!dev) {
+        return false;
+    }
+
+    dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_FS;
+    dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
+    dev->transport.pci.device_class = PCI_CLASS_OTHERS;
+
+    return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
+}
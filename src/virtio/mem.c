@@ -0,0 +1,495 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stddef.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/guest.h>
+#include <libvmm/guest_ram.h>
+#include <libvmm/virq.h>
+#include <libvmm/util/util.h>
+#include <libvmm/virtio/config.h>
+#include <libvmm/virtio/mmio.h>
+#include <libvmm/virtio/mem.h>
+#include <libvmm/virtio/virtio.h>
+
+/*
+ * The virtio-mem device lets the guest's memory grow and shrink while it runs. The VMM
+ * sets the size it wants the guest to have, and the guest plugs in or unplugs blocks of a
+ * region reserved for it until it has that much. Which blocks are plugged in is kept in a
+ * bitmap that `gpa_to_hva` checks, so the VMM never touches memory the guest has given up.
+ */
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_MEM
+
+#if defined(DEBUG_MEM)
+#define LOG_MEM(...) do{ printf("VIRTIO(MEM): "); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_MEM(...) do{}while(0)
+#endif
+
+#define LOG_MEM_ERR(...) do{ printf("VIRTIO(MEM)|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+/* Features we offer in the first 32 feature bits */
+#define MEM_FEATURES BIT_LOW(VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE)
+
+/* Blocks are at least a page */
+#define MEM_MIN_BLOCK_SIZE 0x1000
+
+/* The plug request waiting on the memory manager was from a driver that has since reset the device */
+#define PLUG_HEAD_NONE UINT16_MAX
+
+static inline struct virtio_mem_device *device_state(struct virtio_device *dev)
+{
+    return (struct virtio_mem_device *)dev->device_data;
+}
+
+static inline bool block_plugged(struct virtio_mem_device *mem, uint64_t block)
+{
+    return (mem->plugged[block / 64] >> (block % 64)) & 1;
+}
+
+static inline void block_set_plugged(struct virtio_mem_device *mem, uint64_t block, bool plugged)
+{
+    if (plugged) {
+        mem->plugged[block / 64] |= 1ul << (block % 64);
+    } else {
+        mem->plugged[block / 64] &= ~(1ul << (block % 64));
+    }
+}
+
+static void notify_mm(struct virtio_mem_device *mem)
+{
+    if (mem->mm_ch >= 0) {
+        microkit_notify((microkit_channel)mem->mm_ch);
+    }
+}
+
+static void virtio_mem_respond(struct virtio_mem_device *mem, uint16_t desc_head, uint16_t type, uint16_t state)
+{
+    virtio_queue_handler_t *vq = &mem->vqs[VIRTIO_MEM_REQ_QUEUE];
+    struct virtio_mem_resp resp = { .type = type, .state = state };
+    uint64_t req_len;
+    uint64_t resp_len;
+
+    /* The response goes after the request, in the writable buffers */
+    uint32_t written = 0;
+    if (virtio_desc_chain_split_len(vq, desc_head, &req_len, &resp_len) && resp_len >= sizeof(resp)
+        && virtio_write_data_to_desc_chain(vq, desc_head, sizeof(resp), req_len, (char *)&resp)) {
+        written = sizeof(resp);
+    } else {
+        LOG_MEM_ERR("no room for a response to request at descriptor %u\n", desc_head);
+    }
+
+    virtio_virtq_add_used(vq, desc_head, written);
+}
+
+/* First block of a range of the request, false if the range is not within the usable region */
+static bool range_blocks(struct virtio_mem_device *mem, struct virtio_mem_req_range *range, uint64_t *first)
+{
+    uint64_t block_size = mem->config.block_size;
+    uint64_t usable_end = mem->config.addr + mem->config.usable_region_size;
+    if (range->nb_blocks == 0 || range->addr % block_size || range->addr < mem->config.addr
+        || range->addr >= usable_end || range->nb_blocks > (usable_end - range->addr) / block_size) {
+        LOG_MEM_ERR("invalid range of %u blocks at 0x%lx\n", range->nb_blocks, range->addr);
+        return false;
+    }
+
+    *first = (range->addr - mem->config.addr) / block_size;
+    return true;
+}
+
+/* Number of blocks of the range that are plugged in */
+static uint64_t range_plugged(struct virtio_mem_device *mem, uint64_t first, uint64_t nb_blocks)
+{
+    uint64_t plugged = 0;
+    for (uint64_t block = first; block < first + nb_blocks; block++) {
+        plugged += block_plugged(mem, block);
+    }
+    return plugged;
+}
+
+static void range_set_plugged(struct virtio_mem_device *mem, uint64_t first, uint64_t nb_blocks, bool plugged)
+{
+    for (uint64_t block = first; block < first + nb_blocks; block++) {
+        block_set_plugged(mem, block, plugged);
+    }
+}
+
+/* Returns the response, or VIRTIO_MEM_RESP_BUSY if it waits on the memory manager */
+static uint16_t virtio_mem_plug(struct virtio_mem_device *mem, struct virtio_mem_req_range *range)
+{
+    uint64_t first;
+    if (!range_blocks(mem, range, &first) || range_plugged(mem, first, range->nb_blocks)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    uint64_t size = range->nb_blocks * mem->config.block_size;
+    if (mem->config.plugged_size + size > mem->config.requested_size) {
+        LOG_MEM("plug of 0x%lx bytes refused, 0x%lx of 0x%lx plugged\n", size, mem->config.plugged_size,
+                mem->config.requested_size);
+        return VIRTIO_MEM_RESP_NACK;
+    }
+
+    range_set_plugged(mem, first, range->nb_blocks, true);
+    mem->config.plugged_size += size;
+    LOG_MEM("plugged 0x%lx bytes at 0x%lx\n", size, range->addr);
+
+    if (mem->mm_ch >= 0) {
+        notify_mm(mem);
+        return VIRTIO_MEM_RESP_BUSY;
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t virtio_mem_unplug(struct virtio_mem_device *mem, struct virtio_mem_req_range *range)
+{
+    uint64_t first;
+    if (!range_blocks(mem, range, &first) || range_plugged(mem, first, range->nb_blocks) != range->nb_blocks) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    range_set_plugged(mem, first, range->nb_blocks, false);
+    mem->config.plugged_size -= range->nb_blocks * mem->config.block_size;
+    LOG_MEM("unplugged 0x%lx bytes at 0x%lx\n", range->nb_blocks * mem->config.block_size, range->addr);
+
+    notify_mm(mem);
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t virtio_mem_unplug_all(struct virtio_mem_device *mem)
+{
+    memset(mem->plugged, 0, VIRTIO_MEM_BITMAP_WORDS(mem->config.region_size, mem->config.block_size)
+                                * sizeof(uint64_t));
+    mem->config.plugged_size = 0;
+    LOG_MEM("unplugged all memory\n");
+
+    notify_mm(mem);
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t virtio_mem_state(struct virtio_mem_device *mem, struct virtio_mem_req_range *range, uint16_t *state)
+{
+    uint64_t first;
+    if (!range_blocks(mem, range, &first)) {
+        return VIRTIO_MEM_RESP_ERROR;
+    }
+
+    uint64_t plugged = range_plugged(mem, first, range->nb_blocks);
+    if (plugged == range->nb_blocks) {
+        *state = VIRTIO_MEM_STATE_PLUGGED;
+    } else if (plugged == 0) {
+        *state = VIRTIO_MEM_STATE_UNPLUGGED;
+    } else {
+        *state = VIRTIO_MEM_STATE_MIXED;
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static bool virtio_mem_handle_requests(struct virtio_mem_device *mem)
+{
+    virtio_queue_handler_t *vq = &mem->vqs[VIRTIO_MEM_REQ_QUEUE];
+    bool respond = false;
+    uint16_t desc_head;
+
+    if (!vq->ready) {
+        return false;
+    }
+
+    /* One request at a time while a plug waits on the memory manager, so they are answered in order */
+    while (!mem->plug_pending && virtio_virtq_pop_avail(vq, &desc_head)) {
+        struct virtio_mem_req req = { 0 };
+        uint16_t resp_type;
+        uint16_t state = 0;
+
+        if (!virtio_read_data_from_desc_chain(vq, desc_head, sizeof(req), 0, (char *)&req)) {
+            LOG_MEM_ERR("request at descriptor %u is too short\n", desc_head);
+            resp_type = VIRTIO_MEM_RESP_ERROR;
+        } else {
+            switch (req.type) {
+            case VIRTIO_MEM_REQ_PLUG:
+                resp_type = virtio_mem_plug(mem, &req.range);
+                break;
+            case VIRTIO_MEM_REQ_UNPLUG:
+                resp_type = virtio_mem_unplug(mem, &req.range);
+                break;
+            case VIRTIO_MEM_REQ_UNPLUG_ALL:
+                resp_type = virtio_mem_unplug_all(mem);
+                break;
+            case VIRTIO_MEM_REQ_STATE:
+                resp_type = virtio_mem_state(mem, &req.range, &state);
+                break;
+            default:
+                LOG_MEM_ERR("unknown request type %u\n", req.type);
+                resp_type = VIRTIO_MEM_RESP_ERROR;
+            }
+        }
+
+        if (resp_type == VIRTIO_MEM_RESP_BUSY) {
+            mem->plug_pending = true;
+            mem->plug_head = desc_head;
+        } else {
+            virtio_mem_respond(mem, desc_head, resp_type, state);
+            respond = true;
+        }
+    }
+
+    return respond;
+}
+
+static bool virtio_mem_queue_notify(struct virtio_device *dev)
+{
+    struct virtio_mem_device *mem = device_state(dev);
+
+    if (dev->regs.QueueNotify != VIRTIO_MEM_REQ_QUEUE) {
+        LOG_MEM_ERR("notified on invalid queue %u\n", dev->regs.QueueNotify);
+        return false;
+    }
+
+    if (!virtio_mem_handle_requests(mem)) {
+        return true;
+    }
+
+    virtio_set_interrupt_status(dev, true, false);
+    return virtio_inject_interrupt(dev);
+}
+
+bool virtio_mem_mm_ack(struct virtio_mem_device *mem)
+{
+    if (!mem->plug_pending) {
+        return true;
+    }
+
+    mem->plug_pending = false;
+    bool respond = false;
+    if (mem->plug_head != PLUG_HEAD_NONE) {
+        virtio_mem_respond(mem, mem->plug_head, VIRTIO_MEM_RESP_ACK, 0);
+        respond = true;
+    }
+
+    /* Requests that queued up behind the plug */
+    respond |= virtio_mem_handle_requests(mem);
+    if (!respond) {
+        return true;
+    }
+
+    virtio_set_interrupt_status(&mem->virtio_device, true, false);
+    return virtio_inject_interrupt(&mem->virtio_device);
+}
+
+bool virtio_mem_set_requested_size(struct virtio_mem_device *mem, uint64_t size)
+{
+    if (size > mem->config.usable_region_size || size % mem->config.block_size) {
+        LOG_MEM_ERR("requested size 0x%lx is not a multiple of 0x%lx up to 0x%lx\n", size, mem->config.block_size,
+                    mem->config.usable_region_size);
+        return false;
+    }
+
+    LOG_MEM("requested size 0x%lx, 0x%lx plugged\n", size, mem->config.plugged_size);
+    mem->config.requested_size = size;
+
+    struct virtio_device *dev = &mem->virtio_device;
+    dev->regs.ConfigGeneration++;
+    virtio_set_interrupt_status(dev, false, true);
+    return virtio_inject_interrupt(dev);
+}
+
+static void virtio_mem_regs_init(struct virtio_device *dev)
+{
+    dev->regs.DeviceID = VIRTIO_DEVICE_ID_MEM;
+    dev->regs.VendorID = VIRTIO_DEV_VENDOR_ID;
+}
+
+static void virtio_mem_reset(struct virtio_device *dev)
+{
+    LOG_MEM("operation: reset device\n");
+
+    for (int i = 0; i < dev->num_vqs; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        dev->vqs[i].virtq.avail_gpa = 0;
+        dev->vqs[i].virtq.used_gpa = 0;
+        dev->vqs[i].virtq.desc_gpa = 0;
+        dev->vqs[i].virtq.num = 0;
+    }
+
+    /*
+     * Plugged memory stays plugged, a new driver finds it from plugged_size and unplugs
+     * it. A plug waiting on the memory manager still waits, but is not answered.
+     */
+    struct virtio_mem_device *mem = device_state(dev);
+    if (mem->plug_pending) {
+        mem->plug_head = PLUG_HEAD_NONE;
+    }
+
+    virtio_set_interrupt_status(dev, false, false);
+    memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
+    virtio_mem_regs_init(dev);
+}
+
+static bool virtio_mem_get_device_features(struct virtio_device *dev, uint32_t *features)
+{
+    LOG_MEM("operation: get device features\n");
+
+    switch (dev->regs.DeviceFeaturesSel) {
+    case 0:
+        *features = MEM_FEATURES;
+        break;
+    case 1:
+        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        break;
+    default:
+        *features = 0;
+    }
+
+    return true;
+}
+
+static bool virtio_mem_set_driver_features(struct virtio_device *dev, uint32_t features)
+{
+    LOG_MEM("operation: set driver features\n");
+
+    bool success = false;
+
+    switch (dev->regs.DriverFeaturesSel) {
+    // feature bits 0 to 31
+    case 0:
+        success = (features & ~MEM_FEATURES) == 0;
+        break;
+    // features bits 32 to 63
+    case 1:
+        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        break;
+    default:
+        success = true;
+    }
+
+    if (success) {
+        dev->regs.DriverFeatures = features;
+        dev->features_happy = 1;
+        LOG_MEM("device is feature happy\n");
+    }
+
+    return success;
+}
+
+static bool virtio_mem_get_device_config(struct virtio_device *dev, uint32_t offset, uint32_t *config)
+{
+    LOG_MEM("operation: get device config\n");
+
+    struct virtio_mem_config *device_config = &device_state(dev)->config;
+    if (offset >= sizeof(struct virtio_mem_config)) {
+        LOG_MEM_ERR("Unknown device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    *config = 0;
+    memcpy(config, (uint8_t *)device_config + offset, MIN(sizeof(uint32_t), sizeof(struct virtio_mem_config) - offset));
+
+    return true;
+}
+
+static bool virtio_mem_set_device_config(struct virtio_device *dev, uint32_t offset, uint32_t config)
+{
+    LOG_MEM("operation: set device config\n");
+    return false;
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_mem_reset,
+    .get_device_features = virtio_mem_get_device_features,
+    .set_driver_features = virtio_mem_set_driver_features,
+    .get_device_config = virtio_mem_get_device_config,
+    .set_device_config = virtio_mem_set_device_config,
+    .queue_notify = virtio_mem_queue_notify,
+};
+
+static struct virtio_device *virtio_mem_init(struct virtio_mem_device *mem, virtio_transport_type_t type,
+                                             irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size,
+                                             void *vmm_vaddr, uint64_t block_size, uint64_t *plugged,
+                                             size_t plugged_words, int mm_ch)
+{
+    if (block_size < MEM_MIN_BLOCK_SIZE) {
+        LOG_MEM_ERR("block size 0x%lx is less than a page\n", block_size);
+        return NULL;
+    }
+
+    if (size == 0 || size % block_size) {
+        LOG_MEM_ERR("region size 0x%lx is not a multiple of the block size 0x%lx\n", size, block_size);
+        return NULL;
+    }
+
+    if (plugged_words < VIRTIO_MEM_BITMAP_WORDS(size, block_size)) {
+        LOG_MEM_ERR("plugged bitmap of %lu words is too small, the region needs %lu\n", plugged_words,
+                    VIRTIO_MEM_BITMAP_WORDS(size, block_size));
+        return NULL;
+    }
+
+    /* Everything starts unplugged */
+    memset(plugged, 0, VIRTIO_MEM_BITMAP_WORDS(size, block_size) * sizeof(uint64_t));
+
+    struct guest_ram_region region = {
+        .gpa_start = gpa,
+        .size = size,
+        .vmm_vaddr = vmm_vaddr,
+    };
+    if (!guest_ram_add_hotplug_region(region, block_size, plugged)) {
+        return NULL;
+    }
+
+    struct virtio_device *dev = &mem->virtio_device;
+
+    dev->transport_type = type;
+    dev->funs = &functions;
+    dev->vqs = mem->vqs;
+    dev->num_vqs = VIRTIO_MEM_NUM_VIRTQ;
+    dev->irq_routing_info = irq_routing_info;
+    dev->device_data = mem;
+    virtio_mem_regs_init(dev);
+
+    memset(&mem->config, 0, sizeof(mem->config));
+    mem->config.block_size = block_size;
+    mem->config.addr = gpa;
+    mem->config.region_size = size;
+    mem->config.usable_region_size = size;
+    mem->plugged = plugged;
+    mem->mm_ch = mm_ch;
+    mem->plug_pending = false;
+
+    return dev;
+}
+
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_mem_init(struct virtio_mem_device *mem, uintptr_t region_base, uintptr_t region_size,
+                          irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, void *vmm_vaddr,
+                          uint64_t block_size, uint64_t *plugged, size_t plugged_words, int mm_ch)
+{
+    struct virtio_device *dev = virtio_mem_init(mem, VIRTIO_TRANSPORT_MMIO, irq_routing_info, gpa, size, vmm_vaddr,
+                                                block_size, plugged, plugged_words, mm_ch);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+#endif
+
+bool virtio_pci_mem_init(struct virtio_mem_device *mem, uint16_t pci_bus, uint16_t pci_dev,
+                         irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, void *vmm_vaddr,
+                         uint64_t block_size, uint64_t *plugged, size_t plugged_words, int mm_ch)
+{
+    struct virtio_device *dev = virtio_mem_init(mem, VIRTIO_TRANSPORT_PCI, irq_routing_info, gpa, size, vmm_vaddr,
+                                                block_size, plugged, plugged_words, mm_ch);
+    if (!dev) {
+        return false;
+    }
+
+    dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_MEM;
+    dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
+    dev->transport.pci.device_class = PCI_CLASS_OTHERS;
+
+    return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
+}
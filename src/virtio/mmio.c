@@ -124,6 +124,16 @@ static bool handle_virtio_mmio_reg_read(virtio_device_t *dev, size_t vcpu_id, si
     case REG_RANGE(REG_VIRTIO_MMIO_STATUS, REG_VIRTIO_MMIO_QUEUE_DESC_LOW):
         reg = dev->regs.Status;
         break;
+    case REG_RANGE(REG_VIRTIO_MMIO_SHM_LEN_LOW, REG_VIRTIO_MMIO_QUEUE_RESET): {
+        /* A region that does not exist has a length of -1 */
+        uint64_t shm_reg = UINT64_MAX;
+        if (dev->regs.SHMSel < dev->num_shm_regions) {
+            struct virtio_shm_region *shm = &dev->shm_regions[dev->regs.SHMSel];
+            shm_reg = (offset < REG_VIRTIO_MMIO_SHM_BASE_LOW) ? shm->size : shm->gpa;
+        }
+        reg = (offset & 0x4) ? shm_reg >> 32 : (uint32_t)shm_reg;
+        break;
+    }
     case REG_RANGE(REG_VIRTIO_MMIO_CONFIG_GENERATION, REG_VIRTIO_MMIO_CONFIG):
         reg = dev->regs.ConfigGeneration;
         break;
@@ -269,7 +279,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         }
         break;
     }
-    case REG_RANGE(REG_VIRTIO_MMIO_QUEUE_USED_HIGH, REG_VIRTIO_MMIO_CONFIG_GENERATION): {
+    case REG_RANGE(REG_VIRTIO_MMIO_QUEUE_USED_HIGH, REG_VIRTIO_MMIO_SHM_SEL): {
         if (dev->regs.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->used_gpa;
@@ -283,6 +293,9 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         }
         break;
     }
+    case REG_RANGE(REG_VIRTIO_MMIO_SHM_SEL, REG_VIRTIO_MMIO_SHM_LEN_LOW):
+        dev->regs.SHMSel = data;
+        break;
     case REG_RANGE(REG_VIRTIO_MMIO_CONFIG, REG_VIRTIO_MMIO_CONFIG + 0x100):
         success = dev->funs->set_device_config(dev, offset, data);
         break;
@@ -14,6 +14,7 @@
 #include <libvmm/virtio/virtio.h>
 #include <sddf/network/queue.h>
 #include <sddf/network/constants.h>
+#include "net_proto.h"
 
 /* Uncomment this to enable debug logging */
 // #define DEBUG_NET
@@ -26,17 +27,183 @@
 
 #define LOG_NET_ERR(...) do{ printf("VIRTIO(NET)|ERROR: "); printf(__VA_ARGS__); }while(0)
 
+/* With VIRTIO_F_VERSION_1 the header always includes the num_buffers field */
+#define VIRTIO_NET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
 static inline struct virtio_net_device *device_state(struct virtio_device *dev)
 {
     return (struct virtio_net_device *)dev->device_data;
 }
 
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+/*
+ * Accumulate the ones' complement sum of `len` bytes in network byte order. The bulk of the data
+ * is summed a word at a time in host byte order into independent accumulators, which the compiler
+ * can vectorise. The ones' complement sum is byte order independent (RFC 1071), so the folded
+ * result only needs swapping back before being added to `sum`.
+ */
+static uint64_t csum_add(uint64_t sum, const uint8_t *data, size_t len)
+{
+    uint64_t acc[4] = { 0 };
+    while (len >= 32) {
+        acc[0] += (uint64_t)load32(&data[0]) + load32(&data[16]);
+        acc[1] += (uint64_t)load32(&data[4]) + load32(&data[20]);
+        acc[2] += (uint64_t)load32(&data[8]) + load32(&data[24]);
+        acc[3] += (uint64_t)load32(&data[12]) + load32(&data[28]);
+        data += 32;
+        len -= 32;
+    }
+    while (len >= 4) {
+        acc[0] += load32(data);
+        data += 4;
+        len -= 4;
+    }
+
+    uint64_t host_sum = (acc[0] & 0xFFFFFFFF) + (acc[0] >> 32) + (acc[1] & 0xFFFFFFFF) + (acc[1] >> 32)
+                      + (acc[2] & 0xFFFFFFFF) + (acc[2] >> 32) + (acc[3] & 0xFFFFFFFF) + (acc[3] >> 32);
+    while (host_sum >> 16) {
+        host_sum = (host_sum & 0xFFFF) + (host_sum >> 16);
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    host_sum = __builtin_bswap16(host_sum);
+#endif
+    sum += host_sum;
+
+    while (len > 1) {
+        sum += read_be16(data);
+        data += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum += (uint16_t)data[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return sum;
+}
+
+static bool net_parse_headers(const uint8_t *frame, uint32_t len, struct virtio_net_hdr_info *info)
+{
+    if (len < ETH_HDR_LEN) {
+        return false;
+    }
+
+    uint32_t off = ETH_HDR_LEN;
+    uint16_t eth_type = read_be16(&frame[ETH_TYPE_OFF]);
+    for (int i = 0; i < VLAN_MAX_TAGS && (eth_type == ETH_TYPE_VLAN || eth_type == ETH_TYPE_QINQ); i++) {
+        if (len < off + VLAN_HDR_LEN) {
+            return false;
+        }
+        eth_type = read_be16(&frame[off + 2]);
+        off += VLAN_HDR_LEN;
+    }
+
+    info->eth_type = eth_type;
+    info->l3_off = off;
+    info->fragment = false;
+
+    if (eth_type == ETH_TYPE_IPV4) {
+        if (len < off + IPV4_HDR_MIN_LEN) {
+            return false;
+        }
+        uint32_t ihl = (frame[off] & 0xF) * 4;
+        if (ihl < IPV4_HDR_MIN_LEN || len < off + ihl) {
+            return false;
+        }
+        info->l4_proto = frame[off + IPV4_PROTO_OFF];
+        info->l3_len = read_be16(&frame[off + IPV4_TOTAL_LEN_OFF]);
+        /* Only the first fragment carries the L4 header */
+        info->fragment = (read_be16(&frame[off + IPV4_FRAG_OFF]) & IPV4_FRAG_OFF_MASK) != 0;
+        off += ihl;
+    } else if (eth_type == ETH_TYPE_IPV6) {
+        if (len < off + IPV6_HDR_LEN) {
+            return false;
+        }
+        uint8_t next_hdr = frame[off + IPV6_NEXT_HDR_OFF];
+        info->l3_len = IPV6_HDR_LEN + read_be16(&frame[off + IPV6_PAYLOAD_LEN_OFF]);
+        off += IPV6_HDR_LEN;
+        while (next_hdr == IP_PROTO_HOPOPTS || next_hdr == IP_PROTO_ROUTING || next_hdr == IP_PROTO_DSTOPTS) {
+            if (len < off + 8) {
+                return false;
+            }
+            next_hdr = frame[off];
+            off += (frame[off + 1] + 1) * 8;
+        }
+        if (len < off) {
+            return false;
+        }
+        info->l4_proto = next_hdr;
+        info->fragment = (next_hdr == IP_PROTO_FRAGMENT);
+    } else {
+        return false;
+    }
+
+    info->l4_off = off;
+    info->payload_off = off;
+    if (info->fragment) {
+        return true;
+    }
+
+    if (info->l4_proto == IP_PROTO_TCP) {
+        if (len < off + TCP_HDR_MIN_LEN) {
+            return false;
+        }
+        uint32_t doff = (frame[off + TCP_DOFF_OFF] >> 4) * 4;
+        if (doff < TCP_HDR_MIN_LEN || len < off + doff) {
+            return false;
+        }
+        info->payload_off = off + doff;
+    } else if (info->l4_proto == IP_PROTO_UDP) {
+        if (len < off + UDP_HDR_LEN) {
+            return false;
+        }
+        info->payload_off = off + UDP_HDR_LEN;
+    }
+
+    return true;
+}
+
+/* Sum of the IPv4/IPv6 pseudo-header for an L4 segment of `l4_len` bytes */
+static uint64_t csum_pseudo(const uint8_t *frame, const struct virtio_net_hdr_info *info, uint32_t l4_len)
+{
+    const uint8_t *ip = &frame[info->l3_off];
+    uint64_t sum;
+    if (info->eth_type == ETH_TYPE_IPV4) {
+        sum = csum_add(0, &ip[IPV4_SRC_OFF], 8);
+    } else {
+        sum = csum_add(0, &ip[IPV6_SRC_OFF], 32);
+    }
+    sum += info->l4_proto;
+    sum += l4_len >> 16;
+    sum += l4_len & 0xFFFF;
+    return sum;
+}
+
 static void virtio_net_regs_init(struct virtio_device *dev)
 {
     dev->regs.DeviceID = VIRTIO_DEVICE_ID_NET;
     dev->regs.VendorID = VIRTIO_DEV_VENDOR_ID;
 }
 
+/* Until the driver says otherwise it receives everything, as it would without VIRTIO_NET_F_CTRL_RX */
+static void virtio_net_rx_mode_reset(struct virtio_net_rx_mode *rx_mode)
+{
+    memset(rx_mode, 0, sizeof(*rx_mode));
+    rx_mode->promisc = true;
+}
+
 static void virtio_net_reset(struct virtio_device *dev)
 {
     LOG_NET("operation: reset\n");
@@ -49,6 +216,13 @@ static void virtio_net_reset(struct virtio_device *dev)
         dev->vqs[i].virtq.num = 0;
     }
 
+    struct virtio_net_device *state = device_state(dev);
+    state->driver_features = 0;
+    state->active_queue_pairs = 1;
+    state->rss.enabled = false;
+    virtio_net_rx_mode_reset(&state->rx_mode);
+    memcpy(state->config.mac, state->mac, VIRTIO_NET_CONFIG_MAC_SZ);
+
     virtio_set_interrupt_status(dev, false, false);
     memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
     virtio_net_regs_init(dev);
@@ -59,10 +233,33 @@ static bool driver_ok(struct virtio_device *dev)
     return (dev->regs.Status & VIRTIO_CONFIG_S_DRIVER_OK) && (dev->regs.Status & VIRTIO_CONFIG_S_FEATURES_OK);
 }
 
-/* Upstream networking device have checksum offloading? */
-static bool virtio_net_csum_offload(struct virtio_device *dev)
+#define VIRTIO_NET_FEATURE(bit) (1ull << (bit))
+
+static bool virtio_net_has_feature(struct virtio_net_device *state, int feature)
+{
+    return state->driver_features & VIRTIO_NET_FEATURE(feature);
+}
+
+/* Feature bits 0 to 63 offered to the driver */
+static uint64_t virtio_net_device_features(struct virtio_device *dev)
 {
-    return ((struct virtio_net_device *)dev->device_data)->dev_csum_offload;
+    uint64_t features = VIRTIO_NET_FEATURE(VIRTIO_NET_F_MAC) | VIRTIO_NET_FEATURE(VIRTIO_F_VERSION_1);
+    /* Partial checksums and the segments we produce are either left for the backing device to
+     * fill in or completed in software, so the guest never has to compute them itself. */
+    features |= VIRTIO_NET_FEATURE(VIRTIO_NET_F_CSUM) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_HOST_TSO4)
+              | VIRTIO_NET_FEATURE(VIRTIO_NET_F_HOST_TSO6) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_HOST_UFO);
+    /* Received frames are marked as validated when the backing device has checked them, and coalesced
+     * frames are handed to the guest with a partial checksum, both of which require GUEST_CSUM. */
+    features |= VIRTIO_NET_FEATURE(VIRTIO_NET_F_GUEST_CSUM) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_GUEST_TSO4)
+              | VIRTIO_NET_FEATURE(VIRTIO_NET_F_GUEST_TSO6) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_MRG_RXBUF);
+    /* The driver can narrow down what it receives, so unwanted frames are dropped before being copied */
+    features |= VIRTIO_NET_FEATURE(VIRTIO_NET_F_CTRL_VQ) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_CTRL_RX)
+              | VIRTIO_NET_FEATURE(VIRTIO_NET_F_CTRL_RX_EXTRA) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_CTRL_VLAN)
+              | VIRTIO_NET_FEATURE(VIRTIO_NET_F_CTRL_MAC_ADDR);
+    if (device_state(dev)->num_queue_pairs > 1) {
+        features |= VIRTIO_NET_FEATURE(VIRTIO_NET_F_MQ) | VIRTIO_NET_FEATURE(VIRTIO_NET_F_RSS);
+    }
+    return features;
 }
 
 static bool virtio_net_get_device_features(struct virtio_device *dev, uint32_t *features)
@@ -76,16 +273,11 @@ static bool virtio_net_get_device_features(struct virtio_device *dev, uint32_t *
     switch (dev->regs.DeviceFeaturesSel) {
     /* Feature bits 0 to 31 */
     case 0:
-        *features = BIT_LOW(VIRTIO_NET_F_MAC);
-        if (virtio_net_csum_offload(dev)) {
-            /* There is no need for the guest to compute full checksums in software
-             * since we will clear it anyways. */
-            *features |= BIT_LOW(VIRTIO_NET_F_CSUM);
-        }
+        *features = virtio_net_device_features(dev);
         break;
     /* Features bits 32 to 63 */
     case 1:
-        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        *features = virtio_net_device_features(dev) >> 32;
         break;
     default:
         *features = 0;
@@ -96,6 +288,8 @@ static bool virtio_net_get_device_features(struct virtio_device *dev, uint32_t *
 
 static bool virtio_net_set_driver_features(struct virtio_device *dev, uint32_t features)
 {
+    struct virtio_net_device *state = device_state(dev);
+    uint64_t device_features = virtio_net_device_features(dev);
     bool success = true;
 
     switch (dev->regs.DriverFeaturesSel) {
@@ -103,11 +297,25 @@ static bool virtio_net_set_driver_features(struct virtio_device *dev, uint32_t f
     case 0:
         /** F_MAC is required */
         success = (features & BIT_LOW(VIRTIO_NET_F_MAC));
+        success = success && (features & (uint32_t)device_features) == features;
+        /* Every control command needs the control virtqueue */
+        if (features & (BIT_LOW(VIRTIO_NET_F_CTRL_RX) | BIT_LOW(VIRTIO_NET_F_CTRL_RX_EXTRA)
+                        | BIT_LOW(VIRTIO_NET_F_CTRL_VLAN) | BIT_LOW(VIRTIO_NET_F_CTRL_MAC_ADDR)
+                        | BIT_LOW(VIRTIO_NET_F_MQ))) {
+            success = success && (features & BIT_LOW(VIRTIO_NET_F_CTRL_VQ));
+        }
+        if (success) {
+            state->driver_features = (state->driver_features & ~0xFFFFFFFFull) | features;
+        }
         break;
 
     /* Features bits 32 to 63 */
     case 1:
-        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        success = (features & BIT_HIGH(VIRTIO_F_VERSION_1));
+        success = success && (features & (uint32_t)(device_features >> 32)) == features;
+        if (success) {
+            state->driver_features = (state->driver_features & 0xFFFFFFFFull) | ((uint64_t)features << 32);
+        }
         break;
     }
 
@@ -122,25 +330,14 @@ static bool virtio_net_get_device_config(struct virtio_device *dev, uint32_t off
 {
     struct virtio_net_config *config = &device_state(dev)->config;
 
-    uint32_t word_offset = offset / sizeof(uint32_t);
-    switch (word_offset) {
-    case 0:
-        *ret_val = (uint32_t)config->mac[0];
-        *ret_val |= (uint32_t)config->mac[1] << 8;
-        *ret_val |= (uint32_t)config->mac[2] << 16;
-        *ret_val |= (uint32_t)config->mac[3] << 24;
-        break;
-
-    case 1:
-        *ret_val = (uint32_t)config->mac[4];
-        *ret_val |= (uint32_t)config->mac[5] << 8;
-        break;
-
-    default:
+    if (offset >= sizeof(struct virtio_net_config)) {
         LOG_NET_ERR("Unknown device config register: 0x%x\n", offset);
         return false;
     }
 
+    *ret_val = 0;
+    memcpy(ret_val, (uint8_t *)config + offset, MIN(sizeof(uint32_t), sizeof(struct virtio_net_config) - offset));
+
     return true;
 }
 
@@ -157,254 +354,1423 @@ static bool virtio_net_respond(struct virtio_device *dev)
     return success;
 }
 
-void sanitise_packet_for_hw_csum(char *buf, size_t len)
-{
-    /* Make sure it's an IPv4 frame */
-    uint16_t eth_type = (buf[12] << 8) | buf[13];
-    if (eth_type != 0x0800) {
-        return; // Only handling IPv4 for now
-    }
-
-    /* Locate IP header */
-    char *ip_hdr = &buf[14];
-    char ip_proto = ip_hdr[9];
-    char ip_hdr_len = (ip_hdr[0] & 0x0F) * 4;
-    char *l4_hdr = ip_hdr + ip_hdr_len;
-
-    /* Zero out IP csum */
-    ip_hdr[10] = 0;
-    ip_hdr[11] = 0;
-
-    /* Zero out L4 csum */
-    if (ip_proto == 1) {
-        /* ICMP */
-        l4_hdr[2] = 0;
-        l4_hdr[3] = 0;
-    } else if (ip_proto == 6) {
-        /* TCP */
-        l4_hdr[16] = 0;
-        l4_hdr[17] = 0;
-    } else if (ip_proto == 17) {
-        /* UDP */
-        l4_hdr[6] = 0;
-        l4_hdr[7] = 0;
-    } else {
-        LOG_NET_ERR("unknown IP protocol for checksum clearning: 0x%x\n", ip_proto);
+/* Offset of the checksum field within the L4 header, or 0 if the protocol has none we know of */
+static uint16_t net_l4_csum_off(const struct virtio_net_hdr_info *info)
+{
+    switch (info->l4_proto) {
+    case IP_PROTO_TCP:
+        return TCP_CSUM_OFF;
+    case IP_PROTO_UDP:
+        return UDP_CSUM_OFF;
+    case IP_PROTO_ICMP:
+        return (info->eth_type == ETH_TYPE_IPV4) ? ICMP_CSUM_OFF : 0;
+    default:
+        return 0;
     }
 }
 
-static void handle_tx_msg(struct virtio_device *dev, uint16_t desc_head, bool *notify_tx_server, bool *respond_to_guest)
+static void ipv4_csum_fill(uint8_t *ip, uint16_t ip_hdr_len)
 {
-    struct virtio_net_device *state = device_state(dev);
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_TX_VIRTQ];
+    write_be16(&ip[IPV4_CSUM_OFF], 0);
+    write_be16(&ip[IPV4_CSUM_OFF], ~csum_fold(csum_add(0, ip, ip_hdr_len)));
+}
 
-    if (net_queue_full_active(&state->tx)) {
-        goto fail;
-    }
+/* Fill in the full L4 checksum of a frame with a complete L4 header */
+static void l4_csum_fill(uint8_t *frame, const struct virtio_net_hdr_info *info, uint32_t len)
+{
+    uint32_t l4_len = len - info->l4_off;
+    uint8_t *csum = &frame[info->l4_off + net_l4_csum_off(info)];
+    write_be16(csum, 0);
+    uint16_t sum = ~csum_fold(csum_add(csum_pseudo(frame, info, l4_len), &frame[info->l4_off], l4_len));
+    /* Zero means no checksum for UDP over IPv4 and is the same as 0xFFFF for TCP */
+    write_be16(csum, sum ? sum : 0xFFFF);
+}
 
-    net_buff_desc_t sddf_buffer;
-    int error = net_dequeue_free(&state->tx, &sddf_buffer);
-    if (error) {
-        goto fail;
+/*
+ * Get the checksums of a frame about to be enqueued to sDDF into the form the backing device
+ * expects. A device that offloads checksums computes the IPv4 header and TCP/UDP/ICMP checksums
+ * itself and needs them cleared, otherwise it double-checksums. Any partial checksum the device
+ * cannot complete (or every one, without checksum offload) is completed here as described by the
+ * virtIO header, which has been checked to lie within the frame.
+ */
+static void tx_csum_finish(struct virtio_net_device *state, uint8_t *frame, uint32_t len,
+                           const struct virtio_net_hdr *virtio_hdr)
+{
+    bool needs_csum = virtio_hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    uint32_t csum_off = virtio_hdr->csum_start + virtio_hdr->csum_offset;
+
+    struct virtio_net_hdr_info info;
+    if (state->dev_csum_offload && net_parse_headers(frame, len, &info)) {
+        if (info.eth_type == ETH_TYPE_IPV4) {
+            write_be16(&frame[info.l3_off + IPV4_CSUM_OFF], 0);
+        }
+        uint16_t l4_csum_off = net_l4_csum_off(&info);
+        if (!info.fragment && l4_csum_off != 0 && info.l4_off + l4_csum_off + sizeof(uint16_t) <= len) {
+            write_be16(&frame[info.l4_off + l4_csum_off], 0);
+            if (csum_off == info.l4_off + l4_csum_off) {
+                needs_csum = false;
+            }
+        }
     }
 
-    char *dest_buf = state->tx_data + sddf_buffer.io_or_offset;
+    if (needs_csum) {
+        uint16_t csum = ~csum_fold(csum_add(0, &frame[virtio_hdr->csum_start], len - virtio_hdr->csum_start));
+        write_be16(&frame[csum_off], csum ? csum : 0xFFFF);
+    }
+}
 
-    uint64_t payload_len = virtio_desc_chain_payload_len(vq, desc_head);
-    uint64_t packet_len = payload_len - sizeof(struct virtio_net_hdr_mrg_rxbuf);
+/* Take buffers off the sDDF TX free queue until `num` free buffers are held */
+static void tx_free_reap(struct virtio_net_device *state, uint16_t qp_idx, uint32_t num)
+{
+    struct virtio_net_queue_pair *qp = &state->queue_pairs[qp_idx];
+    struct virtio_net_tx_state *tx = &state->tx_state[qp_idx];
 
-    /*
-     * read_off = sizeof(struct virtio_net_hdr_mrg_rxbuf)
-     * to strip virtio header before copying to sDDF
-     */
-    assert(
-        virtio_read_data_from_desc_chain(vq, desc_head, packet_len, sizeof(struct virtio_net_hdr_mrg_rxbuf), dest_buf));
-    sddf_buffer.len = packet_len;
+    net_buff_desc_t buffer;
+    while (tx->num_pool < num && !net_dequeue_free(&qp->tx, &buffer)) {
+        tx->pool[tx->num_pool++] = buffer;
+    }
+}
 
-    if (virtio_net_csum_offload(dev)) {
-        /* Even for partially checksummed packets we need to clear all checksums,
-         * otherwise it causes double checksumming. */
-        sanitise_packet_for_hw_csum(dest_buf, sddf_buffer.len);
+/* Make sure `num` free sDDF TX buffers are held for a frame */
+static bool tx_free_reserve(struct virtio_net_device *state, uint16_t qp_idx, uint32_t num)
+{
+    struct virtio_net_tx_state *tx = &state->tx_state[qp_idx];
+    if (tx->num_pool < num) {
+        tx_free_reap(state, qp_idx, num);
     }
 
-    error = net_enqueue_active(&state->tx, sddf_buffer);
-    /* This cannot fail as we've checked above */
-    assert(!error);
+    return tx->num_pool >= num;
+}
 
-    virtio_virtq_add_used(vq, desc_head, 0);
-    *respond_to_guest = true;
-    *notify_tx_server = true;
-    return;
+/* Take a free sDDF TX buffer to copy a frame into */
+static bool tx_free_dequeue(struct virtio_net_device *state, struct virtio_net_queue_pair *qp,
+                            net_buff_desc_t *buffer)
+{
+    uint16_t qp_idx = qp - state->queue_pairs;
+    struct virtio_net_tx_state *tx = &state->tx_state[qp_idx];
 
-fail:
-    virtio_virtq_add_used(vq, desc_head, 0);
-    *respond_to_guest = true;
+    if (!tx_free_reserve(state, qp_idx, 1) || net_queue_full_active(&qp->tx)) {
+        return false;
+    }
+    *buffer = tx->pool[--tx->num_pool];
+
+    return true;
 }
 
-static bool virtio_net_queue_notify(struct virtio_device *dev)
+/*
+ * Split a TCP frame handed to us by a guest that negotiated VIRTIO_NET_F_HOST_TSO4/6 into frames
+ * carrying at most `mss` bytes of payload each. Every segment gets a copy of the original headers
+ * with the lengths, sequence number and flags fixed up. Checksums are cleared for the backing
+ * device to fill in if it offloads them, otherwise they are computed here.
+ */
+static void tx_segment_tcp(struct virtio_net_device *state, virtio_queue_handler_t *vq,
+                           struct virtio_net_queue_pair *qp, uint16_t desc_head, const uint8_t *hdr,
+                           const struct virtio_net_hdr_info *info, uint64_t packet_len, uint16_t mss,
+                           bool *notify_tx_server)
 {
-    struct virtio_net_device *state = device_state(dev);
 
-    if (!driver_ok(dev)) {
-        LOG_NET_ERR("Driver not ready\n");
-        return false;
+    uint32_t seq = read_be32(&hdr[info->l4_off + TCP_SEQ_OFF]);
+    uint8_t tcp_flags = hdr[info->l4_off + TCP_FLAGS_OFF];
+    uint16_t ip_id = 0;
+    if (info->eth_type == ETH_TYPE_IPV4) {
+        ip_id = read_be16(&hdr[info->l3_off + IPV4_ID_OFF]);
     }
-    if (dev->regs.QueueSel == VIRTIO_NET_RX_VIRTQ) {
-        if (!dev->vqs[VIRTIO_NET_RX_VIRTQ].ready) {
-            LOG_NET_ERR("RX virtq not ready\n");
-            return false;
+
+    uint64_t payload_len = packet_len - info->payload_off;
+    uint16_t seg_idx = 0;
+    for (uint64_t off = 0; off < payload_len; off += mss, seg_idx++) {
+        uint16_t seg_len = MIN(mss, payload_len - off);
+        bool last = (off + seg_len == payload_len);
+
+        net_buff_desc_t sddf_buffer;
+        if (!tx_free_dequeue(state, qp, &sddf_buffer)) {
+            LOG_NET_ERR("no sDDF TX buffers, dropping %lu bytes of TCP payload\n", payload_len - off);
+            return;
         }
-        virtio_net_handle_rx(device_state(dev));
-        return true;
+
+        uint8_t *dest = qp->tx_data + sddf_buffer.io_or_offset;
+        memcpy(dest, hdr, info->payload_off);
+        assert(virtio_read_data_from_desc_chain(vq, desc_head, seg_len, VIRTIO_NET_HDR_SIZE + info->payload_off + off,
+                                                (char *)dest + info->payload_off));
+
+        uint8_t *ip = &dest[info->l3_off];
+        uint8_t *tcp = &dest[info->l4_off];
+        if (info->eth_type == ETH_TYPE_IPV4) {
+            write_be16(&ip[IPV4_TOTAL_LEN_OFF], info->payload_off - info->l3_off + seg_len);
+            write_be16(&ip[IPV4_ID_OFF], ip_id + seg_idx);
+            write_be16(&ip[IPV4_CSUM_OFF], 0);
+        } else {
+            write_be16(&ip[IPV6_PAYLOAD_LEN_OFF], info->payload_off - info->l3_off - IPV6_HDR_LEN + seg_len);
+        }
+
+        uint8_t flags = tcp_flags;
+        if (!last) {
+            flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (seg_idx != 0) {
+            flags &= ~TCP_FLAG_CWR;
+        }
+        tcp[TCP_FLAGS_OFF] = flags;
+        write_be32(&tcp[TCP_SEQ_OFF], seq + off);
+        write_be16(&tcp[TCP_CSUM_OFF], 0);
+
+        sddf_buffer.len = info->payload_off + seg_len;
+        if (!state->dev_csum_offload) {
+            if (info->eth_type == ETH_TYPE_IPV4) {
+                ipv4_csum_fill(ip, info->l4_off - info->l3_off);
+            }
+            l4_csum_fill(dest, info, sddf_buffer.len);
+        }
+        int error = net_enqueue_active(&qp->tx, sddf_buffer);
+        assert(!error);
+        *notify_tx_server = true;
     }
-    if (dev->regs.QueueSel == VIRTIO_NET_TX_VIRTQ && !dev->vqs[VIRTIO_NET_TX_VIRTQ].ready) {
-        LOG_NET_ERR("TX virtq not ready\n");
-        return false;
+}
+
+/*
+ * Split a UDP datagram handed to us by a guest that negotiated VIRTIO_NET_F_HOST_UFO into IPv4
+ * fragments carrying at most `frag_size` bytes each. A device cannot checksum a datagram that has
+ * already been fragmented, so the UDP checksum is completed here if the guest left it partial.
+ */
+static void tx_fragment_udp(struct virtio_net_device *state, virtio_queue_handler_t *vq,
+                            struct virtio_net_queue_pair *qp, uint16_t desc_head, const uint8_t *hdr,
+                            const struct virtio_net_hdr_info *info, uint64_t packet_len, uint16_t frag_size,
+                            bool needs_csum, bool *notify_tx_server)
+{
+
+    uint64_t datagram_len = packet_len - info->l4_off;
+    uint64_t sum = 0;
+    if (needs_csum) {
+        sum = csum_pseudo(hdr, info, datagram_len);
     }
 
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_TX_VIRTQ];
+    /* The first fragment holds the UDP header and is only sent once its checksum is known.
+     * Fragments may arrive in any order, so it going out last makes no difference to the receiver. */
+    net_buff_desc_t first_buffer = { 0 };
+    for (uint64_t off = 0; off < datagram_len; off += frag_size) {
+        uint16_t frag_len = MIN(frag_size, datagram_len - off);
+        bool last = (off + frag_len == datagram_len);
+
+        net_buff_desc_t sddf_buffer;
+        if (!tx_free_dequeue(state, qp, &sddf_buffer)) {
+            LOG_NET_ERR("no sDDF TX buffers, dropping %lu bytes of UDP datagram\n", datagram_len - off);
+            if (off == 0) {
+                return;
+            }
+            /* The receiver discards the incomplete datagram on reassembly timeout */
+            break;
+        }
 
-    bool notify_tx_server = false;
-    bool respond_to_guest = false;
+        uint8_t *dest = qp->tx_data + sddf_buffer.io_or_offset;
+        memcpy(dest, hdr, info->l4_off);
+        assert(virtio_read_data_from_desc_chain(vq, desc_head, frag_len, VIRTIO_NET_HDR_SIZE + info->l4_off + off,
+                                                (char *)dest + info->l4_off));
+
+        uint8_t *ip = &dest[info->l3_off];
+        write_be16(&ip[IPV4_TOTAL_LEN_OFF], info->l4_off - info->l3_off + frag_len);
+        write_be16(&ip[IPV4_FRAG_OFF], (off >> 3) | (last ? 0 : IPV4_FRAG_MF));
+        write_be16(&ip[IPV4_CSUM_OFF], 0);
+        if (!state->dev_csum_offload) {
+            ipv4_csum_fill(ip, info->l4_off - info->l3_off);
+        }
 
-    uint16_t desc_head;
-    while (virtio_virtq_pop_avail(vq, &desc_head)) {
-        handle_tx_msg(dev, desc_head, &notify_tx_server, &respond_to_guest);
-    }
+        if (needs_csum) {
+            if (off == 0) {
+                write_be16(&dest[info->l4_off + UDP_CSUM_OFF], 0);
+            }
+            /* Every fragment but the last is a multiple of 8 bytes, so the partial sums line up */
+            sum = csum_add(sum, &dest[info->l4_off], frag_len);
+        }
 
-    if (notify_tx_server && net_require_signal_active(&state->tx)) {
-        net_cancel_signal_active(&state->tx);
-        microkit_notify(state->tx_ch);
+        sddf_buffer.len = info->l4_off + frag_len;
+        if (off == 0) {
+            first_buffer = sddf_buffer;
+        } else {
+            int error = net_enqueue_active(&qp->tx, sddf_buffer);
+            assert(!error);
+        }
     }
 
-    bool success = true;
-    if (respond_to_guest) {
-        success = virtio_net_respond(dev);
+    if (needs_csum) {
+        uint16_t csum = ~csum_fold(sum);
+        uint8_t *first = qp->tx_data + first_buffer.io_or_offset;
+        /* Zero means no checksum for UDP over IPv4 */
+        write_be16(&first[info->l4_off + UDP_CSUM_OFF], csum ? csum : 0xFFFF);
     }
 
-    return success;
+    int error = net_enqueue_active(&qp->tx, first_buffer);
+    assert(!error);
+    *notify_tx_server = true;
 }
 
-static void handle_rx_buffer(struct virtio_device *dev, uint64_t buf_offset, uint32_t size, bool *respond_to_guest)
+/*
+ * Returns false if there are not enough free sDDF buffers for all the segments of the frame yet, in
+ * which case it has not been consumed. Malformed frames are dropped.
+ */
+static bool handle_tx_gso(struct virtio_net_device *state, virtio_queue_handler_t *vq,
+                          struct virtio_net_queue_pair *qp, uint16_t desc_head, const struct virtio_net_hdr *virtio_hdr,
+                          uint64_t packet_len, bool *notify_tx_server)
 {
-    struct virtio_net_device *state = device_state(dev);
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_RX_VIRTQ];
+    uint16_t qp_idx = qp - state->queue_pairs;
 
-    if (!vq->ready) {
-        return;
-    }
+    uint8_t hdr[VIRTIO_NET_MAX_HDR_LEN];
+    uint32_t hdr_copy_len = MIN(packet_len, VIRTIO_NET_MAX_HDR_LEN);
+    assert(virtio_read_data_from_desc_chain(vq, desc_head, hdr_copy_len, VIRTIO_NET_HDR_SIZE, (char *)hdr));
 
-    uint16_t desc_head;
-    if (!virtio_virtq_pop_avail(vq, &desc_head)) {
-        /* No available buffer */
-        return;
+    struct virtio_net_hdr_info info;
+    if (!net_parse_headers(hdr, hdr_copy_len, &info) || info.fragment) {
+        LOG_NET_ERR("could not parse headers of GSO frame, dropping\n");
+        return true;
     }
 
-    struct virtio_net_hdr_mrg_rxbuf virtio_hdr = { 0 };
-    virtio_hdr.num_buffers = 1;
-
-    assert(virtio_write_data_to_desc_chain(vq, desc_head, sizeof(struct virtio_net_hdr_mrg_rxbuf), 0,
-                                           (char *)&virtio_hdr));
-    assert(virtio_write_data_to_desc_chain(vq, desc_head, size, sizeof(struct virtio_net_hdr_mrg_rxbuf),
-                                           (char *)(state->rx_data + buf_offset)));
-
-    /* Put it in the used ring */
-    virtio_virtq_add_used(vq, desc_head, sizeof(struct virtio_net_hdr_mrg_rxbuf) + size);
+    uint8_t gso_type = virtio_hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    uint16_t gso_size = virtio_hdr->gso_size;
+    switch (gso_type) {
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6: {
+        uint16_t eth_type = (gso_type == VIRTIO_NET_HDR_GSO_TCPV4) ? ETH_TYPE_IPV4 : ETH_TYPE_IPV6;
+        if (info.eth_type != eth_type || info.l4_proto != IP_PROTO_TCP || gso_size == 0
+            || info.payload_off + gso_size > NET_BUFFER_SIZE) {
+            break;
+        }
+        uint64_t num_segs = (packet_len - info.payload_off + gso_size - 1) / gso_size;
+        if (num_segs > VIRTIO_NET_TX_POOL_SIZE) {
+            break;
+        }
+        if (!tx_free_reserve(state, qp_idx, num_segs)) {
+            return false;
+        }
+        tx_segment_tcp(state, vq, qp, desc_head, hdr, &info, packet_len, gso_size, notify_tx_server);
+        return true;
+    }
+    case VIRTIO_NET_HDR_GSO_UDP: {
+        uint16_t frag_size = gso_size & ~0x7;
+        if (info.eth_type != ETH_TYPE_IPV4 || info.l4_proto != IP_PROTO_UDP || frag_size == 0
+            || info.l4_off + frag_size > NET_BUFFER_SIZE) {
+            break;
+        }
+        uint64_t num_frags = (packet_len - info.l4_off + frag_size - 1) / frag_size;
+        if (num_frags > VIRTIO_NET_TX_POOL_SIZE) {
+            break;
+        }
+        if (!tx_free_reserve(state, qp_idx, num_frags)) {
+            return false;
+        }
+        bool needs_csum = virtio_hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        tx_fragment_udp(state, vq, qp, desc_head, hdr, &info, packet_len, frag_size, needs_csum,
+                        notify_tx_server);
+        return true;
+    }
+    default:
+        break;
+    }
 
-    *respond_to_guest = true;
+    LOG_NET_ERR("unsupported GSO frame (type 0x%x, size %u), dropping\n", virtio_hdr->gso_type, gso_size);
+    return true;
 }
 
-void virtio_net_handle_rx(struct virtio_net_device *state)
+/*
+ * Send the frame in a TX descriptor chain. Returns false if there are no free sDDF buffers to send
+ * it with, in which case the chain is left for when the TX virtualiser returns some.
+ */
+static bool handle_tx_msg(struct virtio_device *dev, uint16_t qp_idx, uint16_t desc_head, bool *notify_tx_server,
+                          bool *respond_to_guest)
 {
-    struct virtio_device *dev = &state->virtio_device;
-    net_buff_desc_t sddf_buffer;
-    bool reprocess = true;
-    bool respond_to_guest = false;
+    struct virtio_net_device *state = device_state(dev);
+    struct virtio_net_queue_pair *qp = &state->queue_pairs[qp_idx];
+    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_TX_VIRTQ_IDX(qp_idx)];
 
-    while (reprocess) {
-        while (net_dequeue_active(&state->rx, &sddf_buffer) != -1) {
-            /* this is likely most of the time, we don't want to pay the branch misprediction cost */
-            if (likely(driver_ok(dev) && dev->vqs[VIRTIO_NET_RX_VIRTQ].ready)) {
-                /* On failure, drop packet since we don't know how long until next interrupt */
-                handle_rx_buffer(dev, sddf_buffer.io_or_offset, sddf_buffer.len, &respond_to_guest);
-            }
+    uint64_t payload_len = virtio_desc_chain_payload_len(vq, desc_head);
+    if (payload_len < VIRTIO_NET_HDR_SIZE) {
+        LOG_NET_ERR("TX descriptor chain %u too short for virtIO header\n", desc_head);
+        goto fail;
+    }
+    uint64_t packet_len = payload_len - VIRTIO_NET_HDR_SIZE;
 
-            sddf_buffer.len = 0;
-            net_enqueue_free(&state->rx, sddf_buffer);
-        }
+    struct virtio_net_hdr_mrg_rxbuf virtio_hdr;
+    assert(virtio_read_data_from_desc_chain(vq, desc_head, VIRTIO_NET_HDR_SIZE, 0, (char *)&virtio_hdr));
 
-        net_request_signal_active(&state->rx);
-        reprocess = false;
+    if (net_filter_enabled(&state->filter, NET_FILTER_TX)) {
+        uint8_t hdr[VIRTIO_NET_MAX_HDR_LEN];
+        uint32_t hdr_len = MIN(packet_len, VIRTIO_NET_MAX_HDR_LEN);
+        assert(virtio_read_data_from_desc_chain(vq, desc_head, hdr_len, VIRTIO_NET_HDR_SIZE, (char *)hdr));
+        if (!net_filter_accept(&state->filter, NET_FILTER_TX, hdr, hdr_len)) {
+            goto fail;
+        }
+    }
 
-        if (!net_queue_empty_active(&state->rx)) {
-            net_cancel_signal_active(&state->rx);
-            reprocess = true;
+    if (virtio_hdr.hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        if (!handle_tx_gso(state, vq, qp, desc_head, &virtio_hdr.hdr, packet_len, notify_tx_server)) {
+            return false;
         }
+        virtio_virtq_add_used(vq, desc_head, 0);
+        *respond_to_guest = true;
+        return true;
     }
 
-    if (respond_to_guest) {
-        virtio_net_respond(dev);
+    if ((virtio_hdr.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+        && (virtio_hdr.hdr.csum_start >= packet_len
+            || virtio_hdr.hdr.csum_start + virtio_hdr.hdr.csum_offset + sizeof(uint16_t) > packet_len)) {
+        LOG_NET_ERR("partial checksum at %u+%u outside of %lu byte frame\n", virtio_hdr.hdr.csum_start,
+                    virtio_hdr.hdr.csum_offset, packet_len);
+        goto fail;
     }
-}
 
-static virtio_device_funs_t functions = {
-    .device_reset = virtio_net_reset,
-    .get_device_features = virtio_net_get_device_features,
-    .set_driver_features = virtio_net_set_driver_features,
-    .get_device_config = virtio_net_get_device_config,
-    .set_device_config = virtio_net_set_device_config,
-    .queue_notify = virtio_net_queue_notify,
-};
+    net_buff_desc_t sddf_buffer;
+    if (!tx_free_dequeue(state, qp, &sddf_buffer)) {
+        return false;
+    }
 
-static struct virtio_device *virtio_net_init(struct virtio_net_device *net_dev, virtio_transport_type_t type,
-                                             irq_routing_info_t irq_routing_info, net_queue_handle_t *rx,
-                                             net_queue_handle_t *tx, uintptr_t rx_data, uintptr_t tx_data,
-                                             microkit_channel rx_ch, microkit_channel tx_ch,
-                                             uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
-{
-    struct virtio_device *dev = &net_dev->virtio_device;
+    char *dest_buf = qp->tx_data + sddf_buffer.io_or_offset;
 
-    virtio_net_regs_init(dev);
-    dev->transport_type = type;
-    dev->funs = &functions;
-    dev->vqs = net_dev->vqs;
-    dev->num_vqs = VIRTIO_NET_NUM_VIRTQ;
-    dev->irq_routing_info = irq_routing_info;
-    dev->device_data = net_dev;
+    /*
+     * read_off = VIRTIO_NET_HDR_SIZE
+     * to strip virtio header before copying to sDDF
+     */
+    assert(virtio_read_data_from_desc_chain(vq, desc_head, packet_len, VIRTIO_NET_HDR_SIZE, dest_buf));
+    sddf_buffer.len = packet_len;
 
-    memcpy(net_dev->config.mac, mac, VIRTIO_NET_CONFIG_MAC_SZ);
+    tx_csum_finish(state, (uint8_t *)dest_buf, sddf_buffer.len, &virtio_hdr.hdr);
 
-    net_dev->rx = *rx;
-    net_dev->tx = *tx;
-    net_dev->rx_data = (void *)rx_data;
-    net_dev->tx_data = (void *)tx_data;
-    net_dev->rx_ch = rx_ch;
-    net_dev->tx_ch = tx_ch;
-    net_dev->dev_csum_offload = csum_offload;
+    int error = net_enqueue_active(&qp->tx, sddf_buffer);
+    /* This cannot fail as we've checked above */
+    assert(!error);
 
-    return dev;
-}
+    virtio_virtq_add_used(vq, desc_head, 0);
+    *respond_to_guest = true;
+    *notify_tx_server = true;
+    return true;
 
-#if !defined(CONFIG_ARCH_X86)
-bool virtio_mmio_net_init(struct virtio_net_device *net_dev, uintptr_t region_base, uintptr_t region_size,
+fail:
+    /* Malformed and filtered frames are dropped */
+    virtio_virtq_add_used(vq, desc_head, 0);
+    *respond_to_guest = true;
+    return true;
+}
+
+/* Largest command data accepted on the control virtqueue, enough for a full RSS configuration */
+#define VIRTIO_NET_CTRL_MAX_DATA_LEN 512
+
+/* The control virtqueue follows the last queue pair the driver may use */
+static uint16_t virtio_net_ctrl_virtq_idx(struct virtio_net_device *state)
+{
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_MQ)) {
+        return 2 * state->num_queue_pairs;
+    }
+    return 2;
+}
+
+static bool virtio_net_rss_configure(struct virtio_net_device *state, const uint8_t *data, uint32_t len)
+{
+    struct virtio_net_rss_config config;
+    if (len < sizeof(config)) {
+        return false;
+    }
+    memcpy(&config, data, sizeof(config));
+
+    uint32_t table_len = config.indirection_table_mask + 1;
+    if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN || (table_len & (table_len - 1)) != 0) {
+        LOG_NET_ERR("invalid RSS indirection table length %u\n", table_len);
+        return false;
+    }
+
+    /* The indirection table is followed by max_tx_vq, the key length and the key */
+    uint32_t off = sizeof(config) + table_len * sizeof(uint16_t);
+    if (len < off + sizeof(uint16_t) + sizeof(uint8_t)) {
+        return false;
+    }
+    uint16_t max_tx_vq;
+    memcpy(&max_tx_vq, &data[off], sizeof(uint16_t));
+    uint8_t key_size = data[off + sizeof(uint16_t)];
+    off += sizeof(uint16_t) + sizeof(uint8_t);
+    if (key_size > VIRTIO_NET_RSS_MAX_KEY_SIZE || len < off + key_size) {
+        LOG_NET_ERR("invalid RSS key length %u\n", key_size);
+        return false;
+    }
+    if (max_tx_vq == 0 || max_tx_vq > state->num_queue_pairs || config.unclassified_queue >= state->num_queue_pairs) {
+        return false;
+    }
+
+    struct virtio_net_rss *rss = &state->rss;
+    for (uint32_t i = 0; i < table_len; i++) {
+        uint16_t queue;
+        memcpy(&queue, &data[sizeof(config) + i * sizeof(uint16_t)], sizeof(uint16_t));
+        if (queue >= state->num_queue_pairs) {
+            LOG_NET_ERR("RSS indirection table entry %u refers to invalid queue %u\n", i, queue);
+            return false;
+        }
+        rss->indirection_table[i] = queue;
+    }
+
+    rss->hash_types = config.hash_types;
+    rss->indirection_table_mask = config.indirection_table_mask;
+    rss->unclassified_queue = config.unclassified_queue;
+    rss->key_size = key_size;
+    memset(rss->key, 0, sizeof(rss->key));
+    memcpy(rss->key, &data[off], key_size);
+    rss->enabled = true;
+    state->active_queue_pairs = max_tx_vq;
+
+    return true;
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_ctrl_mq(struct virtio_net_device *state, uint8_t cmd,
+                                                     const uint8_t *data, uint32_t len)
+{
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: {
+        struct virtio_net_ctrl_mq mq;
+        if (len < sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        memcpy(&mq, data, sizeof(mq));
+        if (mq.virtqueue_pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || mq.virtqueue_pairs > state->num_queue_pairs) {
+            LOG_NET_ERR("driver requested invalid number of queue pairs %u\n", mq.virtqueue_pairs);
+            return VIRTIO_NET_ERR;
+        }
+        LOG_NET("using %u queue pairs\n", mq.virtqueue_pairs);
+        state->active_queue_pairs = mq.virtqueue_pairs;
+        /* Back to the default steering of sDDF queue to virtqueue */
+        state->rss.enabled = false;
+        return VIRTIO_NET_OK;
+    }
+    case VIRTIO_NET_CTRL_MQ_RSS_CONFIG:
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_RSS) || !virtio_net_rss_configure(state, data, len)) {
+            return VIRTIO_NET_ERR;
+        }
+        return VIRTIO_NET_OK;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_ctrl_rx(struct virtio_net_device *state, uint8_t cmd,
+                                                     const uint8_t *data, uint32_t len)
+{
+    struct virtio_net_rx_mode *rx_mode = &state->rx_mode;
+    if (len < 1) {
+        return VIRTIO_NET_ERR;
+    }
+    bool on = data[0] != 0;
+
+    int feature = (cmd <= VIRTIO_NET_CTRL_RX_ALLMULTI) ? VIRTIO_NET_F_CTRL_RX : VIRTIO_NET_F_CTRL_RX_EXTRA;
+    if (!virtio_net_has_feature(state, feature)) {
+        return VIRTIO_NET_ERR;
+    }
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_RX_PROMISC:
+        rx_mode->promisc = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_ALLMULTI:
+        rx_mode->allmulti = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_ALLUNI:
+        rx_mode->alluni = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOMULTI:
+        rx_mode->nomulti = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOUNI:
+        rx_mode->nouni = on;
+        break;
+    case VIRTIO_NET_CTRL_RX_NOBCAST:
+        rx_mode->nobcast = on;
+        break;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+
+    return VIRTIO_NET_OK;
+}
+
+/* Copy one of the two address lists of a MAC_TABLE_SET command, returns the number of bytes it took up */
+static uint32_t virtio_net_mac_table_parse(const uint8_t *data, uint32_t len, uint8_t table[][VIRTIO_NET_CONFIG_MAC_SZ],
+                                           uint32_t *num_entries, bool *overflow)
+{
+    uint32_t entries;
+    if (len < sizeof(entries)) {
+        return 0;
+    }
+    memcpy(&entries, data, sizeof(entries));
+    if (entries > (len - sizeof(entries)) / VIRTIO_NET_CONFIG_MAC_SZ) {
+        return 0;
+    }
+
+    *overflow = entries > VIRTIO_NET_MAC_TABLE_SIZE;
+    *num_entries = *overflow ? 0 : entries;
+    memcpy(table, &data[sizeof(entries)], *num_entries * VIRTIO_NET_CONFIG_MAC_SZ);
+
+    return sizeof(entries) + entries * VIRTIO_NET_CONFIG_MAC_SZ;
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_ctrl_mac(struct virtio_net_device *state, uint8_t cmd,
+                                                      const uint8_t *data, uint32_t len)
+{
+    struct virtio_net_rx_mode *rx_mode = &state->rx_mode;
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MAC_TABLE_SET: {
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_RX)) {
+            return VIRTIO_NET_ERR;
+        }
+        /* The unicast list is followed by the multicast one */
+        uint32_t uni_len = virtio_net_mac_table_parse(data, len, rx_mode->uni, &rx_mode->num_uni,
+                                                      &rx_mode->uni_overflow);
+        if (uni_len == 0) {
+            return VIRTIO_NET_ERR;
+        }
+        uint32_t multi_len = virtio_net_mac_table_parse(&data[uni_len], len - uni_len, rx_mode->multi,
+                                                        &rx_mode->num_multi, &rx_mode->multi_overflow);
+        if (multi_len == 0) {
+            return VIRTIO_NET_ERR;
+        }
+        return VIRTIO_NET_OK;
+    }
+    case VIRTIO_NET_CTRL_MAC_ADDR_SET:
+        if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_MAC_ADDR) || len < VIRTIO_NET_CONFIG_MAC_SZ) {
+            return VIRTIO_NET_ERR;
+        }
+        memcpy(state->config.mac, data, VIRTIO_NET_CONFIG_MAC_SZ);
+        return VIRTIO_NET_OK;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_ctrl_vlan(struct virtio_net_device *state, uint8_t cmd,
+                                                       const uint8_t *data, uint32_t len)
+{
+    uint16_t vid;
+    if (!virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_VLAN) || len < sizeof(vid)) {
+        return VIRTIO_NET_ERR;
+    }
+    memcpy(&vid, data, sizeof(vid));
+    if (vid >= VIRTIO_NET_VLAN_MAX) {
+        return VIRTIO_NET_ERR;
+    }
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_VLAN_ADD:
+        state->rx_mode.vlans[vid / 32] |= 1u << (vid % 32);
+        return VIRTIO_NET_OK;
+    case VIRTIO_NET_CTRL_VLAN_DEL:
+        state->rx_mode.vlans[vid / 32] &= ~(1u << (vid % 32));
+        return VIRTIO_NET_OK;
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static bool virtio_net_handle_ctrl(struct virtio_device *dev)
+{
+    struct virtio_net_device *state = device_state(dev);
+    virtio_queue_handler_t *vq = &dev->vqs[virtio_net_ctrl_virtq_idx(state)];
+    bool respond_to_guest = false;
+
+    uint16_t desc_head;
+    while (virtio_virtq_pop_avail(vq, &desc_head)) {
+        /* The command header comes first and the device-writable ack last, the data is in between */
+        uint64_t len = virtio_desc_chain_payload_len(vq, desc_head);
+        if (len < sizeof(struct virtio_net_ctrl_hdr) + sizeof(virtio_net_ctrl_ack)) {
+            LOG_NET_ERR("control descriptor chain %u too short\n", desc_head);
+            virtio_virtq_add_used(vq, desc_head, 0);
+            respond_to_guest = true;
+            continue;
+        }
+
+        virtio_net_ctrl_ack ack = VIRTIO_NET_ERR;
+        uint64_t data_len = len - sizeof(struct virtio_net_ctrl_hdr) - sizeof(virtio_net_ctrl_ack);
+        struct virtio_net_ctrl_hdr hdr;
+        assert(virtio_read_data_from_desc_chain(vq, desc_head, sizeof(hdr), 0, (char *)&hdr));
+        LOG_NET("control command class %u cmd %u\n", hdr.class, hdr.cmd);
+
+        if (data_len <= VIRTIO_NET_CTRL_MAX_DATA_LEN) {
+            uint8_t data[VIRTIO_NET_CTRL_MAX_DATA_LEN];
+            if (data_len > 0) {
+                assert(virtio_read_data_from_desc_chain(vq, desc_head, data_len, sizeof(hdr), (char *)data));
+            }
+
+            switch (hdr.class) {
+            case VIRTIO_NET_CTRL_RX:
+                ack = virtio_net_handle_ctrl_rx(state, hdr.cmd, data, data_len);
+                break;
+            case VIRTIO_NET_CTRL_MAC:
+                ack = virtio_net_handle_ctrl_mac(state, hdr.cmd, data, data_len);
+                break;
+            case VIRTIO_NET_CTRL_VLAN:
+                ack = virtio_net_handle_ctrl_vlan(state, hdr.cmd, data, data_len);
+                break;
+            case VIRTIO_NET_CTRL_MQ:
+                ack = virtio_net_handle_ctrl_mq(state, hdr.cmd, data, data_len);
+                break;
+            }
+        } else if (hdr.class == VIRTIO_NET_CTRL_MAC && hdr.cmd == VIRTIO_NET_CTRL_MAC_TABLE_SET
+                   && virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_RX)) {
+            /* Filtering may be imperfect, so rather than fail let through every address of either kind */
+            state->rx_mode.uni_overflow = true;
+            state->rx_mode.multi_overflow = true;
+            ack = VIRTIO_NET_OK;
+        } else {
+            LOG_NET_ERR("control command of %lu bytes too large\n", data_len);
+        }
+
+        assert(virtio_write_data_to_desc_chain(vq, desc_head, sizeof(ack), len - sizeof(ack), (char *)&ack));
+        virtio_virtq_add_used(vq, desc_head, sizeof(ack));
+        respond_to_guest = true;
+    }
+
+    bool success = true;
+    if (respond_to_guest) {
+        success = virtio_net_respond(dev);
+    }
+
+    return success;
+}
+
+static void virtio_net_process_tx(struct virtio_device *dev, uint16_t qp_idx, bool *respond_to_guest)
+{
+    struct virtio_net_queue_pair *qp = &device_state(dev)->queue_pairs[qp_idx];
+    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_TX_VIRTQ_IDX(qp_idx)];
+
+    bool notify_tx_server = false;
+
+    uint16_t desc_head;
+    while (virtio_virtq_peek_avail(vq, &desc_head)) {
+        if (!handle_tx_msg(dev, qp_idx, desc_head, &notify_tx_server, respond_to_guest)) {
+            /* Out of sDDF buffers, leave the rest in the avail ring until the virtualiser returns some */
+            net_request_signal_free(&qp->tx);
+            if (net_queue_empty_free(&qp->tx)) {
+                break;
+            }
+            net_cancel_signal_free(&qp->tx);
+            continue;
+        }
+        vq->last_idx++;
+    }
+
+    if (notify_tx_server && net_require_signal_active(&qp->tx)) {
+        net_cancel_signal_active(&qp->tx);
+        microkit_notify(qp->tx_ch);
+    }
+}
+
+static bool virtio_net_handle_tx(struct virtio_device *dev, uint16_t qp_idx)
+{
+    bool respond_to_guest = false;
+    virtio_net_process_tx(dev, qp_idx, &respond_to_guest);
+
+    bool success = true;
+    if (respond_to_guest) {
+        success = virtio_net_respond(dev);
+    }
+
+    return success;
+}
+
+static bool virtio_net_queue_notify(struct virtio_device *dev)
+{
+    struct virtio_net_device *state = device_state(dev);
+
+    if (!driver_ok(dev)) {
+        LOG_NET_ERR("Driver not ready\n");
+        return false;
+    }
+
+    uint32_t vq_idx = dev->regs.QueueNotify;
+    if (vq_idx >= dev->num_vqs || !dev->vqs[vq_idx].ready) {
+        LOG_NET_ERR("virtq %u not ready\n", vq_idx);
+        return false;
+    }
+
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_VQ) && vq_idx == virtio_net_ctrl_virtq_idx(state)) {
+        return virtio_net_handle_ctrl(dev);
+    }
+
+    uint16_t qp_idx = vq_idx / 2;
+    if (qp_idx >= state->num_queue_pairs) {
+        LOG_NET_ERR("notified on invalid virtq %u\n", vq_idx);
+        return false;
+    }
+
+    if (vq_idx == VIRTIO_NET_RX_VIRTQ_IDX(qp_idx)) {
+        virtio_net_handle_rx(state);
+        return true;
+    }
+
+    return virtio_net_handle_tx(dev, qp_idx);
+}
+
+enum rx_reserve_status {
+    RX_RESERVE_OK,
+    /* The guest has not made enough buffers available yet */
+    RX_RESERVE_NO_BUFFERS,
+    /* The frame does not fit in as many buffers as it may take */
+    RX_RESERVE_TOO_LARGE,
+};
+
+/* Make sure `frame` has room for `len` bytes in total, taking more guest buffers if allowed */
+static enum rx_reserve_status rx_frame_reserve(struct virtio_device *dev, struct virtio_net_rx_frame *frame,
+                                               uint64_t len)
+{
+    virtio_queue_handler_t *vq = frame->vq;
+    uint16_t max_bufs = 1;
+    if (virtio_net_has_feature(device_state(dev), VIRTIO_NET_F_MRG_RXBUF)) {
+        max_bufs = VIRTIO_NET_RX_MAX_BUFS;
+    }
+
+    uint16_t bufs_taken = 0;
+    while (frame->capacity < len) {
+        uint16_t desc_head;
+        bool too_large = (frame->num_bufs == max_bufs);
+        if (too_large || !virtio_virtq_pop_avail(vq, &desc_head)) {
+            /* Hand back any buffers we took, they have not been published as used */
+            vq->last_idx -= bufs_taken;
+            frame->num_bufs -= bufs_taken;
+            for (uint16_t i = 0; i < bufs_taken; i++) {
+                frame->capacity -= frame->buf_lens[frame->num_bufs + i];
+            }
+            return too_large ? RX_RESERVE_TOO_LARGE : RX_RESERVE_NO_BUFFERS;
+        }
+
+        uint32_t buf_len = virtio_desc_chain_payload_len(vq, desc_head);
+        frame->desc_heads[frame->num_bufs] = desc_head;
+        frame->buf_lens[frame->num_bufs] = buf_len;
+        frame->num_bufs++;
+        frame->capacity += buf_len;
+        bufs_taken++;
+    }
+
+    return RX_RESERVE_OK;
+}
+
+/* Write `len` bytes at offset `off` of a frame that has room for them */
+static void rx_frame_write(struct virtio_device *dev, struct virtio_net_rx_frame *frame, uint64_t off, uint64_t len,
+                           const void *data)
+{
+    virtio_queue_handler_t *vq = frame->vq;
+    assert(off + len <= frame->capacity);
+
+    uint64_t buf_start = 0;
+    for (uint16_t i = 0; i < frame->num_bufs && len > 0; i++) {
+        uint64_t buf_end = buf_start + frame->buf_lens[i];
+        if (off < buf_end) {
+            uint64_t copy_len = MIN(len, buf_end - off);
+            assert(virtio_write_data_to_desc_chain(vq, frame->desc_heads[i], copy_len, off - buf_start,
+                                                   (char *)data));
+            data += copy_len;
+            off += copy_len;
+            len -= copy_len;
+        }
+        buf_start = buf_end;
+    }
+
+    frame->len = MAX(frame->len, off);
+}
+
+/* Write the virtIO header of a frame and publish its buffers to the guest */
+static void rx_frame_finish(struct virtio_device *dev, struct virtio_net_rx_frame *frame,
+                            struct virtio_net_hdr_mrg_rxbuf *hdr, bool *respond_to_guest)
+{
+    virtio_queue_handler_t *vq = frame->vq;
+
+    hdr->num_buffers = frame->num_bufs;
+    rx_frame_write(dev, frame, 0, VIRTIO_NET_HDR_SIZE, hdr);
+
+    uint64_t remaining = frame->len;
+    for (uint16_t i = 0; i < frame->num_bufs; i++) {
+        uint32_t used_len = MIN(remaining, frame->buf_lens[i]);
+        virtio_virtq_add_used(vq, frame->desc_heads[i], used_len);
+        remaining -= used_len;
+    }
+
+    *respond_to_guest = true;
+}
+
+static enum rx_reserve_status handle_rx_buffer(struct virtio_device *dev, virtio_queue_handler_t *vq,
+                                               const uint8_t *data, uint32_t size, bool data_valid,
+                                               bool *respond_to_guest)
+{
+    struct virtio_net_rx_frame frame = { .vq = vq };
+    enum rx_reserve_status status = rx_frame_reserve(dev, &frame, VIRTIO_NET_HDR_SIZE + size);
+    if (status != RX_RESERVE_OK) {
+        return status;
+    }
+
+    rx_frame_write(dev, &frame, VIRTIO_NET_HDR_SIZE, size, data);
+
+    struct virtio_net_hdr_mrg_rxbuf virtio_hdr = { 0 };
+    if (data_valid) {
+        virtio_hdr.hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    }
+    rx_frame_finish(dev, &frame, &virtio_hdr, respond_to_guest);
+
+    return RX_RESERVE_OK;
+}
+
+static void rx_coalesce_key(const uint8_t *frame, const struct virtio_net_hdr_info *info, uint8_t *key)
+{
+    memcpy(key, frame, info->payload_off);
+
+    uint8_t *ip = &key[info->l3_off];
+    if (info->eth_type == ETH_TYPE_IPV4) {
+        write_be16(&ip[IPV4_TOTAL_LEN_OFF], 0);
+        write_be16(&ip[IPV4_ID_OFF], 0);
+        write_be16(&ip[IPV4_CSUM_OFF], 0);
+    } else {
+        write_be16(&ip[IPV6_PAYLOAD_LEN_OFF], 0);
+    }
+
+    uint8_t *tcp = &key[info->l4_off];
+    write_be32(&tcp[TCP_SEQ_OFF], 0);
+    write_be16(&tcp[TCP_CSUM_OFF], 0);
+    tcp[TCP_FLAGS_OFF] &= ~TCP_FLAG_PSH;
+}
+
+/* Check the IPv4 header and L4 checksums of a frame whose IP packet lies within it */
+static bool rx_csum_verify(const uint8_t *frame, const struct virtio_net_hdr_info *info)
+{
+    if (info->eth_type == ETH_TYPE_IPV4
+        && csum_fold(csum_add(0, &frame[info->l3_off], info->l4_off - info->l3_off)) != 0xFFFF) {
+        return false;
+    }
+
+    uint32_t l4_len = info->l3_off + info->l3_len - info->l4_off;
+    return csum_fold(csum_add(csum_pseudo(frame, info, l4_len), &frame[info->l4_off], l4_len)) == 0xFFFF;
+}
+
+/* Is this parsed frame a plain in-flow TCP data segment we can merge with its neighbours? */
+static bool rx_coalesce_eligible(struct virtio_net_device *state, const uint8_t *frame, uint32_t len,
+                                 const struct virtio_net_hdr_info *info)
+{
+    if (info->l4_proto != IP_PROTO_TCP || info->fragment) {
+        return false;
+    }
+    if (info->payload_off > VIRTIO_NET_MAX_HDR_LEN || info->l3_off + info->l3_len > len
+        || info->l3_off + info->l3_len <= info->payload_off) {
+        return false;
+    }
+
+    int feature = (info->eth_type == ETH_TYPE_IPV4) ? VIRTIO_NET_F_GUEST_TSO4 : VIRTIO_NET_F_GUEST_TSO6;
+    if (!virtio_net_has_feature(state, feature)) {
+        return false;
+    }
+
+    uint8_t flags = frame[info->l4_off + TCP_FLAGS_OFF];
+    if ((flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK) {
+        return false;
+    }
+
+    /* The guest does not check the segments of a coalesced frame itself, so if the backing
+     * device has not validated them already it has to happen here. */
+    return state->dev_csum_offload || rx_csum_verify(frame, info);
+}
+
+static void rx_coalesce_flush(struct virtio_device *dev, struct virtio_net_rx_coalesce *ctx, bool *respond_to_guest)
+{
+    if (!ctx->active) {
+        return;
+    }
+    ctx->active = false;
+
+    struct virtio_net_hdr_mrg_rxbuf virtio_hdr = { 0 };
+    if (ctx->num_segs == 1) {
+        /* Only ever started with a segment whose checksums are known to be good */
+        if (virtio_net_has_feature(device_state(dev), VIRTIO_NET_F_GUEST_CSUM)) {
+            virtio_hdr.hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+        }
+    } else {
+        struct virtio_net_hdr_info *info = &ctx->info;
+        uint32_t frame_len = ctx->frame.len - VIRTIO_NET_HDR_SIZE;
+        uint8_t *ip = &ctx->hdr[info->l3_off];
+        uint8_t *tcp = &ctx->hdr[info->l4_off];
+
+        if (info->eth_type == ETH_TYPE_IPV4) {
+            write_be16(&ip[IPV4_TOTAL_LEN_OFF], frame_len - info->l3_off);
+            write_be16(&ip[IPV4_CSUM_OFF], 0);
+            write_be16(&ip[IPV4_CSUM_OFF], ~csum_fold(csum_add(0, ip, info->l4_off - info->l3_off)));
+            virtio_hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        } else {
+            write_be16(&ip[IPV6_PAYLOAD_LEN_OFF], frame_len - info->l3_off - IPV6_HDR_LEN);
+            virtio_hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        }
+        if (ctx->push) {
+            tcp[TCP_FLAGS_OFF] |= TCP_FLAG_PSH;
+        }
+        /* The guest completes the checksum from the pseudo-header sum onwards */
+        write_be16(&tcp[TCP_CSUM_OFF], csum_fold(csum_pseudo(ctx->hdr, info, frame_len - info->l4_off)));
+
+        virtio_hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        virtio_hdr.hdr.gso_size = ctx->mss;
+        virtio_hdr.hdr.hdr_len = info->payload_off;
+        virtio_hdr.hdr.csum_start = info->l4_off;
+        virtio_hdr.hdr.csum_offset = TCP_CSUM_OFF;
+
+        rx_frame_write(dev, &ctx->frame, VIRTIO_NET_HDR_SIZE, info->payload_off, ctx->hdr);
+    }
+
+    rx_frame_finish(dev, &ctx->frame, &virtio_hdr, respond_to_guest);
+}
+
+static bool rx_coalesce_append(struct virtio_device *dev, struct virtio_net_rx_coalesce *ctx,
+                               virtio_queue_handler_t *vq, const uint8_t *frame,
+                               const struct virtio_net_hdr_info *info)
+{
+    if (!ctx->active || ctx->closed || ctx->frame.vq != vq || info->payload_off != ctx->info.payload_off) {
+        return false;
+    }
+
+    uint8_t key[VIRTIO_NET_MAX_HDR_LEN];
+    rx_coalesce_key(frame, info, key);
+    if (memcmp(key, ctx->key, info->payload_off) != 0) {
+        return false;
+    }
+
+    const uint8_t *tcp = &frame[info->l4_off];
+    uint32_t seg_len = info->l3_off + info->l3_len - info->payload_off;
+    if (read_be32(&tcp[TCP_SEQ_OFF]) != ctx->next_seq || seg_len > ctx->mss) {
+        return false;
+    }
+    if (ctx->frame.len - VIRTIO_NET_HDR_SIZE - info->l3_off + seg_len > IPV4_MAX_LEN) {
+        return false;
+    }
+    if (rx_frame_reserve(dev, &ctx->frame, ctx->frame.len + seg_len) != RX_RESERVE_OK) {
+        return false;
+    }
+
+    rx_frame_write(dev, &ctx->frame, ctx->frame.len, seg_len, &frame[info->payload_off]);
+    ctx->num_segs++;
+    ctx->next_seq += seg_len;
+    ctx->push = tcp[TCP_FLAGS_OFF] & TCP_FLAG_PSH;
+    /* Only the last segment of a coalesced frame may be short or pushed */
+    ctx->closed = ctx->push || seg_len < ctx->mss;
+
+    return true;
+}
+
+static enum rx_reserve_status rx_coalesce_start(struct virtio_device *dev, struct virtio_net_rx_coalesce *ctx,
+                                                virtio_queue_handler_t *vq, const uint8_t *frame,
+                                                const struct virtio_net_hdr_info *info)
+{
+    uint32_t frame_len = info->l3_off + info->l3_len;
+    uint32_t seg_len = frame_len - info->payload_off;
+
+    struct virtio_net_rx_frame rx_frame = { .vq = vq };
+    enum rx_reserve_status status = rx_frame_reserve(dev, &rx_frame, VIRTIO_NET_HDR_SIZE + frame_len);
+    if (status != RX_RESERVE_OK) {
+        return status;
+    }
+    rx_frame_write(dev, &rx_frame, VIRTIO_NET_HDR_SIZE, frame_len, frame);
+
+    const uint8_t *tcp = &frame[info->l4_off];
+    ctx->active = true;
+    ctx->frame = rx_frame;
+    ctx->info = *info;
+    ctx->num_segs = 1;
+    ctx->mss = seg_len;
+    ctx->next_seq = read_be32(&tcp[TCP_SEQ_OFF]) + seg_len;
+    ctx->push = tcp[TCP_FLAGS_OFF] & TCP_FLAG_PSH;
+    ctx->closed = ctx->push;
+    memcpy(ctx->hdr, frame, info->payload_off);
+    rx_coalesce_key(frame, info, ctx->key);
+
+    return RX_RESERVE_OK;
+}
+
+/* Toeplitz hash of `input` as used by RSS */
+static uint32_t rss_toeplitz_hash(const uint8_t *key, const uint8_t *input, uint32_t len)
+{
+    uint32_t hash = 0;
+    /* The 32 bits of the key lined up with the current input bit */
+    uint32_t window = read_be32(key);
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t next_key = (i + 4 < VIRTIO_NET_RSS_MAX_KEY_SIZE) ? key[i + 4] : 0;
+        for (int bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((next_key >> bit) & 1);
+        }
+    }
+    return hash;
+}
+
+/* Pick the guest RX queue for a frame according to the driver's RSS configuration */
+static uint16_t virtio_net_rss_select(struct virtio_net_rss *rss, const uint8_t *frame, uint32_t len)
+{
+    struct virtio_net_hdr_info info;
+    if (!net_parse_headers(frame, len, &info)) {
+        return rss->unclassified_queue;
+    }
+
+    bool ipv4 = info.eth_type == ETH_TYPE_IPV4;
+    uint32_t ip_type = ipv4 ? VIRTIO_NET_RSS_HASH_TYPE_IPv4 : VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+    uint32_t l4_type = 0;
+    if (info.l4_proto == IP_PROTO_TCP) {
+        l4_type = ipv4 ? VIRTIO_NET_RSS_HASH_TYPE_TCPv4 : VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+    } else if (info.l4_proto == IP_PROTO_UDP) {
+        l4_type = ipv4 ? VIRTIO_NET_RSS_HASH_TYPE_UDPv4 : VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+    }
+    bool hash_ports = !info.fragment && (rss->hash_types & l4_type) && info.payload_off > info.l4_off;
+    if (!hash_ports && !(rss->hash_types & ip_type)) {
+        return rss->unclassified_queue;
+    }
+
+    /* Source and destination addresses followed by source and destination ports */
+    uint8_t input[2 * 16 + 2 * sizeof(uint16_t)];
+    uint32_t addrs_len = ipv4 ? 8 : 32;
+    uint32_t addrs_off = info.l3_off + (ipv4 ? IPV4_SRC_OFF : IPV6_SRC_OFF);
+    memcpy(input, &frame[addrs_off], addrs_len);
+    uint32_t input_len = addrs_len;
+    if (hash_ports) {
+        memcpy(&input[input_len], &frame[info.l4_off], 2 * sizeof(uint16_t));
+        input_len += 2 * sizeof(uint16_t);
+    }
+
+    uint32_t hash = rss_toeplitz_hash(rss->key, input, input_len);
+    return rss->indirection_table[hash & rss->indirection_table_mask];
+}
+
+/* Guest RX queue for a frame received on the sDDF RX queue of queue pair `qp_idx` */
+static uint16_t virtio_net_rx_queue_select(struct virtio_net_device *state, uint16_t qp_idx, const uint8_t *frame,
+                                           uint32_t len)
+{
+    if (state->rss.enabled) {
+        return virtio_net_rss_select(&state->rss, frame, len);
+    }
+    return qp_idx % state->active_queue_pairs;
+}
+
+static bool mac_table_contains(const uint8_t table[][VIRTIO_NET_CONFIG_MAC_SZ], uint32_t num_entries,
+                               const uint8_t *mac)
+{
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (memcmp(table[i], mac, VIRTIO_NET_CONFIG_MAC_SZ) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether the driver's RX mode, MAC and VLAN tables let a received frame through */
+static bool rx_mode_accept(struct virtio_net_device *state, const uint8_t *frame, uint32_t len)
+{
+    struct virtio_net_rx_mode *rx_mode = &state->rx_mode;
+    if (rx_mode->promisc || len < ETH_HDR_LEN) {
+        return true;
+    }
+
+    uint16_t eth_type = read_be16(&frame[ETH_TYPE_OFF]);
+    if (virtio_net_has_feature(state, VIRTIO_NET_F_CTRL_VLAN) && eth_type == ETH_TYPE_VLAN) {
+        if (len < ETH_HDR_LEN + VLAN_HDR_LEN) {
+            return false;
+        }
+        uint16_t vid = read_be16(&frame[ETH_HDR_LEN]) & (VIRTIO_NET_VLAN_MAX - 1);
+        if (!(rx_mode->vlans[vid / 32] & (1u << (vid % 32)))) {
+            return false;
+        }
+    }
+
+    const uint8_t *dst = frame;
+    if (dst[0] & 0x1) {
+        static const uint8_t broadcast[VIRTIO_NET_CONFIG_MAC_SZ] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+        if (memcmp(dst, broadcast, VIRTIO_NET_CONFIG_MAC_SZ) == 0) {
+            return !rx_mode->nobcast;
+        }
+        if (rx_mode->nomulti) {
+            return false;
+        }
+        return rx_mode->allmulti || rx_mode->multi_overflow
+            || mac_table_contains(rx_mode->multi, rx_mode->num_multi, dst);
+    }
+
+    if (rx_mode->nouni) {
+        return false;
+    }
+    return rx_mode->alluni || rx_mode->uni_overflow || memcmp(dst, state->config.mac, VIRTIO_NET_CONFIG_MAC_SZ) == 0
+        || mac_table_contains(rx_mode->uni, rx_mode->num_uni, dst);
+}
+
+/* Whether a received frame gets past both the VMM's filter and the driver's */
+static bool virtio_net_rx_accept(struct virtio_net_device *state, const uint8_t *frame, uint32_t len)
+{
+    if (net_filter_enabled(&state->filter, NET_FILTER_RX)
+        && !net_filter_accept(&state->filter, NET_FILTER_RX, frame, len)) {
+        return false;
+    }
+    return rx_mode_accept(state, frame, len);
+}
+
+/*
+ * Deliver a frame to a guest RX queue. Returns false if the guest has not made enough buffers
+ * available for it yet. Frames that can never fit are dropped.
+ */
+static bool handle_rx_frame(struct virtio_device *dev, uint16_t rxq, const uint8_t *frame, uint32_t size,
+                            bool *respond_to_guest)
+{
+    struct virtio_net_device *state = device_state(dev);
+    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_RX_VIRTQ_IDX(rxq)];
+    struct virtio_net_rx_coalesce *ctx = &state->rx_coalesce[rxq];
+
+    struct virtio_net_hdr_info info;
+    bool parsed = net_parse_headers(frame, size, &info);
+    if (parsed && rx_coalesce_eligible(state, frame, size, &info)) {
+        if (rx_coalesce_append(dev, ctx, vq, frame, &info)) {
+            return true;
+        }
+        rx_coalesce_flush(dev, ctx, respond_to_guest);
+        return rx_coalesce_start(dev, ctx, vq, frame, &info) != RX_RESERVE_NO_BUFFERS;
+    }
+    /* Keep frames of other flows in order with the one being coalesced */
+    rx_coalesce_flush(dev, ctx, respond_to_guest);
+
+    /* Let the guest skip checking frames the backing device has already validated */
+    bool data_valid = parsed && state->dev_csum_offload && virtio_net_has_feature(state, VIRTIO_NET_F_GUEST_CSUM)
+                   && !info.fragment && (info.l4_proto == IP_PROTO_TCP || info.l4_proto == IP_PROTO_UDP);
+
+    return handle_rx_buffer(dev, vq, frame, size, data_valid, respond_to_guest) != RX_RESERVE_NO_BUFFERS;
+}
+
+static bool rx_staging_empty(struct virtio_net_rx_staging *staging)
+{
+    return staging->head == staging->tail;
+}
+
+/* Hold on to an sDDF RX buffer until its guest RX queue has buffers, returns false if there is no room */
+static bool rx_staging_push(struct virtio_net_rx_staging *staging, uint16_t qp_idx, net_buff_desc_t buffer)
+{
+    if (staging->tail - staging->head == VIRTIO_NET_RX_STAGING_SIZE) {
+        return false;
+    }
+
+    staging->frames[staging->tail % VIRTIO_NET_RX_STAGING_SIZE] = (struct virtio_net_rx_staged) {
+        .buffer = buffer,
+        .qp_idx = qp_idx,
+    };
+    staging->tail++;
+
+    return true;
+}
+
+static void rx_buffer_free(struct virtio_net_queue_pair *qp, net_buff_desc_t buffer)
+{
+    buffer.len = 0;
+    net_enqueue_free(&qp->rx, buffer);
+}
+
+/* Deliver the frames held back for a guest RX queue in order, for as long as it has buffers */
+static void rx_staging_replay(struct virtio_net_device *state, uint16_t rxq, bool *returned_buffers,
+                              bool *respond_to_guest)
+{
+    struct virtio_device *dev = &state->virtio_device;
+    struct virtio_net_rx_staging *staging = &state->rx_staging[rxq];
+    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_RX_VIRTQ_IDX(rxq)];
+    /* Frames for a queue the driver has since reset are dropped */
+    bool deliver = driver_ok(dev) && vq->ready;
+
+    while (!rx_staging_empty(staging)) {
+        struct virtio_net_rx_staged *staged = &staging->frames[staging->head % VIRTIO_NET_RX_STAGING_SIZE];
+        struct virtio_net_queue_pair *qp = &state->queue_pairs[staged->qp_idx];
+        const uint8_t *frame = qp->rx_data + staged->buffer.io_or_offset;
+        if (deliver && !handle_rx_frame(dev, rxq, frame, staged->buffer.len, respond_to_guest)) {
+            break;
+        }
+
+        rx_buffer_free(qp, staged->buffer);
+        returned_buffers[staged->qp_idx] = true;
+        staging->head++;
+    }
+}
+
+void virtio_net_handle_rx(struct virtio_net_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+    net_buff_desc_t sddf_buffer;
+    bool returned_buffers[VIRTIO_NET_MAX_QUEUE_PAIRS] = { 0 };
+    bool respond_to_guest = false;
+
+    /* Frames held back while the guest had no buffers go before anything new */
+    for (uint16_t i = 0; i < state->num_queue_pairs; i++) {
+        rx_staging_replay(state, i, returned_buffers, &respond_to_guest);
+    }
+
+    for (uint16_t i = 0; i < state->num_queue_pairs; i++) {
+        struct virtio_net_queue_pair *qp = &state->queue_pairs[i];
+        bool reprocess = true;
+
+        while (reprocess) {
+            while (net_dequeue_active(&qp->rx, &sddf_buffer) != -1) {
+                const uint8_t *frame = qp->rx_data + sddf_buffer.io_or_offset;
+                bool staged = false;
+                /* this is likely most of the time, we don't want to pay the branch misprediction cost */
+                if (likely(driver_ok(dev)) && virtio_net_rx_accept(state, frame, sddf_buffer.len)) {
+                    uint16_t rxq = virtio_net_rx_queue_select(state, i, frame, sddf_buffer.len);
+                    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_NET_RX_VIRTQ_IDX(rxq)];
+                    struct virtio_net_rx_staging *staging = &state->rx_staging[rxq];
+                    if (likely(vq->ready)
+                        && (!rx_staging_empty(staging)
+                            || !handle_rx_frame(dev, rxq, frame, sddf_buffer.len, &respond_to_guest))) {
+                        /* Keep the frame until the guest makes buffers available and kicks the queue,
+                         * dropping it only if too many frames are already waiting */
+                        staged = rx_staging_push(staging, i, sddf_buffer);
+                    }
+                }
+
+                if (!staged) {
+                    rx_buffer_free(qp, sddf_buffer);
+                    returned_buffers[i] = true;
+                }
+            }
+
+            net_request_signal_active(&qp->rx);
+            reprocess = false;
+
+            if (!net_queue_empty_active(&qp->rx)) {
+                net_cancel_signal_active(&qp->rx);
+                reprocess = true;
+            }
+        }
+    }
+
+    for (uint16_t i = 0; i < state->num_queue_pairs; i++) {
+        rx_coalesce_flush(dev, &state->rx_coalesce[i], &respond_to_guest);
+    }
+
+    for (uint16_t i = 0; i < state->num_queue_pairs; i++) {
+        struct virtio_net_queue_pair *qp = &state->queue_pairs[i];
+        if (returned_buffers[i] && net_require_signal_free(&qp->rx)) {
+            net_cancel_signal_free(&qp->rx);
+            microkit_notify(qp->rx_ch);
+        }
+    }
+
+    if (respond_to_guest) {
+        virtio_net_respond(dev);
+    }
+}
+
+bool virtio_net_set_filter(struct virtio_net_device *dev, const struct net_filter_rule *rules, uint32_t num_rules,
+                           enum net_filter_action default_action)
+{
+    if (!net_filter_compile(&dev->filter, rules, num_rules, default_action)) {
+        LOG_NET_ERR("invalid packet filter rules\n");
+        return false;
+    }
+
+    return true;
+}
+
+void virtio_net_handle_tx_complete(struct virtio_net_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
+    bool respond_to_guest = false;
+
+    for (uint16_t i = 0; i < state->num_queue_pairs; i++) {
+        /* Resume sending frames that were waiting for free sDDF buffers */
+        if (driver_ok(dev) && dev->vqs[VIRTIO_NET_TX_VIRTQ_IDX(i)].ready) {
+            virtio_net_process_tx(dev, i, &respond_to_guest);
+        }
+    }
+
+    if (respond_to_guest) {
+        virtio_net_respond(dev);
+    }
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_net_reset,
+    .get_device_features = virtio_net_get_device_features,
+    .set_driver_features = virtio_net_set_driver_features,
+    .get_device_config = virtio_net_get_device_config,
+    .set_device_config = virtio_net_set_device_config,
+    .queue_notify = virtio_net_queue_notify,
+};
+
+static struct virtio_device *virtio_net_init(struct virtio_net_device *net_dev, virtio_transport_type_t type,
+                                             irq_routing_info_t irq_routing_info,
+                                             struct virtio_net_queue_pair *queue_pairs, uint16_t num_queue_pairs,
+                                             uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
+{
+    if (num_queue_pairs == 0 || num_queue_pairs > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+        LOG_NET_ERR("invalid number of queue pairs %u, must be between 1 and %u\n", num_queue_pairs,
+                    VIRTIO_NET_MAX_QUEUE_PAIRS);
+        return NULL;
+    }
+
+    struct virtio_device *dev = &net_dev->virtio_device;
+
+    virtio_net_regs_init(dev);
+    dev->transport_type = type;
+    dev->funs = &functions;
+    dev->vqs = net_dev->vqs;
+    /* An RX and TX virtqueue per pair followed by the control virtqueue */
+    dev->num_vqs = 2 * num_queue_pairs + 1;
+    dev->irq_routing_info = irq_routing_info;
+    dev->device_data = net_dev;
+
+    memcpy(net_dev->config.mac, mac, VIRTIO_NET_CONFIG_MAC_SZ);
+    memcpy(net_dev->mac, mac, VIRTIO_NET_CONFIG_MAC_SZ);
+    net_dev->config.max_virtqueue_pairs = num_queue_pairs;
+    net_dev->config.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    net_dev->config.rss_max_indirection_table_length = VIRTIO_NET_RSS_MAX_TABLE_LEN;
+    net_dev->config.supported_hash_types = VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4
+                                         | VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | VIRTIO_NET_RSS_HASH_TYPE_IPv6
+                                         | VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+
+    memcpy(net_dev->queue_pairs, queue_pairs, num_queue_pairs * sizeof(struct virtio_net_queue_pair));
+    memset(net_dev->tx_state, 0, sizeof(net_dev->tx_state));
+    memset(net_dev->rx_staging, 0, sizeof(net_dev->rx_staging));
+    memset(&net_dev->filter, 0, sizeof(net_dev->filter));
+    virtio_net_rx_mode_reset(&net_dev->rx_mode);
+    net_dev->num_queue_pairs = num_queue_pairs;
+    net_dev->active_queue_pairs = 1;
+    net_dev->rss.enabled = false;
+    net_dev->dev_csum_offload = csum_offload;
+
+    return dev;
+}
+
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_net_init_mq(struct virtio_net_device *net_dev, uintptr_t region_base, uintptr_t region_size,
+                             irq_routing_info_t irq_routing_info, struct virtio_net_queue_pair *queue_pairs,
+                             uint16_t num_queue_pairs, uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
+{
+    struct virtio_device *dev = virtio_net_init(net_dev, VIRTIO_TRANSPORT_MMIO, irq_routing_info, queue_pairs,
+                                                num_queue_pairs, mac, csum_offload);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+
+bool virtio_mmio_net_init(struct virtio_net_device *net_dev, uintptr_t region_base, uintptr_t region_size,
                           irq_routing_info_t irq_routing_info, net_queue_handle_t *rx, net_queue_handle_t *tx,
                           uintptr_t rx_data, uintptr_t tx_data, microkit_channel rx_ch, microkit_channel tx_ch,
                           uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
 {
-    struct virtio_device *dev = virtio_net_init(net_dev, VIRTIO_TRANSPORT_MMIO, irq_routing_info, rx, tx, rx_data,
-                                                tx_data, rx_ch, tx_ch, mac, csum_offload);
-
-    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+    struct virtio_net_queue_pair qp = {
+        .rx = *rx,
+        .tx = *tx,
+        .rx_data = (void *)rx_data,
+        .tx_data = (void *)tx_data,
+        .rx_ch = rx_ch,
+        .tx_ch = tx_ch,
+    };
+
+    return virtio_mmio_net_init_mq(net_dev, region_base, region_size, irq_routing_info, &qp, 1, mac, csum_offload);
 }
 #endif
 
-bool virtio_pci_net_init(struct virtio_net_device *net_dev, uint16_t pci_bus, uint16_t pci_dev,
-                         irq_routing_info_t irq_routing_info, net_queue_handle_t *rx, net_queue_handle_t *tx,
-                         uintptr_t rx_data, uintptr_t tx_data, microkit_channel rx_ch, microkit_channel tx_ch,
-                         uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
+bool virtio_pci_net_init_mq(struct virtio_net_device *net_dev, uint16_t pci_bus, uint16_t pci_dev,
+                            irq_routing_info_t irq_routing_info, struct virtio_net_queue_pair *queue_pairs,
+                            uint16_t num_queue_pairs, uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
 {
-    struct virtio_device *dev = virtio_net_init(net_dev, VIRTIO_TRANSPORT_PCI, irq_routing_info, rx, tx, rx_data,
-                                                tx_data, rx_ch, tx_ch, mac, csum_offload);
+    struct virtio_device *dev = virtio_net_init(net_dev, VIRTIO_TRANSPORT_PCI, irq_routing_info, queue_pairs,
+                                                num_queue_pairs, mac, csum_offload);
+    if (!dev) {
+        return false;
+    }
 
     dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_NET;
     dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
@@ -412,3 +1778,20 @@ bool virtio_pci_net_init(struct virtio_net_device *net_dev, uint16_t pci_bus, ui
 
     return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
 }
+
+bool virtio_pci_net_init(struct virtio_net_device *net_dev, uint16_t pci_bus, uint16_t pci_dev,
+                         irq_routing_info_t irq_routing_info, net_queue_handle_t *rx, net_queue_handle_t *tx,
+                         uintptr_t rx_data, uintptr_t tx_data, microkit_channel rx_ch, microkit_channel tx_ch,
+                         uint8_t mac[VIRTIO_NET_CONFIG_MAC_SZ], bool csum_offload)
+{
+    struct virtio_net_queue_pair qp = {
+        .rx = *rx,
+        .tx = *tx,
+        .rx_data = (void *)rx_data,
+        .tx_data = (void *)tx_data,
+        .rx_ch = rx_ch,
+        .tx_ch = tx_ch,
+    };
+
+    return virtio_pci_net_init_mq(net_dev, pci_bus, pci_dev, irq_routing_info, &qp, 1, mac, csum_offload);
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <string.h>
+#include <libvmm/util/util.h>
+#include <libvmm/virtio/net_filter.h>
+#include "net_proto.h"
+
+static_assert(sizeof(union net_filter_key) == sizeof(((union net_filter_key *)0)->words),
+              "filter key fields must fit in its words");
+
+static uint32_t prefix_mask(uint8_t prefix_len)
+{
+    return prefix_len == 0 ? 0 : ~0u << (32 - prefix_len);
+}
+
+/* Fill in the fields of `key` that the frame has, leaving the rest zero */
+static void net_filter_key_extract(const uint8_t *frame, uint32_t len, union net_filter_key *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->vlan_id = NET_FILTER_VLAN_NONE;
+    if (len < ETH_HDR_LEN) {
+        return;
+    }
+
+    memcpy(key->dst_mac, frame, sizeof(key->dst_mac));
+    memcpy(key->src_mac, &frame[sizeof(key->dst_mac)], sizeof(key->src_mac));
+
+    uint32_t off = ETH_HDR_LEN;
+    uint16_t eth_type = read_be16(&frame[ETH_TYPE_OFF]);
+    for (int i = 0; i < VLAN_MAX_TAGS && (eth_type == ETH_TYPE_VLAN || eth_type == ETH_TYPE_QINQ); i++) {
+        if (len < off + VLAN_HDR_LEN) {
+            return;
+        }
+        if (i == 0) {
+            key->vlan_id = read_be16(&frame[off]) & VLAN_VID_MASK;
+        }
+        eth_type = read_be16(&frame[off + 2]);
+        off += VLAN_HDR_LEN;
+    }
+    key->eth_type = eth_type;
+
+    bool first_fragment = true;
+    if (eth_type == ETH_TYPE_IPV4) {
+        if (len < off + IPV4_HDR_MIN_LEN) {
+            return;
+        }
+        uint32_t ihl = (frame[off] & 0xF) * 4;
+        if (ihl < IPV4_HDR_MIN_LEN) {
+            return;
+        }
+        key->src_ip = read_be32(&frame[off + IPV4_SRC_OFF]);
+        key->dst_ip = read_be32(&frame[off + IPV4_DST_OFF]);
+        key->ip_proto = frame[off + IPV4_PROTO_OFF];
+        key->flags = NET_FILTER_KEY_IP | NET_FILTER_KEY_IPV4;
+        first_fragment = (read_be16(&frame[off + IPV4_FRAG_OFF]) & IPV4_FRAG_OFF_MASK) == 0;
+        off += ihl;
+    } else if (eth_type == ETH_TYPE_IPV6) {
+        /* Extension headers are not followed, so ports are only found directly after the fixed header */
+        if (len < off + IPV6_HDR_LEN) {
+            return;
+        }
+        key->ip_proto = frame[off + IPV6_NEXT_HDR_OFF];
+        key->flags = NET_FILTER_KEY_IP;
+        off += IPV6_HDR_LEN;
+    } else {
+        return;
+    }
+
+    if (first_fragment && (key->ip_proto == IP_PROTO_TCP || key->ip_proto == IP_PROTO_UDP) && len >= off + 4) {
+        key->src_port = read_be16(&frame[off]);
+        key->dst_port = read_be16(&frame[off + 2]);
+        key->flags |= NET_FILTER_KEY_PORTS;
+    }
+}
+
+static bool net_filter_rule_compile(const struct net_filter_rule *rule, struct net_filter_entry *entry)
+{
+    if (rule->action != NET_FILTER_ACCEPT && rule->action != NET_FILTER_DROP) {
+        return false;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->action = rule->action;
+    entry->src_port_max = 0xFFFF;
+    entry->dst_port_max = 0xFFFF;
+
+    union net_filter_key *mask = &entry->mask;
+    union net_filter_key *value = &entry->value;
+
+    if (rule->match & NET_FILTER_MATCH_DST_MAC) {
+        memset(mask->dst_mac, 0xFF, sizeof(mask->dst_mac));
+        memcpy(value->dst_mac, rule->dst_mac, sizeof(value->dst_mac));
+    }
+    if (rule->match & NET_FILTER_MATCH_SRC_MAC) {
+        memset(mask->src_mac, 0xFF, sizeof(mask->src_mac));
+        memcpy(value->src_mac, rule->src_mac, sizeof(value->src_mac));
+    }
+    if (rule->match & NET_FILTER_MATCH_VLAN) {
+        if (rule->vlan_id > VLAN_VID_MASK && rule->vlan_id != NET_FILTER_VLAN_NONE) {
+            return false;
+        }
+        mask->vlan_id = 0xFFFF;
+        value->vlan_id = rule->vlan_id;
+    }
+    if (rule->match & NET_FILTER_MATCH_ETH_TYPE) {
+        mask->eth_type = 0xFFFF;
+        value->eth_type = rule->eth_type;
+    }
+    if (rule->match & (NET_FILTER_MATCH_SRC_IP | NET_FILTER_MATCH_DST_IP)) {
+        if (rule->src_ip_prefix_len > 32 || rule->dst_ip_prefix_len > 32) {
+            return false;
+        }
+        mask->flags |= NET_FILTER_KEY_IPV4;
+        value->flags |= NET_FILTER_KEY_IPV4;
+    }
+    if (rule->match & NET_FILTER_MATCH_SRC_IP) {
+        mask->src_ip = prefix_mask(rule->src_ip_prefix_len);
+        value->src_ip = rule->src_ip & mask->src_ip;
+    }
+    if (rule->match & NET_FILTER_MATCH_DST_IP) {
+        mask->dst_ip = prefix_mask(rule->dst_ip_prefix_len);
+        value->dst_ip = rule->dst_ip & mask->dst_ip;
+    }
+    if (rule->match & NET_FILTER_MATCH_IP_PROTO) {
+        mask->ip_proto = 0xFF;
+        value->ip_proto = rule->ip_proto;
+        mask->flags |= NET_FILTER_KEY_IP;
+        value->flags |= NET_FILTER_KEY_IP;
+    }
+    if (rule->match & (NET_FILTER_MATCH_SRC_PORT | NET_FILTER_MATCH_DST_PORT)) {
+        mask->flags |= NET_FILTER_KEY_PORTS;
+        value->flags |= NET_FILTER_KEY_PORTS;
+    }
+    if (rule->match & NET_FILTER_MATCH_SRC_PORT) {
+        if (rule->src_port_min > rule->src_port_max) {
+            return false;
+        }
+        entry->src_port_min = rule->src_port_min;
+        entry->src_port_max = rule->src_port_max;
+    }
+    if (rule->match & NET_FILTER_MATCH_DST_PORT) {
+        if (rule->dst_port_min > rule->dst_port_max) {
+            return false;
+        }
+        entry->dst_port_min = rule->dst_port_min;
+        entry->dst_port_max = rule->dst_port_max;
+    }
+
+    return true;
+}
+
+bool net_filter_compile(struct net_filter *filter, const struct net_filter_rule *rules, uint32_t num_rules,
+                        enum net_filter_action default_action)
+{
+    if (default_action != NET_FILTER_ACCEPT && default_action != NET_FILTER_DROP) {
+        return false;
+    }
+
+    /* Compile into a copy so that a bad rule leaves the filter in use untouched */
+    static struct net_filter compiled;
+    for (int dir = 0; dir < NET_FILTER_NUM_DIRECTIONS; dir++) {
+        compiled.tables[dir].num_entries = 0;
+        compiled.tables[dir].default_action = default_action;
+        compiled.tables[dir].dropped = filter->tables[dir].dropped;
+    }
+
+    for (uint32_t i = 0; i < num_rules; i++) {
+        const struct net_filter_rule *rule = &rules[i];
+        if (rule->directions == 0 || (rule->directions & ~(NET_FILTER_DIR_RX | NET_FILTER_DIR_TX))) {
+            return false;
+        }
+
+        for (int dir = 0; dir < NET_FILTER_NUM_DIRECTIONS; dir++) {
+            struct net_filter_table *table = &compiled.tables[dir];
+            if (!(rule->directions & (1 << dir))) {
+                continue;
+            }
+            if (table->num_entries == NET_FILTER_MAX_RULES) {
+                return false;
+            }
+            if (!net_filter_rule_compile(rule, &table->entries[table->num_entries])) {
+                return false;
+            }
+            table->num_entries++;
+        }
+    }
+
+    memcpy(filter, &compiled, sizeof(compiled));
+
+    return true;
+}
+
+bool net_filter_accept(struct net_filter *filter, enum net_filter_direction dir, const uint8_t *frame, uint32_t len)
+{
+    struct net_filter_table *table = &filter->tables[dir];
+
+    union net_filter_key key;
+    net_filter_key_extract(frame, len, &key);
+
+    enum net_filter_action action = table->default_action;
+    for (uint32_t i = 0; i < table->num_entries; i++) {
+        const struct net_filter_entry *entry = &table->entries[i];
+        uint64_t diff = 0;
+        for (int w = 0; w < ARRAY_SIZE(key.words); w++) {
+            diff |= (key.words[w] & entry->mask.words[w]) ^ entry->value.words[w];
+        }
+        if (diff == 0 && key.src_port >= entry->src_port_min && key.src_port <= entry->src_port_max
+            && key.dst_port >= entry->dst_port_min && key.dst_port <= entry->dst_port_max) {
+            action = entry->action;
+            break;
+        }
+    }
+
+    if (action == NET_FILTER_DROP) {
+        table->dropped++;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Ethernet, IP and L4 header layouts shared by the virtIO net device and its frame filter */
+
+#define ETH_HDR_LEN         14
+#define ETH_TYPE_OFF        12
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_IPV6       0x86DD
+#define ETH_TYPE_VLAN       0x8100
+#define ETH_TYPE_QINQ       0x88A8
+#define VLAN_HDR_LEN        4
+#define VLAN_MAX_TAGS       2
+#define VLAN_VID_MASK       0xFFF
+
+#define IPV4_HDR_MIN_LEN    20
+#define IPV4_TOTAL_LEN_OFF  2
+#define IPV4_ID_OFF         4
+#define IPV4_FRAG_OFF       6
+#define IPV4_PROTO_OFF      9
+#define IPV4_CSUM_OFF       10
+#define IPV4_SRC_OFF        12
+#define IPV4_DST_OFF        16
+#define IPV4_MAX_LEN        0xFFFF
+#define IPV4_FRAG_MF        0x2000
+/* Fragment offset, without the flags */
+#define IPV4_FRAG_OFF_MASK  0x1FFF
+
+#define IPV6_HDR_LEN        40
+#define IPV6_PAYLOAD_LEN_OFF 4
+#define IPV6_NEXT_HDR_OFF   6
+#define IPV6_SRC_OFF        8
+
+#define IP_PROTO_HOPOPTS    0
+#define IP_PROTO_ICMP       1
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+#define IP_PROTO_ROUTING    43
+#define IP_PROTO_FRAGMENT   44
+#define IP_PROTO_DSTOPTS    60
+
+#define TCP_HDR_MIN_LEN     20
+#define TCP_SEQ_OFF         4
+#define TCP_DOFF_OFF        12
+#define TCP_FLAGS_OFF       13
+#define TCP_CSUM_OFF        16
+#define TCP_FLAG_FIN        0x01
+#define TCP_FLAG_PSH        0x08
+#define TCP_FLAG_ACK        0x10
+#define TCP_FLAG_CWR        0x80
+
+#define UDP_HDR_LEN         8
+#define UDP_CSUM_OFF        6
+
+#define ICMP_CSUM_OFF       2
+
+static inline uint16_t read_be16(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void write_be16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xFF;
+}
+
+static inline void write_be32(uint8_t *p, uint32_t val)
+{
+    p[0] = val >> 24;
+    p[1] = (val >> 16) & 0xFF;
+    p[2] = (val >> 8) & 0xFF;
+    p[3] = val & 0xFF;
+}
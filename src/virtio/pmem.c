@@ -0,0 +1,329 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stddef.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/guest.h>
+#include <libvmm/virq.h>
+#include <libvmm/util/util.h>
+#include <libvmm/virtio/config.h>
+#include <libvmm/virtio/mmio.h>
+#include <libvmm/virtio/pmem.h>
+#include <libvmm/virtio/virtio.h>
+
+/*
+ * The pmem device gives the guest a range of its physical address space that it treats
+ * as persistent memory. The range is mapped into the guest by the system description, so
+ * with DAX the guest reads and writes files in it without exits or copies. The device
+ * itself only handles flushes, which the guest sends when it needs what it has written to
+ * the range to be persistent.
+ */
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_PMEM
+
+#if defined(DEBUG_PMEM)
+#define LOG_PMEM(...) do{ printf("VIRTIO(PMEM): "); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_PMEM(...) do{}while(0)
+#endif
+
+#define LOG_PMEM_ERR(...) do{ printf("VIRTIO(PMEM)|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+/* Mappings of the range into the guest are made in pages */
+#define PMEM_ALIGN 0x1000
+
+/* Non-zero responses make the guest fail the flush with EIO */
+#define PMEM_RESP_OK 0
+#define PMEM_RESP_ERROR 1
+
+static inline struct virtio_pmem_device *device_state(struct virtio_device *dev)
+{
+    return (struct virtio_pmem_device *)dev->device_data;
+}
+
+static void virtio_pmem_respond(struct virtio_pmem_device *pmem, uint16_t desc_head, uint32_t ret)
+{
+    virtio_queue_handler_t *vq = &pmem->vqs[VIRTIO_PMEM_REQ_QUEUE];
+    struct virtio_pmem_resp resp = { .ret = ret };
+    uint64_t req_len;
+    uint64_t resp_len;
+
+    /* The response goes after the request, in the writable buffers */
+    uint32_t written = 0;
+    if (virtio_desc_chain_split_len(vq, desc_head, &req_len, &resp_len) && resp_len >= sizeof(resp)
+        && virtio_write_data_to_desc_chain(vq, desc_head, sizeof(resp), req_len, (char *)&resp)) {
+        written = sizeof(resp);
+    } else {
+        LOG_PMEM_ERR("no room for a response to request at descriptor %u\n", desc_head);
+    }
+
+    virtio_virtq_add_used(vq, desc_head, written);
+}
+
+/*
+ * Take flush requests from the guest. While the storage component is flushing, new
+ * requests are left in the virtqueue, as they may need what the guest wrote since that
+ * flush started.
+ */
+static bool virtio_pmem_handle_requests(struct virtio_pmem_device *pmem)
+{
+    virtio_queue_handler_t *vq = &pmem->vqs[VIRTIO_PMEM_REQ_QUEUE];
+    bool respond = false;
+    uint16_t desc_head;
+
+    if (!vq->ready) {
+        return false;
+    }
+
+    while (!pmem->flushing && pmem->num_flush_heads < VIRTIO_PMEM_FLUSH_BATCH
+           && virtio_virtq_pop_avail(vq, &desc_head)) {
+        struct virtio_pmem_req req;
+        if (!virtio_read_data_from_desc_chain(vq, desc_head, sizeof(req), 0, (char *)&req)
+            || req.type != VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+            LOG_PMEM_ERR("invalid request at descriptor %u\n", desc_head);
+            virtio_pmem_respond(pmem, desc_head, PMEM_RESP_ERROR);
+            respond = true;
+            continue;
+        }
+
+        LOG_PMEM("flush request at descriptor %u\n", desc_head);
+        if (pmem->storage_ch < 0) {
+            /* Nothing behind the range to write back to */
+            virtio_pmem_respond(pmem, desc_head, PMEM_RESP_OK);
+            respond = true;
+        } else {
+            pmem->flush_heads[pmem->num_flush_heads++] = desc_head;
+        }
+    }
+
+    /* One flush covers every request taken so far */
+    if (!pmem->flushing && pmem->num_flush_heads) {
+        pmem->flushing = true;
+        microkit_notify((microkit_channel)pmem->storage_ch);
+    }
+
+    return respond;
+}
+
+static bool virtio_pmem_queue_notify(struct virtio_device *dev)
+{
+    struct virtio_pmem_device *pmem = device_state(dev);
+
+    if (dev->regs.QueueNotify != VIRTIO_PMEM_REQ_QUEUE) {
+        LOG_PMEM_ERR("notified on invalid queue %u\n", dev->regs.QueueNotify);
+        return false;
+    }
+
+    if (!virtio_pmem_handle_requests(pmem)) {
+        return true;
+    }
+
+    virtio_set_interrupt_status(dev, true, false);
+    return virtio_inject_interrupt(dev);
+}
+
+bool virtio_pmem_flush_done(struct virtio_pmem_device *pmem)
+{
+    if (!pmem->flushing) {
+        LOG_PMEM_ERR("flush acknowledged with no flush in progress\n");
+        return true;
+    }
+
+    bool respond = pmem->num_flush_heads > 0;
+    for (uint32_t i = 0; i < pmem->num_flush_heads; i++) {
+        virtio_pmem_respond(pmem, pmem->flush_heads[i], PMEM_RESP_OK);
+    }
+    pmem->num_flush_heads = 0;
+    pmem->flushing = false;
+
+    /* Requests that arrived during the flush start the next one */
+    respond |= virtio_pmem_handle_requests(pmem);
+    if (!respond) {
+        return true;
+    }
+
+    virtio_set_interrupt_status(&pmem->virtio_device, true, false);
+    return virtio_inject_interrupt(&pmem->virtio_device);
+}
+
+static void virtio_pmem_regs_init(struct virtio_device *dev)
+{
+    dev->regs.DeviceID = VIRTIO_DEVICE_ID_PMEM;
+    dev->regs.VendorID = VIRTIO_DEV_VENDOR_ID;
+}
+
+static void virtio_pmem_reset(struct virtio_device *dev)
+{
+    LOG_PMEM("operation: reset device\n");
+
+    for (int i = 0; i < dev->num_vqs; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        dev->vqs[i].virtq.avail_gpa = 0;
+        dev->vqs[i].virtq.used_gpa = 0;
+        dev->vqs[i].virtq.desc_gpa = 0;
+        dev->vqs[i].virtq.num = 0;
+    }
+
+    /*
+     * The requests of the old driver are forgotten. A flush in progress is still waited
+     * for, so that its acknowledgement is not taken for a later one.
+     */
+    device_state(dev)->num_flush_heads = 0;
+
+    virtio_set_interrupt_status(dev, false, false);
+    memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
+    virtio_pmem_regs_init(dev);
+}
+
+/* The range can be given as a shared memory region only where the transport has them */
+static uint32_t virtio_pmem_features(struct virtio_device *dev)
+{
+    return dev->num_shm_regions ? BIT_LOW(VIRTIO_PMEM_F_SHMEM_REGION) : 0;
+}
+
+static bool virtio_pmem_get_device_features(struct virtio_device *dev, uint32_t *features)
+{
+    LOG_PMEM("operation: get device features\n");
+
+    switch (dev->regs.DeviceFeaturesSel) {
+    case 0:
+        *features = virtio_pmem_features(dev);
+        break;
+    case 1:
+        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        break;
+    default:
+        *features = 0;
+    }
+
+    return true;
+}
+
+static bool virtio_pmem_set_driver_features(struct virtio_device *dev, uint32_t features)
+{
+    LOG_PMEM("operation: set driver features\n");
+
+    bool success = false;
+
+    switch (dev->regs.DriverFeaturesSel) {
+    // feature bits 0 to 31
+    case 0:
+        success = (features & ~virtio_pmem_features(dev)) == 0;
+        break;
+    // features bits 32 to 63
+    case 1:
+        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        break;
+    default:
+        success = true;
+    }
+
+    if (success) {
+        dev->regs.DriverFeatures = features;
+        dev->features_happy = 1;
+        LOG_PMEM("device is feature happy\n");
+    }
+
+    return success;
+}
+
+static bool virtio_pmem_get_device_config(struct virtio_device *dev, uint32_t offset, uint32_t *config)
+{
+    LOG_PMEM("operation: get device config\n");
+
+    struct virtio_pmem_config *device_config = &device_state(dev)->config;
+    if (offset >= sizeof(struct virtio_pmem_config)) {
+        LOG_PMEM_ERR("Unknown device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    *config = 0;
+    memcpy(config, (uint8_t *)device_config + offset,
+           MIN(sizeof(uint32_t), sizeof(struct virtio_pmem_config) - offset));
+
+    return true;
+}
+
+static bool virtio_pmem_set_device_config(struct virtio_device *dev, uint32_t offset, uint32_t config)
+{
+    LOG_PMEM("operation: set device config\n");
+    return false;
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_pmem_reset,
+    .get_device_features = virtio_pmem_get_device_features,
+    .set_driver_features = virtio_pmem_set_driver_features,
+    .get_device_config = virtio_pmem_get_device_config,
+    .set_device_config = virtio_pmem_set_device_config,
+    .queue_notify = virtio_pmem_queue_notify,
+};
+
+static struct virtio_device *virtio_pmem_init(struct virtio_pmem_device *pmem, virtio_transport_type_t type,
+                                              irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size,
+                                              int storage_ch)
+{
+    if (size == 0 || gpa % PMEM_ALIGN || size % PMEM_ALIGN) {
+        LOG_PMEM_ERR("range of 0x%lx bytes at 0x%lx must be page aligned and not empty\n", size, gpa);
+        return NULL;
+    }
+
+    struct virtio_device *dev = &pmem->virtio_device;
+
+    dev->transport_type = type;
+    dev->funs = &functions;
+    dev->vqs = pmem->vqs;
+    dev->num_vqs = VIRTIO_PMEM_NUM_VIRTQ;
+    dev->irq_routing_info = irq_routing_info;
+    dev->device_data = pmem;
+    virtio_pmem_regs_init(dev);
+
+    /* The config has the range even when it is a shared memory region, for older drivers */
+    pmem->config.start = gpa;
+    pmem->config.size = size;
+    pmem->region.gpa = gpa;
+    pmem->region.size = size;
+    pmem->storage_ch = storage_ch;
+    pmem->flushing = false;
+    pmem->num_flush_heads = 0;
+
+    return dev;
+}
+
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_pmem_init(struct virtio_pmem_device *pmem, uintptr_t region_base, uintptr_t region_size,
+                           irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, int storage_ch)
+{
+    struct virtio_device *dev = virtio_pmem_init(pmem, VIRTIO_TRANSPORT_MMIO, irq_routing_info, gpa, size,
+                                                 storage_ch);
+    if (!dev) {
+        return false;
+    }
+
+    dev->shm_regions = &pmem->region;
+    dev->num_shm_regions = 1;
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+#endif
+
+bool virtio_pci_pmem_init(struct virtio_pmem_device *pmem, uint16_t pci_bus, uint16_t pci_dev,
+                          irq_routing_info_t irq_routing_info, uint64_t gpa, uint64_t size, int storage_ch)
+{
+    struct virtio_device *dev = virtio_pmem_init(pmem, VIRTIO_TRANSPORT_PCI, irq_routing_info, gpa, size,
+                                                 storage_ch);
+    if (!dev) {
+        return false;
+    }
+
+    dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_PMEM;
+    dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
+    dev->transport.pci.device_class = PCI_CLASS_STORAGE_OTHER;
+
+    return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
+}
@@ -6,6 +6,7 @@
 
 #include <microkit.h>
 #include <libvmm/guest.h>
+#include <libvmm/guest_ram.h>
 #include <libvmm/virq.h>
 #include <libvmm/util/util.h>
 #include <libvmm/virtio/sound.h>
@@ -363,7 +364,7 @@ static void handle_control_msg(struct virtio_device *dev, struct virtq *virtq, u
 {
     struct virtq_desc *desc_ring = virtio_get_desc_ring(virtq);
     struct virtq_desc *req_desc = &desc_ring[desc_head];
-    struct virtio_snd_hdr *hdr = (void *)req_desc->addr;
+    struct virtio_snd_hdr *hdr = gpa_to_hva(req_desc->addr, req_desc->len);
     struct virtio_snd_pcm_hdr *pcm_hdr = (void *)hdr;
 
     bool immediate = false;
@@ -376,7 +377,11 @@ static void handle_control_msg(struct virtio_device *dev, struct virtq *virtq, u
     }
 
     struct virtq_desc *status_desc = &desc_ring[req_desc->next];
-    uint32_t *status_ptr = (void *)status_desc->addr;
+    uint32_t *status_ptr = gpa_to_hva(status_desc->addr, sizeof(uint32_t));
+    if (hdr == NULL || status_ptr == NULL) {
+        LOG_SOUND_ERR("Control message is not in guest RAM\n");
+        return;
+    }
 
     int result;
 
@@ -390,7 +395,13 @@ static void handle_control_msg(struct virtio_device *dev, struct virtq *virtq, u
         }
 
         struct virtq_desc *response_desc = &desc_ring[status_desc->next];
-        result = handle_pcm_info(dev, virtq, (void *)hdr, (void *)response_desc->addr,
+        struct virtio_snd_pcm_info *responses = gpa_to_hva(response_desc->addr, response_desc->len);
+        if (responses == NULL) {
+            LOG_SOUND_ERR("Control message response descriptor is not in guest RAM\n");
+            result = -VIRTIO_SOUND_S_BAD_MSG;
+            break;
+        }
+        result = handle_pcm_info(dev, virtq, (void *)hdr, responses,
                                  response_desc->len / sizeof(struct virtio_snd_pcm_info), &bytes_written);
         if (result >= 0) {
             bytes_written += result * sizeof(struct virtio_snd_pcm_info);
@@ -443,6 +454,53 @@ static void handle_control_msg(struct virtio_device *dev, struct virtq *virtq, u
     *respond = immediate;
 }
 
+static inline bool zc_enabled(struct virtio_snd_device *state)
+{
+    return state->zero_copy.size != 0;
+}
+
+/*
+ * Find the offset at which the sound driver sees the guest buffer [gpa, gpa + len) in the data
+ * region. Returns false if the buffer is not entirely within the zero-copy window.
+ */
+static bool zc_offset(struct virtio_snd_device *state, uint64_t gpa, uint32_t len, uint64_t *offset)
+{
+    struct virtio_snd_zero_copy *zc = &state->zero_copy;
+    if (!zc_enabled(state) || gpa < zc->gpa || len > zc->size || gpa - zc->gpa > zc->size - len) {
+        return false;
+    }
+
+    *offset = zc->offset + (gpa - zc->gpa);
+    return true;
+}
+
+/* Whether a data region offset returned by the sound driver points into guest RAM */
+static bool zc_owns(struct virtio_snd_device *state, uint64_t offset)
+{
+    struct virtio_snd_zero_copy *zc = &state->zero_copy;
+    return zc_enabled(state) && offset >= zc->offset && offset - zc->offset < zc->size;
+}
+
+static bool enqueue_pcm(struct virtio_snd_device *state, uint64_t offset, uint32_t len, int stream_id, int cookie,
+                        int *sent)
+{
+    sound_pcm_t pcm;
+    pcm.io_or_offset = offset;
+    pcm.len = len;
+    pcm.stream_id = stream_id;
+    pcm.cookie = cookie;
+    pcm.status = 0;
+    pcm.latency_bytes = 0;
+
+    if (sound_enqueue_pcm(&state->pcm_req, &pcm) != 0) {
+        LOG_SOUND_ERR("Failed to enqueue to pcm request\n");
+        return false;
+    }
+
+    (*sent)++;
+    return true;
+}
+
 static bool perform_xfer(struct virtio_device *dev, struct virtq *virtq, struct virtq_desc *desc, bool transmit,
                          int stream_id, int cookie, int *sent)
 {
@@ -450,62 +508,69 @@ static bool perform_xfer(struct virtio_device *dev, struct virtq *virtq, struct
     struct virtq_desc *desc_ring = virtio_get_desc_ring(virtq);
 
     uintptr_t buf_offset;
-    if (!queue_dequeue_front(&state->free_buffers, &buf_offset)) {
-        LOG_SOUND_ERR("No free buffers\n");
-        return false;
-    }
-
+    bool have_buffer = false;
     uint32_t pcm_transmitted = 0;
-    uint32_t pcm_remaining = SOUND_PCM_BUFFER_SIZE;
 
     // Decompose descriptor chain into one or more sDDF requests.
     for (; desc->flags & VIRTQ_DESC_F_NEXT; desc = &desc_ring[desc->next]) {
         if (!!(desc->flags & VIRTQ_DESC_F_WRITE) == transmit) {
             LOG_SOUND_ERR("Incorrect xfer buffer type\n");
-            return false;
+            goto fail;
         }
 
-        uint32_t desc_transmitted = 0;
-        uint32_t desc_remaining = desc->len;
+        // Buffers in guest RAM shared with the driver are handed over as they are.
+        uint64_t zc_buf_offset;
+        if (zc_offset(state, desc->addr, desc->len, &zc_buf_offset)) {
+            // Keep PCM in order by first sending what has been gathered for copying.
+            if (pcm_transmitted > 0) {
+                have_buffer = false;
+                if (!enqueue_pcm(state, buf_offset, pcm_transmitted, stream_id, cookie, sent)) {
+                    return false;
+                }
+                pcm_transmitted = 0;
+            }
+            for (uint32_t off = 0; off < desc->len; off += SOUND_PCM_BUFFER_SIZE) {
+                uint32_t len = MIN(desc->len - off, SOUND_PCM_BUFFER_SIZE);
+                if (!enqueue_pcm(state, zc_buf_offset + off, len, stream_id, cookie, sent)) {
+                    goto fail;
+                }
+            }
+            continue;
+        }
 
-        while (desc_remaining > 0) {
+        void *desc_data = NULL;
+        if (transmit) {
+            desc_data = gpa_to_hva(desc->addr, desc->len);
+            if (desc_data == NULL) {
+                LOG_SOUND_ERR("Xfer buffer is not in guest RAM\n");
+                goto fail;
+            }
+        }
 
-            int to_xfer = MIN(desc_remaining, pcm_remaining);
+        uint32_t desc_transmitted = 0;
+        while (desc_transmitted < desc->len) {
+            if (!have_buffer) {
+                if (!queue_dequeue_front(&state->free_buffers, &buf_offset)) {
+                    LOG_SOUND_ERR("No free buffers\n");
+                    goto fail;
+                }
+                have_buffer = true;
+            }
 
+            uint32_t to_xfer = MIN(desc->len - desc_transmitted, SOUND_PCM_BUFFER_SIZE - pcm_transmitted);
             if (transmit) {
                 void *pcm_buffer = state->data_region + buf_offset;
-                memcpy(pcm_buffer + pcm_transmitted, (void *)desc->addr + desc_transmitted, to_xfer);
+                memcpy(pcm_buffer + pcm_transmitted, desc_data + desc_transmitted, to_xfer);
             }
             desc_transmitted += to_xfer;
-            desc_remaining -= to_xfer;
-
             pcm_transmitted += to_xfer;
-            pcm_remaining -= to_xfer;
 
             // If current to-be-sent request is full, send it.
-            if (pcm_remaining == 0) {
-
-                sound_pcm_t pcm;
-                pcm.io_or_offset = buf_offset;
-                pcm.len = pcm_transmitted;
-                pcm.stream_id = stream_id;
-                pcm.cookie = cookie;
-                pcm.status = 0;
-                pcm.latency_bytes = 0;
-
-                if (sound_enqueue_pcm(&state->pcm_req, &pcm) != 0) {
-                    LOG_SOUND_ERR("Failed to enqueue to pcm request\n");
+            if (pcm_transmitted == SOUND_PCM_BUFFER_SIZE) {
+                have_buffer = false;
+                if (!enqueue_pcm(state, buf_offset, pcm_transmitted, stream_id, cookie, sent)) {
                     return false;
                 }
-
-                (*sent)++;
-
-                if (!queue_dequeue_front(&state->free_buffers, &buf_offset)) {
-                    LOG_SOUND_ERR("No free buffers\n");
-                    return false;
-                }
-
-                pcm_remaining = SOUND_PCM_BUFFER_SIZE;
                 pcm_transmitted = 0;
             }
         }
@@ -513,21 +578,18 @@ static bool perform_xfer(struct virtio_device *dev, struct virtq *virtq, struct
 
     // Transmit remaining PCM data.
     if (pcm_transmitted > 0) {
-        sound_pcm_t pcm;
-        pcm.io_or_offset = buf_offset;
-        pcm.len = pcm_transmitted;
-        pcm.stream_id = stream_id;
-        pcm.cookie = cookie;
-        pcm.status = 0;
-        pcm.latency_bytes = 0;
-
-        if (sound_enqueue_pcm(&state->pcm_req, &pcm) != 0) {
-            LOG_SOUND_ERR("Failed to enqueue to tx used\n");
+        have_buffer = false;
+        if (!enqueue_pcm(state, buf_offset, pcm_transmitted, stream_id, cookie, sent)) {
             return false;
         }
-        (*sent)++;
     }
     return true;
+
+fail:
+    if (have_buffer) {
+        queue_enqueue(&state->free_buffers, &buf_offset);
+    }
+    return false;
 }
 
 static void handle_xfer(struct virtio_device *dev, struct virtq *virtq, uint16_t desc_head, bool transmit,
@@ -535,7 +597,7 @@ static void handle_xfer(struct virtio_device *dev, struct virtq *virtq, uint16_t
 {
     struct virtq_desc *desc_ring = virtio_get_desc_ring(virtq);
     struct virtq_desc *req_desc = &desc_ring[desc_head];
-    struct virtio_snd_pcm_xfer *hdr = (void *)req_desc->addr;
+    struct virtio_snd_pcm_xfer *hdr = gpa_to_hva(req_desc->addr, sizeof(struct virtio_snd_pcm_xfer));
 
     struct virtio_snd_device *state = device_state(dev);
 
@@ -543,6 +605,10 @@ static void handle_xfer(struct virtio_device *dev, struct virtq *virtq, uint16_t
         LOG_SOUND_ERR("XFER message missing data\n");
         return;
     }
+    if (hdr == NULL) {
+        LOG_SOUND_ERR("XFER message is not in guest RAM\n");
+        return;
+    }
 
     uint32_t cookie;
     int err = ialloc_alloc(&state->free_requests, &cookie);
@@ -561,10 +627,12 @@ static void handle_xfer(struct virtio_device *dev, struct virtq *virtq, uint16_t
 
         assert(desc->flags & VIRTQ_DESC_F_WRITE);
 
-        uint32_t *status_ptr = (void *)desc->addr;
-        *status_ptr = VIRTIO_SOUND_S_IO_ERR;
+        uint32_t *status_ptr = gpa_to_hva(desc->addr, sizeof(uint32_t));
+        if (status_ptr != NULL) {
+            *status_ptr = VIRTIO_SOUND_S_IO_ERR;
+        }
 
-        virtq_enqueue_used(virtq, desc_head, sizeof(uint32_t));
+        virtq_enqueue_used(virtq, desc_head, status_ptr != NULL ? sizeof(uint32_t) : 0);
         ialloc_free(&state->free_requests, cookie);
 
         *respond = true;
@@ -674,6 +742,7 @@ bool virtio_snd_init(struct virtio_snd_device *sound_dev, uintptr_t region_base,
     sound_dev->pcm_res = queues->pcm_res;
     sound_dev->data_region = (void *)data_region;
     sound_dev->server_ch = server_ch;
+    memset(&sound_dev->zero_copy, 0, sizeof(sound_dev->zero_copy));
 
     for (uintptr_t i = 0; i < sound_dev->pcm_req.capacity; i++) {
         uintptr_t offset = i * SOUND_PCM_BUFFER_SIZE;
@@ -683,6 +752,21 @@ bool virtio_snd_init(struct virtio_snd_device *sound_dev, uintptr_t region_base,
     return virtio_mmio_register_device(dev, region_base, region_size, virq);
 }
 
+bool virtio_snd_enable_zero_copy(struct virtio_snd_device *sound_dev, struct virtio_snd_zero_copy *zero_copy)
+{
+    // The copy buffers handed out by the device must stay distinguishable from guest RAM.
+    uint64_t copy_buffers_end = sound_dev->pcm_req.capacity * SOUND_PCM_BUFFER_SIZE;
+    if (zero_copy->size != 0 && zero_copy->offset < copy_buffers_end) {
+        LOG_SOUND_ERR("Zero-copy window at offset 0x%lx overlaps copy buffers ending at 0x%lx\n",
+                      zero_copy->offset, copy_buffers_end);
+        return false;
+    }
+
+    sound_dev->zero_copy = *zero_copy;
+    return true;
+}
+
+// A NULL `pcm` means the driver already wrote the data into guest RAM, so only the position advances.
 static unsigned copy_rx_data(struct virtq *virtq, struct virtq_desc *desc, virtio_snd_request_t *req, void *pcm,
                              unsigned pcm_len)
 {
@@ -706,8 +790,16 @@ static unsigned copy_rx_data(struct virtq *virtq, struct virtq_desc *desc, virti
             uint32_t offset = req->bytes_received - desc_position;
             uint32_t to_write = MIN(pcm_len, desc->len - offset);
 
-            memcpy((void *)desc->addr + offset, pcm, to_write);
-            pcm += to_write;
+            if (pcm != NULL) {
+                void *dest = gpa_to_hva(desc->addr + offset, to_write);
+                if (dest == NULL) {
+                    LOG_SOUND_ERR("RX buffer is not in guest RAM\n");
+                    req->status = SOUND_S_BAD_MSG;
+                } else {
+                    memcpy(dest, pcm, to_write);
+                }
+                pcm += to_write;
+            }
             req->bytes_received += to_write;
             pcm_len -= to_write;
         }
@@ -770,10 +862,11 @@ static bool respond_to_request(virtio_snd_request_t *req, struct virtio_device *
     struct virtq_desc *status_desc = res_desc;
     for (; status_desc->flags & VIRTQ_DESC_F_NEXT; status_desc = &desc_ring[status_desc->next]);
 
-    if (status_desc == req_desc || (status_desc->flags & VIRTQ_DESC_F_WRITE) == 0) {
+    void *status_ptr = gpa_to_hva(status_desc->addr, response_len);
+    if (status_desc == req_desc || (status_desc->flags & VIRTQ_DESC_F_WRITE) == 0 || status_ptr == NULL) {
         LOG_SOUND_ERR("Message must contain writeable status descriptor\n");
     } else {
-        memcpy((void *)status_desc->addr, response, response_len);
+        memcpy(status_ptr, response, response_len);
         used += response_len;
     }
 
@@ -816,15 +909,19 @@ void virtio_snd_notified(struct virtio_snd_device *state)
         response.status = virtio_status_from_sddf(req->status);
         response.latency_bytes = pcm.latency_bytes;
 
-        void *pcm_buffer = state->data_region + pcm.io_or_offset;
+        bool zero_copy = zc_owns(state, pcm.io_or_offset);
+        void *pcm_buffer = zero_copy ? NULL : state->data_region + pcm.io_or_offset;
         bool responded = respond_to_request(req, dev, pcm_buffer, pcm.len, &response, sizeof(response));
         if (responded) {
             ialloc_free(&state->free_requests, pcm.cookie);
             respond = true;
         }
 
-        uintptr_t buf_offset = (uintptr_t)pcm.io_or_offset;
-        queue_enqueue(&state->free_buffers, &buf_offset);
+        // Guest buffers are simply released back to the guest with the request.
+        if (!zero_copy) {
+            uintptr_t buf_offset = (uintptr_t)pcm.io_or_offset;
+            queue_enqueue(&state->free_buffers, &buf_offset);
+        }
     }
 
     if (respond) {
@@ -75,6 +75,46 @@ uint64_t virtio_desc_chain_payload_len(virtio_queue_handler_t *vq_handler, uint1
     return payload_len;
 }
 
+bool virtio_desc_chain_split_len(virtio_queue_handler_t *vq_handler, uint16_t desc_head, uint64_t *read_len,
+                                 uint64_t *write_len)
+{
+    assert(vq_handler->ready);
+    struct virtq *virtq = &vq_handler->virtq;
+    struct virtq_desc *desc_ring = virtio_get_desc_ring(virtq);
+
+    uint64_t loop_iter_count = 0;
+    uint64_t readable = 0;
+    uint64_t writable = 0;
+    uint16_t curr_desc = desc_head;
+    while (true) {
+        if (loop_iter_count > virtq->num || curr_desc >= virtq->num) {
+            LOG_VMM_ERR("bad descriptor chain starting at %u\n", desc_head);
+            return false;
+        }
+
+        struct virtq_desc *desc = &desc_ring[curr_desc];
+        if (desc->flags & VIRTQ_DESC_F_WRITE) {
+            writable += desc->len;
+        } else if (writable) {
+            LOG_VMM_ERR("readable buffer after writable ones in descriptor chain starting at %u\n", desc_head);
+            return false;
+        } else {
+            readable += desc->len;
+        }
+
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+
+        curr_desc = desc->next;
+        loop_iter_count++;
+    }
+
+    *read_len = readable;
+    *write_len = writable;
+    return true;
+}
+
 bool virtio_read_data_from_desc_chain(virtio_queue_handler_t *vq_handler, uint16_t desc_head, uint64_t bytes_to_read,
                                       uint64_t read_off, char *data)
 {
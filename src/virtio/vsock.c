@@ -0,0 +1,868 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stddef.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/guest.h>
+#include <libvmm/virq.h>
+#include <libvmm/util/util.h>
+#include <libvmm/virtio/config.h>
+#include <libvmm/virtio/mmio.h>
+#include <libvmm/virtio/vsock.h>
+#include <libvmm/virtio/virtio.h>
+#include <sddf/util/fence.h>
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_VSOCK
+
+#if defined(DEBUG_VSOCK)
+#define LOG_VSOCK(...) do{ printf("VIRTIO(VSOCK): "); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_VSOCK(...) do{}while(0)
+#endif
+
+#define LOG_VSOCK_ERR(...) do{ printf("VIRTIO(VSOCK)|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+/* Features we offer in the first 32 feature bits */
+#define VSOCK_FEATURES (BIT_LOW(VIRTIO_VSOCK_F_STREAM) | BIT_LOW(VIRTIO_VSOCK_F_SEQPACKET))
+
+/* Local ports for connections made by the VMM start from here */
+#define VSOCK_FIRST_EPHEMERAL_PORT 1024
+
+/* Payload of a packet from the guest to the VMM is handed to the recv callback in chunks of this size */
+#define VSOCK_RECV_CHUNK 0x1000
+
+static uint8_t recv_chunk[VSOCK_RECV_CHUNK];
+
+static inline struct virtio_vsock_device *device_state(struct virtio_device *dev)
+{
+    return (struct virtio_vsock_device *)dev->device_data;
+}
+
+static void virtio_vsock_features_print(uint32_t features)
+{
+    /* Dump the features given in a human-readable format */
+    LOG_VSOCK("Dumping features (0x%lx):\n", features);
+    LOG_VSOCK("feature VIRTIO_VSOCK_F_STREAM set to %s\n",
+              BIT_LOW(VIRTIO_VSOCK_F_STREAM) & features ? "true" : "false");
+    LOG_VSOCK("feature VIRTIO_VSOCK_F_SEQPACKET set to %s\n",
+              BIT_LOW(VIRTIO_VSOCK_F_SEQPACKET) & features ? "true" : "false");
+}
+
+/*
+ * Guest RX
+ */
+
+/* Payload that fits in the guest's next RX buffer, false if there is none */
+static bool virtio_vsock_rx_space(struct virtio_vsock_device *vsock, uint32_t *space)
+{
+    virtio_queue_handler_t *vq = &vsock->vqs[VIRTIO_VSOCK_RX_QUEUE];
+    uint16_t desc_head;
+    if (!vq->ready || !virtio_virtq_peek_avail(vq, &desc_head)) {
+        return false;
+    }
+
+    uint64_t len = virtio_desc_chain_payload_len(vq, desc_head);
+    if (len < sizeof(struct virtio_vsock_hdr)) {
+        return false;
+    }
+
+    *space = MIN(len - sizeof(struct virtio_vsock_hdr), UINT32_MAX);
+    return true;
+}
+
+/* Put a packet in the guest's next RX buffer, returns false if there is no buffer big enough */
+static bool virtio_vsock_rx_packet(struct virtio_vsock_device *vsock, struct virtio_vsock_hdr *hdr, const void *data)
+{
+    uint32_t space;
+    if (!virtio_vsock_rx_space(vsock, &space) || space < hdr->len) {
+        return false;
+    }
+
+    virtio_queue_handler_t *vq = &vsock->vqs[VIRTIO_VSOCK_RX_QUEUE];
+    uint16_t desc_head;
+    virtio_virtq_pop_avail(vq, &desc_head);
+
+    bool success = virtio_write_data_to_desc_chain(vq, desc_head, sizeof(*hdr), 0, (char *)hdr);
+    if (success && hdr->len) {
+        success = virtio_write_data_to_desc_chain(vq, desc_head, hdr->len, sizeof(*hdr), (char *)data);
+    }
+    assert(success);
+
+    virtio_virtq_add_used(vq, desc_head, sizeof(*hdr) + hdr->len);
+    return true;
+}
+
+static bool virtio_vsock_ctrl_flush(struct virtio_vsock_device *vsock)
+{
+    bool sent = false;
+    while (vsock->ctrl_pending_head != vsock->ctrl_pending_tail) {
+        struct virtio_vsock_hdr *hdr = &vsock->ctrl_pending[vsock->ctrl_pending_head % VIRTIO_VSOCK_CTRL_PENDING];
+        if (!virtio_vsock_rx_packet(vsock, hdr, NULL)) {
+            break;
+        }
+        vsock->ctrl_pending_head++;
+        sent = true;
+    }
+    return sent;
+}
+
+/* Queue a packet without payload for the guest, sent in order once it has RX buffers */
+static void virtio_vsock_ctrl_queue(struct virtio_vsock_device *vsock, struct virtio_vsock_hdr *hdr)
+{
+    if (vsock->ctrl_pending_tail - vsock->ctrl_pending_head == VIRTIO_VSOCK_CTRL_PENDING) {
+        LOG_VSOCK_ERR("control packet queue full, dropping op %u for port %u\n", hdr->op, hdr->dst_port);
+        return;
+    }
+
+    vsock->ctrl_pending[vsock->ctrl_pending_tail % VIRTIO_VSOCK_CTRL_PENDING] = *hdr;
+    vsock->ctrl_pending_tail++;
+}
+
+/*
+ * Connections between the guest and the VMM
+ */
+
+static inline int conn_id(struct virtio_vsock_device *vsock, struct virtio_vsock_conn *conn)
+{
+    return conn - vsock->conns;
+}
+
+static struct virtio_vsock_conn *conn_find(struct virtio_vsock_device *vsock, uint32_t local_port,
+                                           uint32_t guest_port)
+{
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        struct virtio_vsock_conn *conn = &vsock->conns[i];
+        if (conn->state != VIRTIO_VSOCK_CONN_FREE && conn->local_port == local_port
+            && conn->guest_port == guest_port) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+static struct virtio_vsock_conn *conn_alloc(struct virtio_vsock_device *vsock)
+{
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        if (vsock->conns[i].state == VIRTIO_VSOCK_CONN_FREE) {
+            memset(&vsock->conns[i], 0, sizeof(struct virtio_vsock_conn));
+            return &vsock->conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void conn_free(struct virtio_vsock_device *vsock, struct virtio_vsock_conn *conn)
+{
+    conn->state = VIRTIO_VSOCK_CONN_FREE;
+    if (conn->ops->closed) {
+        conn->ops->closed(vsock, conn_id(vsock, conn), conn->cookie);
+    }
+}
+
+/* Bytes the guest can currently take on a connection */
+static uint32_t conn_credit(struct virtio_vsock_conn *conn)
+{
+    uint32_t in_flight = conn->tx_cnt - conn->guest_fwd_cnt;
+    return in_flight >= conn->guest_buf_alloc ? 0 : conn->guest_buf_alloc - in_flight;
+}
+
+static void conn_hdr(struct virtio_vsock_device *vsock, struct virtio_vsock_conn *conn, struct virtio_vsock_hdr *hdr,
+                     uint16_t op, uint32_t flags, uint32_t len)
+{
+    hdr->src_cid = VIRTIO_VSOCK_CID_HOST;
+    hdr->dst_cid = vsock->config.guest_cid;
+    hdr->src_port = conn->local_port;
+    hdr->dst_port = conn->guest_port;
+    hdr->len = len;
+    hdr->type = conn->type;
+    hdr->op = op;
+    hdr->flags = flags;
+    hdr->buf_alloc = VIRTIO_VSOCK_BUF_ALLOC;
+    hdr->fwd_cnt = conn->fwd_cnt;
+    conn->last_fwd_cnt = conn->fwd_cnt;
+}
+
+static void conn_send_ctrl(struct virtio_vsock_device *vsock, struct virtio_vsock_conn *conn, uint16_t op,
+                           uint32_t flags)
+{
+    struct virtio_vsock_hdr hdr;
+    conn_hdr(vsock, conn, &hdr, op, flags, 0);
+    virtio_vsock_ctrl_queue(vsock, &hdr);
+}
+
+/* Reset the connection a packet from the guest belongs to */
+static void virtio_vsock_reply_rst(struct virtio_vsock_device *vsock, struct virtio_vsock_hdr *req)
+{
+    if (req->op == VIRTIO_VSOCK_OP_RST) {
+        return;
+    }
+
+    struct virtio_vsock_hdr hdr = {
+        .src_cid = req->dst_cid,
+        .dst_cid = req->src_cid,
+        .src_port = req->dst_port,
+        .dst_port = req->src_port,
+        .type = req->type,
+        .op = VIRTIO_VSOCK_OP_RST,
+    };
+    virtio_vsock_ctrl_queue(vsock, &hdr);
+}
+
+/* Take the credit information every packet from the guest carries */
+static void conn_update_credit(struct virtio_vsock_device *vsock, struct virtio_vsock_conn *conn,
+                               struct virtio_vsock_hdr *hdr)
+{
+    conn->guest_buf_alloc = hdr->buf_alloc;
+    conn->guest_fwd_cnt = hdr->fwd_cnt;
+}
+
+/* Hand the payload of an RW packet to the connection's recv callback */
+static void conn_recv(struct virtio_vsock_device *vsock, struct virtio_vsock_conn *conn, virtio_queue_handler_t *vq,
+                      uint16_t desc_head, struct virtio_vsock_hdr *hdr)
+{
+    int id = conn_id(vsock, conn);
+    bool eom = conn->type == VIRTIO_VSOCK_TYPE_SEQPACKET && (hdr->flags & VIRTIO_VSOCK_SEQ_EOM);
+
+    for (uint32_t off = 0; off < hdr->len;) {
+        uint32_t n = MIN(hdr->len - off, VSOCK_RECV_CHUNK);
+        if (!virtio_read_data_from_desc_chain(vq, desc_head, n, sizeof(*hdr) + off, (char *)recv_chunk)) {
+            break;
+        }
+        off += n;
+        if (conn->ops->recv) {
+            conn->ops->recv(vsock, id, recv_chunk, n, eom && off == hdr->len, conn->cookie);
+        }
+        /* The callback may have closed the connection */
+        if (conn->state == VIRTIO_VSOCK_CONN_FREE) {
+            return;
+        }
+    }
+
+    /* Data is consumed as soon as it is handed over, let the guest know before it runs out of credit */
+    conn->fwd_cnt += hdr->len;
+    if (conn->fwd_cnt - conn->last_fwd_cnt >= VIRTIO_VSOCK_BUF_ALLOC / 2) {
+        conn_send_ctrl(vsock, conn, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+    }
+}
+
+static void virtio_vsock_handle_request(struct virtio_vsock_device *vsock, struct virtio_vsock_hdr *hdr)
+{
+    struct virtio_vsock_listener *listener = NULL;
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_LISTENERS; i++) {
+        struct virtio_vsock_listener *l = &vsock->listeners[i];
+        if (l->in_use && l->port == hdr->dst_port && l->type == hdr->type) {
+            listener = l;
+            break;
+        }
+    }
+
+    struct virtio_vsock_conn *conn = listener ? conn_alloc(vsock) : NULL;
+    if (!conn) {
+        LOG_VSOCK("refusing connection from guest port %u to port %u\n", hdr->src_port, hdr->dst_port);
+        virtio_vsock_reply_rst(vsock, hdr);
+        return;
+    }
+
+    conn->state = VIRTIO_VSOCK_CONN_CONNECTED;
+    conn->type = hdr->type;
+    conn->local_port = hdr->dst_port;
+    conn->guest_port = hdr->src_port;
+    conn->ops = listener->ops;
+    conn->cookie = listener->cookie;
+    conn_update_credit(vsock, conn, hdr);
+    conn_send_ctrl(vsock, conn, VIRTIO_VSOCK_OP_RESPONSE, 0);
+
+    if (conn->ops->connected) {
+        conn->ops->connected(vsock, conn_id(vsock, conn), conn->cookie);
+    }
+}
+
+/* A packet from the guest to the VMM itself */
+static void virtio_vsock_handle_local(struct virtio_vsock_device *vsock, virtio_queue_handler_t *vq,
+                                      uint16_t desc_head, struct virtio_vsock_hdr *hdr)
+{
+    if (hdr->op == VIRTIO_VSOCK_OP_REQUEST) {
+        virtio_vsock_handle_request(vsock, hdr);
+        return;
+    }
+
+    struct virtio_vsock_conn *conn = conn_find(vsock, hdr->dst_port, hdr->src_port);
+    if (!conn || conn->type != hdr->type) {
+        virtio_vsock_reply_rst(vsock, hdr);
+        return;
+    }
+
+    conn_update_credit(vsock, conn, hdr);
+
+    switch (hdr->op) {
+    case VIRTIO_VSOCK_OP_RESPONSE:
+        if (conn->state != VIRTIO_VSOCK_CONN_CONNECTING) {
+            virtio_vsock_reply_rst(vsock, hdr);
+            break;
+        }
+        conn->state = VIRTIO_VSOCK_CONN_CONNECTED;
+        if (conn->ops->connected) {
+            conn->ops->connected(vsock, conn_id(vsock, conn), conn->cookie);
+        }
+        break;
+    case VIRTIO_VSOCK_OP_RW:
+        if (conn->state == VIRTIO_VSOCK_CONN_CONNECTED) {
+            conn_recv(vsock, conn, vq, desc_head, hdr);
+        }
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+        conn_send_ctrl(vsock, conn, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+        break;
+    case VIRTIO_VSOCK_OP_SHUTDOWN:
+        /* Only a full shutdown ends the connection, the guest then waits for our reset */
+        if ((hdr->flags & (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND))
+            == (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND)) {
+            conn_send_ctrl(vsock, conn, VIRTIO_VSOCK_OP_RST, 0);
+            conn_free(vsock, conn);
+        }
+        break;
+    case VIRTIO_VSOCK_OP_RST:
+        conn_free(vsock, conn);
+        break;
+    default:
+        LOG_VSOCK_ERR("unknown op %u from guest port %u\n", hdr->op, hdr->src_port);
+        virtio_vsock_reply_rst(vsock, hdr);
+        conn_free(vsock, conn);
+        break;
+    }
+}
+
+/* Tell connections whose sends were cut short that they can send again */
+static void virtio_vsock_wake_writers(struct virtio_vsock_device *vsock)
+{
+    uint32_t space;
+    if (!virtio_vsock_rx_space(vsock, &space)) {
+        return;
+    }
+
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        struct virtio_vsock_conn *conn = &vsock->conns[i];
+        if (conn->state == VIRTIO_VSOCK_CONN_CONNECTED && conn->blocked && conn_credit(conn) > 0) {
+            conn->blocked = false;
+            if (conn->ops->writable) {
+                conn->ops->writable(vsock, i, conn->cookie);
+            }
+        }
+    }
+}
+
+/*
+ * Peer queues
+ */
+
+static struct virtio_vsock_peer *peer_find(struct virtio_vsock_device *vsock, uint64_t cid)
+{
+    for (uint32_t i = 0; i < vsock->num_peers; i++) {
+        if (vsock->peers[i].cid == cid) {
+            return &vsock->peers[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t peer_queue_free(struct virtio_vsock_peer *peer)
+{
+    struct virtio_vsock_queue *q = peer->txq;
+    uint32_t used = q->tail - q->head;
+    THREAD_MEMORY_ACQUIRE();
+    return peer->capacity - used;
+}
+
+/* Copy a packet from the guest into the peer's queue, split into as many slots as it needs */
+static bool peer_enqueue(struct virtio_vsock_peer *peer, virtio_queue_handler_t *vq, uint16_t desc_head,
+                         struct virtio_vsock_hdr *hdr)
+{
+    struct virtio_vsock_queue *q = peer->txq;
+    uint32_t tail = q->tail;
+    uint32_t off = 0;
+
+    do {
+        struct virtio_vsock_queue_slot *slot = &q->slots[tail % peer->capacity];
+        uint32_t n = MIN(hdr->len - off, VIRTIO_VSOCK_SLOT_DATA);
+        bool last = off + n == hdr->len;
+
+        slot->hdr = *hdr;
+        slot->hdr.len = n;
+        /* Message boundaries only belong on the last part */
+        if (!last) {
+            slot->hdr.flags &= ~(VIRTIO_VSOCK_SEQ_EOM | VIRTIO_VSOCK_SEQ_EOR);
+        }
+        if (n && !virtio_read_data_from_desc_chain(vq, desc_head, n, sizeof(*hdr) + off, (char *)slot->data)) {
+            return false;
+        }
+
+        off += n;
+        tail++;
+    } while (off < hdr->len);
+
+    THREAD_MEMORY_RELEASE();
+    q->tail = tail;
+    return true;
+}
+
+/* Move packets from peer queues into guest RX buffers, returns true if any were delivered */
+static bool virtio_vsock_handle_peer_rx(struct virtio_vsock_device *vsock)
+{
+    bool delivered = false;
+    for (uint32_t i = 0; i < vsock->num_peers; i++) {
+        struct virtio_vsock_peer *peer = &vsock->peers[i];
+        struct virtio_vsock_queue *q = peer->rxq;
+        uint32_t head = q->head;
+        bool consumed = false;
+
+        while (head != q->tail) {
+            THREAD_MEMORY_ACQUIRE();
+            struct virtio_vsock_queue_slot *slot = &q->slots[head % peer->capacity];
+            struct virtio_vsock_hdr hdr = slot->hdr;
+
+            if (hdr.src_cid != peer->cid || hdr.dst_cid != vsock->config.guest_cid
+                || hdr.len > VIRTIO_VSOCK_SLOT_DATA) {
+                LOG_VSOCK_ERR("dropping bad packet from peer %lu\n", peer->cid);
+            } else if (!virtio_vsock_rx_packet(vsock, &hdr, slot->data)) {
+                /* Out of guest RX buffers, leave it in the queue */
+                break;
+            } else {
+                delivered = true;
+            }
+
+            head++;
+            consumed = true;
+        }
+
+        if (consumed) {
+            THREAD_MEMORY_RELEASE();
+            q->head = head;
+            /* Publishing head must be ordered before reading the flag, pairs with the fence on the
+             * producer side. A release fence only orders stores, not a store before a load. */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (q->producer_waiting) {
+                q->producer_waiting = 0;
+                microkit_notify((microkit_channel)peer->ch);
+            }
+        }
+    }
+    return delivered;
+}
+
+/*
+ * Guest TX
+ */
+
+/* Returns true if any buffers were returned to the guest */
+static bool virtio_vsock_handle_tx(struct virtio_vsock_device *vsock)
+{
+    virtio_queue_handler_t *vq = &vsock->vqs[VIRTIO_VSOCK_TX_QUEUE];
+    if (!vq->ready) {
+        return false;
+    }
+
+    bool notify_peer[VIRTIO_VSOCK_MAX_PEERS] = { false };
+    bool handled = false;
+    uint16_t desc_head;
+
+    while (virtio_virtq_peek_avail(vq, &desc_head)) {
+        struct virtio_vsock_hdr hdr;
+        uint64_t chain_len = virtio_desc_chain_payload_len(vq, desc_head);
+        bool valid = chain_len >= sizeof(hdr)
+                     && virtio_read_data_from_desc_chain(vq, desc_head, sizeof(hdr), 0, (char *)&hdr)
+                     && chain_len - sizeof(hdr) >= hdr.len;
+
+        struct virtio_vsock_peer *peer = valid ? peer_find(vsock, hdr.dst_cid) : NULL;
+        if (peer) {
+            /* Keep the packet in the guest's queue until the peer's has room for all of it */
+            uint32_t slots = hdr.len ? (hdr.len + VIRTIO_VSOCK_SLOT_DATA - 1) / VIRTIO_VSOCK_SLOT_DATA : 1;
+            if (slots > peer->capacity) {
+                LOG_VSOCK_ERR("packet of %u bytes does not fit in the queue to peer %lu\n", hdr.len, peer->cid);
+                valid = false;
+            } else if (peer_queue_free(peer) < slots) {
+                peer->txq->producer_waiting = 1;
+                /* Setting the flag must be ordered before reading head, pairs with the fence on the
+                 * consumer side. The peer may have made room before it saw the flag. */
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (peer_queue_free(peer) < slots) {
+                    break;
+                }
+                peer->txq->producer_waiting = 0;
+            }
+        }
+
+        virtio_virtq_pop_avail(vq, &desc_head);
+
+        if (!valid) {
+            LOG_VSOCK_ERR("dropping malformed packet\n");
+        } else if (hdr.src_cid != vsock->config.guest_cid) {
+            LOG_VSOCK_ERR("dropping packet from CID %lu, guest is CID %lu\n", hdr.src_cid,
+                          vsock->config.guest_cid);
+        } else if (hdr.dst_cid == VIRTIO_VSOCK_CID_HOST) {
+            virtio_vsock_handle_local(vsock, vq, desc_head, &hdr);
+        } else if (peer) {
+            if (peer_enqueue(peer, vq, desc_head, &hdr)) {
+                notify_peer[peer - vsock->peers] = true;
+            }
+        } else {
+            virtio_vsock_reply_rst(vsock, &hdr);
+        }
+
+        virtio_virtq_add_used(vq, desc_head, 0);
+        handled = true;
+    }
+
+    for (uint32_t i = 0; i < vsock->num_peers; i++) {
+        if (notify_peer[i]) {
+            microkit_notify((microkit_channel)vsock->peers[i].ch);
+        }
+    }
+
+    return handled;
+}
+
+static bool virtio_vsock_process(struct virtio_vsock_device *vsock)
+{
+    bool handled = virtio_vsock_handle_tx(vsock);
+    /* Replies to what the guest just sent go ahead of packets from peers */
+    handled |= virtio_vsock_ctrl_flush(vsock);
+    handled |= virtio_vsock_handle_peer_rx(vsock);
+    virtio_vsock_wake_writers(vsock);
+    /* The callbacks may have queued more */
+    handled |= virtio_vsock_ctrl_flush(vsock);
+
+    if (handled) {
+        virtio_set_interrupt_status(&vsock->virtio_device, true, false);
+        return virtio_inject_interrupt(&vsock->virtio_device);
+    }
+
+    return true;
+}
+
+static bool virtio_vsock_queue_notify(struct virtio_device *dev)
+{
+    return virtio_vsock_process(device_state(dev));
+}
+
+bool virtio_vsock_handle_peer_notify(struct virtio_vsock_device *vsock)
+{
+    return virtio_vsock_process(vsock);
+}
+
+/*
+ * VMM socket API
+ */
+
+bool virtio_vsock_listen(struct virtio_vsock_device *vsock, uint32_t port, enum virtio_vsock_type type,
+                         const struct virtio_vsock_ops *ops, void *cookie)
+{
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_LISTENERS; i++) {
+        struct virtio_vsock_listener *l = &vsock->listeners[i];
+        if (!l->in_use) {
+            l->in_use = true;
+            l->port = port;
+            l->type = type;
+            l->ops = ops;
+            l->cookie = cookie;
+            return true;
+        }
+    }
+
+    LOG_VSOCK_ERR("no free listener for port %u\n", port);
+    return false;
+}
+
+int virtio_vsock_connect(struct virtio_vsock_device *vsock, uint32_t port, enum virtio_vsock_type type,
+                         const struct virtio_vsock_ops *ops, void *cookie)
+{
+    struct virtio_vsock_conn *conn = conn_alloc(vsock);
+    if (!conn) {
+        LOG_VSOCK_ERR("no free connection to guest port %u\n", port);
+        return -1;
+    }
+
+    /* An ephemeral port not used by another connection to the same guest port */
+    uint32_t local_port;
+    do {
+        local_port = vsock->next_port++;
+        if (vsock->next_port < VSOCK_FIRST_EPHEMERAL_PORT) {
+            vsock->next_port = VSOCK_FIRST_EPHEMERAL_PORT;
+        }
+    } while (conn_find(vsock, local_port, port));
+
+    conn->state = VIRTIO_VSOCK_CONN_CONNECTING;
+    conn->type = type;
+    conn->local_port = local_port;
+    conn->guest_port = port;
+    conn->ops = ops;
+    conn->cookie = cookie;
+    conn_send_ctrl(vsock, conn, VIRTIO_VSOCK_OP_REQUEST, 0);
+
+    if (virtio_vsock_ctrl_flush(vsock)) {
+        virtio_set_interrupt_status(&vsock->virtio_device, true, false);
+        virtio_inject_interrupt(&vsock->virtio_device);
+    }
+
+    return conn_id(vsock, conn);
+}
+
+uint32_t virtio_vsock_send(struct virtio_vsock_device *vsock, int id, const void *data, uint32_t len, bool eom)
+{
+    if (id < 0 || id >= VIRTIO_VSOCK_MAX_CONNS || vsock->conns[id].state != VIRTIO_VSOCK_CONN_CONNECTED) {
+        return 0;
+    }
+    struct virtio_vsock_conn *conn = &vsock->conns[id];
+
+    /* Control packets go first so that data does not overtake the connection's setup */
+    bool sent_any = virtio_vsock_ctrl_flush(vsock);
+    uint32_t sent = 0;
+    if (vsock->ctrl_pending_head == vsock->ctrl_pending_tail) {
+        while (sent < len) {
+            uint32_t space;
+            uint32_t credit = conn_credit(conn);
+            if (credit == 0 || !virtio_vsock_rx_space(vsock, &space) || space == 0) {
+                break;
+            }
+
+            uint32_t n = MIN(MIN(len - sent, space), credit);
+            bool last = sent + n == len;
+            uint32_t flags = (conn->type == VIRTIO_VSOCK_TYPE_SEQPACKET && eom && last) ? VIRTIO_VSOCK_SEQ_EOM : 0;
+
+            struct virtio_vsock_hdr hdr;
+            conn_hdr(vsock, conn, &hdr, VIRTIO_VSOCK_OP_RW, flags, n);
+            virtio_vsock_rx_packet(vsock, &hdr, (const uint8_t *)data + sent);
+
+            conn->tx_cnt += n;
+            sent += n;
+            sent_any = true;
+        }
+    }
+
+    conn->blocked = sent < len;
+
+    if (sent_any) {
+        virtio_set_interrupt_status(&vsock->virtio_device, true, false);
+        virtio_inject_interrupt(&vsock->virtio_device);
+    }
+
+    return sent;
+}
+
+bool virtio_vsock_close(struct virtio_vsock_device *vsock, int id)
+{
+    if (id < 0 || id >= VIRTIO_VSOCK_MAX_CONNS || vsock->conns[id].state == VIRTIO_VSOCK_CONN_FREE) {
+        return false;
+    }
+    struct virtio_vsock_conn *conn = &vsock->conns[id];
+
+    if (conn->state != VIRTIO_VSOCK_CONN_CLOSING) {
+        conn->state = VIRTIO_VSOCK_CONN_CLOSING;
+        conn_send_ctrl(vsock, conn, VIRTIO_VSOCK_OP_SHUTDOWN, VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND);
+        if (virtio_vsock_ctrl_flush(vsock)) {
+            virtio_set_interrupt_status(&vsock->virtio_device, true, false);
+            return virtio_inject_interrupt(&vsock->virtio_device);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Device operations
+ */
+
+static void virtio_vsock_regs_init(struct virtio_device *dev)
+{
+    dev->regs.DeviceID = VIRTIO_DEVICE_ID_VSOCK;
+    dev->regs.VendorID = VIRTIO_DEV_VENDOR_ID;
+}
+
+static void virtio_vsock_reset(struct virtio_device *dev)
+{
+    LOG_VSOCK("operation: reset device\n");
+
+    for (int i = 0; i < dev->num_vqs; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        dev->vqs[i].virtq.avail_gpa = 0;
+        dev->vqs[i].virtq.used_gpa = 0;
+        dev->vqs[i].virtq.desc_gpa = 0;
+        dev->vqs[i].virtq.num = 0;
+    }
+
+    /* Connections to the VMM do not survive the guest driver going away */
+    struct virtio_vsock_device *vsock = device_state(dev);
+    for (int i = 0; i < VIRTIO_VSOCK_MAX_CONNS; i++) {
+        if (vsock->conns[i].state != VIRTIO_VSOCK_CONN_FREE) {
+            conn_free(vsock, &vsock->conns[i]);
+        }
+    }
+    vsock->ctrl_pending_head = 0;
+    vsock->ctrl_pending_tail = 0;
+
+    virtio_set_interrupt_status(dev, false, false);
+    memset(&dev->regs, 0, sizeof(virtio_device_regs_t));
+    virtio_vsock_regs_init(dev);
+}
+
+static bool virtio_vsock_get_device_features(struct virtio_device *dev, uint32_t *features)
+{
+    LOG_VSOCK("operation: get device features\n");
+
+    switch (dev->regs.DeviceFeaturesSel) {
+    case 0:
+        *features = VSOCK_FEATURES;
+        break;
+    case 1:
+        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        break;
+    default:
+        *features = 0;
+    }
+
+    return true;
+}
+
+static bool virtio_vsock_set_driver_features(struct virtio_device *dev, uint32_t features)
+{
+    LOG_VSOCK("operation: set driver features\n");
+    virtio_vsock_features_print(features);
+
+    bool success = false;
+
+    switch (dev->regs.DriverFeaturesSel) {
+    // feature bits 0 to 31
+    case 0:
+        success = (features & ~VSOCK_FEATURES) == 0;
+        break;
+    // features bits 32 to 63
+    case 1:
+        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        break;
+    default:
+        success = true;
+    }
+
+    if (success) {
+        dev->regs.DriverFeatures = features;
+        dev->features_happy = 1;
+        LOG_VSOCK("device is feature happy\n");
+    }
+
+    return success;
+}
+
+static bool virtio_vsock_get_device_config(struct virtio_device *dev, uint32_t offset, uint32_t *config)
+{
+    LOG_VSOCK("operation: get device config\n");
+
+    struct virtio_vsock_config *device_config = &device_state(dev)->config;
+    if (offset >= sizeof(struct virtio_vsock_config)) {
+        LOG_VSOCK_ERR("Unknown device config register: 0x%x\n", offset);
+        return false;
+    }
+
+    *config = 0;
+    memcpy(config, (uint8_t *)device_config + offset,
+           MIN(sizeof(uint32_t), sizeof(struct virtio_vsock_config) - offset));
+
+    return true;
+}
+
+static bool virtio_vsock_set_device_config(struct virtio_device *dev, uint32_t offset, uint32_t config)
+{
+    LOG_VSOCK("operation: set device config\n");
+    return false;
+}
+
+static virtio_device_funs_t functions = {
+    .device_reset = virtio_vsock_reset,
+    .get_device_features = virtio_vsock_get_device_features,
+    .set_driver_features = virtio_vsock_set_driver_features,
+    .get_device_config = virtio_vsock_get_device_config,
+    .set_device_config = virtio_vsock_set_device_config,
+    .queue_notify = virtio_vsock_queue_notify,
+};
+
+static struct virtio_device *virtio_vsock_init(struct virtio_vsock_device *vsock, virtio_transport_type_t type,
+                                               irq_routing_info_t irq_routing_info, uint64_t guest_cid,
+                                               struct virtio_vsock_peer *peers, uint32_t num_peers)
+{
+    /* CIDs 0 to 2 are reserved, 2 being the VMM itself */
+    if (guest_cid <= VIRTIO_VSOCK_CID_HOST) {
+        LOG_VSOCK_ERR("invalid guest CID %lu\n", guest_cid);
+        return NULL;
+    }
+
+    if (num_peers > VIRTIO_VSOCK_MAX_PEERS) {
+        LOG_VSOCK_ERR("too many peers %u, at most %u\n", num_peers, VIRTIO_VSOCK_MAX_PEERS);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < num_peers; i++) {
+        if (peers[i].capacity == 0 || (peers[i].capacity & (peers[i].capacity - 1)) != 0) {
+            LOG_VSOCK_ERR("capacity %u of queues to peer %lu is not a power of two\n", peers[i].capacity,
+                          peers[i].cid);
+            return NULL;
+        }
+    }
+
+    struct virtio_device *dev = &vsock->virtio_device;
+
+    dev->transport_type = type;
+    dev->funs = &functions;
+    dev->vqs = vsock->vqs;
+    dev->num_vqs = VIRTIO_VSOCK_NUM_VIRTQ;
+    dev->irq_routing_info = irq_routing_info;
+    dev->device_data = vsock;
+    virtio_vsock_regs_init(dev);
+
+    vsock->config.guest_cid = guest_cid;
+    memcpy(vsock->peers, peers, num_peers * sizeof(struct virtio_vsock_peer));
+    vsock->num_peers = num_peers;
+    memset(vsock->listeners, 0, sizeof(vsock->listeners));
+    memset(vsock->conns, 0, sizeof(vsock->conns));
+    vsock->next_port = VSOCK_FIRST_EPHEMERAL_PORT;
+    vsock->ctrl_pending_head = 0;
+    vsock->ctrl_pending_tail = 0;
+
+    return dev;
+}
+
+#if !defined(CONFIG_ARCH_X86)
+bool virtio_mmio_vsock_init(struct virtio_vsock_device *vsock, uintptr_t region_base, uintptr_t region_size,
+                            irq_routing_info_t irq_routing_info, uint64_t guest_cid,
+                            struct virtio_vsock_peer *peers, uint32_t num_peers)
+{
+    struct virtio_device *dev = virtio_vsock_init(vsock, VIRTIO_TRANSPORT_MMIO, irq_routing_info, guest_cid, peers,
+                                                  num_peers);
+    if (!dev) {
+        return false;
+    }
+
+    return virtio_mmio_register_device(dev, region_base, region_size, irq_routing_info);
+}
+#endif
+
+bool virtio_pci_vsock_init(struct virtio_vsock_device *vsock, uint16_t pci_bus, uint16_t pci_dev,
+                           irq_routing_info_t irq_routing_info, uint64_t guest_cid,
+                           struct virtio_vsock_peer *peers, uint32_t num_peers)
+{
+    struct virtio_device *dev = virtio_vsock_init(vsock, VIRTIO_TRANSPORT_PCI, irq_routing_info, guest_cid, peers,
+                                                  num_peers);
+    if (!dev) {
+        return false;
+    }
+
+    dev->transport.pci.device_id = VIRTIO_PCI_MODERN_BASE_DEVICE_ID + VIRTIO_DEVICE_ID_VSOCK;
+    dev->transport.pci.vendor_id = VIRTIO_PCI_VENDOR_ID;
+    dev->transport.pci.device_class = PCI_CLASS_COMMUNICATION_OTHER;
+
+    return virtio_pci_register_device(dev, pci_bus, pci_dev, irq_routing_info);
+}
@@ -0,0 +1,590 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Packet rate benchmark for the virtIO net device model (src/virtio/net.c).
+ *
+ * The device model is linked as-is into a Linux program. The benchmark plays
+ * both the guest driver, posting descriptors into virtqueues that live in a
+ * mocked guest RAM, and the sDDF RX/TX virtualisers on the other side of the
+ * sDDF net queues. Only the time spent in the device model is measured.
+ *
+ * Frames up to the Ethernet MTU are UDP. Larger frames are TCP, sent with TSO
+ * by the guest and received as MSS-sized segments which the device coalesces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <libvmm/virq.h>
+#include <libvmm/virtio/config.h>
+#include <libvmm/virtio/virtq.h>
+#include <libvmm/virtio/virtio.h>
+#include <libvmm/virtio/net.h>
+#include <sddf/network/queue.h>
+#include <sddf/network/constants.h>
+#include "bench.h"
+
+#define GUEST_RAM_GPA 0x40000000ull
+#define GUEST_RAM_SIZE (64 * 1024 * 1024)
+
+#define VIRTQ_SIZE 256
+#define SDDF_QUEUE_CAPACITY 512
+/* Frames posted by the guest, or received by the RX virtualiser, per notification */
+#define BATCH_SIZE 64
+
+#define RX_BUFFER_SIZE 2048
+#define TX_FRAME_MAX 9216
+#define NUM_TX_SLOTS (VIRTQ_SIZE / 2)
+
+#define ETH_HDR_LEN 14
+#define IPV4_HDR_LEN 20
+#define UDP_HDR_LEN 8
+#define TCP_HDR_LEN 20
+#define ETH_MAX_FRAME (ETH_HDR_LEN + 1500)
+#define TCP_HDRS_LEN (ETH_HDR_LEN + IPV4_HDR_LEN + TCP_HDR_LEN)
+#define TCP_MSS (ETH_MAX_FRAME - TCP_HDRS_LEN)
+#define MIN_FRAME (ETH_HDR_LEN + IPV4_HDR_LEN + UDP_HDR_LEN)
+
+#define NET_HDR_LEN sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+#define RX_CH 1
+#define TX_CH 2
+
+enum direction {
+    DIR_TX,
+    DIR_RX,
+};
+
+enum csum_mode {
+    /* The guest computes checksums itself */
+    CSUM_OFF,
+    /* Offloaded by the guest, computed by the VMM as the backing device cannot */
+    CSUM_SW,
+    /* Offloaded by the guest and the backing device */
+    CSUM_HW,
+};
+
+static const char *dir_names[] = { "tx", "rx" };
+static const char *csum_names[] = { "off", "sw", "hw" };
+
+static const uint32_t default_sizes[] = { 64, 128, 256, 512, 1024, 1514, 9000 };
+
+static uint8_t device_mac[VIRTIO_NET_CONFIG_MAC_SZ] = { 0x52, 0x54, 0x01, 0x00, 0x00, 0x10 };
+static uint8_t peer_mac[VIRTIO_NET_CONFIG_MAC_SZ] = { 0x52, 0x54, 0x01, 0x00, 0x00, 0x20 };
+
+struct guest_queue {
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint16_t last_used;
+};
+
+struct bench {
+    struct virtio_net_device net;
+    net_queue_handle_t rx;
+    net_queue_handle_t tx;
+    uint8_t *rx_data;
+    uint8_t *tx_data;
+
+    uint8_t *guest_ram;
+    uint64_t guest_alloc;
+    struct guest_queue rxq;
+    struct guest_queue txq;
+    uint64_t rx_buffers_gpa;
+    uint64_t tx_hdrs_gpa;
+    uint64_t tx_frames_gpa;
+
+    uint64_t device_ns;
+    uint32_t tcp_seq;
+};
+
+static struct bench bench;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *guest_hva(uint64_t gpa)
+{
+    return bench.guest_ram + (gpa - GUEST_RAM_GPA);
+}
+
+static uint64_t guest_alloc(uint64_t size)
+{
+    uint64_t gpa = bench.guest_alloc;
+    bench.guest_alloc += (size + 0xfff) & ~0xfffull;
+    if (bench.guest_alloc > GUEST_RAM_GPA + GUEST_RAM_SIZE) {
+        fprintf(stderr, "out of guest RAM\n");
+        exit(EXIT_FAILURE);
+    }
+    return gpa;
+}
+
+static void write_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void write_be32(uint8_t *p, uint32_t v)
+{
+    write_be16(p, v >> 16);
+    write_be16(p + 2, v);
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (len & 1) {
+        sum += data[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+/*
+ * Fill in an Ethernet/IPv4/UDP or TCP frame of `len` bytes. With `partial_csum` the
+ * L4 checksum field only holds the pseudo-header sum, as a guest offloading it would.
+ */
+static void build_frame(uint8_t *frame, uint32_t len, bool tcp, uint32_t seq, uint8_t tcp_flags, bool partial_csum)
+{
+    uint8_t *ip = frame + ETH_HDR_LEN;
+    uint8_t *l4 = ip + IPV4_HDR_LEN;
+    uint32_t l4_len = len - ETH_HDR_LEN - IPV4_HDR_LEN;
+
+    memcpy(frame, device_mac, VIRTIO_NET_CONFIG_MAC_SZ);
+    memcpy(frame + VIRTIO_NET_CONFIG_MAC_SZ, peer_mac, VIRTIO_NET_CONFIG_MAC_SZ);
+    write_be16(frame + 12, 0x0800);
+
+    memset(ip, 0, IPV4_HDR_LEN);
+    ip[0] = 0x45;
+    write_be16(ip + 2, len - ETH_HDR_LEN);
+    ip[8] = 64;
+    ip[9] = tcp ? 6 : 17;
+    write_be32(ip + 12, 0x0a000001);
+    write_be32(ip + 16, 0x0a000002);
+    write_be16(ip + 10, ~csum_fold(csum_add(0, ip, IPV4_HDR_LEN)));
+
+    uint32_t csum_off;
+    if (tcp) {
+        memset(l4, 0, TCP_HDR_LEN);
+        write_be16(l4, 40000);
+        write_be16(l4 + 2, 5001);
+        write_be32(l4 + 4, seq);
+        write_be32(l4 + 8, 1);
+        l4[12] = (TCP_HDR_LEN / 4) << 4;
+        l4[13] = tcp_flags;
+        write_be16(l4 + 14, 0xffff);
+        csum_off = 16;
+    } else {
+        memset(l4, 0, UDP_HDR_LEN);
+        write_be16(l4, 40000);
+        write_be16(l4 + 2, 5001);
+        write_be16(l4 + 4, l4_len);
+        csum_off = 6;
+    }
+    uint32_t hdr_len = tcp ? TCP_HDR_LEN : UDP_HDR_LEN;
+    for (uint32_t i = hdr_len; i < l4_len; i++) {
+        l4[i] = i;
+    }
+
+    uint32_t sum = csum_add(0, ip + 12, 8) + ip[9] + l4_len;
+    if (partial_csum) {
+        write_be16(l4 + csum_off, csum_fold(sum));
+    } else {
+        uint16_t csum = ~csum_fold(csum_add(sum, l4, l4_len));
+        write_be16(l4 + csum_off, (!tcp && csum == 0) ? 0xffff : csum);
+    }
+}
+
+static void guest_queue_init(struct guest_queue *q, uint16_t vq_idx)
+{
+    virtio_queue_handler_t *vq = &bench.net.vqs[vq_idx];
+    uint64_t desc_gpa = guest_alloc(VIRTQ_SIZE * sizeof(struct virtq_desc));
+    uint64_t avail_gpa = guest_alloc(sizeof(struct virtq_avail) + VIRTQ_SIZE * sizeof(uint16_t));
+    uint64_t used_gpa = guest_alloc(sizeof(struct virtq_used) + VIRTQ_SIZE * sizeof(struct virtq_used_elem));
+
+    q->desc = guest_hva(desc_gpa);
+    q->avail = guest_hva(avail_gpa);
+    q->used = guest_hva(used_gpa);
+    q->last_used = 0;
+
+    vq->virtq.num = VIRTQ_SIZE;
+    vq->virtq.desc_gpa = (struct virtq_desc *)desc_gpa;
+    vq->virtq.avail_gpa = (struct virtq_avail *)avail_gpa;
+    vq->virtq.used_gpa = (struct virtq_used *)used_gpa;
+    vq->last_idx = 0;
+    vq->ready = true;
+}
+
+static void guest_queue_post(struct guest_queue *q, uint16_t desc_head)
+{
+    q->avail->ring[q->avail->idx % VIRTQ_SIZE] = desc_head;
+    q->avail->idx++;
+}
+
+static void device_notify(uint16_t vq_idx)
+{
+    struct virtio_device *dev = &bench.net.virtio_device;
+    uint64_t start = now_ns();
+    dev->regs.QueueNotify = vq_idx;
+    dev->funs->queue_notify(dev);
+    bench.device_ns += now_ns() - start;
+}
+
+static void sddf_queue_init(net_queue_handle_t *handle, uint8_t **data)
+{
+    size_t queue_size = sizeof(net_queue_t) + SDDF_QUEUE_CAPACITY * sizeof(net_buff_desc_t);
+    net_queue_t *free_queue = calloc(1, queue_size);
+    net_queue_t *active_queue = calloc(1, queue_size);
+    *data = malloc(SDDF_QUEUE_CAPACITY * NET_BUFFER_SIZE);
+    if (free_queue == NULL || active_queue == NULL || *data == NULL) {
+        fprintf(stderr, "could not allocate sDDF queues\n");
+        exit(EXIT_FAILURE);
+    }
+
+    net_queue_init(handle, free_queue, active_queue, SDDF_QUEUE_CAPACITY);
+    for (uint32_t i = 0; i < SDDF_QUEUE_CAPACITY; i++) {
+        net_buff_desc_t buffer = { .io_or_offset = i * NET_BUFFER_SIZE, .len = 0 };
+        net_enqueue_free(handle, buffer);
+    }
+}
+
+static void sddf_queue_destroy(net_queue_handle_t *handle, uint8_t *data)
+{
+    free(handle->free);
+    free(handle->active);
+    free(data);
+}
+
+static void bench_setup(enum csum_mode csum)
+{
+    memset(&bench, 0, sizeof(bench));
+    memset(&bench_counters, 0, sizeof(bench_counters));
+
+    bench.guest_ram = bench_guest_ram_init(GUEST_RAM_GPA, GUEST_RAM_SIZE);
+    if (bench.guest_ram == NULL) {
+        fprintf(stderr, "could not allocate guest RAM\n");
+        exit(EXIT_FAILURE);
+    }
+    bench.guest_alloc = GUEST_RAM_GPA;
+
+    sddf_queue_init(&bench.rx, &bench.rx_data);
+    sddf_queue_init(&bench.tx, &bench.tx_data);
+
+    bool success = virtio_mmio_net_init(&bench.net, 0, 0x1000, ARM_GIC_IRQ_ROUTE(0, 0), &bench.rx, &bench.tx,
+                                        (uintptr_t)bench.rx_data, (uintptr_t)bench.tx_data, RX_CH, TX_CH, device_mac,
+                                        csum == CSUM_HW);
+    if (!success) {
+        fprintf(stderr, "could not initialise virtIO net device\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Driver initialisation, virtIO spec 3.1.1 */
+    struct virtio_device *dev = &bench.net.virtio_device;
+    uint64_t features = BIT_LOW(VIRTIO_NET_F_MAC) | BIT_LOW(VIRTIO_NET_F_MRG_RXBUF);
+    if (csum != CSUM_OFF) {
+        features |= BIT_LOW(VIRTIO_NET_F_CSUM) | BIT_LOW(VIRTIO_NET_F_GUEST_CSUM) | BIT_LOW(VIRTIO_NET_F_HOST_TSO4)
+                  | BIT_LOW(VIRTIO_NET_F_GUEST_TSO4);
+    }
+    dev->regs.Status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    dev->regs.DriverFeaturesSel = 0;
+    success = dev->funs->set_driver_features(dev, features);
+    dev->regs.DriverFeaturesSel = 1;
+    success = success && dev->funs->set_driver_features(dev, BIT_HIGH(VIRTIO_F_VERSION_1));
+    if (!success) {
+        fprintf(stderr, "device rejected driver features\n");
+        exit(EXIT_FAILURE);
+    }
+    dev->regs.Status |= VIRTIO_CONFIG_S_FEATURES_OK;
+
+    guest_queue_init(&bench.rxq, VIRTIO_NET_RX_VIRTQ);
+    guest_queue_init(&bench.txq, VIRTIO_NET_TX_VIRTQ);
+    bench.rx_buffers_gpa = guest_alloc(VIRTQ_SIZE * RX_BUFFER_SIZE);
+    bench.tx_hdrs_gpa = guest_alloc(NUM_TX_SLOTS * NET_HDR_LEN);
+    bench.tx_frames_gpa = guest_alloc(NUM_TX_SLOTS * TX_FRAME_MAX);
+
+    dev->regs.Status |= VIRTIO_CONFIG_S_DRIVER_OK;
+}
+
+static void bench_teardown(void)
+{
+    sddf_queue_destroy(&bench.rx, bench.rx_data);
+    sddf_queue_destroy(&bench.tx, bench.tx_data);
+}
+
+/* Each TX slot is a two descriptor chain, the virtIO net header followed by the frame */
+static void tx_slots_init(uint32_t size, enum csum_mode csum)
+{
+    bool tso = size > ETH_MAX_FRAME;
+
+    struct virtio_net_hdr_mrg_rxbuf hdr = { 0 };
+    if (csum != CSUM_OFF) {
+        hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.hdr.csum_start = ETH_HDR_LEN + IPV4_HDR_LEN;
+        hdr.hdr.csum_offset = tso ? 16 : 6;
+    }
+    if (tso) {
+        hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr.gso_size = TCP_MSS;
+        hdr.hdr.hdr_len = TCP_HDRS_LEN;
+    }
+
+    for (uint16_t slot = 0; slot < NUM_TX_SLOTS; slot++) {
+        uint64_t hdr_gpa = bench.tx_hdrs_gpa + slot * NET_HDR_LEN;
+        uint64_t frame_gpa = bench.tx_frames_gpa + slot * TX_FRAME_MAX;
+
+        memcpy(guest_hva(hdr_gpa), &hdr, NET_HDR_LEN);
+        build_frame(guest_hva(frame_gpa), size, tso, 1, 0x10, csum != CSUM_OFF);
+
+        struct virtq_desc *desc = &bench.txq.desc[slot * 2];
+        desc[0] = (struct virtq_desc) { .addr = hdr_gpa, .len = NET_HDR_LEN, .flags = VIRTQ_DESC_F_NEXT,
+                                        .next = slot * 2 + 1 };
+        desc[1] = (struct virtq_desc) { .addr = frame_gpa, .len = size };
+    }
+}
+
+static uint64_t bench_tx(uint32_t size, enum csum_mode csum, uint64_t packets)
+{
+    struct guest_queue *q = &bench.txq;
+    uint16_t free_slots[NUM_TX_SLOTS];
+    uint16_t num_free = NUM_TX_SLOTS;
+    for (uint16_t i = 0; i < NUM_TX_SLOTS; i++) {
+        free_slots[i] = i;
+    }
+    tx_slots_init(size, csum);
+
+    uint64_t sent = 0;
+    uint64_t completed = 0;
+    while (completed < packets) {
+        uint64_t progress = completed;
+
+        /* Guest: queue a batch of frames and kick the device */
+        for (int i = 0; i < BATCH_SIZE && num_free > 0 && sent < packets; i++) {
+            guest_queue_post(q, free_slots[--num_free] * 2);
+            sent++;
+        }
+        device_notify(VIRTIO_NET_TX_VIRTQ);
+
+        /* TX virtualiser: transmit everything and return the buffers */
+        net_buff_desc_t buffer;
+        while (net_dequeue_active(&bench.tx, &buffer) == 0) {
+            buffer.len = 0;
+            net_enqueue_free(&bench.tx, buffer);
+        }
+        net_request_signal_active(&bench.tx);
+        uint64_t start = now_ns();
+        virtio_net_handle_tx_complete(&bench.net);
+        bench.device_ns += now_ns() - start;
+
+        /* Guest: reclaim the slots of transmitted frames */
+        while (q->last_used != q->used->idx) {
+            free_slots[num_free++] = q->used->ring[q->last_used % VIRTQ_SIZE].id / 2;
+            q->last_used++;
+            completed++;
+        }
+
+        if (completed == progress && num_free == 0) {
+            fprintf(stderr, "TX made no progress\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return completed;
+}
+
+static uint64_t bench_rx(uint32_t size, enum csum_mode csum, uint64_t packets)
+{
+    struct guest_queue *q = &bench.rxq;
+    bool segmented = size > ETH_MAX_FRAME;
+    uint32_t payload = size - TCP_HDRS_LEN;
+    uint32_t segs_per_frame = segmented ? (payload + TCP_MSS - 1) / TCP_MSS : 1;
+    uint64_t total_segs = packets * segs_per_frame;
+
+    for (uint16_t i = 0; i < VIRTQ_SIZE; i++) {
+        q->desc[i] = (struct virtq_desc) { .addr = bench.rx_buffers_gpa + i * RX_BUFFER_SIZE, .len = RX_BUFFER_SIZE,
+                                           .flags = VIRTQ_DESC_F_WRITE };
+        guest_queue_post(q, i);
+    }
+
+    uint64_t received = 0;
+    uint32_t seg = 0;
+    while (received < total_segs) {
+        /* RX virtualiser: hand over a batch of frames to the VMM */
+        net_buff_desc_t buffer;
+        uint32_t batch = 0;
+        while (batch < BATCH_SIZE * segs_per_frame && received < total_segs
+               && net_dequeue_free(&bench.rx, &buffer) == 0) {
+            uint8_t *frame = bench.rx_data + buffer.io_or_offset;
+            if (segmented) {
+                uint32_t seg_len = MIN(TCP_MSS, payload - seg * TCP_MSS);
+                bool last = ++seg == segs_per_frame;
+                /* ACK, with PSH marking the end of each frame */
+                build_frame(frame, TCP_HDRS_LEN + seg_len, true, bench.tcp_seq, last ? 0x18 : 0x10, false);
+                buffer.len = TCP_HDRS_LEN + seg_len;
+                bench.tcp_seq += seg_len;
+                if (last) {
+                    seg = 0;
+                }
+            } else {
+                /* The buffers are recycled, so each only needs filling in once */
+                if (received < SDDF_QUEUE_CAPACITY) {
+                    build_frame(frame, size, false, 0, 0, false);
+                }
+                buffer.len = size;
+            }
+            net_enqueue_active(&bench.rx, buffer);
+            batch++;
+            received++;
+        }
+        if (batch == 0) {
+            fprintf(stderr, "RX made no progress\n");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t start = now_ns();
+        virtio_net_handle_rx(&bench.net);
+        bench.device_ns += now_ns() - start;
+
+        /* Guest: consume the frames and give the buffers back */
+        while (q->last_used != q->used->idx) {
+            guest_queue_post(q, q->used->ring[q->last_used % VIRTQ_SIZE].id);
+            q->last_used++;
+        }
+        device_notify(VIRTIO_NET_RX_VIRTQ);
+    }
+
+    return received / segs_per_frame;
+}
+
+static void run(enum direction dir, uint32_t size, enum csum_mode csum, uint64_t packets)
+{
+    /* Frames beyond the MTU need segmentation offload, which in turn needs checksum offload */
+    if (size > ETH_MAX_FRAME && csum == CSUM_OFF) {
+        return;
+    }
+
+    bench_setup(csum);
+    uint64_t done = (dir == DIR_TX) ? bench_tx(size, csum, packets) : bench_rx(size, csum, packets);
+    double ns = (double)bench.device_ns;
+    printf("%-4s %6u %-5s %10lu %9.3f %9.1f %9.2f %9.3f %9.3f\n", dir_names[dir], size, csum_names[csum], done,
+           done * 1e3 / ns, ns / done, done * size * 8.0 / ns, bench_counters.interrupts / (double)done,
+           bench_counters.notifications / (double)done);
+    bench_teardown();
+}
+
+static int lookup(const char *name, const char **names, int num_names)
+{
+    for (int i = 0; i < num_names; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n packets] [-s size]... [-d tx|rx]... [-c off|sw|hw]...\n"
+            "  -n  frames to send per run (default 1000000)\n"
+            "  -s  frame size in bytes, %u-%u (default 64 to 9000)\n"
+            "  -d  direction, as seen from the guest (default both)\n"
+            "  -c  checksum mode: computed by the guest, by the VMM or by the backing device (default all)\n",
+            prog, MIN_FRAME, TX_FRAME_MAX);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t packets = 1000000;
+    uint32_t sizes[32];
+    int num_sizes = 0;
+    bool dirs[ARRAY_SIZE(dir_names)] = { false };
+    bool csums[ARRAY_SIZE(csum_names)] = { false };
+    bool any_dir = false;
+    bool any_csum = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:d:c:h")) != -1) {
+        int idx;
+        switch (opt) {
+        case 'n':
+            packets = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            if (num_sizes == ARRAY_SIZE(sizes)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            sizes[num_sizes] = strtoul(optarg, NULL, 0);
+            if (sizes[num_sizes] < MIN_FRAME || sizes[num_sizes] > TX_FRAME_MAX) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            num_sizes++;
+            break;
+        case 'd':
+            idx = lookup(optarg, dir_names, ARRAY_SIZE(dir_names));
+            if (idx < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            dirs[idx] = any_dir = true;
+            break;
+        case 'c':
+            idx = lookup(optarg, csum_names, ARRAY_SIZE(csum_names));
+            if (idx < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            csums[idx] = any_csum = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (packets == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (num_sizes == 0) {
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+        num_sizes = ARRAY_SIZE(default_sizes);
+    }
+
+    printf("%-4s %6s %-5s %10s %9s %9s %9s %9s %9s\n", "dir", "size", "csum", "packets", "Mpps", "ns/pkt", "Gbit/s",
+           "irq/pkt", "ntfn/pkt");
+    for (int dir = 0; dir < ARRAY_SIZE(dir_names); dir++) {
+        if (any_dir && !dirs[dir]) {
+            continue;
+        }
+        for (int csum = 0; csum < ARRAY_SIZE(csum_names); csum++) {
+            if (any_csum && !csums[csum]) {
+                continue;
+            }
+            for (int i = 0; i < num_sizes; i++) {
+                run(dir, sizes[i], csum, packets);
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Notifications and interrupts raised by the device model, counted by the mocks */
+struct bench_counters {
+    uint64_t notifications;
+    uint64_t interrupts;
+};
+
+extern struct bench_counters bench_counters;
+
+/* Back guest RAM at `gpa` with `size` bytes of host memory, which is zeroed */
+void *bench_guest_ram_init(uint64_t gpa, size_t size);
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Just enough of the Microkit API for the libvmm headers and the virtIO
+ * device models to build as a Linux program.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int microkit_channel;
+typedef unsigned int microkit_child;
+typedef uint64_t microkit_msginfo;
+
+typedef uint64_t seL4_Word;
+typedef int seL4_Bool;
+
+#define seL4_True 1
+#define seL4_False 0
+
+typedef struct seL4_UserContext_ {
+    seL4_Word regs[36];
+} seL4_UserContext;
+
+typedef struct seL4_VCPUContext_ {
+    seL4_Word regs[8];
+} seL4_VCPUContext;
+
+#define MICROKIT_MAX_CHANNELS 62
+
+extern char microkit_name[];
+
+void microkit_notify(microkit_channel ch);
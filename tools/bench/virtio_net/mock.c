@@ -0,0 +1,94 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Stand-ins for the parts of libvmm and Microkit that the virtIO net device
+ * model calls into, so that it can run as a Linux program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <microkit.h>
+#include <libvmm/guest_ram.h>
+#include <libvmm/pci.h>
+#include <libvmm/virq.h>
+#include <libvmm/virtio/virtio.h>
+#include "bench.h"
+
+char microkit_name[] = "bench";
+
+struct bench_counters bench_counters;
+
+static struct guest_ram_region guest_ram;
+
+void *bench_guest_ram_init(uint64_t gpa, size_t size)
+{
+    if (guest_ram.vmm_vaddr == NULL || guest_ram.size != size) {
+        free(guest_ram.vmm_vaddr);
+        guest_ram.vmm_vaddr = aligned_alloc(0x1000, size);
+        if (guest_ram.vmm_vaddr == NULL) {
+            return NULL;
+        }
+    }
+    memset(guest_ram.vmm_vaddr, 0, size);
+    guest_ram.gpa_start = gpa;
+    guest_ram.size = size;
+
+    return guest_ram.vmm_vaddr;
+}
+
+void *gpa_to_hva(uint64_t gpa, size_t size)
+{
+    if (gpa < guest_ram.gpa_start || size > guest_ram.size || gpa - guest_ram.gpa_start > guest_ram.size - size) {
+        return NULL;
+    }
+
+    return (char *)guest_ram.vmm_vaddr + (gpa - guest_ram.gpa_start);
+}
+
+struct guest_ram_region *guest_ram_get_regions(int *num_regions_ret)
+{
+    *num_regions_ret = 1;
+    return &guest_ram;
+}
+
+void microkit_notify(microkit_channel ch)
+{
+    bench_counters.notifications++;
+}
+
+bool virq_inject(irq_routing_info_t irq_routing_info)
+{
+    bench_counters.interrupts++;
+    return true;
+}
+
+bool virq_set_level(irq_routing_info_t irq_routing_info, bool level)
+{
+    if (level) {
+        bench_counters.interrupts++;
+    }
+    return true;
+}
+
+bool pci_device_set_irq_status(pci_dev_handle_t pci_dev_handle, bool new_status)
+{
+    return true;
+}
+
+/* The benchmark plays the guest driver itself, so there are no register accesses to trap */
+bool virtio_mmio_register_device(virtio_device_t *dev, uintptr_t region_base, uintptr_t region_size,
+                                 irq_routing_info_t irq_routing_info)
+{
+    return true;
+}
+
+bool virtio_pci_register_device(virtio_device_t *dev, uint16_t pci_bus, uint16_t pci_dev,
+                                irq_routing_info_t irq_routing_info)
+{
+    return true;
+}
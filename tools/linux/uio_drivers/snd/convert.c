@@ -100,6 +100,15 @@ uint64_t sddf_formats_from_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params
     return formats;
 }
 
+uint64_t sddf_rates_all(void)
+{
+    uint64_t rates = 0;
+    for (int i = 0; i < RATE_COUNT; i++) {
+        rates |= (1 << sddf_rates[i]);
+    }
+    return rates;
+}
+
 snd_pcm_format_t sddf_format_to_alsa(sound_pcm_fmt_t format)
 {
     unsigned idx = (unsigned)format;
@@ -5,6 +5,7 @@
  */
 
 #include "log.h"
+#include "mixer.h"
 #include "stream.h"
 #include <libvmm/util/atomic.h>
 #include <uio/sound.h>
@@ -12,6 +13,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <getopt.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -21,7 +23,9 @@
 #define QUEUE_BYTES 0x200000
 
 #define DEFAULT_DEVICE "default"
-#define MAX_STREAMS 2
+// Playback and capture devices
+#define MAX_TARGETS 2
+#define MAX_STREAMS SOUND_MAX_STREAM_COUNT
 #define UIO_POLLFD 0
 
 #define UIO_MAP "/sys/class/uio/uio0/maps/map"
@@ -215,8 +219,34 @@ static bool handle_uio_interrupt(driver_state_t *state)
     return notify_client;
 }
 
+static void usage(const char *prog)
+{
+    LOG_SOUND_ERR("Usage: %s [-m clients] [playback device] [capture device]\n", prog);
+}
+
 int main(int argc, char **argv)
 {
+    // With -m, the playback device is shared by this many streams through a software mixer
+    int mixed_streams = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mixed_streams = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Leave a stream for capture
+    int max_mixed = MIXER_MAX_CLIENTS < MAX_STREAMS - 1 ? MIXER_MAX_CLIENTS : MAX_STREAMS - 1;
+    if (mixed_streams < 0 || mixed_streams > max_mixed) {
+        LOG_SOUND_ERR("Can mix at most %d streams\n", max_mixed);
+        return EXIT_FAILURE;
+    }
+
     system("alsactl init -U");
 
     LOG_SOUND("Starting sound driver\n");
@@ -245,19 +275,20 @@ int main(int argc, char **argv)
     LOG_SOUND("Opened /dev/mem\n");
 
     // The idea is that this should work even if one stream fails to open.
-    snd_pcm_stream_t stream_directions[MAX_STREAMS] = {
+    snd_pcm_stream_t stream_directions[MAX_TARGETS] = {
         SND_PCM_STREAM_PLAYBACK,
         SND_PCM_STREAM_CAPTURE,
     };
 
-    bool stream_ready[MAX_STREAMS];
-    memset(stream_ready, 0, sizeof(bool) * MAX_STREAMS);
+    bool stream_ready[MAX_TARGETS];
+    memset(stream_ready, 0, sizeof(bool) * MAX_TARGETS);
+    int targets_ready = 0;
 
     state.stream_count = 0;
 
     int tries = 0;
-    while (state.stream_count != MAX_STREAMS && tries < 10) {
-        for (int i = 0; i < MAX_STREAMS; i++) {
+    while (targets_ready != MAX_TARGETS && tries < 10) {
+        for (int i = 0; i < MAX_TARGETS; i++) {
 
             snd_pcm_stream_t direction = stream_directions[i];
             if (stream_ready[i]) {
@@ -265,12 +296,34 @@ int main(int argc, char **argv)
             }
 
             char *device_name;
-            if (argc - 1 > i) {
-                device_name = argv[i+1];
+            if (argc - optind > i) {
+                device_name = argv[optind + i];
             } else {
                 device_name = DEFAULT_DEVICE;
             }
 
+            if (direction == SND_PCM_STREAM_PLAYBACK && mixed_streams > 0) {
+                mixer_t *mixer = mixer_open(device_name);
+                if (mixer == NULL) {
+                    LOG_SOUND_WARN("Could not open mixer for target %d (%s)\n", i, device_name);
+                    continue;
+                }
+                for (int j = 0; j < mixed_streams; j++) {
+                    state.streams[state.stream_count] = stream_open_mixed(
+                        &state.shared_state->sound.stream_info[state.stream_count], mixer, state.translate,
+                        &state.queues.cmd_res, &state.queues.pcm_res);
+                    if (state.streams[state.stream_count] == NULL) {
+                        LOG_SOUND_WARN("Could not initialise mixed stream %d (%s)\n", j, device_name);
+                        break;
+                    }
+                    state.stream_count++;
+                }
+                LOG_SOUND("Initialised mixer for target %d (%s)\n", i, device_name);
+                stream_ready[i] = true;
+                targets_ready++;
+                continue;
+            }
+
             state.streams[state.stream_count] = stream_open(
                 &state.shared_state->sound.stream_info[state.stream_count], device_name, direction,
                 state.translate, &state.queues.cmd_res, &state.queues.pcm_res);
@@ -280,11 +333,12 @@ int main(int argc, char **argv)
             } else {
                 LOG_SOUND("Initialised stream %d (%s)\n", i, device_name);
                 stream_ready[i] = true;
+                targets_ready++;
                 state.stream_count++;
             }
         }
 
-        if (state.stream_count != MAX_STREAMS) {
+        if (targets_ready != MAX_TARGETS) {
             LOG_SOUND_WARN("Trying again in 1s...\n");
             sleep(1);
             tries++;
@@ -0,0 +1,401 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "mixer.h"
+#include "log.h"
+#include "pcm.h"
+#include "resample.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// Parameters the device is opened with, the closest supported ones are used
+#define MIXER_CHANNELS 2
+#define MIXER_RATE 48000
+#define MIXER_LATENCY 500000
+#define MIXER_PERIOD_TIME 100000
+// Time of audio each client can have queued
+#define MIXER_FIFO_TIME 500000
+
+// Frames converted or mixed at once
+#define MIXER_CHUNK_FRAMES 256
+#define MIXER_RESAMPLE_FRAMES 1024
+
+#define US_PER_SECOND 1000000
+
+struct mixer_client {
+    bool used;
+    bool configured;
+    bool active;
+
+    sound_pcm_fmt_t format;
+    unsigned channels;
+    unsigned frame_bytes;
+    // Most input frames converted at once, so that the resampled output fits
+    size_t chunk_frames;
+    resampler_t resampler;
+
+    // Ring of interleaved frames at the device rate and channel count
+    float *fifo;
+    size_t fifo_head;
+    size_t fifo_len;
+};
+
+struct mixer {
+    snd_pcm_t *handle;
+    // Device sample format, rate and channel count
+    sound_pcm_fmt_t format;
+    unsigned rate;
+    unsigned channels;
+    size_t fifo_frames;
+
+    struct mixer_client clients[MIXER_MAX_CLIENTS];
+
+    // Scratch buffers for the conversion and mixing stages
+    uint8_t bounce[MIXER_CHUNK_FRAMES * PCM_MAX_CHANNELS * sizeof(int32_t)] __attribute__((aligned(16)));
+    float converted[MIXER_CHUNK_FRAMES * PCM_MAX_CHANNELS];
+    float remapped[MIXER_CHUNK_FRAMES * PCM_MAX_CHANNELS];
+    float resampled[MIXER_RESAMPLE_FRAMES * PCM_MAX_CHANNELS];
+    float mix[MIXER_CHUNK_FRAMES * PCM_MAX_CHANNELS];
+};
+
+// Device formats the mixer can produce, in order of preference
+static const struct {
+    snd_pcm_format_t alsa;
+    sound_pcm_fmt_t sddf;
+} device_formats[] = {
+    { SND_PCM_FORMAT_S16, SOUND_PCM_FMT_S16 },
+    { SND_PCM_FORMAT_S32, SOUND_PCM_FMT_S32 },
+    { SND_PCM_FORMAT_FLOAT, SOUND_PCM_FMT_FLOAT },
+};
+
+static int set_params(mixer_t *mixer, snd_pcm_t *handle)
+{
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_hw_params_alloca(&hw_params);
+    snd_pcm_sw_params_alloca(&sw_params);
+
+    int err = snd_pcm_hw_params_any(handle, hw_params);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_hw_params_set_rate_resample(handle, hw_params, 1);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (err < 0) {
+        return err;
+    }
+
+    err = -EINVAL;
+    for (int i = 0; i < sizeof(device_formats) / sizeof(device_formats[0]); i++) {
+        if (snd_pcm_hw_params_test_format(handle, hw_params, device_formats[i].alsa) == 0) {
+            err = snd_pcm_hw_params_set_format(handle, hw_params, device_formats[i].alsa);
+            mixer->format = device_formats[i].sddf;
+            break;
+        }
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    unsigned channels = MIXER_CHANNELS;
+    err = snd_pcm_hw_params_set_channels_near(handle, hw_params, &channels);
+    if (err < 0) {
+        return err;
+    }
+    if (channels > PCM_MAX_CHANNELS) {
+        return -EINVAL;
+    }
+
+    unsigned rate = MIXER_RATE;
+    err = snd_pcm_hw_params_set_rate_near(handle, hw_params, &rate, 0);
+    if (err < 0) {
+        return err;
+    }
+
+    unsigned latency = MIXER_LATENCY;
+    unsigned period_time = MIXER_PERIOD_TIME;
+    int dir;
+    err = snd_pcm_hw_params_set_buffer_time_near(handle, hw_params, &latency, &dir);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_hw_params_set_period_time_near(handle, hw_params, &period_time, &dir);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_hw_params(handle, hw_params);
+    if (err < 0) {
+        return err;
+    }
+
+    snd_pcm_uframes_t period_size;
+    err = snd_pcm_hw_params_get_period_size(hw_params, &period_size, &dir);
+    if (err < 0) {
+        return err;
+    }
+
+    // Start playing as soon as a period is mixed, clients join and leave at any time
+    err = snd_pcm_sw_params_current(handle, sw_params);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_sw_params_set_start_threshold(handle, sw_params, period_size);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_sw_params_set_avail_min(handle, sw_params, period_size);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_pcm_sw_params(handle, sw_params);
+    if (err < 0) {
+        return err;
+    }
+
+    mixer->rate = rate;
+    mixer->channels = channels;
+    return 0;
+}
+
+mixer_t *mixer_open(const char *device)
+{
+    mixer_t *mixer = calloc(1, sizeof(mixer_t));
+    if (mixer == NULL) {
+        LOG_SOUND_ERR("No enough memory\n");
+        return NULL;
+    }
+
+    int err = snd_pcm_open(&mixer->handle, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+    if (err < 0) {
+        LOG_SOUND_ERR("Failed to open mixer device %s: %s\n", device, snd_strerror(err));
+        free(mixer);
+        return NULL;
+    }
+
+    err = set_params(mixer, mixer->handle);
+    if (err < 0) {
+        LOG_SOUND_ERR("Failed to configure mixer device %s: %s\n", device, snd_strerror(err));
+        goto fail;
+    }
+
+    mixer->fifo_frames = (size_t)mixer->rate * MIXER_FIFO_TIME / US_PER_SECOND;
+    for (int i = 0; i < MIXER_MAX_CLIENTS; i++) {
+        mixer->clients[i].fifo = calloc(mixer->fifo_frames * mixer->channels, sizeof(float));
+        if (mixer->clients[i].fifo == NULL) {
+            LOG_SOUND_ERR("No enough memory\n");
+            goto fail;
+        }
+    }
+
+    LOG_SOUND("Mixing onto %s at %uHz, %u channels, format %s\n", device, mixer->rate, mixer->channels,
+              sound_pcm_fmt_str(mixer->format));
+
+    return mixer;
+
+fail:
+    for (int i = 0; i < MIXER_MAX_CLIENTS; i++) {
+        free(mixer->clients[i].fifo);
+    }
+    snd_pcm_close(mixer->handle);
+    free(mixer);
+    return NULL;
+}
+
+int mixer_client_add(mixer_t *mixer)
+{
+    for (int i = 0; i < MIXER_MAX_CLIENTS; i++) {
+        if (!mixer->clients[i].used) {
+            mixer->clients[i].used = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void mixer_client_reset(mixer_t *mixer, int client)
+{
+    struct mixer_client *c = &mixer->clients[client];
+    c->fifo_head = 0;
+    c->fifo_len = 0;
+    if (c->configured) {
+        resampler_init(&c->resampler, c->resampler.in_rate, mixer->rate, mixer->channels);
+    }
+}
+
+bool mixer_client_configure(mixer_t *mixer, int client, sound_pcm_fmt_t format, unsigned rate, unsigned channels)
+{
+    struct mixer_client *c = &mixer->clients[client];
+
+    unsigned sample_bytes = pcm_sample_bytes(format);
+    if (sample_bytes == 0 || channels == 0 || channels > PCM_MAX_CHANNELS) {
+        return false;
+    }
+
+    c->format = format;
+    c->channels = channels;
+    c->frame_bytes = sample_bytes * channels;
+    resampler_init(&c->resampler, rate, mixer->rate, mixer->channels);
+
+    c->chunk_frames = MIXER_CHUNK_FRAMES;
+    while (resampler_max_output(&c->resampler, c->chunk_frames) > MIXER_RESAMPLE_FRAMES) {
+        c->chunk_frames /= 2;
+    }
+    if (c->chunk_frames == 0) {
+        return false;
+    }
+
+    c->configured = true;
+    mixer_client_reset(mixer, client);
+    return true;
+}
+
+void mixer_client_set_active(mixer_t *mixer, int client, bool active)
+{
+    mixer->clients[client].active = active;
+}
+
+snd_pcm_sframes_t mixer_client_queued(mixer_t *mixer, int client)
+{
+    return mixer->clients[client].fifo_len;
+}
+
+static void fifo_push(mixer_t *mixer, struct mixer_client *c, const float *frames, size_t count)
+{
+    assert(c->fifo_len + count <= mixer->fifo_frames);
+
+    size_t tail = (c->fifo_head + c->fifo_len) % mixer->fifo_frames;
+    size_t first = count < mixer->fifo_frames - tail ? count : mixer->fifo_frames - tail;
+    memcpy(&c->fifo[tail * mixer->channels], frames, first * mixer->channels * sizeof(float));
+    memcpy(c->fifo, &frames[first * mixer->channels], (count - first) * mixer->channels * sizeof(float));
+    c->fifo_len += count;
+}
+
+// Add `count` frames from the front of the FIFO to `acc` and drop them
+static void fifo_mix(mixer_t *mixer, struct mixer_client *c, float *acc, size_t count)
+{
+    assert(count <= c->fifo_len);
+
+    size_t first = count < mixer->fifo_frames - c->fifo_head ? count : mixer->fifo_frames - c->fifo_head;
+    pcm_mix(acc, &c->fifo[c->fifo_head * mixer->channels], first * mixer->channels);
+    pcm_mix(&acc[first * mixer->channels], c->fifo, (count - first) * mixer->channels);
+    c->fifo_head = (c->fifo_head + count) % mixer->fifo_frames;
+    c->fifo_len -= count;
+}
+
+snd_pcm_sframes_t mixer_client_write(mixer_t *mixer, int client, const void *pcm, snd_pcm_sframes_t frames)
+{
+    struct mixer_client *c = &mixer->clients[client];
+    if (!c->configured) {
+        return -1;
+    }
+
+    const uint8_t *src = pcm;
+    snd_pcm_sframes_t taken = 0;
+    while (taken < frames) {
+        size_t count = frames - taken < c->chunk_frames ? frames - taken : c->chunk_frames;
+        size_t space = mixer->fifo_frames - c->fifo_len;
+        while (count > 0 && resampler_max_output(&c->resampler, count) > space) {
+            count /= 2;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        // Bring the PCM out of device memory first, converting from it directly would need unaligned reads
+        pcm_device_copy(mixer->bounce, &src[taken * c->frame_bytes], count * c->frame_bytes);
+        pcm_to_float(c->format, mixer->bounce, mixer->converted, count * c->channels);
+        pcm_remap_channels(mixer->converted, c->channels, mixer->remapped, mixer->channels, count);
+
+        size_t used;
+        size_t out = resampler_process(&c->resampler, mixer->remapped, count, mixer->resampled, MIXER_RESAMPLE_FRAMES,
+                                       &used);
+        assert(used == count);
+        fifo_push(mixer, c, mixer->resampled, out);
+
+        taken += count;
+    }
+
+    return taken;
+}
+
+void mixer_update(mixer_t *mixer)
+{
+    size_t pending = 0;
+    for (int i = 0; i < MIXER_MAX_CLIENTS; i++) {
+        struct mixer_client *c = &mixer->clients[i];
+        if (c->active && c->fifo_len > pending) {
+            pending = c->fifo_len;
+        }
+    }
+    if (pending == 0) {
+        return;
+    }
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(mixer->handle);
+    if (avail < 0) {
+        // Underran while no client had anything to play, start over
+        int err = snd_pcm_recover(mixer->handle, avail, 1);
+        if (err < 0) {
+            LOG_SOUND_ERR("Failed to recover mixer device: %s\n", snd_strerror(err));
+            return;
+        }
+        avail = snd_pcm_avail_update(mixer->handle);
+        if (avail < 0) {
+            return;
+        }
+    }
+
+    size_t frames = pending < (size_t)avail ? pending : (size_t)avail;
+    while (frames > 0) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t count = frames < MIXER_CHUNK_FRAMES ? frames : MIXER_CHUNK_FRAMES;
+
+        int err = snd_pcm_mmap_begin(mixer->handle, &areas, &offset, &count);
+        if (err < 0) {
+            LOG_SOUND_ERR("Failed to mmap mixer device: %s\n", snd_strerror(err));
+            snd_pcm_recover(mixer->handle, err, 1);
+            return;
+        }
+
+        size_t samples = count * mixer->channels;
+        memset(mixer->mix, 0, samples * sizeof(float));
+        for (int i = 0; i < MIXER_MAX_CLIENTS; i++) {
+            struct mixer_client *c = &mixer->clients[i];
+            if (c->active && c->fifo_len > 0) {
+                fifo_mix(mixer, c, mixer->mix, c->fifo_len < count ? c->fifo_len : count);
+            }
+        }
+
+        void *dst = areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+        pcm_from_float(mixer->format, mixer->mix, dst, samples);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(mixer->handle, offset, count);
+        if (committed < 0) {
+            LOG_SOUND_ERR("Failed to commit mixed PCM: %s\n", snd_strerror(committed));
+            snd_pcm_recover(mixer->handle, committed, 1);
+            return;
+        }
+        if ((snd_pcm_uframes_t)committed != count) {
+            return;
+        }
+
+        frames -= count;
+    }
+}
+
+uint64_t mixer_formats(void)
+{
+    return pcm_formats_to_float();
+}
+
+unsigned mixer_max_channels(void)
+{
+    return PCM_MAX_CHANNELS;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sddf/sound/queue.h>
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+
+/*
+ * Software mixer sharing one ALSA playback device between several clients. Each client
+ * has its own sample format, rate and channel count, which are converted to the device's
+ * as PCM is written, and held in a per-client FIFO until mixed into the device buffer.
+ */
+
+// Most clients a mixer takes, can be overridden at build time
+#ifndef MIXER_MAX_CLIENTS
+#define MIXER_MAX_CLIENTS 4
+#endif
+
+typedef struct mixer mixer_t;
+
+mixer_t *mixer_open(const char *device);
+
+/** Returns a new client ID, or -1 if there are already MIXER_MAX_CLIENTS */
+int mixer_client_add(mixer_t *mixer);
+
+/** Set the client's PCM parameters, returns false if they cannot be converted */
+bool mixer_client_configure(mixer_t *mixer, int client, sound_pcm_fmt_t format, unsigned rate, unsigned channels);
+
+/** Drop queued PCM and conversion state */
+void mixer_client_reset(mixer_t *mixer, int client);
+
+/** Only active clients are mixed */
+void mixer_client_set_active(mixer_t *mixer, int client, bool active);
+
+/**
+ * Queue PCM from UIO device memory for mixing, converting it as it goes.
+ * Returns the number of frames taken, which is less than `frames` once the FIFO fills up.
+ */
+snd_pcm_sframes_t mixer_client_write(mixer_t *mixer, int client, const void *pcm, snd_pcm_sframes_t frames);
+
+/** Frames queued for mixing, at the device rate */
+snd_pcm_sframes_t mixer_client_queued(mixer_t *mixer, int client);
+
+/** Mix queued PCM of active clients into the device for as much as it has room */
+void mixer_update(mixer_t *mixer);
+
+/** Bitmask of the sDDF formats (1 << SOUND_PCM_FMT_*) clients may use */
+uint64_t mixer_formats(void);
+
+unsigned mixer_max_channels(void);
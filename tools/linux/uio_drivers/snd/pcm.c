@@ -0,0 +1,342 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "pcm.h"
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define PCM_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PCM_SSE2
+#endif
+
+// Samples per vector iteration
+#define VEC_SAMPLES 4
+
+#define S16_SCALE 32768.0f
+#define S24_SCALE 8388608.0f
+#define S32_SCALE 2147483648.0f
+// Largest float below 1.0 that still converts to an in-range S32
+#define S32_MAX_F (2147483520.0f / S32_SCALE)
+#define S16_MAX_F (32767.0f / S16_SCALE)
+
+void *pcm_device_copy(void *dst, const void *src, size_t len)
+{
+    char *c_dst = dst;
+    const char *c_src = src;
+
+#if defined(PCM_NEON) || defined(PCM_SSE2)
+    if ((uintptr_t)src % 16 == 0 && (uintptr_t)dst % 16 == 0) {
+        while (len >= 64) {
+#if defined(PCM_NEON)
+            uint8x16_t v0 = vld1q_u8((const uint8_t *)c_src);
+            uint8x16_t v1 = vld1q_u8((const uint8_t *)c_src + 16);
+            uint8x16_t v2 = vld1q_u8((const uint8_t *)c_src + 32);
+            uint8x16_t v3 = vld1q_u8((const uint8_t *)c_src + 48);
+            vst1q_u8((uint8_t *)c_dst, v0);
+            vst1q_u8((uint8_t *)c_dst + 16, v1);
+            vst1q_u8((uint8_t *)c_dst + 32, v2);
+            vst1q_u8((uint8_t *)c_dst + 48, v3);
+#else
+            __m128i v0 = _mm_load_si128((const __m128i *)c_src);
+            __m128i v1 = _mm_load_si128((const __m128i *)c_src + 1);
+            __m128i v2 = _mm_load_si128((const __m128i *)c_src + 2);
+            __m128i v3 = _mm_load_si128((const __m128i *)c_src + 3);
+            _mm_store_si128((__m128i *)c_dst, v0);
+            _mm_store_si128((__m128i *)c_dst + 1, v1);
+            _mm_store_si128((__m128i *)c_dst + 2, v2);
+            _mm_store_si128((__m128i *)c_dst + 3, v3);
+#endif
+            c_src += 64;
+            c_dst += 64;
+            len -= 64;
+        }
+    }
+#endif
+
+    if ((uintptr_t)c_src % sizeof(long) == 0 && (uintptr_t)c_dst % sizeof(long) == 0) {
+        long *l_dst = (long *)c_dst;
+        const long *l_src = (const long *)c_src;
+        while (len >= sizeof(long)) {
+            *l_dst++ = *l_src++;
+            len -= sizeof(long);
+        }
+        c_dst = (char *)l_dst;
+        c_src = (const char *)l_src;
+    }
+
+    while (len--) {
+        *c_dst++ = *c_src++;
+    }
+
+    return dst;
+}
+
+uint64_t pcm_formats_to_float(void)
+{
+    return (1 << SOUND_PCM_FMT_S8) | (1 << SOUND_PCM_FMT_U8) | (1 << SOUND_PCM_FMT_S16) | (1 << SOUND_PCM_FMT_U16)
+         | (1 << SOUND_PCM_FMT_S24_3) | (1 << SOUND_PCM_FMT_S24) | (1 << SOUND_PCM_FMT_S32)
+         | (1 << SOUND_PCM_FMT_U32) | (1 << SOUND_PCM_FMT_FLOAT);
+}
+
+unsigned pcm_sample_bytes(sound_pcm_fmt_t format)
+{
+    switch (format) {
+    case SOUND_PCM_FMT_S8:
+    case SOUND_PCM_FMT_U8:
+        return 1;
+    case SOUND_PCM_FMT_S16:
+    case SOUND_PCM_FMT_U16:
+        return 2;
+    case SOUND_PCM_FMT_S24_3:
+        return 3;
+    case SOUND_PCM_FMT_S24:
+    case SOUND_PCM_FMT_S32:
+    case SOUND_PCM_FMT_U32:
+    case SOUND_PCM_FMT_FLOAT:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static void s16_to_float(const int16_t *src, float *dst, size_t samples)
+{
+    size_t i = 0;
+#if defined(PCM_NEON)
+    float32x4_t scale = vdupq_n_f32(1.0f / S16_SCALE);
+    for (; i + 2 * VEC_SAMPLES <= samples; i += 2 * VEC_SAMPLES) {
+        int16x8_t v = vld1q_s16(&src[i]);
+        vst1q_f32(&dst[i], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+        vst1q_f32(&dst[i + VEC_SAMPLES], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+    }
+#elif defined(PCM_SSE2)
+    __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+    for (; i + 2 * VEC_SAMPLES <= samples; i += 2 * VEC_SAMPLES) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        // Sign extend by placing each sample in the top half of a 32-bit lane
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(&dst[i + VEC_SAMPLES], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = src[i] / S16_SCALE;
+    }
+}
+
+static void s32_to_float(const int32_t *src, float *dst, size_t samples)
+{
+    size_t i = 0;
+#if defined(PCM_NEON)
+    float32x4_t scale = vdupq_n_f32(1.0f / S32_SCALE);
+    for (; i + VEC_SAMPLES <= samples; i += VEC_SAMPLES) {
+        vst1q_f32(&dst[i], vmulq_f32(vcvtq_f32_s32(vld1q_s32(&src[i])), scale));
+    }
+#elif defined(PCM_SSE2)
+    __m128 scale = _mm_set1_ps(1.0f / S32_SCALE);
+    for (; i + VEC_SAMPLES <= samples; i += VEC_SAMPLES) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = src[i] / S32_SCALE;
+    }
+}
+
+static void float_to_s16(const float *src, int16_t *dst, size_t samples)
+{
+    size_t i = 0;
+#if defined(PCM_NEON)
+    float32x4_t scale = vdupq_n_f32(S16_SCALE);
+    for (; i + 2 * VEC_SAMPLES <= samples; i += 2 * VEC_SAMPLES) {
+        // Conversion and narrowing both saturate, so no explicit clipping is needed
+        int32x4_t lo = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(&src[i]), scale));
+        int32x4_t hi = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(&src[i + VEC_SAMPLES]), scale));
+        vst1q_s16(&dst[i], vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#elif defined(PCM_SSE2)
+    __m128 scale = _mm_set1_ps(S16_SCALE);
+    __m128 max = _mm_set1_ps(S16_MAX_F);
+    __m128 min = _mm_set1_ps(-1.0f);
+    for (; i + 2 * VEC_SAMPLES <= samples; i += 2 * VEC_SAMPLES) {
+        // Clip first, out of range conversions would give INT32_MIN
+        __m128 lo = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(&src[i]), max), min);
+        __m128 hi = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(&src[i + VEC_SAMPLES]), max), min);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(lo, scale)),
+                                         _mm_cvtps_epi32(_mm_mul_ps(hi, scale)));
+        _mm_storeu_si128((__m128i *)&dst[i], packed);
+    }
+#endif
+    for (; i < samples; i++) {
+        float s = src[i] > S16_MAX_F ? S16_MAX_F : (src[i] < -1.0f ? -1.0f : src[i]);
+        dst[i] = (int16_t)__builtin_lrintf(s * S16_SCALE);
+    }
+}
+
+static void float_to_s32(const float *src, int32_t *dst, size_t samples)
+{
+    size_t i = 0;
+#if defined(PCM_NEON)
+    float32x4_t scale = vdupq_n_f32(S32_SCALE);
+    for (; i + VEC_SAMPLES <= samples; i += VEC_SAMPLES) {
+        vst1q_s32(&dst[i], vcvtnq_s32_f32(vmulq_f32(vld1q_f32(&src[i]), scale)));
+    }
+#elif defined(PCM_SSE2)
+    __m128 scale = _mm_set1_ps(S32_SCALE);
+    __m128 max = _mm_set1_ps(S32_MAX_F);
+    __m128 min = _mm_set1_ps(-1.0f);
+    for (; i + VEC_SAMPLES <= samples; i += VEC_SAMPLES) {
+        __m128 v = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(&src[i]), max), min);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_cvtps_epi32(_mm_mul_ps(v, scale)));
+    }
+#endif
+    for (; i < samples; i++) {
+        float s = src[i] > S32_MAX_F ? S32_MAX_F : (src[i] < -1.0f ? -1.0f : src[i]);
+        dst[i] = (int32_t)__builtin_lrintf(s * S32_SCALE);
+    }
+}
+
+static void float_clip(const float *src, float *dst, size_t samples)
+{
+    size_t i = 0;
+#if defined(PCM_NEON)
+    float32x4_t max = vdupq_n_f32(1.0f);
+    float32x4_t min = vdupq_n_f32(-1.0f);
+    for (; i + VEC_SAMPLES <= samples; i += VEC_SAMPLES) {
+        vst1q_f32(&dst[i], vmaxq_f32(vminq_f32(vld1q_f32(&src[i]), max), min));
+    }
+#elif defined(PCM_SSE2)
+    __m128 max = _mm_set1_ps(1.0f);
+    __m128 min = _mm_set1_ps(-1.0f);
+    for (; i + VEC_SAMPLES <= samples; i += VEC_SAMPLES) {
+        _mm_storeu_ps(&dst[i], _mm_max_ps(_mm_min_ps(_mm_loadu_ps(&src[i]), max), min));
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = src[i] > 1.0f ? 1.0f : (src[i] < -1.0f ? -1.0f : src[i]);
+    }
+}
+
+bool pcm_to_float(sound_pcm_fmt_t format, const void *src, float *dst, size_t samples)
+{
+    const uint8_t *bytes = src;
+
+    switch (format) {
+    case SOUND_PCM_FMT_S16:
+        s16_to_float(src, dst, samples);
+        return true;
+    case SOUND_PCM_FMT_S32:
+        s32_to_float(src, dst, samples);
+        return true;
+    case SOUND_PCM_FMT_FLOAT:
+        memcpy(dst, src, samples * sizeof(float));
+        return true;
+    case SOUND_PCM_FMT_S8:
+        for (size_t i = 0; i < samples; i++) {
+            dst[i] = (int8_t)bytes[i] / 128.0f;
+        }
+        return true;
+    case SOUND_PCM_FMT_U8:
+        for (size_t i = 0; i < samples; i++) {
+            dst[i] = (bytes[i] - 128) / 128.0f;
+        }
+        return true;
+    case SOUND_PCM_FMT_U16:
+        for (size_t i = 0; i < samples; i++) {
+            dst[i] = (((const uint16_t *)src)[i] - 32768) / S16_SCALE;
+        }
+        return true;
+    case SOUND_PCM_FMT_S24_3:
+        for (size_t i = 0; i < samples; i++, bytes += 3) {
+            int32_t s = (int32_t)(((uint32_t)bytes[0] << 8) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 24));
+            dst[i] = (s >> 8) / S24_SCALE;
+        }
+        return true;
+    case SOUND_PCM_FMT_S24:
+        // 24 bits in the low part of 32-bit containers
+        for (size_t i = 0; i < samples; i++) {
+            int32_t s = (int32_t)(((const uint32_t *)src)[i] << 8);
+            dst[i] = (s >> 8) / S24_SCALE;
+        }
+        return true;
+    case SOUND_PCM_FMT_U32:
+        for (size_t i = 0; i < samples; i++) {
+            dst[i] = (int32_t)(((const uint32_t *)src)[i] ^ 0x80000000u) / S32_SCALE;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool pcm_from_float(sound_pcm_fmt_t format, const float *src, void *dst, size_t samples)
+{
+    switch (format) {
+    case SOUND_PCM_FMT_S16:
+        float_to_s16(src, dst, samples);
+        return true;
+    case SOUND_PCM_FMT_S32:
+        float_to_s32(src, dst, samples);
+        return true;
+    case SOUND_PCM_FMT_FLOAT:
+        float_clip(src, dst, samples);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void pcm_remap_channels(const float *src, unsigned in_channels, float *dst, unsigned out_channels, size_t frames)
+{
+    if (in_channels == out_channels) {
+        memcpy(dst, src, frames * in_channels * sizeof(float));
+        return;
+    }
+
+    for (size_t f = 0; f < frames; f++) {
+        const float *in = &src[f * in_channels];
+        float *out = &dst[f * out_channels];
+        if (out_channels == 1) {
+            // Down to mono, average every channel
+            float sum = 0;
+            for (unsigned c = 0; c < in_channels; c++) {
+                sum += in[c];
+            }
+            out[0] = sum / in_channels;
+        } else {
+            // Otherwise repeat input channels across the output ones, dropping extra ones
+            for (unsigned c = 0; c < out_channels; c++) {
+                out[c] = in[c % in_channels];
+            }
+        }
+    }
+}
+
+void pcm_mix(float *acc, const float *src, size_t samples)
+{
+    size_t i = 0;
+#if defined(PCM_NEON)
+    for (; i + 2 * VEC_SAMPLES <= samples; i += 2 * VEC_SAMPLES) {
+        vst1q_f32(&acc[i], vaddq_f32(vld1q_f32(&acc[i]), vld1q_f32(&src[i])));
+        vst1q_f32(&acc[i + VEC_SAMPLES],
+                  vaddq_f32(vld1q_f32(&acc[i + VEC_SAMPLES]), vld1q_f32(&src[i + VEC_SAMPLES])));
+    }
+#elif defined(PCM_SSE2)
+    for (; i + 2 * VEC_SAMPLES <= samples; i += 2 * VEC_SAMPLES) {
+        _mm_storeu_ps(&acc[i], _mm_add_ps(_mm_loadu_ps(&acc[i]), _mm_loadu_ps(&src[i])));
+        _mm_storeu_ps(&acc[i + VEC_SAMPLES],
+                      _mm_add_ps(_mm_loadu_ps(&acc[i + VEC_SAMPLES]), _mm_loadu_ps(&src[i + VEC_SAMPLES])));
+    }
+#endif
+    for (; i < samples; i++) {
+        acc[i] += src[i];
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sddf/sound/queue.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample format conversion and mixing. Samples are converted to interleaved 32-bit float
+ * in [-1, 1) for mixing and back to the format of the output device. The common formats
+ * have SSE2 (x86_64) or NEON (aarch64) paths, the rest are converted a sample at a time.
+ */
+
+// Most channels a converted stream may have
+#define PCM_MAX_CHANNELS 8
+
+/** Copy to or from UIO device memory, which must be accessed aligned */
+void *pcm_device_copy(void *dst, const void *src, size_t len);
+
+/** Bitmask of the sDDF formats (1 << SOUND_PCM_FMT_*) that can be converted to float */
+uint64_t pcm_formats_to_float(void);
+
+/** Bytes per sample of a format that can be converted, 0 otherwise */
+unsigned pcm_sample_bytes(sound_pcm_fmt_t format);
+
+/** Convert `samples` samples of `format` to float, returns false if unsupported */
+bool pcm_to_float(sound_pcm_fmt_t format, const void *src, float *dst, size_t samples);
+
+/** Convert `samples` float samples to `format`, clipping. Supports S16, S32 and FLOAT. */
+bool pcm_from_float(sound_pcm_fmt_t format, const float *src, void *dst, size_t samples);
+
+/** Map interleaved frames from `in_channels` to `out_channels` channels */
+void pcm_remap_channels(const float *src, unsigned in_channels, float *dst, unsigned out_channels, size_t frames);
+
+/** acc[i] += src[i] */
+void pcm_mix(float *acc, const float *src, size_t samples);
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "resample.h"
+#include <string.h>
+
+#define FRAC_BITS 32
+#define FRAC_MASK ((1ull << FRAC_BITS) - 1)
+#define FRAC_ONE ((float)(1ull << FRAC_BITS))
+
+void resampler_init(resampler_t *r, unsigned in_rate, unsigned out_rate, unsigned channels)
+{
+    memset(r, 0, sizeof(*r));
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->channels = channels;
+    r->step = ((uint64_t)in_rate << FRAC_BITS) / out_rate;
+}
+
+size_t resampler_max_output(resampler_t *r, size_t in_frames)
+{
+    if (r->in_rate == r->out_rate) {
+        return in_frames;
+    }
+    return ((in_frames << FRAC_BITS) / r->step) + 2;
+}
+
+size_t resampler_process(resampler_t *r, const float *in, size_t in_frames, float *out, size_t out_frames,
+                         size_t *in_used)
+{
+    unsigned channels = r->channels;
+
+    if (r->in_rate == r->out_rate) {
+        size_t frames = in_frames < out_frames ? in_frames : out_frames;
+        memcpy(out, in, frames * channels * sizeof(float));
+        *in_used = frames;
+        return frames;
+    }
+
+    size_t written = 0;
+    uint64_t pos = r->pos;
+    // Output frame at `pos` lies between input frame k - 1 (`prev` when k is 0) and k
+    for (size_t k = pos >> FRAC_BITS; k < in_frames && written < out_frames; k = pos >> FRAC_BITS) {
+        const float *a = k == 0 ? r->prev : &in[(k - 1) * channels];
+        const float *b = &in[k * channels];
+        float t = (pos & FRAC_MASK) / FRAC_ONE;
+        for (unsigned c = 0; c < channels; c++) {
+            out[c] = a[c] + (b[c] - a[c]) * t;
+        }
+        out += channels;
+        written++;
+        pos += r->step;
+    }
+
+    size_t used = pos >> FRAC_BITS;
+    if (used > in_frames) {
+        used = in_frames;
+    }
+    if (used > 0) {
+        memcpy(r->prev, &in[(used - 1) * channels], channels * sizeof(float));
+    }
+    r->pos = pos - ((uint64_t)used << FRAC_BITS);
+    *in_used = used;
+
+    return written;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2026, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include "pcm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming linear-interpolation sample-rate converter over interleaved float frames.
+ * State carries over between calls, so a stream can be converted in chunks of any size.
+ */
+typedef struct resampler {
+    unsigned in_rate;
+    unsigned out_rate;
+    unsigned channels;
+    // Input frames advanced per output frame, 32.32 fixed point
+    uint64_t step;
+    // Position of the next output frame, 32.32 fixed point, relative to `prev`
+    uint64_t pos;
+    // Last input frame of the previous call
+    float prev[PCM_MAX_CHANNELS];
+} resampler_t;
+
+void resampler_init(resampler_t *r, unsigned in_rate, unsigned out_rate, unsigned channels);
+
+/** Upper bound on the output frames produced from `in_frames` input frames */
+size_t resampler_max_output(resampler_t *r, size_t in_frames);
+
+/**
+ * Convert up to `in_frames` frames from `in` into at most `out_frames` frames at `out`.
+ * Returns the number of frames written, and the number of input frames used in `in_used`.
+ */
+size_t resampler_process(resampler_t *r, const float *in, size_t in_frames, float *out, size_t out_frames,
+                         size_t *in_used);
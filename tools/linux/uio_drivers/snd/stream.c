@@ -7,6 +7,8 @@
 #include "stream.h"
 #include "convert.h"
 #include "log.h"
+#include "mixer.h"
+#include "pcm.h"
 #include "queue.h"
 #include <assert.h>
 #include <limits.h>
@@ -25,6 +27,7 @@
 
 #define BITS_PER_BYTE 8
 #define NS_PER_SECOND 1000000000
+#define US_PER_SECOND 1000000
 
 typedef snd_pcm_sframes_t (*pcm_op_t)(stream_t *stream,
                                       void *pcm,
@@ -40,7 +43,7 @@ typedef enum stream_state {
 } stream_state_t;
 
 struct stream {
-    // ALSA
+    // ALSA, NULL for streams played through a mixer
     snd_pcm_t *handle;
     snd_pcm_hw_params_t *hw_params;
     snd_pcm_sw_params_t *sw_params;
@@ -65,6 +68,10 @@ struct stream {
     bool timer_enabled;
     int timer_fd;
 
+    // Mixer shared with other playback streams, if any
+    mixer_t *mixer;
+    int mixer_client;
+
     // Communication
     queue_t *cmd_req;
     queue_t *pcm_req;
@@ -170,35 +177,15 @@ static int stream_fail(stream_t *stream)
     return responses_sent;
 }
 
-/** Aligned memcpy implementation for device memory */
-static void* device_copy(void *dst, void const *src, size_t len)
-{
-    long *l_dst = (long *)dst;
-    long const *l_src = (long const *)src;
-
-    if (((uintptr_t)src % sizeof(long) == 0) && ((uintptr_t)dst % sizeof(long) == 0)) {
-
-        while (len >= sizeof(long)) {
-            *l_dst++ = *l_src++;
-            len -= sizeof(long);
-        }
-    }
-
-    char *c_dst = (char *)l_dst;
-    char const *c_src = (char const *)l_src;
-
-    while (len--) {
-        *c_dst++ = *c_src++;
-    }
-
-    return dst;
-}
-
 static snd_pcm_sframes_t stream_xfer(stream_t *stream,
                                      void *user_pcm,
                                      snd_pcm_sframes_t frames,
                                      bool write)
 {
+    if (stream->mixer) {
+        return mixer_client_write(stream->mixer, stream->mixer_client, user_pcm, frames);
+    }
+
     const snd_pcm_channel_area_t *areas;
     snd_pcm_uframes_t alsa_offset;
     snd_pcm_uframes_t avail = (snd_pcm_uframes_t)frames;
@@ -219,9 +206,9 @@ static snd_pcm_sframes_t stream_xfer(stream_t *stream,
     void *alsa_pcm = areas[0].addr + (areas[0].first + alsa_offset * areas[0].step) / 8;
 
     if (write) {
-        device_copy(alsa_pcm, user_pcm, nbytes);
+        pcm_device_copy(alsa_pcm, user_pcm, nbytes);
     } else {
-        device_copy(user_pcm, alsa_pcm, nbytes);
+        pcm_device_copy(user_pcm, alsa_pcm, nbytes);
     }
 
     snd_pcm_sframes_t written
@@ -260,7 +247,9 @@ static int flush_pcm(stream_t *stream, int max_count)
     int response_count = 0;
 
     // For some reason this is needed for mmap to work
-    snd_pcm_avail(stream->handle);
+    if (stream->handle) {
+        snd_pcm_avail(stream->handle);
+    }
 
     while (!queue_empty(stream->pcm_req) && max_count-- > 0) {
 
@@ -471,19 +460,30 @@ static sound_status_t stream_set_params(stream_t *stream, sound_pcm_set_params_t
     struct buffer_state buffer_state;
     sound_status_t code;
 
-    code = set_hwparams(handle, stream->hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED, &alsa_params,
-                        &buffer_state);
+    if (stream->mixer) {
+        // The mixer converts to the device's parameters, so only the period timing is ours
+        if (!mixer_client_configure(stream->mixer, stream->mixer_client, params->format, rate,
+                                    params->channels)) {
+            LOG_SOUND_ERR("Mixer cannot convert format %s\n", sound_pcm_fmt_str(params->format));
+            return SOUND_S_NOT_SUPP;
+        }
+        buffer_state.buffer_size = (snd_pcm_sframes_t)rate * LATENCY / US_PER_SECOND;
+        buffer_state.period_size = (snd_pcm_sframes_t)rate * PERIOD_TIME / US_PER_SECOND;
+    } else {
+        code = set_hwparams(handle, stream->hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED, &alsa_params,
+                            &buffer_state);
 
-    if (code != SOUND_S_OK) {
-        LOG_SOUND_ERR("Failed to set hardware params\n");
-        return code;
-    }
+        if (code != SOUND_S_OK) {
+            LOG_SOUND_ERR("Failed to set hardware params\n");
+            return code;
+        }
 
-    code = set_swparams(handle, stream->sw_params, &buffer_state);
+        code = set_swparams(handle, stream->sw_params, &buffer_state);
 
-    if (code != SOUND_S_OK) {
-        LOG_SOUND_ERR("Failed to set software params\n");
-        return code;
+        if (code != SOUND_S_OK) {
+            LOG_SOUND_ERR("Failed to set software params\n");
+            return code;
+        }
     }
 
     stream->state = STREAM_STATE_SET;
@@ -502,10 +502,14 @@ static sound_status_t stream_prepare(stream_t *stream)
         return SOUND_S_BAD_MSG;
     }
 
-    int err = snd_pcm_prepare(stream->handle);
-    if (err) {
-        LOG_SOUND_ERR("Failed to prepare stream: %s\n", snd_strerror(err));
-        return SOUND_S_IO_ERR;
+    if (stream->mixer) {
+        mixer_client_reset(stream->mixer, stream->mixer_client);
+    } else {
+        int err = snd_pcm_prepare(stream->handle);
+        if (err) {
+            LOG_SOUND_ERR("Failed to prepare stream: %s\n", snd_strerror(err));
+            return SOUND_S_IO_ERR;
+        }
     }
 
     LOG_SOUND("[%s] Prepared stream\n", stream_name(stream));
@@ -572,10 +576,14 @@ static sound_status_t stream_start(stream_t *stream)
 
     LOG_SOUND("[%s] Starting stream\n", stream_name(stream));
 
-    int err = snd_pcm_start(stream->handle);
-    if (err < 0) {
-        LOG_SOUND_ERR("Failed to start ALSA stream\n");
-        return SOUND_S_IO_ERR;
+    if (stream->mixer) {
+        mixer_client_set_active(stream->mixer, stream->mixer_client, true);
+    } else {
+        int err = snd_pcm_start(stream->handle);
+        if (err < 0) {
+            LOG_SOUND_ERR("Failed to start ALSA stream\n");
+            return SOUND_S_IO_ERR;
+        }
     }
 
     sound_status_t status = timer_start(stream);
@@ -626,7 +634,13 @@ static sound_status_t stream_stop(stream_t *stream, bool *blocked, bool *notify)
     }
 
     int err;
-    if (stream->direction == SND_PCM_STREAM_PLAYBACK) {
+    if (stream->mixer) {
+        // Drained once the mixer has played out everything queued
+        err = mixer_client_queued(stream->mixer, stream->mixer_client) > 0 ? -EAGAIN : 0;
+        if (err == 0) {
+            mixer_client_set_active(stream->mixer, stream->mixer_client, false);
+        }
+    } else if (stream->direction == SND_PCM_STREAM_PLAYBACK) {
         err = snd_pcm_drain(stream->handle);
     } else {
         err = snd_pcm_drop(stream->handle);
@@ -707,6 +721,11 @@ static bool stream_flush_commands(stream_t *stream)
 
 bool stream_update(stream_t *stream)
 {
+    // Make room in the mixer before queueing more
+    if (stream->mixer) {
+        mixer_update(stream->mixer);
+    }
+
     int responses_sent = flush_pcm(stream, INT_MAX);
 
     bool notify = stream_flush_commands(stream);
@@ -817,6 +836,53 @@ fail:
     return NULL;
 }
 
+stream_t *stream_open_mixed(sound_pcm_info_t *info,
+                            mixer_t *mixer,
+                            ssize_t translate_offset,
+                            sound_cmd_queue_handle_t *cmd_res,
+                            sound_pcm_queue_handle_t *pcm_res)
+{
+    int client = mixer_client_add(mixer);
+    if (client < 0) {
+        LOG_SOUND_ERR("Mixer has no free client slots\n");
+        return NULL;
+    }
+
+    stream_t *stream = malloc(sizeof(stream_t));
+    if (stream == NULL) {
+        LOG_SOUND_ERR("No enough memory\n");
+        return NULL;
+    }
+
+    memset(info, 0, sizeof(sound_pcm_info_t));
+    memset(stream, 0, sizeof(stream_t));
+
+    // Anything the mixer can convert, at any rate
+    info->formats = mixer_formats();
+    info->rates = sddf_rates_all();
+    info->direction = SOUND_D_OUTPUT;
+    info->channels_min = 1;
+    info->channels_max = mixer_max_channels();
+
+    stream->state = STREAM_STATE_UNSET;
+    stream->direction = SND_PCM_STREAM_PLAYBACK;
+    stream->translate_offset = translate_offset;
+    stream->mixer = mixer;
+    stream->mixer_client = client;
+
+    stream->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+
+    stream->cmd_req = queue_create(sizeof(sound_cmd_t), SOUND_PCM_QUEUE_SIZE / 4);
+    stream->cmd_res = *cmd_res;
+
+    stream->pcm_req = queue_create(sizeof(sound_pcm_t), SOUND_PCM_QUEUE_SIZE / 4);
+    stream->pcm_res = *pcm_res;
+
+    stream->staged_responses = queue_create(sizeof(sound_pcm_t), PCM_QUEUE_SIZE);
+
+    return stream;
+}
+
 void stream_enqueue_command(stream_t *stream, sound_cmd_t *cmd)
 {
     queue_enqueue(stream->cmd_req, cmd);
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include "mixer.h"
 #include <sddf/sound/queue.h>
 #include <alsa/asoundlib.h>
 #include <stdbool.h>
@@ -19,6 +20,13 @@ stream_t *stream_open(sound_pcm_info_t *info,
                       sound_cmd_queue_handle_t *cmd_res,
                       sound_pcm_queue_handle_t *pcm_res);
 
+/* Open a playback stream that shares an output device with others through `mixer` */
+stream_t *stream_open_mixed(sound_pcm_info_t *info,
+                            mixer_t *mixer,
+                            ssize_t translate_offset,
+                            sound_cmd_queue_handle_t *cmd_res,
+                            sound_pcm_queue_handle_t *pcm_res);
+
 void stream_enqueue_command(stream_t *stream, sound_cmd_t *cmd);
 void stream_enqueue_pcm_req(stream_t *stream, sound_pcm_t *pcm);
 
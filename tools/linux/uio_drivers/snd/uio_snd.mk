@@ -28,7 +28,7 @@ $(CHECK_UIO_SND_DRIVER_FLAGS_HASH):
 
 UIO_SND_DRV_DIR := $(LIBVMM)/tools/linux/uio_drivers/snd
 
-CFILES_uio_snd_driver := main.c stream.c queue.c convert.c
+CFILES_uio_snd_driver := main.c stream.c queue.c convert.c pcm.c resample.c mixer.c
 OBJECTS_uio_snd_driver := $(CFILES_uio_snd_driver:.c=.o)
 DEPENDS_uio_snd_driver := $(CFILES_uio_snd_driver:.c=.d)
 
@@ -65,12 +65,20 @@ endif
 
 ARCH_INDEP_FILES := \
 		    src/virtio/console.c \
+			src/virtio/balloon.c \
+			src/virtio/mem.c \
+			src/virtio/vsock.c \
+			src/virtio/fs.c \
+			src/virtio/pmem.c \
 			src/virtio/block.c \
 			src/virtio/net.c \
+			src/virtio/net_filter.c \
 		    src/virtio/virtio.c \
 			src/virtio/pci.c \
 		    src/util/util.c \
 			src/pci.c \
+			src/ivshmem.c \
+			src/coalesced_io.c \
 			src/guest_ram.c \
 			src/uefi/table_loader.c \
 			src/uefi/fw_cfg.c